@@ -0,0 +1,535 @@
+#!/usr/bin/env python3
+"""
+Benchmark harness for the high-performance zipper.
+
+Generates reproducible synthetic corpora (text, incompressible, many tiny
+files, a few huge files), runs the zipper over a grid of thread counts,
+compression levels and codecs, and writes the results as JSON so two commits
+can be compared:
+
+    python3 benchmark.py run --output bench-results/base.json
+    python3 benchmark.py run --quick --output bench-results/new.json
+    python3 benchmark.py compare bench-results/base.json bench-results/new.json
+
+`check` is a round trip instead: it zips small test corpora and a sparse
+input over 4 GiB, then reads every archive back twice, with the zipper's own
+verify mode and with an unrelated reader (libarchive's bsdtar or 7-Zip):
+
+    python3 benchmark.py check
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import platform
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zipfile
+from pathlib import Path
+
+SCRIPT_DIR = Path(__file__).resolve().parent
+CORPUS_VERSION = 1  # bump when generation changes, so cached corpora are rebuilt
+PASSWORD = "bench-password"
+CODECS = ["zlib", "libdeflate", "isal", "zstd"]
+MB = 1024 * 1024
+
+# name -> (file count, min size, max size, content) for full and quick runs
+CORPORA = {
+    "text":           {"full": (64, MB // 2, 3 * MB // 2, "text"),   "quick": (16, 128 * 1024, 384 * 1024, "text")},
+    "incompressible": {"full": (16, 4 * MB, 4 * MB, "random"),       "quick": (8, MB, MB, "random")},
+    "tiny":           {"full": (5000, 0, 4096, "mixed"),             "quick": (1000, 0, 4096, "mixed")},
+    "huge":           {"full": (2, 256 * MB, 256 * MB, "text"),      "quick": (2, 32 * MB, 32 * MB, "text")},
+}
+
+ZIP64_SIZE = 4 * 1024 * MB + 123457  # past 4 GiB, and not a multiple of any block size
+AES_METHOD = 99
+AES_EXTRA = 0x9901
+
+# name -> (check corpus, settings, compression methods the archives must use)
+CHECKS = {
+    "adaptive": ("mixed", {"ZIPPER_COMPRESSION": "adaptive"}, {0, 8}),
+    "stored":   ("mixed", {"ZIPPER_COMPRESSION": "store"}, {0}),
+    "bundled":  ("mixed", {"ZIPPER_BUNDLE_SIZE": "1M"}, {0, 8}),
+    "zip64":    ("zip64", {}, {8}),
+}
+
+
+class TextSource:
+    """Deterministic pseudo-English. A few 1MB chunks are generated word by
+    word, then files are assembled from rotated copies: deflate's 32KB window
+    never sees the repetition, and big corpora build at disk speed."""
+
+    CHUNK = MB
+    CHUNKS = 8
+
+    def __init__(self, rng):
+        syllables = ["ka", "lo", "mi", "ne", "ra", "to", "shi", "ven", "dor", "an", "el", "is", "or", "um", "qua", "bri"]
+        words = sorted({"".join(rng.choice(syllables) for _ in range(rng.randint(1, 4))) for _ in range(2000)})
+        # Zipf-like weights make common words common, as in real text
+        weights = [1.0 / (rank + 1) for rank in range(len(words))]
+        self.chunks = []
+        for _ in range(self.CHUNKS):
+            parts = []
+            size = 0
+            while size < self.CHUNK:
+                line = " ".join(rng.choices(words, weights, k=rng.randint(6, 16))).capitalize() + ".\n"
+                parts.append(line)
+                size += len(line)
+            self.chunks.append("".join(parts).encode()[:self.CHUNK])
+
+    def generate(self, rng, size):
+        out = bytearray()
+        while len(out) < size:
+            chunk = rng.choice(self.chunks)
+            cut = rng.randrange(len(chunk))
+            out += chunk[cut:] + chunk[:cut]
+        return bytes(out[:size])
+
+
+def corpus_path(work_dir, name, scale):
+    return Path(work_dir) / "corpora" / f"{name}-{scale}-v{CORPUS_VERSION}"
+
+
+def build_corpus(work_dir, name, scale):
+    """Create the corpus unless an identical one is cached; returns its folder"""
+    path = corpus_path(work_dir, name, scale)
+    marker = path.with_name(path.name + ".complete")  # outside the folder the zipper scans
+    spec = CORPORA[name][scale]
+    if marker.exists() and json.loads(marker.read_text()) == list(spec):
+        return path
+
+    count, min_size, max_size, content = spec
+    print(f"Generating {name} corpus ({scale}: {count} files)...", flush=True)
+    shutil.rmtree(path, ignore_errors=True)
+    path.mkdir(parents=True)
+    rng = random.Random(f"{name}-{scale}-{CORPUS_VERSION}")
+    text = TextSource(rng)
+    width = len(str(count))
+    for i in range(count):
+        size = rng.randint(min_size, max_size)
+        kind = content if content != "mixed" else ("random" if rng.random() < 0.25 else "text")
+        data = rng.randbytes(size) if kind == "random" else text.generate(rng, size)
+        suffix = ".bin" if kind == "random" else ".txt"
+        (path / f"{name}-{i:0{width}d}{suffix}").write_bytes(data)
+    marker.write_text(json.dumps(list(spec)))
+    return path
+
+
+def level_env(level):
+    """'adaptive' and 'store' are policies; a number forces that deflate level"""
+    if level in ("adaptive", "store", "fast", "max"):
+        return {"ZIPPER_COMPRESSION": level}
+    return {"ZIPPER_COMPRESSION": "max", "ZIPPER_MAX_LEVEL": str(int(level))}
+
+
+def zipper_env(corpus, out_dir, env):
+    run_env = os.environ.copy()
+    run_env.update(env)
+    run_env.update({
+        "ZIPPER_INPUT_FOLDER": str(corpus),
+        "ZIPPER_OUTPUT_FOLDER": str(out_dir),
+        "ZIPPER_PASSWORD": PASSWORD,
+    })
+    return run_env
+
+
+def run_once(binary, corpus, out_dir, env):
+    """One zipper run; returns (summary event, wall seconds, rusage, console output)"""
+    shutil.rmtree(out_dir, ignore_errors=True)
+    out_dir.mkdir(parents=True)
+
+    events_read, events_write = os.pipe()
+    run_env = zipper_env(corpus, out_dir, env)
+    run_env["ZIPPER_EVENTS"] = f"fd:{events_write}"
+
+    summary = {}
+
+    def read_events():
+        with os.fdopen(events_read, "r", encoding="utf-8", errors="replace") as stream:
+            for line in stream:
+                try:
+                    event = json.loads(line)
+                except ValueError:
+                    continue
+                if event.get("event") == "summary":
+                    summary.update(event)
+
+    with tempfile.TemporaryFile() as console:
+        start = time.perf_counter()
+        try:
+            process = subprocess.Popen([str(binary)], stdout=console, stderr=subprocess.STDOUT,
+                                       env=run_env, pass_fds=(events_write,))
+        finally:
+            os.close(events_write)
+        reader = threading.Thread(target=read_events, daemon=True)
+        reader.start()
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+        reader.join(timeout=10)
+        console.seek(0)
+        output = console.read().decode(errors="replace")
+
+    if process.returncode != 0 or not summary.get("ok"):
+        raise RuntimeError(f"zipper failed (exit {process.returncode}):\n{output[-2000:]}")
+    return summary, wall, usage, output
+
+
+def run_benchmarks(args):
+    binary = Path(args.binary).resolve()
+    if not binary.exists():
+        sys.exit(f"{binary} not found; build it with 'make' first")
+
+    work_dir = Path(args.work).resolve()
+    out_dir = work_dir / "out"
+    scale = "quick" if args.quick else "full"
+    corpora = args.corpora.split(",")
+    threads = sorted({int(t) for t in args.threads.split(",")})
+    levels = args.levels.split(",")
+    codecs = CODECS if args.codecs == "all" else args.codecs.split(",")
+    if any("=" not in item for item in args.env):
+        sys.exit("--env takes KEY=VALUE")
+    extra_env = dict(item.split("=", 1) for item in args.env)
+    repeat = 1 if args.quick and args.repeat is None else (args.repeat or 3)
+
+    for name in corpora:
+        if name not in CORPORA:
+            sys.exit(f"Unknown corpus '{name}' (choose from {', '.join(CORPORA)})")
+    paths = {name: build_corpus(work_dir, name, scale) for name in corpora}
+
+    results = []
+    unavailable = set()
+    grid = [(c, t, l, k) for c in corpora for t in threads for l in levels for k in codecs]
+    for index, (name, thread_count, level, codec) in enumerate(grid, 1):
+        label = f"[{index}/{len(grid)}] {name} threads={thread_count} level={level} codec={codec}"
+        record = {"corpus": name, "threads": thread_count, "level": level, "codec": codec}
+        if codec in unavailable:
+            results.append(dict(record, skipped="codec not built in"))
+            continue
+
+        env = dict(extra_env)
+        env.update(level_env(level))
+        env.update({"ZIPPER_THREADS": str(thread_count), "ZIPPER_CODEC": codec})
+
+        runs = []
+        try:
+            for attempt in range(args.warmup + repeat):
+                summary, wall, usage, output = run_once(binary, paths[name], out_dir, env)
+                if f"codec '{codec}' not available" in output:
+                    unavailable.add(codec)
+                    break
+                if attempt >= args.warmup:
+                    runs.append((wall, usage, summary))
+        except RuntimeError as e:
+            print(f"{label}: FAILED\n{e}", flush=True)
+            results.append(dict(record, failed=str(e)[-500:]))
+            continue
+        if codec in unavailable:
+            print(f"{label}: skipped, codec not built in", flush=True)
+            results.append(dict(record, skipped="codec not built in"))
+            continue
+
+        walls = [wall for wall, _, _ in runs]
+        median = statistics.median(walls)
+        wall, usage, summary = min(runs, key=lambda run: abs(run[0] - median))
+        input_bytes = summary.get("input_bytes", 0)
+        output_bytes = summary.get("output_bytes", 0)
+        record.update({
+            "wall_s": [round(w, 4) for w in walls],
+            "median_s": round(median, 4),
+            "stdev_s": round(statistics.stdev(walls), 4) if len(walls) > 1 else 0.0,
+            "cpu_s": round(usage.ru_utime + usage.ru_stime, 4),
+            "max_rss_kb": usage.ru_maxrss,
+            "files": summary.get("processed", 0),
+            "input_bytes": input_bytes,
+            "output_bytes": output_bytes,
+            "ratio": round(output_bytes / input_bytes, 4) if input_bytes else 1.0,
+            "mb_per_s": round(input_bytes / median / 1e6, 2) if median > 0 else 0.0,
+            "stage_ms": summary.get("stage_ms", {}),
+        })
+        results.append(record)
+        print(f"{label}: {record['median_s']:.3f} s, {record['mb_per_s']:.1f} MB/s, ratio {record['ratio']:.3f}",
+              flush=True)
+
+    shutil.rmtree(out_dir, ignore_errors=True)
+    report = {
+        "schema": 1,
+        "created": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "commit": git_revision(),
+        "host": host_info(),
+        "binary": str(binary),
+        "scale": scale,
+        "repeat": repeat,
+        "warmup": args.warmup,
+        "env": extra_env,
+        "results": results,
+    }
+    output = Path(args.output) if args.output else SCRIPT_DIR / "bench-results" / f"{report['commit']['short'] or 'unknown'}.json"
+    output.parent.mkdir(parents=True, exist_ok=True)
+    output.write_text(json.dumps(report, indent=2, sort_keys=True) + "\n")
+    print(f"Results written to {output}")
+
+
+def build_check_corpus(work_dir, kind):
+    """Small mixed files with odd sizes and names, or one sparse input past 4 GiB"""
+    path = Path(work_dir) / "check" / f"{kind}-v{CORPUS_VERSION}"
+    marker = path.with_name(path.name + ".complete")
+    if marker.exists():
+        return path
+    shutil.rmtree(path, ignore_errors=True)
+    path.mkdir(parents=True)
+    rng = random.Random(f"check-{kind}-{CORPUS_VERSION}")
+    if kind == "zip64":
+        # Text at both ends so the entropy probe and the last block see data
+        # that does compress; zeros between that cost no disk
+        text = TextSource(rng).generate(rng, MB)
+        with open(path / "large.txt", "wb") as out:
+            out.write(text)
+            out.truncate(ZIP64_SIZE)
+            out.seek(ZIP64_SIZE - len(text))
+            out.write(text)
+    else:
+        text = TextSource(rng)
+        sizes = [0, 1, 255, 4096, 65535, 65536, 65537, 300 * 1024, 3 * MB + 17]
+        for i, size in enumerate(sizes):
+            (path / f"text {i:02d}.txt").write_bytes(text.generate(rng, size))
+            (path / f"random-{i:02d}.bin").write_bytes(rng.randbytes(size))
+        (path / "ünïcödé.txt").write_bytes(text.generate(rng, 10000))
+    marker.write_text("{}")
+    return path
+
+
+def external_reader():
+    """(name, command that streams one entry of an archive to stdout)"""
+    if shutil.which("bsdtar"):
+        return "bsdtar", lambda archive, entry: ["bsdtar", "-xOf", str(archive), "--passphrase", PASSWORD, "--", entry]
+    for seven in ("7zz", "7z", "7za"):
+        if shutil.which(seven):
+            return seven, lambda archive, entry: [seven, "x", "-so", f"-p{PASSWORD}", str(archive), entry]
+    sys.exit("check needs bsdtar (libarchive-tools) or 7-Zip to read the archives independently")
+
+
+def digest(stream):
+    hasher = hashlib.blake2b()
+    for block in iter(lambda: stream.read(MB), b""):
+        hasher.update(block)
+    return hasher.hexdigest()
+
+
+def inner_method(info):
+    """Compression method under the WinZip-AES extra field"""
+    extra = info.extra
+    while len(extra) >= 4:
+        tag, size = int.from_bytes(extra[:2], "little"), int.from_bytes(extra[2:4], "little")
+        if tag == AES_EXTRA and size >= 7:
+            return int.from_bytes(extra[9:11], "little")
+        extra = extra[4 + size:]
+    return None
+
+
+def check_archives(corpus, out_dir, methods, reader, zip64):
+    """Problems found reading the archives with Python's zipfile and the external reader"""
+    problems = []
+    sources = {p.relative_to(corpus).as_posix(): p for p in corpus.rglob("*") if p.is_file()}
+    seen = set()
+    used = set()
+    archives = sorted(p for p in out_dir.rglob("*.zip") if not p.name.startswith("."))
+    for archive in archives:
+        try:
+            entries = zipfile.ZipFile(archive).infolist()
+        except (zipfile.BadZipFile, OSError) as e:
+            problems.append(f"{archive.name}: zipfile cannot open it: {e}")
+            continue
+        for info in entries:
+            source = sources.get(info.filename)
+            if source is None:
+                problems.append(f"{archive.name}: unexpected entry {info.filename!r}")
+                continue
+            seen.add(info.filename)
+            method = inner_method(info)
+            used.add(method)
+            if info.compress_type != AES_METHOD or method is None:
+                problems.append(f"{archive.name}: {info.filename} is not WinZip-AES encrypted")
+            if info.file_size != source.stat().st_size:
+                problems.append(f"{archive.name}: {info.filename} records {info.file_size} bytes, "
+                                f"source has {source.stat().st_size}")
+            if zip64 and info.file_size <= 0xFFFFFFFF:
+                problems.append(f"{archive.name}: {info.filename} does not need zip64")
+            with subprocess.Popen(reader(archive, info.filename), stdout=subprocess.PIPE,
+                                  stderr=subprocess.PIPE) as process:
+                extracted = digest(process.stdout)
+                error = process.stderr.read().decode(errors="replace").strip()
+            if process.returncode != 0:
+                problems.append(f"{archive.name}: external reader failed on {info.filename}: {error[-500:]}")
+                continue
+            with open(source, "rb") as original:
+                if extracted != digest(original):
+                    problems.append(f"{archive.name}: {info.filename} extracts to different bytes")
+    for name in sorted(set(sources) - seen):
+        problems.append(f"{name}: in no archive")
+    if used - methods or methods - used:
+        problems.append(f"compression methods {sorted(used, key=str)}, expected {sorted(methods)}")
+    return len(archives), problems
+
+
+def run_checks(args):
+    """Exit status 1 when any archive fails either reader"""
+    binary = Path(args.binary).resolve()
+    if not binary.exists():
+        sys.exit(f"{binary} not found; build it with 'make' first")
+    if any("=" not in item for item in args.env):
+        sys.exit("--env takes KEY=VALUE")
+    extra_env = dict(item.split("=", 1) for item in args.env)
+    reader_name, reader = external_reader()
+    work_dir = Path(args.work).resolve()
+    out_dir = work_dir / "check-out"
+    names = args.checks.split(",")
+    for name in names:
+        if name not in CHECKS:
+            sys.exit(f"Unknown check '{name}' (choose from {', '.join(CHECKS)})")
+
+    failures = 0
+    for name in names:
+        kind, settings, methods = CHECKS[name]
+        corpus = build_check_corpus(work_dir, kind)
+        env = dict(extra_env)
+        env.update(settings)
+        start = time.perf_counter()
+        try:
+            run_once(binary, corpus, out_dir, env)
+        except RuntimeError as e:
+            print(f"{name}: FAILED\n{e}", flush=True)
+            failures += 1
+            continue
+
+        problems = []
+        verify_env = zipper_env(corpus, out_dir, dict(env, ZIPPER_VERIFY="1", ZIPPER_QUIET="1"))
+        verify = subprocess.run([str(binary)], env=verify_env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        if verify.returncode != 0:
+            problems.append("ZIPPER_VERIFY failed:\n" + verify.stdout.decode(errors="replace").strip()[-2000:])
+        archives, found = check_archives(corpus, out_dir, methods, reader, kind == "zip64")
+        problems += found
+        wall = time.perf_counter() - start
+        if problems:
+            failures += 1
+            print(f"{name}: FAILED ({archives} archives)", flush=True)
+            for problem in problems:
+                print(f"  {problem}", flush=True)
+        else:
+            print(f"{name}: ok, {archives} archives read back by the zipper and {reader_name} "
+                  f"({wall:.1f} s)", flush=True)
+
+    shutil.rmtree(out_dir, ignore_errors=True)
+    if failures:
+        print(f"\n{failures} of {len(names)} checks failed")
+        sys.exit(1)
+    print(f"\nAll {len(names)} checks passed")
+
+
+def git_revision():
+    def git(*command):
+        try:
+            return subprocess.check_output(["git", "-C", str(SCRIPT_DIR), *command],
+                                           stderr=subprocess.DEVNULL).decode().strip()
+        except (OSError, subprocess.CalledProcessError):
+            return ""
+    return {"sha": git("rev-parse", "HEAD"), "short": git("rev-parse", "--short", "HEAD"),
+            "dirty": bool(git("status", "--porcelain", "--untracked-files=no"))}
+
+
+def host_info():
+    cpus = len(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else os.cpu_count()
+    model = ""
+    try:
+        with open("/proc/cpuinfo") as cpuinfo:
+            model = next((line.split(":", 1)[1].strip() for line in cpuinfo if line.startswith("model name")), "")
+    except OSError:
+        pass
+    return {"cpus": cpus, "cpu_model": model, "platform": platform.platform(), "python": platform.python_version()}
+
+
+def compare_results(args):
+    """Exit status 1 when any configuration got slower or compressed worse"""
+    base = json.loads(Path(args.base).read_text())
+    new = json.loads(Path(args.new).read_text())
+    if base.get("host", {}).get("cpu_model") != new.get("host", {}).get("cpu_model") or \
+            base.get("host", {}).get("cpus") != new.get("host", {}).get("cpus"):
+        print("Warning: results come from different hosts; timings may not be comparable")
+    if base.get("scale") != new.get("scale"):
+        print("Warning: results use different corpus scales")
+
+    def key(result):
+        return (result["corpus"], result["threads"], str(result["level"]), result["codec"])
+
+    baseline = {key(r): r for r in base["results"] if "median_s" in r}
+    regressions = 0
+    print(f"{'corpus':<16}{'thr':>4} {'level':<9}{'codec':<11}{'base s':>9}{'new s':>9}{'delta':>9}{'ratio':>14}")
+    for result in new["results"]:
+        old = baseline.get(key(result))
+        if old is None or "median_s" not in result:
+            continue
+        delta = (result["median_s"] - old["median_s"]) / old["median_s"] * 100.0 if old["median_s"] > 0 else 0.0
+        slower = delta > args.threshold and result["median_s"] - old["median_s"] > args.min_seconds
+        worse_ratio = result["ratio"] > old["ratio"] + args.ratio_tolerance
+        flags = (" SLOWER" if slower else "") + (" LARGER" if worse_ratio else "")
+        regressions += bool(flags)
+        print(f"{result['corpus']:<16}{result['threads']:>4} {str(result['level']):<9}{result['codec']:<11}"
+              f"{old['median_s']:>9.3f}{result['median_s']:>9.3f}{delta:>+8.1f}%"
+              f"{old['ratio']:>7.3f}{result['ratio']:>7.3f}{flags}")
+
+    if regressions:
+        print(f"\n{regressions} regression(s) beyond {args.threshold:.1f}% / ratio +{args.ratio_tolerance}")
+        sys.exit(1)
+    print("\nNo regressions")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the high-performance zipper")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    cpus = len(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else (os.cpu_count() or 1)
+    run = commands.add_parser("run", help="generate corpora, sweep configurations and write JSON results")
+    run.add_argument("--binary", default=str(SCRIPT_DIR / "high_performance_zipper"))
+    run.add_argument("--work", default=str(SCRIPT_DIR / ".bench"), help="corpus cache and scratch output")
+    run.add_argument("--output", help="results file (default: bench-results/<commit>.json)")
+    run.add_argument("--quick", action="store_true", help="small corpora and one timed run each")
+    run.add_argument("--corpora", default=",".join(CORPORA))
+    run.add_argument("--threads", default=",".join(str(t) for t in sorted({1, max(cpus // 2, 1), cpus})))
+    run.add_argument("--levels", default="adaptive,1,9", help="adaptive, store or deflate levels 1-9")
+    run.add_argument("--codecs", default="zlib", help=f"comma-separated from {', '.join(CODECS)}, or 'all'")
+    run.add_argument("--repeat", type=int, help="timed runs per configuration (default 3, quick 1)")
+    run.add_argument("--warmup", type=int, default=1, help="untimed runs first, to warm the page cache")
+    run.add_argument("--env", action="append", default=[], metavar="KEY=VALUE",
+                     help="extra zipper setting for every run, e.g. ZIPPER_WRITER=native")
+    run.set_defaults(handler=run_benchmarks)
+
+    compare = commands.add_parser("compare", help="compare two results files")
+    compare.add_argument("base")
+    compare.add_argument("new")
+    compare.add_argument("--threshold", type=float, default=5.0, help="slowdown in percent that counts")
+    compare.add_argument("--min-seconds", type=float, default=0.05, help="ignore slowdowns smaller than this")
+    compare.add_argument("--ratio-tolerance", type=float, default=0.002, help="allowed growth of output/input")
+    compare.set_defaults(handler=compare_results)
+
+    check = commands.add_parser("check", help="zip test corpora, then read every archive back with the zipper and "
+                                              "an external reader")
+    check.add_argument("--binary", default=str(SCRIPT_DIR / "high_performance_zipper"))
+    check.add_argument("--work", default=str(SCRIPT_DIR / ".bench"), help="corpus cache and scratch output")
+    check.add_argument("--checks", default=",".join(CHECKS), help=f"comma-separated from {', '.join(CHECKS)}")
+    check.add_argument("--env", action="append", default=[], metavar="KEY=VALUE",
+                       help="extra zipper setting for every run, e.g. ZIPPER_WRITER=native")
+    check.set_defaults(handler=run_checks)
+
+    args = parser.parse_args()
+    args.handler(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -16,7 +16,6 @@ from pathlib import Path
 from dataclasses import dataclass
 from typing import Optional, Dict, Any, List
 import queue
-import re
 import shutil
 
 # Import GitHub manager
@@ -119,7 +118,7 @@ class HighPerformanceZipperGUI:
         self.output_folder = tk.StringVar(value="../MyStorage/files")
         self.password = tk.StringVar(value="")  # No default password - user must enter
         self.use_parallel = tk.BooleanVar(value=True)
-        self.max_threads = tk.IntVar(value=8)
+        self.max_threads = tk.IntVar(value=0)  # 0 = let the zipper size itself
         
         # File management - simplified to single source
         self.selected_files = []  # List of individually selected files from source
@@ -299,8 +298,8 @@ class HighPerformanceZipperGUI:
         thread_frame = ttk.Frame(parent)
         thread_frame.grid(row=1, column=0, sticky=(tk.W, tk.E), pady=(0, 10))
         
-        ttk.Label(thread_frame, text="Max threads:").grid(row=0, column=0, sticky=tk.W, padx=(0, 10))
-        self.threads_spin = ttk.Spinbox(thread_frame, from_=1, to=16, textvariable=self.max_threads, width=10)
+        ttk.Label(thread_frame, text="Max threads (0 = auto):").grid(row=0, column=0, sticky=tk.W, padx=(0, 10))
+        self.threads_spin = ttk.Spinbox(thread_frame, from_=0, to=512, textvariable=self.max_threads, width=10)
         self.threads_spin.grid(row=0, column=1, sticky=tk.W)
         
         # Storage location info
@@ -1116,48 +1115,56 @@ class HighPerformanceZipperGUI:
         self.output_text.see(tk.END)
         self.root.update_idletasks()
         
-    def update_stats_from_output(self, line):
-        """Parse output line and update statistics"""
-        # Parse processing summary
-        if "Files processed:" in line:
-            match = re.search(r"Files processed: (\d+)", line)
-            if match:
-                self.stats_vars['processed'].set(match.group(1))
-                
-        elif "Files failed:" in line:
-            match = re.search(r"Files failed: (\d+)", line)
-            if match:
-                self.stats_vars['failed'].set(match.group(1))
-                
-        elif "Total files:" in line:
-            match = re.search(r"Total files: (\d+)", line)
-            if match:
-                self.stats_vars['total'].set(match.group(1))
-                
-        elif "Total input size:" in line:
-            match = re.search(r"Total input size: ([\d.]+ \w+)", line)
-            if match:
-                self.stats_vars['input_size'].set(match.group(1))
-                
-        elif "Total output size:" in line:
-            match = re.search(r"Total output size: ([\d.]+ \w+)", line)
-            if match:
-                self.stats_vars['output_size'].set(match.group(1))
-                
-        elif "Overall compression:" in line:
-            match = re.search(r"Overall compression: ([\d.]+%)", line)
-            if match:
-                self.stats_vars['compression'].set(match.group(1))
-                
-        elif "Processing time:" in line:
-            match = re.search(r"Processing time: (\d+ ms)", line)
-            if match:
-                self.stats_vars['time'].set(match.group(1))
-                
-        elif "Throughput:" in line:
-            match = re.search(r"Throughput: ([\d.]+ \w+/s)", line)
-            if match:
-                self.stats_vars['throughput'].set(match.group(1))
+    def update_stats_from_event(self, event):
+        """Update statistics and progress from one zipper event"""
+        kind = event.get('event')
+        if kind == 'start':
+            self.stats_vars['total'].set(str(event.get('files', 0) + event.get('skipped', 0)))
+            self.progress_bar.stop()
+            self.progress_bar.config(mode='determinate', maximum=100, value=0)
+            
+        elif kind == 'progress':
+            done = event.get('files_done', 0)
+            total = event.get('files_total', 0)
+            bytes_total = event.get('bytes_total', 0)
+            # Bytes read moves smoothly through large files; bytes done only at file boundaries
+            bytes_progress = min(max(event.get('bytes_done', 0), event.get('bytes_read', 0)), bytes_total)
+            percent = 100.0 * bytes_progress / bytes_total if bytes_total > 0 else 100.0
+            
+            self.stats_vars['processed'].set(str(done))
+            self.stats_vars['failed'].set(str(event.get('files_failed', 0)))
+            self.stats_vars['input_size'].set(self.format_bytes(event.get('bytes_done', 0)))
+            self.stats_vars['output_size'].set(self.format_bytes(event.get('bytes_written', 0)))
+            self.stats_vars['time'].set(f"{event.get('elapsed_ms', 0)} ms")
+            self.stats_vars['throughput'].set(f"{self.format_bytes(event.get('read_bps', 0))}/s")
+            self.progress_bar.config(value=percent)
+            self.progress_var.set(f"Processed {done}/{total} files ({percent:.0f}%)")
+            
+        elif kind == 'summary':
+            input_size = event.get('input_bytes', 0)
+            output_size = event.get('output_bytes', 0)
+            elapsed_ms = event.get('ms', 0)
+            self.stats_vars['processed'].set(str(event.get('processed', 0)))
+            self.stats_vars['failed'].set(str(event.get('failed', 0)))
+            self.stats_vars['total'].set(str(event.get('files', 0)))
+            self.stats_vars['input_size'].set(self.format_bytes(input_size))
+            self.stats_vars['output_size'].set(self.format_bytes(output_size))
+            if input_size > 0:
+                self.stats_vars['compression'].set(f"{(1.0 - output_size / input_size) * 100.0:.1f}%")
+            self.stats_vars['time'].set(f"{elapsed_ms} ms")
+            if elapsed_ms > 0:
+                self.stats_vars['throughput'].set(f"{self.format_bytes(input_size / (elapsed_ms / 1000.0))}/s")
+            self.progress_bar.config(value=100)
+            
+    def read_events(self, stream_fd):
+        """Forward NDJSON events from the zipper to the GUI thread"""
+        with os.fdopen(stream_fd, 'r', encoding='utf-8', errors='replace') as stream:
+            for line in stream:
+                try:
+                    event = json.loads(line)
+                except ValueError:
+                    continue
+                self.root.after(0, lambda e=event: self.update_stats_from_event(e))
                 
     def start_processing(self):
         """Start the file processing"""
@@ -1264,66 +1271,24 @@ class HighPerformanceZipperGUI:
             self.root.after(0, self.processing_finished)
             
     def process_individual_files(self):
-        """Process individually selected files"""
+        """Process individually selected files where they are"""
         try:
             # Create final output directory (not temporary)
             final_output_path = Path(self.get_final_output_folder())
             final_output_path.mkdir(parents=True, exist_ok=True)
             
-            # Copy files to input directory temporarily for processing
-            temp_input = final_output_path / "temp_input"
-            temp_input.mkdir(exist_ok=True)
-            
-            # Copy selected files to temp input
-            self.root.after(0, lambda: self.log_message("Preparing files for processing...", "INFO"))
-            
-            copied_files = []
-            for i, file_path in enumerate(self.selected_files):
-                if not self.is_processing:
-                    break
-                    
-                source_path = Path(file_path)
-                if source_path.exists():
-                    # Create unique filename to avoid conflicts
-                    dest_name = source_path.name
-                    counter = 1
-                    while (temp_input / dest_name).exists():
-                        stem = source_path.stem
-                        suffix = source_path.suffix
-                        dest_name = f"{stem}_{counter}{suffix}"
-                        counter += 1
-                    
-                    dest_path = temp_input / dest_name
-                    shutil.copy2(source_path, dest_path)
-                    copied_files.append(dest_name)
-                    
-                    # Update progress
-                    progress = f"Prepared {i+1}/{len(self.selected_files)} files"
-                    self.root.after(0, lambda p=progress: self.progress_var.set(p))
-                    self.root.after(0, lambda f=source_path.name: self.log_message(f"Prepared: {f}", "INFO"))
+            # The backend reads each selected file once, straight from its location
+            files = [file_path for file_path in self.selected_files if Path(file_path).is_file()]
+            missing = len(self.selected_files) - len(files)
+            if missing:
+                self.root.after(0, lambda: self.log_message(f"Skipping {missing} selected files that no longer exist", "WARNING"))
             
-            if not copied_files:
+            if not files:
                 self.root.after(0, lambda: self.log_message("No valid files to process", "ERROR"))
                 return False
                 
-            # Update environment to use temp input directory
-            old_source = self.source_folder.get()
-            self.source_folder.set(str(temp_input))
-            
-            # Process using C++ backend
-            self.root.after(0, lambda: self.log_message("Starting compression...", "INFO"))
-            success = self.run_cpp_backend()
-            
-            # Restore original source folder
-            self.source_folder.set(old_source)
-            
-            # Clean up temp directory
-            try:
-                shutil.rmtree(temp_input)
-            except:
-                pass  # Best effort cleanup
-                
-            return success
+            self.root.after(0, lambda: self.log_message(f"Starting compression of {len(files)} files...", "INFO"))
+            return self.run_cpp_backend(files)
             
         except Exception as e:
             self.root.after(0, lambda: self.log_message(f"Error processing individual files: {str(e)}", "ERROR"))
@@ -1345,8 +1310,8 @@ class HighPerformanceZipperGUI:
             
         return self.run_cpp_backend()
         
-    def run_cpp_backend(self):
-        """Run the C++ backend process"""
+    def run_cpp_backend(self, files=None):
+        """Run the C++ backend process, on the source folder or on a list of files"""
         try:
             # Set environment variables for the C++ program
             env = os.environ.copy()
@@ -1356,21 +1321,53 @@ class HighPerformanceZipperGUI:
             final_output = self.get_final_output_folder()
             env['ZIPPER_OUTPUT_FOLDER'] = final_output
             env['ZIPPER_PASSWORD'] = self.password.get()
+            # Someone is watching: show the first files early rather than finish soonest
+            env.setdefault('ZIPPER_SCHEDULE', 'latency')
+            
+            # Auto sizing honours cgroup quotas and NUMA layout; only override on request
+            if not self.use_parallel.get():
+                env['ZIPPER_THREADS'] = '1'
+            elif self.max_threads.get() > 0:
+                env['ZIPPER_THREADS'] = str(self.max_threads.get())
             
             self.root.after(0, lambda: self.log_message(f"ZIP files will be saved directly to: {final_output}", "INFO"))
             
             # Run the high-performance zipper
             cmd = ["./high_performance_zipper"]
+            if files:
+                # NUL-separated on stdin: any file name survives, and argv length is no limit
+                cmd.append("@-")
             
-            self.process = subprocess.Popen(
-                cmd,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.STDOUT,
-                text=True,
-                bufsize=1,
-                universal_newlines=True,
-                env=env
-            )
+            # Statistics and progress arrive as NDJSON events on a pipe; stdout is only logged
+            events_read, events_write = os.pipe()
+            env['ZIPPER_EVENTS'] = f"fd:{events_write}"
+            try:
+                self.process = subprocess.Popen(
+                    cmd,
+                    stdin=subprocess.PIPE if files else subprocess.DEVNULL,
+                    stdout=subprocess.PIPE,
+                    stderr=subprocess.STDOUT,
+                    text=True,
+                    bufsize=1,
+                    universal_newlines=True,
+                    env=env,
+                    pass_fds=(events_write,)
+                )
+            except Exception:
+                os.close(events_read)
+                raise
+            finally:
+                os.close(events_write)
+            
+            events_thread = threading.Thread(target=self.read_events, args=(events_read,), daemon=True)
+            events_thread.start()
+            
+            if files:
+                try:
+                    self.process.stdin.write("\0".join(files) + "\0")
+                    self.process.stdin.close()
+                except BrokenPipeError:
+                    pass  # the backend exited early; its output says why
             
             # Read output line by line
             for line in self.process.stdout:
@@ -1381,10 +1378,10 @@ class HighPerformanceZipperGUI:
                 if line:
                     # Update GUI from main thread
                     self.root.after(0, lambda l=line: self.log_message(l, "OUTPUT"))
-                    self.root.after(0, lambda l=line: self.update_stats_from_output(l))
             
             # Wait for process to complete
             return_code = self.process.wait()
+            events_thread.join(timeout=5)
             return return_code == 0
             
         except Exception as e:
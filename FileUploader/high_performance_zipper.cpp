@@ -1,3 +1,4 @@
+#include "zipper.h"
 #include <iostream>
 #include <string>
 #include <string_view>
@@ -5,12 +6,30 @@
 #include <vector>
 #include <memory>
 #include <zip.h>
+#include <zlib.h>
+#ifdef ZIPPER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ZIPPER_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef ZIPPER_WITH_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <chrono>
 #include <thread>
 #include <future>
 #include <algorithm>
 #include <execution>
 #include <cmath>
+#include <cstdio>
 #include <iomanip>
 #include <sstream>
 #include <array>
@@ -20,78 +39,666 @@
 #include <atomic>
 #include <fstream>
 #include <memory_resource>
+#include <span>
+#include <deque>
+#include <optional>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <numeric>
+#include <limits>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <charconv>
+#include <bit>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#endif
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define ZIPPER_HAVE_IO_URING 1
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace fs = std::filesystem;
 
-// MIME type utility class
+// MIME types by extension, looked up in a perfect-hash table built at
+// compile time: no allocation, one probe and one compare per name. Files
+// with an unknown extension can be typed from their first bytes instead.
 class MimeTypeMapper {
+public:
+    static constexpr std::string_view DEFAULT_TYPE = "application/octet-stream";
+    static constexpr size_t SNIFF_BYTES = 16;  // enough for every signature below
+    
 private:
-    static const std::unordered_map<std::string, std::string> mimeTypes;
+    struct Mapping {
+        std::string_view extension;
+        std::string_view type;
+    };
+    
+    static constexpr std::array<Mapping, 14> MAPPINGS = {{
+        {"pdf", "application/pdf"},
+        {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+        {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+        {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+        {"doc", "application/msword"},
+        {"xls", "application/vnd.ms-excel"},
+        {"ppt", "application/vnd.ms-powerpoint"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"png", "image/png"},
+        {"gif", "image/gif"},
+        {"svg", "image/svg+xml"},
+        {"zip", "application/zip"},
+        {"txt", "text/plain"},
+    }};
+    
+    static constexpr size_t MAX_EXTENSION = 4;
+    static constexpr size_t SLOTS = 32;
+    static constexpr uint8_t EMPTY_SLOT = 0xFF;
+    
+    struct Signature {
+        std::string_view magic;
+        std::string_view type;
+    };
+    
+    static constexpr std::array<Signature, 9> SIGNATURES = {{
+        {"%PDF-", "application/pdf"},
+        {"\x89PNG\r\n\x1a\n", "image/png"},
+        {"\xFF\xD8\xFF", "image/jpeg"},
+        {"GIF87a", "image/gif"},
+        {"GIF89a", "image/gif"},
+        {"PK\x03\x04", "application/zip"},
+        {"\x1F\x8B", "application/gzip"},
+        {std::string_view("\x28\xB5\x2F\xFD", 4), "application/zstd"},
+        {"7z\xBC\xAF\x27\x1C", "application/x-7z-compressed"},
+    }};
+    
+    // FNV-1a over the lower-case extension, salted with the table's seed
+    static constexpr uint32_t hash(std::string_view extension, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+        for (const char c : extension) {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return (h ^ (h >> 15)) & (SLOTS - 1);
+    }
+    
+    // The first seed under which no two extensions share a slot
+    static constexpr uint32_t findSeed() {
+        for (uint32_t seed = 0; seed < 100000; ++seed) {
+            std::array<bool, SLOTS> used{};
+            bool collides = false;
+            for (const auto& mapping : MAPPINGS) {
+                auto& slot = used[hash(mapping.extension, seed)];
+                collides = collides || slot;
+                slot = true;
+            }
+            if (!collides) return seed;
+        }
+        return UINT32_MAX;
+    }
+    
+    // Defined below the class, where findSeed() can be evaluated
+    static const uint32_t SEED;
+    static const std::array<uint8_t, SLOTS> TABLE;
     
 public:
-    static std::string getMimeType(const std::string& extension) {
-        // Convert extension to lowercase for lookup
-        std::string lowerExt = extension;
-        std::transform(lowerExt.begin(), lowerExt.end(), lowerExt.begin(), ::tolower);
+    static constexpr std::string_view getMimeType(std::string_view extension) {
+        if (!extension.empty() && extension[0] == '.') extension.remove_prefix(1);
+        if (extension.empty() || extension.size() > MAX_EXTENSION) return DEFAULT_TYPE;
         
-        // Remove leading dot if present
-        if (!lowerExt.empty() && lowerExt[0] == '.') {
-            lowerExt = lowerExt.substr(1);
+        // Lookup is case-insensitive
+        std::array<char, MAX_EXTENSION> lower{};
+        for (size_t i = 0; i < extension.size(); ++i) {
+            const char c = extension[i];
+            lower[i] = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
         }
+        const std::string_view key(lower.data(), extension.size());
         
-        auto it = mimeTypes.find(lowerExt);
-        return (it != mimeTypes.end()) ? it->second : "application/octet-stream";
+        const uint8_t slot = TABLE[hash(key, SEED)];
+        return (slot != EMPTY_SLOT && MAPPINGS[slot].extension == key) ? MAPPINGS[slot].type : DEFAULT_TYPE;
+    }
+    
+    // The type a file's leading bytes announce; empty when none matches
+    static std::string_view sniff(std::span<const unsigned char> head) {
+        const std::string_view bytes(reinterpret_cast<const char*>(head.data()), head.size());
+        for (const auto& signature : SIGNATURES) {
+            if (bytes.starts_with(signature.magic)) return signature.type;
+        }
+        return {};
     }
     
-    static std::string getFileExtension(const std::string& filename) {
+    static constexpr std::string_view getFileExtension(std::string_view filename) {
         const auto lastDot = filename.find_last_of('.');
-        if (lastDot != std::string::npos && lastDot < filename.length() - 1) {
+        if (lastDot != std::string_view::npos && lastDot < filename.length() - 1) {
             return filename.substr(lastDot + 1);
         }
-        return "";
+        return {};
     }
 };
 
-// Define the MIME type mapping
-const std::unordered_map<std::string, std::string> MimeTypeMapper::mimeTypes = {
-    {"pdf", "application/pdf"},
-    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
-    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
-    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
-    {"doc", "application/msword"},
-    {"xls", "application/vnd.ms-excel"},
-    {"ppt", "application/vnd.ms-powerpoint"},
-    {"jpg", "image/jpeg"},
-    {"jpeg", "image/jpeg"},
-    {"png", "image/png"},
-    {"gif", "image/gif"},
-    {"svg", "image/svg+xml"},
-    {"zip", "application/zip"},
-    {"txt", "text/plain"}
+constexpr uint32_t MimeTypeMapper::SEED = findSeed();
+
+constexpr std::array<uint8_t, MimeTypeMapper::SLOTS> MimeTypeMapper::TABLE = [] {
+    static_assert(SEED != UINT32_MAX, "no perfect hash for the extension table; grow SLOTS");
+    std::array<uint8_t, SLOTS> table{};
+    table.fill(EMPTY_SLOT);
+    for (size_t i = 0; i < MAPPINGS.size(); ++i) {
+        table[hash(MAPPINGS[i].extension, SEED)] = static_cast<uint8_t>(i);
+    }
+    return table;
+}();
+
+static_assert(MimeTypeMapper::getMimeType("PDF") == "application/pdf");
+static_assert(MimeTypeMapper::getMimeType(".jpeg") == "image/jpeg");
+static_assert(MimeTypeMapper::getMimeType("docs") == MimeTypeMapper::DEFAULT_TYPE);
+
+// Per-thread memory for the hot path. Every thread gets its own pool, so
+// workers zipping thousands of small files stop contending on the shared
+// heap: strings and metadata that live for one task come from a bump arena
+// released when the task ends, zlib's stream state is recycled through the
+// pool, and read buffers are kept at their high-water size. Nothing here is
+// shared between threads, hence the unsynchronized resources.
+class WorkerArena {
+public:
+    enum class Buffer : size_t { Read, Compare, COUNT };
+    
+private:
+    static constexpr size_t TASK_ARENA_BYTES = 16 * 1024;
+    static constexpr size_t LARGEST_POOLED_BLOCK = 256 * 1024;  // above zlib's largest stream allocation
+    static constexpr size_t ALLOC_HEADER = alignof(std::max_align_t);
+    
+    std::pmr::unsynchronized_pool_resource pool;
+    std::pmr::monotonic_buffer_resource task;
+    std::array<std::vector<unsigned char>, static_cast<size_t>(Buffer::COUNT)> buffers;
+    size_t depth = 0;
+    
+    WorkerArena()
+        : pool(std::pmr::pool_options{0, LARGEST_POOLED_BLOCK}, std::pmr::new_delete_resource()),
+          task(TASK_ARENA_BYTES, &pool) {}
+    
+public:
+    WorkerArena(const WorkerArena&) = delete;
+    WorkerArena& operator=(const WorkerArena&) = delete;
+    
+    static WorkerArena& local() {
+        thread_local WorkerArena arena;
+        return arena;
+    }
+    
+    // Marks one task on this thread. A worker that helps out with another
+    // file's work while its own is in flight nests scopes; only the
+    // outermost one releases the task arena.
+    class TaskScope {
+    private:
+        WorkerArena& arena = local();
+        
+    public:
+        TaskScope() { ++arena.depth; }
+        ~TaskScope() {
+            if (--arena.depth == 0) arena.task.release();
+        }
+        TaskScope(const TaskScope&) = delete;
+        TaskScope& operator=(const TaskScope&) = delete;
+    };
+    
+    // For allocations that die with the current task; outside a task it is
+    // the pool, which recycles instead of growing
+    static std::pmr::memory_resource* taskResource() {
+        auto& arena = local();
+        return arena.depth > 0 ? static_cast<std::pmr::memory_resource*>(&arena.task) : &arena.pool;
+    }
+    
+    // A scratch buffer of at least size bytes, reused by the next caller of
+    // the same slot on this thread
+    static std::span<unsigned char> buffer(Buffer slot, size_t size) {
+        auto& storage = local().buffers[static_cast<size_t>(slot)];
+        if (storage.size() < size) {
+            storage.clear();
+            storage.shrink_to_fit();
+            storage.resize(size);
+        }
+        return {storage.data(), size};
+    }
+    
+    // zalloc/zfree for z_stream; zlib frees without a size, so it is kept in
+    // a header in front of each block
+    static voidpf zlibAlloc(voidpf, uInt items, uInt size) {
+        const size_t bytes = ALLOC_HEADER + static_cast<size_t>(items) * size;
+        try {
+            auto* block = static_cast<unsigned char*>(local().pool.allocate(bytes, ALLOC_HEADER));
+            std::memcpy(block, &bytes, sizeof(bytes));
+            return block + ALLOC_HEADER;
+        } catch (const std::bad_alloc&) {
+            return Z_NULL;
+        }
+    }
+    
+    static void zlibFree(voidpf, voidpf address) {
+        auto* block = static_cast<unsigned char*>(address) - ALLOC_HEADER;
+        size_t bytes;
+        std::memcpy(&bytes, block, sizeof(bytes));
+        local().pool.deallocate(block, bytes, ALLOC_HEADER);
+    }
 };
 
-// File metadata for JSON output
+// File metadata for JSON output. Built by a worker for each finished file
+// and copied into the listing, so it allocates from the task arena.
 struct FileMetadata {
-    std::string name;
-    std::string type;
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
     
-    FileMetadata(const std::string& zipName, const std::string& originalFilename) 
-        : name(zipName) {
-        const std::string extension = MimeTypeMapper::getFileExtension(originalFilename);
-        type = MimeTypeMapper::getMimeType(extension);
-    }
+    std::pmr::string name;
+    std::pmr::string type;
+    std::pmr::string bundle;  // archive holding the entry `name`; empty when `name` is its own zip
+    
+    // `mimeType` is the original file's, as CompressionPolicy found it
+    FileMetadata(std::string_view zipName, std::string_view mimeType, std::string_view bundleName = {},
+                 allocator_type allocator = WorkerArena::taskResource())
+        : name(zipName, allocator), type(mimeType, allocator), bundle(bundleName, allocator) {}
+    
+    FileMetadata(const FileMetadata& other, allocator_type allocator)
+        : name(other.name, allocator), type(other.type, allocator), bundle(other.bundle, allocator) {}
 };
 
-// Memory pool for better allocation performance
-class MemoryPool {
+// Progress lines and summaries: stdout, or nowhere with ZIPPER_QUIET.
+// Errors and warnings always go to stderr.
+std::ostream& console();
+
+// Where the time goes. Timed sections add to a per-stage run total and to the
+// file currently being worked on; when that file is done its stage times land
+// in log-scale histograms, so p50/p99 show whether slow files are slow in one
+// stage or everywhere. Block jobs and pipeline threads adopt the file they
+// work for, so a split file is still timed as one. Totals are summed over
+// threads and can exceed the wall-clock time.
+class StageTimers {
+public:
+    using Clock = std::chrono::steady_clock;
+    
+    enum class Stage : size_t { Scan, Read, Compress, Encrypt, Write, Close };
+    static constexpr size_t STAGE_COUNT = 6;
+    static constexpr std::array<const char*, STAGE_COUNT> STAGE_NAMES = {
+        "scan", "read", "compress", "encrypt", "write", "close"
+    };
+    
+    // Shared by every thread working on the file
+    struct FileTimes {
+        std::array<std::atomic<uint64_t>, STAGE_COUNT> ns{};
+    };
+    
+    // Four sub-buckets per power of two: quantiles within ~25%, fixed memory
+    class Histogram {
+    private:
+        static constexpr size_t SUB_BUCKETS = 4;
+        static constexpr size_t BUCKETS = 64 * SUB_BUCKETS;
+        std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> largest{0};
+        
+    public:
+        void record(uint64_t value) {
+            counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            samples.fetch_add(1, std::memory_order_relaxed);
+            uint64_t seen = largest.load(std::memory_order_relaxed);
+            while (value > seen && !largest.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+        }
+        
+        uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+        
+        // Upper bound of the bucket holding the q-quantile, capped at the largest sample
+        uint64_t quantile(double q) const {
+            const uint64_t total = count();
+            if (total == 0) return 0;
+            const uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(q * static_cast<double>(total))), 1);
+            uint64_t seen = 0;
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                seen += counts[b].load(std::memory_order_relaxed);
+                if (seen >= rank) return std::min(upperBound(b), largest.load(std::memory_order_relaxed));
+            }
+            return largest.load(std::memory_order_relaxed);
+        }
+        
+    private:
+        static size_t bucketOf(uint64_t value) {
+            if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+            const size_t log = 63 - static_cast<size_t>(std::countl_zero(value));
+            const size_t sub = static_cast<size_t>(value >> (log - 2)) - SUB_BUCKETS;
+            return log * SUB_BUCKETS + sub;
+        }
+        
+        static uint64_t upperBound(size_t bucket) {
+            if (bucket < SUB_BUCKETS) return bucket;
+            if (bucket == BUCKETS - 1) return std::numeric_limits<uint64_t>::max();
+            const size_t log = bucket / SUB_BUCKETS;
+            const uint64_t sub = bucket % SUB_BUCKETS;
+            return ((SUB_BUCKETS + sub + 1) << (log - 2)) - 1;
+        }
+    };
+    
+    // Times one section of a stage on this thread
+    class Scope {
+    private:
+        const Stage stage;
+        const Clock::time_point start = Clock::now();
+        
+    public:
+        explicit Scope(Stage s) : stage(s) {}
+        ~Scope() { global().add(stage, Clock::now() - start); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+    
+    // Makes a file current on this thread; its times are recorded on exit
+    class FileScope {
+    private:
+        FileTimes times;
+        FileTimes* const previous = currentFile;
+        const Clock::time_point start = Clock::now();
+        
+    public:
+        FileScope() { currentFile = &times; }
+        ~FileScope() {
+            currentFile = previous;
+            global().finishFile(times, Clock::now() - start);
+        }
+        FileScope(const FileScope&) = delete;
+        FileScope& operator=(const FileScope&) = delete;
+    };
+    
+    // Carries the current file over to another thread
+    class Adopt {
+    private:
+        FileTimes* const previous = currentFile;
+        
+    public:
+        explicit Adopt(FileTimes* file) { currentFile = file; }
+        ~Adopt() { currentFile = previous; }
+        Adopt(const Adopt&) = delete;
+        Adopt& operator=(const Adopt&) = delete;
+    };
+    
+    static StageTimers& global() {
+        static StageTimers timers;
+        return timers;
+    }
+    
+    static FileTimes* current() { return currentFile; }
+    
+    void add(Stage stage, Clock::duration elapsed) {
+        const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        const auto index = static_cast<size_t>(stage);
+        totals[index].fetch_add(ns, std::memory_order_relaxed);
+        if (currentFile) currentFile->ns[index].fetch_add(ns, std::memory_order_relaxed);
+    }
+    
+    // Bytes a stage moved: input read, archive bytes written
+    void addBytes(Stage stage, size_t count) {
+        bytes[static_cast<size_t>(stage)].fetch_add(count, std::memory_order_relaxed);
+    }
+    
+    uint64_t nanosIn(Stage stage) const { return totals[static_cast<size_t>(stage)].load(std::memory_order_relaxed); }
+    uint64_t bytesIn(Stage stage) const { return bytes[static_cast<size_t>(stage)].load(std::memory_order_relaxed); }
+    uint64_t workerNanos() const { return workerNs.load(std::memory_order_relaxed); }
+    uint64_t workerIdleNanos() const { return workerIdleNs.load(std::memory_order_relaxed); }
+    
+    // A worker pool shut down: how long its workers had nothing to run
+    void recordWorkers(size_t workers, Clock::duration lifetime, uint64_t idleNs) {
+        const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(lifetime).count());
+        workerNs.fetch_add(ns * workers, std::memory_order_relaxed);
+        workerIdleNs.fetch_add(std::min(idleNs, ns * workers), std::memory_order_relaxed);
+    }
+    
+    void display() const {
+        if (files.count() == 0 && totals[static_cast<size_t>(Stage::Scan)].load() == 0) return;
+        
+        console() << "\n=== Stage Timings ===\n";
+        console() << std::left << std::setw(12) << "Stage" << std::right << std::setw(12) << "Total"
+                  << std::setw(12) << "p50/file" << std::setw(12) << "p99/file" << '\n';
+        for (size_t i = 0; i < STAGE_COUNT; ++i) {
+            const auto total = totals[i].load(std::memory_order_relaxed);
+            if (total == 0) continue;
+            console() << std::left << std::setw(12) << STAGE_NAMES[i] << std::right << std::setw(12) << formatNanos(total);
+            if (perFile[i].count() > 0) {
+                console() << std::setw(12) << formatNanos(perFile[i].quantile(0.5))
+                          << std::setw(12) << formatNanos(perFile[i].quantile(0.99));
+            }
+            console() << '\n';
+        }
+        if (files.count() > 0) {
+            console() << std::left << std::setw(12) << "file (wall)" << std::right << std::setw(12) << ""
+                      << std::setw(12) << formatNanos(files.quantile(0.5))
+                      << std::setw(12) << formatNanos(files.quantile(0.99)) << '\n';
+        }
+        
+        const auto capacity = workerNs.load(std::memory_order_relaxed);
+        if (capacity > 0) {
+            const auto idle = workerIdleNs.load(std::memory_order_relaxed);
+            console() << "Worker idle: " << formatNanos(idle) << " (" << std::fixed << std::setprecision(1)
+                      << 100.0 * static_cast<double>(idle) / static_cast<double>(capacity) << "% of worker time)\n";
+        }
+    }
+    
 private:
-    std::pmr::unsynchronized_pool_resource pool;
+    inline static thread_local FileTimes* currentFile = nullptr;
+    
+    std::array<std::atomic<uint64_t>, STAGE_COUNT> totals{};
+    std::array<std::atomic<uint64_t>, STAGE_COUNT> bytes{};
+    std::array<Histogram, STAGE_COUNT> perFile;  // over files that went through the stage
+    Histogram files;
+    std::atomic<uint64_t> workerNs{0};
+    std::atomic<uint64_t> workerIdleNs{0};
+    
+    StageTimers() = default;
     
+    void finishFile(const FileTimes& times, Clock::duration wall) {
+        for (size_t i = 0; i < STAGE_COUNT; ++i) {
+            const auto ns = times.ns[i].load(std::memory_order_relaxed);
+            if (ns > 0) perFile[i].record(ns);
+        }
+        files.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count()));
+    }
+    
+    static std::string formatNanos(uint64_t ns) {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(1);
+        if (ns >= 1'000'000'000) {
+            oss << ns / 1e9 << " s";
+        } else if (ns >= 1'000'000) {
+            oss << ns / 1e6 << " ms";
+        } else {
+            oss << ns / 1e3 << " us";
+        }
+        return oss.str();
+    }
+};
+
+// ZIPPER_MAX_MEMORY: one process-wide cap on the buffer bytes held in flight
+// across all workers - pipeline blocks, block-compression windows, read-ahead
+// rings and write staging. A holder takes a Lease sized to what it is about
+// to allocate. Transient leases (blocks on their way to the output) block
+// the reader while the budget is spent. Pinned leases cover buffers an open
+// archive keeps while it waits for transient ones; extras (deeper read-ahead,
+// more write stages) are only taken with tryPin() and skipped otherwise.
+// Waiters are served in order, and one is let through regardless once no
+// transient lease is outstanding, so memory pinned by open archives or a
+// single block larger than the whole budget never wedges the run; the
+// overshoot is bounded by one request. Without a limit nothing is counted.
+class MemoryBudget {
 public:
-    MemoryPool() : pool(std::pmr::get_default_resource()) {}
+    using Clock = std::chrono::steady_clock;
+    
+    class Lease {
+    private:
+        MemoryBudget* budget = nullptr;
+        size_t bytes = 0;
+        bool pinned = false;
+        
+        Lease(MemoryBudget* owner, size_t size, bool pin) : budget(owner), bytes(size), pinned(pin) {}
+        friend class MemoryBudget;
+        
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept
+            : budget(std::exchange(other.budget, nullptr)), bytes(std::exchange(other.bytes, 0)), pinned(other.pinned) {}
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                reset();
+                budget = std::exchange(other.budget, nullptr);
+                bytes = std::exchange(other.bytes, 0);
+                pinned = other.pinned;
+            }
+            return *this;
+        }
+        ~Lease() { reset(); }
+        
+        void reset() {
+            if (budget) budget->release(bytes, pinned);
+            budget = nullptr;
+            bytes = 0;
+        }
+    };
+    
+    static constexpr size_t MMAP_THRESHOLD = 256 * 1024;
+    
+    explicit MemoryBudget(size_t limitBytes) : limitBytes(limitBytes) {}
+    
+    static MemoryBudget& global();
+    
+    bool limited() const { return limitBytes > 0; }
+    size_t limit() const { return limitBytes; }
+    
+    Lease acquire(size_t bytes) { return take(bytes, false); }
+    Lease pin(size_t bytes) { return take(bytes, true); }
+    
+    std::optional<Lease> tryAcquire(size_t bytes) { return tryTake(bytes, false); }
+    std::optional<Lease> tryPin(size_t bytes) { return tryTake(bytes, true); }
+    
+    // A pinned buffer taken before its holder has anything else. It waits
+    // outside the queue until the bytes fit or nothing at all is in use, so
+    // it never overshoots the budget and never holds up a running archive.
+    Lease reserve(size_t bytes) {
+        if (!limited() || bytes == 0) return {};
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto fits = [&]() { return used == 0 || (waiting == 0 && used + bytes <= limitBytes); };
+        if (!fits()) {
+            ++waits;
+            const auto start = Clock::now();
+            released.wait(lock, fits);
+            waited += Clock::now() - start;
+        }
+        grant(bytes, true);
+        return Lease(this, bytes, true);
+    }
+    
+    // Whether bytes would be granted right now, for the scheduler
+    bool wouldFit(size_t bytes) const {
+        if (!limited()) return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        return waiting == 0 && used + bytes <= limitBytes;
+    }
+    
+    void recordDeferred() { deferred.fetch_add(1, std::memory_order_relaxed); }
+    
+    void display() const {
+        if (!limited()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        console() << "\n=== Memory Budget ===\n";
+        console() << "Limit: " << formatMegabytes(limitBytes) << ", peak in flight: " << formatMegabytes(peak) << '\n';
+        console() << "Waits: " << waits << " (" << std::fixed << std::setprecision(2)
+                  << std::chrono::duration<double>(waited).count() << " s blocked)";
+        if (const auto put = deferred.load(std::memory_order_relaxed); put > 0) {
+            console() << ", " << put << " large files deferred behind smaller ones";
+        }
+        console() << '\n';
+    }
+    
+private:
+    const size_t limitBytes;
+    mutable std::mutex mutex;
+    std::condition_variable released;
+    size_t used = 0;
+    size_t transient = 0;  // of used; what will drain without anyone waiting on the budget
+    size_t peak = 0;
+    uint64_t nextTicket = 0;
+    uint64_t serving = 0;
+    size_t waiting = 0;
+    uint64_t waits = 0;
+    Clock::duration waited{};
+    std::atomic<uint64_t> deferred{0};
+    
+    Lease take(size_t bytes, bool pinned) {
+        if (!limited() || bytes == 0) return {};
+        std::unique_lock<std::mutex> lock(mutex);
+        const uint64_t ticket = nextTicket++;
+        const auto admissible = [&]() {
+            return ticket == serving && (transient == 0 || used + bytes <= limitBytes);
+        };
+        if (!admissible()) {
+            ++waiting;
+            ++waits;
+            const auto start = Clock::now();
+            released.wait(lock, admissible);
+            waited += Clock::now() - start;
+            --waiting;
+        }
+        ++serving;
+        grant(bytes, pinned);
+        lock.unlock();
+        released.notify_all();  // let the next ticket check its turn
+        return Lease(this, bytes, pinned);
+    }
+    
+    // Optional pinned buffers may fill half the budget; the rest is kept for
+    // blocks, which are what moves the run forward
+    std::optional<Lease> tryTake(size_t bytes, bool pinned) {
+        if (!limited() || bytes == 0) return Lease{};
+        std::lock_guard<std::mutex> lock(mutex);
+        if (waiting > 0 || used + bytes > limitBytes) return std::nullopt;  // no jumping the queue
+        if (pinned && used - transient + bytes > limitBytes / 2) return std::nullopt;
+        grant(bytes, pinned);
+        return Lease(this, bytes, pinned);
+    }
+    
+    void grant(size_t bytes, bool pinned) {
+        used += bytes;
+        if (!pinned) transient += bytes;
+        peak = std::max(peak, used);
+    }
+    
+    void release(size_t bytes, bool pinned) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+            if (!pinned) transient -= bytes;
+        }
+        released.notify_all();
+    }
     
-    std::pmr::memory_resource* get_resource() {
-        return &pool;
+    static std::string formatMegabytes(size_t bytes) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.1f MB", static_cast<double>(bytes) / (1024.0 * 1024.0));
+        return text;
     }
 };
 
@@ -104,6 +711,19 @@ private:
     std::atomic<size_t> failedFiles{0};
     std::atomic<size_t> totalInputSize{0};
     std::atomic<size_t> totalOutputSize{0};
+    std::atomic<size_t> storedFiles{0};
+    std::atomic<size_t> fastFiles{0};
+    std::atomic<size_t> maxFiles{0};
+    std::atomic<size_t> keysPrecomputed{0};
+    std::atomic<size_t> keysDerivedInline{0};
+    std::atomic<uint64_t> keyTimeSavedNs{0};
+    std::atomic<uint64_t> keyTimeInlineNs{0};
+    std::atomic<size_t> dedupedFiles{0};
+    std::atomic<size_t> dedupedBytes{0};
+    std::atomic<size_t> chunkedFiles{0};
+    std::atomic<size_t> chunkedBytes{0};
+    std::atomic<size_t> chunkReusedBytes{0};
+    std::atomic<size_t> chunkRepeatedBytes{0};
     std::chrono::time_point<std::chrono::high_resolution_clock> startTime;
     
 public:
@@ -115,41 +735,120 @@ public:
     void addInputSize(size_t size) { totalInputSize.fetch_add(size, std::memory_order_relaxed); }
     void addOutputSize(size_t size) { totalOutputSize.fetch_add(size, std::memory_order_relaxed); }
     
+    void incrementStoredFiles() { storedFiles.fetch_add(1, std::memory_order_relaxed); }
+    void incrementFastFiles() { fastFiles.fetch_add(1, std::memory_order_relaxed); }
+    void incrementMaxFiles() { maxFiles.fetch_add(1, std::memory_order_relaxed); }
+    
+    // An output was reused from an identical input instead of recompressed
+    void recordDeduplicated(size_t inputBytes) {
+        dedupedFiles.fetch_add(1, std::memory_order_relaxed);
+        dedupedBytes.fetch_add(inputBytes, std::memory_order_relaxed);
+    }
+    
+    // An input was zipped in chunks; some may have been copied instead of compressed
+    void recordChunked(size_t inputBytes, size_t reusedBytes, size_t repeatedBytes) {
+        chunkedFiles.fetch_add(1, std::memory_order_relaxed);
+        chunkedBytes.fetch_add(inputBytes, std::memory_order_relaxed);
+        chunkReusedBytes.fetch_add(reusedBytes, std::memory_order_relaxed);
+        chunkRepeatedBytes.fetch_add(repeatedBytes, std::memory_order_relaxed);
+    }
+    
+    // A precomputed key was handed to a writer, sparing it the PBKDF2 cost
+    void recordPooledKey(std::chrono::nanoseconds cost) {
+        keysPrecomputed.fetch_add(1, std::memory_order_relaxed);
+        keyTimeSavedNs.fetch_add(static_cast<uint64_t>(cost.count()), std::memory_order_relaxed);
+    }
+    
+    // A writer had to derive its key on the critical path
+    void recordInlineKey(std::chrono::nanoseconds cost) {
+        keysDerivedInline.fetch_add(1, std::memory_order_relaxed);
+        keyTimeInlineNs.fetch_add(static_cast<uint64_t>(cost.count()), std::memory_order_relaxed);
+    }
+    
     void displayResults() const {
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto processingTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         
-        std::cout << "\n=== Processing Summary ===\n";
-        std::cout << "Files processed: " << processedFiles.load() << '\n';
-        std::cout << "Files skipped: " << skippedFiles.load() << '\n';
-        std::cout << "Files failed: " << failedFiles.load() << '\n';
-        std::cout << "Total files: " << totalFiles.load() << '\n';
+        console() << "\n=== Processing Summary ===\n";
+        console() << "Files processed: " << processedFiles.load() << '\n';
+        console() << "Files skipped: " << skippedFiles.load() << '\n';
+        console() << "Files failed: " << failedFiles.load() << '\n';
+        console() << "Total files: " << totalFiles.load() << '\n';
         
         const auto procFiles = processedFiles.load();
         if (procFiles > 0) {
-            std::cout << "\n=== Compression Statistics ===\n";
+            console() << "\n=== Compression Statistics ===\n";
             const auto inputSize = totalInputSize.load();
             const auto outputSize = totalOutputSize.load();
             
-            std::cout << "Total input size: " << formatBytes(inputSize) << '\n';
-            std::cout << "Total output size: " << formatBytes(outputSize) << '\n';
+            console() << "Total input size: " << formatBytes(inputSize) << '\n';
+            console() << "Total output size: " << formatBytes(outputSize) << '\n';
             
             if (inputSize > 0) {
                 const auto overallCompression = (1.0 - static_cast<double>(outputSize) / inputSize) * 100.0;
-                std::cout << "Overall compression: " << std::fixed << std::setprecision(1) << overallCompression << "%\n";
+                console() << "Overall compression: " << std::fixed << std::setprecision(1) << overallCompression << "%\n";
             }
             
-            std::cout << "Processing time: " << processingTime.count() << " ms\n";
+            console() << "Compression policy: " << storedFiles.load() << " stored, " << fastFiles.load()
+                      << " fast, " << maxFiles.load() << " max\n";
+            if (dedupedFiles.load() > 0) {
+                console() << "Deduplicated: " << dedupedFiles.load() << " files ("
+                          << formatBytes(dedupedBytes.load()) << " not recompressed)\n";
+            }
+            if (chunkedFiles.load() > 0) {
+                console() << "Chunked: " << chunkedFiles.load() << " files, " << formatBytes(chunkReusedBytes.load())
+                          << " of " << formatBytes(chunkedBytes.load()) << " reused from earlier archives, "
+                          << formatBytes(chunkRepeatedBytes.load()) << " repeated within files\n";
+            }
+            console() << "Processing time: " << processingTime.count() << " ms\n";
             
             if (processingTime.count() > 0) {
                 const auto throughput = static_cast<double>(inputSize) / (processingTime.count() / 1000.0);
-                std::cout << "Throughput: " << formatBytes(static_cast<size_t>(throughput)) << "/s\n";
+                console() << "Throughput: " << formatBytes(static_cast<size_t>(throughput)) << "/s\n";
             }
         }
+        
+        StageTimers::global().display();
+        MemoryBudget::global().display();
+        
+        const auto pooled = keysPrecomputed.load();
+        const auto inlineKeys = keysDerivedInline.load();
+        if (pooled + inlineKeys > 0) {
+            console() << "\n=== Key Derivation ===\n";
+            console() << "Keys precomputed: " << pooled << '\n';
+            console() << "Keys derived inline: " << inlineKeys << '\n';
+            console() << "PBKDF2 time moved off writers: " << std::fixed << std::setprecision(1)
+                      << keyTimeSavedNs.load() / 1e6 << " ms\n";
+            console() << "PBKDF2 time on writers: " << std::fixed << std::setprecision(1)
+                      << keyTimeInlineNs.load() / 1e6 << " ms\n";
+        }
     }
     
     bool hasFailures() const { return failedFiles.load() > 0; }
     
+    struct Totals {
+        size_t files = 0;
+        size_t processed = 0;
+        size_t skipped = 0;
+        size_t failed = 0;
+        size_t inputBytes = 0;
+        size_t outputBytes = 0;
+        size_t deduplicated = 0;
+    };
+    
+    // Counters so far, for the event stream and the metrics endpoint
+    Totals totals() const {
+        Totals t;
+        t.files = totalFiles.load(std::memory_order_relaxed);
+        t.processed = processedFiles.load(std::memory_order_relaxed);
+        t.skipped = skippedFiles.load(std::memory_order_relaxed);
+        t.failed = failedFiles.load(std::memory_order_relaxed);
+        t.inputBytes = totalInputSize.load(std::memory_order_relaxed);
+        t.outputBytes = totalOutputSize.load(std::memory_order_relaxed);
+        t.deduplicated = dedupedFiles.load(std::memory_order_relaxed);
+        return t;
+    }
+    
 private:
     static std::string formatBytes(size_t bytes) {
         constexpr std::array<const char*, 6> units = {"B", "KB", "MB", "GB", "TB", "PB"};
@@ -163,113 +862,7405 @@ private:
         
         const auto value = static_cast<double>(bytes) / std::pow(1024.0, static_cast<double>(unitIndex));
         
-        std::ostringstream oss;
-        oss << std::fixed << std::setprecision(1) << value << " " << units[unitIndex];
-        return oss.str();
+        // "1023.9 KB" fits the small-string buffer, so this never allocates
+        char text[32];
+        const int length = std::snprintf(text, sizeof(text), "%.1f %s", value, units[unitIndex]);
+        return std::string(text, static_cast<size_t>(std::max(length, 0)));
     }
 };
 
-// Configuration with better defaults and validation
-class Config {
+// CPUs this process may run on, grouped by NUMA node, plus the CPU budget its
+// cgroup grants. Read once from the affinity mask, /sys and /proc on Linux;
+// elsewhere it degrades to hardware_concurrency() on a single node.
+class CpuTopology {
+private:
+    std::vector<std::vector<int>> nodes;  // allowed CPUs per NUMA node with any
+    size_t allowedCpus = 0;
+    size_t quotaCpus = 0;                 // 0 = no cgroup limit
+    
 public:
-    static constexpr std::string_view DEFAULT_INPUT_FOLDER = "input";
-    static constexpr std::string_view DEFAULT_OUTPUT_FOLDER = "output";
-    // No default password - must be provided via environment variable
-    static constexpr size_t MAX_THREADS = 8;  // Reasonable default
-    static constexpr size_t MIN_FILE_SIZE_FOR_THREADING = 1024 * 1024;  // 1MB
+    static const CpuTopology& get() {
+        static const CpuTopology topology;
+        return topology;
+    }
     
-    // Get configuration value with fallback to default
-    static std::string getInputFolder() {
-        const char* env = std::getenv("ZIPPER_INPUT_FOLDER");
-        return env ? std::string(env) : std::string(DEFAULT_INPUT_FOLDER);
+    size_t cpuCount() const { return allowedCpus; }
+    size_t cgroupQuota() const { return quotaCpus; }
+    size_t nodeCount() const { return nodes.size(); }
+    
+    // Restrict the calling thread to one node's CPUs; threads it starts
+    // inherit the mask, and first-touch keeps their buffers on that node
+    bool pinCurrentThread(size_t node) const {
+#ifdef __linux__
+        if (node >= nodes.size()) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int cpu : nodes[node]) {
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)node;
+        return false;
+#endif
     }
     
-    static std::string getOutputFolder() {
-        const char* env = std::getenv("ZIPPER_OUTPUT_FOLDER");
-        return env ? std::string(env) : std::string(DEFAULT_OUTPUT_FOLDER);
+private:
+    CpuTopology() {
+        const auto hw = std::thread::hardware_concurrency();
+        allowedCpus = hw > 0 ? hw : 4;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            allowedCpus = static_cast<size_t>(std::max(CPU_COUNT(&allowed), 1));
+            readNodes(allowed);
+        }
+        quotaCpus = readCgroupQuota();
+#endif
+        if (nodes.empty()) nodes.emplace_back();
     }
     
-    static std::string getPassword() {
-        const char* env = std::getenv("ZIPPER_PASSWORD");
-        if (!env || std::string(env).empty()) {
-            throw std::runtime_error("Password not provided! Please set ZIPPER_PASSWORD environment variable.");
+#ifdef __linux__
+    void readNodes(const cpu_set_t& allowed) {
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+            const auto name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(static_cast<unsigned char>(name[4]))) {
+                continue;
+            }
+            std::ifstream list(entry.path() / "cpulist");
+            std::string text;
+            std::getline(list, text);
+            
+            std::vector<int> cpus;
+            for (const int cpu : parseCpuList(text)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+            }
+            if (!cpus.empty()) nodes.push_back(std::move(cpus));
         }
-        return std::string(env);
     }
-    static constexpr size_t BUFFER_SIZE = 64 * 1024;  // 64KB buffer
     
-    static void displayHeader() {
-        std::cout << "=== High-Performance File Zipper with Password Protection ===\n";
-        std::cout << "Source folder: " << getInputFolder() << '\n';
-        std::cout << "Output folder: " << getOutputFolder() << '\n';
-        std::cout << "Encryption: AES-256\n";
-        std::cout << "Max threads: " << getOptimalThreadCount() << '\n';
-        std::cout << "Password: [USER PROVIDED]\n\n";
+    // "0-3,8-11" -> {0, 1, 2, 3, 8, 9, 10, 11}
+    static std::vector<int> parseCpuList(std::string_view text) {
+        std::vector<int> cpus;
+        while (!text.empty()) {
+            const auto comma = text.find(',');
+            const auto range = text.substr(0, comma);
+            text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+            
+            int first = 0;
+            int last = 0;
+            const auto dash = range.find('-');
+            const auto firstText = range.substr(0, dash);
+            if (std::from_chars(firstText.data(), firstText.data() + firstText.size(), first).ec != std::errc()) continue;
+            last = first;
+            if (dash != std::string_view::npos) {
+                const auto lastText = range.substr(dash + 1);
+                if (std::from_chars(lastText.data(), lastText.data() + lastText.size(), last).ec != std::errc()) continue;
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
     }
     
-    static size_t getOptimalThreadCount() {
-        const auto hw_threads = std::thread::hardware_concurrency();
-        return std::min(static_cast<size_t>(hw_threads > 0 ? hw_threads : 4), MAX_THREADS);
+    // Tightest CPU quota along this process's cgroup path, rounded up
+    static size_t readCgroupQuota() {
+        std::ifstream self("/proc/self/cgroup");
+        std::string line;
+        size_t quota = 0;
+        const auto tighten = [&quota](double cpus) {
+            if (cpus <= 0.0) return;
+            const auto rounded = static_cast<size_t>(std::ceil(cpus));
+            quota = quota == 0 ? rounded : std::min(quota, rounded);
+        };
+        
+        while (std::getline(self, line)) {
+            // "0::/path" is cgroup v2; "N:cpu,cpuacct:/path" is the v1 cpu controller
+            const auto first = line.find(':');
+            const auto second = line.find(':', first + 1);
+            if (first == std::string::npos || second == std::string::npos) continue;
+            const auto controllers = std::string_view(line).substr(first + 1, second - first - 1);
+            const fs::path cgroup = line.substr(second + 1);
+            
+            if (controllers.empty()) {
+                const fs::path root = "/sys/fs/cgroup";
+                for (auto dir = cgroup.has_relative_path() ? root / cgroup.relative_path() : root;;
+                     dir = dir.parent_path()) {
+                    std::ifstream max(dir / "cpu.max");
+                    std::string limit;
+                    double period = 0.0;
+                    if (max >> limit >> period && limit != "max" && period > 0.0) {
+                        tighten(std::strtod(limit.c_str(), nullptr) / period);
+                    }
+                    if (dir == root || !dir.has_relative_path()) break;
+                }
+            } else if (hasController(controllers, "cpu")) {
+                for (const char* mount : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+                    const auto dir = fs::path(mount) / cgroup.relative_path();
+                    std::ifstream quotaFile(dir / "cpu.cfs_quota_us");
+                    std::ifstream periodFile(dir / "cpu.cfs_period_us");
+                    double limit = 0.0;
+                    double period = 0.0;
+                    if (quotaFile >> limit && periodFile >> period && limit > 0.0 && period > 0.0) {
+                        tighten(limit / period);
+                        break;
+                    }
+                }
+            }
+        }
+        return quota;
+    }
+    
+    static bool hasController(std::string_view list, std::string_view name) {
+        while (!list.empty()) {
+            const auto comma = list.find(',');
+            if (list.substr(0, comma) == name) return true;
+            if (comma == std::string_view::npos) break;
+            list.remove_prefix(comma + 1);
+        }
+        return false;
     }
+#endif
 };
 
-// RAII wrapper for zip archives with better error handling
-class ZipArchive {
+// Minimal io_uring ring over the raw syscalls, so there is no liburing
+// dependency. Each reader or writer owns one small ring, keeps no more
+// than `entries` operations in flight and reaps its own completions. If the
+// kernel is too old or seccomp blocks the ring, valid() is false and callers
+// use plain pread/pwrite instead.
+class IoUring {
+public:
+    struct Completion {
+        uint64_t tag = 0;
+        int result = 0;  // bytes transferred, or -errno
+    };
+    
+#ifdef ZIPPER_HAVE_IO_URING
 private:
-    zip_t* archive = nullptr;
-    fs::path filePath;
+    int ringFd = -1;
+    unsigned sqEntries = 0;
+    unsigned sqTail = 0;        // local tail, published to the kernel on submit
+    unsigned unsubmitted = 0;
+    unsigned sqMask = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTailShared = nullptr;
+    unsigned* sqArray = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    unsigned cqMask = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingBytes = 0;
+    size_t cqRingBytes = 0;
+    size_t sqeBytes = 0;
+    bool registered = false;
     
 public:
-    explicit ZipArchive(const fs::path& path) : filePath(path) {
-        int error = 0;
-        archive = zip_open(path.c_str(), ZIP_CREATE | ZIP_TRUNCATE, &error);
-        if (!archive) {
-            std::string errorMsg = "Failed to create zip archive: " + path.string();
-            if (error != 0) {
-                zip_error_t zipError;
-                zip_error_init_with_code(&zipError, error);
-                errorMsg += " (Error: " + std::string(zip_error_strerror(&zipError)) + ")";
-                zip_error_fini(&zipError);
-            }
-            throw std::runtime_error(errorMsg);
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd < 0) return;
+        
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        
+        sqRing = ::mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing != MAP_FAILED) {
+            cqRing = singleMap ? sqRing
+                               : ::mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        ringFd, IORING_OFF_CQ_RING);
         }
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqeMap = cqRing == MAP_FAILED ? MAP_FAILED
+                                            : ::mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                     ringFd, IORING_OFF_SQES);
+        if (sqeMap == MAP_FAILED) {
+            teardown();
+            return;
+        }
+        
+        auto* sq = static_cast<char*>(sqRing);
+        auto* cq = static_cast<char*>(cqRing);
+        sqEntries = params.sq_entries;
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTailShared = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqeMap);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqTail = *sqTailShared;
+    }
+    
+    ~IoUring() { teardown(); }
+    
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    
+    bool valid() const { return ringFd >= 0; }
+    bool hasRegisteredBuffers() const { return registered; }
+    
+    // Pin recycled buffers once, so fixed reads and writes don't map pages on
+    // every call. This can fail under RLIMIT_MEMLOCK; plain ops still work then.
+    bool registerBuffers(const std::vector<iovec>& buffers) {
+        registered = valid() && ::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                                          buffers.data(), static_cast<unsigned>(buffers.size())) == 0;
+        return registered;
+    }
+    
+    // A bufferIndex >= 0 picks a registered buffer. Returns false if the ring is full.
+    bool queueRead(int fd, void* buffer, unsigned len, uint64_t offset, uint64_t tag, int bufferIndex = -1) {
+        return queue(bufferIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer, len, offset, tag, bufferIndex);
+    }
+    
+    bool queueWrite(int fd, const void* buffer, unsigned len, uint64_t offset, uint64_t tag, int bufferIndex = -1) {
+        return queue(bufferIndex >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buffer, len, offset, tag, bufferIndex);
     }
     
-    ~ZipArchive() {
-        if (archive) {
-            if (zip_close(archive) < 0) {
-                std::cerr << "Warning: Failed to properly close zip archive: " << filePath << '\n';
+    // Hand everything queued to the kernel and optionally block for completions.
+    // Returns false with errno set on failure.
+    bool submit(unsigned waitFor = 0) {
+        __atomic_store_n(sqTailShared, sqTail, __ATOMIC_RELEASE);
+        const unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        for (;;) {
+            const long rc = ::syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor, flags, nullptr, 0);
+            if (rc >= 0) {
+                unsubmitted -= std::min(unsubmitted, static_cast<unsigned>(rc));
+                return true;
             }
+            if (errno != EINTR) return false;
         }
     }
     
-    zip_t* get() const { return archive; }
-    
-    // Non-copyable, moveable
-    ZipArchive(const ZipArchive&) = delete;
-    ZipArchive& operator=(const ZipArchive&) = delete;
-    ZipArchive(ZipArchive&& other) noexcept : archive(other.archive), filePath(std::move(other.filePath)) {
-        other.archive = nullptr;
+    bool peek(Completion& out) {
+        const unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+        const auto& cqe = cqes[head & cqMask];
+        out.tag = cqe.user_data;
+        out.result = cqe.res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
     }
-    ZipArchive& operator=(ZipArchive&& other) noexcept {
-        if (this != &other) {
-            if (archive) zip_close(archive);
-            archive = other.archive;
-            filePath = std::move(other.filePath);
-            other.archive = nullptr;
+    
+    // Block for the next completion. Returns false with errno set on failure.
+    bool wait(Completion& out) {
+        while (!peek(out)) {
+            if (!submit(1)) return false;
         }
-        return *this;
+        return true;
+    }
+    
+    // Checked once. Kernels before 5.1 and seccomp'd containers refuse the setup.
+    static bool available() {
+        static const bool supported = IoUring(1).valid();
+        return supported;
+    }
+    
+private:
+    bool queue(uint8_t opcode, int fd, const void* buffer, unsigned len, uint64_t offset, uint64_t tag, int bufferIndex) {
+        if (sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return false;
+        const unsigned index = sqTail & sqMask;
+        auto& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        if (bufferIndex >= 0) sqe.buf_index = static_cast<uint16_t>(bufferIndex);
+        sqArray[index] = index;
+        ++sqTail;
+        ++unsubmitted;
+        return true;
+    }
+    
+    void teardown() {
+        if (sqes) ::munmap(sqes, sqeBytes);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) ::munmap(cqRing, cqRingBytes);
+        if (sqRing != MAP_FAILED) ::munmap(sqRing, sqRingBytes);
+        sqes = nullptr;
+        sqRing = cqRing = MAP_FAILED;
+        if (ringFd >= 0) ::close(ringFd);
+        ringFd = -1;
     }
+#else
+public:
+    explicit IoUring(unsigned) {}
+    bool valid() const { return false; }
+    bool hasRegisteredBuffers() const { return false; }
+    bool registerBuffers(const std::vector<iovec>&) { return false; }
+    bool queueRead(int, void*, unsigned, uint64_t, uint64_t, int = -1) { return false; }
+    bool queueWrite(int, const void*, unsigned, uint64_t, uint64_t, int = -1) { return false; }
+    bool submit(unsigned = 0) { errno = ENOSYS; return false; }
+    bool peek(Completion&) { return false; }
+    bool wait(Completion&) { errno = ENOSYS; return false; }
+    static bool available() { return false; }
+#endif
 };
 
-// File processing task for better parallelization
-struct FileTask {
+// Configuration with better defaults and validation
+class Config {
+public:
+    static constexpr std::string_view DEFAULT_INPUT_FOLDER = "input";
+    static constexpr std::string_view DEFAULT_OUTPUT_FOLDER = "output";
+    // No default password - must be provided via environment variable
+    static constexpr size_t MAX_THREADS = 512;  // sanity bound, not a tuning knob
+    static constexpr size_t MIN_FILE_SIZE_FOR_THREADING = 1024 * 1024;  // 1MB
+    static constexpr size_t BUNDLE_MAX_FILE = 256 * 1024;              // 256KB
+    
+    // A setting by its environment name. Values set through the library API
+    // (zipper::Options::settings, zipper_set_option) win over the environment;
+    // like it, they are process-wide.
+    static const char* lookup(const char* name) {
+        auto& overrides = overridden();
+        {
+            std::lock_guard<std::mutex> lock(overrides.mutex);
+            if (const auto it = overrides.values.find(name); it != overrides.values.end()) return it->second;
+        }
+        return std::getenv(name);
+    }
+    
+    static void setOverride(const std::string& name, const std::string& value) {
+        auto& overrides = overridden();
+        std::lock_guard<std::mutex> lock(overrides.mutex);
+        overrides.values[name] = overrides.storage.emplace_back(value).c_str();
+    }
+    
+    // Get configuration value with fallback to default
+    static std::string getInputFolder() {
+        const char* env = lookup("ZIPPER_INPUT_FOLDER");
+        return env ? std::string(env) : std::string(DEFAULT_INPUT_FOLDER);
+    }
+    
+    // Inputs named on the command line instead of the input folder: paths,
+    // and "@list" files with one path per line, or NUL-separated paths as
+    // `find -print0` writes them; "@-" reads a list from stdin. Nothing when
+    // no arguments were given.
+    static std::optional<std::vector<fs::path>> getInputFiles(int argc, char* argv[]) {
+        if (argc < 2) return std::nullopt;
+        
+        std::vector<fs::path> files;
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg(argv[i]);
+            if (arg.size() < 2 || arg.front() != '@') {
+                files.emplace_back(arg);
+                continue;
+            }
+            
+            std::string text;
+            if (arg == "@-") {
+                text.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+            } else {
+                std::ifstream in(std::string(arg.substr(1)), std::ios::binary);
+                if (!in.is_open()) throw std::runtime_error("Cannot read file list: " + std::string(arg.substr(1)));
+                text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            }
+            
+            const char separator = text.find('\0') != std::string::npos ? '\0' : '\n';
+            for (size_t start = 0; start < text.size();) {
+                const size_t end = std::min(text.find(separator, start), text.size());
+                std::string_view path(text.data() + start, end - start);
+                if (separator == '\n' && !path.empty() && path.back() == '\r') path.remove_suffix(1);
+                if (!path.empty()) files.emplace_back(path);
+                start = end + 1;
+            }
+        }
+        return files;
+    }
+    
+    static std::string getOutputFolder() {
+        const char* env = lookup("ZIPPER_OUTPUT_FOLDER");
+        return env ? std::string(env) : std::string(DEFAULT_OUTPUT_FOLDER);
+    }
+    
+    static std::string getPassword() {
+        const char* env = lookup("ZIPPER_PASSWORD");
+        if (!env || std::string(env).empty()) {
+            throw std::runtime_error("Password not provided! Please set ZIPPER_PASSWORD environment variable.");
+        }
+        return std::string(env);
+    }
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;  // 64KB buffer
+    static constexpr size_t MIN_BUFFER_SIZE = 4 * 1024;
+    static constexpr size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+    
+    static constexpr size_t PIPELINE_THRESHOLD = 16 * 1024 * 1024;  // 16MB
+    static constexpr size_t PARALLEL_DEFLATE_THRESHOLD = 64 * 1024 * 1024;  // 64MB
+    static constexpr size_t PARALLEL_DEFLATE_BLOCK_SIZE = 1024 * 1024;  // 1MB per deflate job
+    
+    // Read chunk size for streamed inputs, overridable via ZIPPER_BUFFER_SIZE
+    static size_t getBufferSize() {
+        const size_t size = getSizeFromEnv("ZIPPER_BUFFER_SIZE", BUFFER_SIZE);
+        return std::clamp(size, MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+    }
+    
+    static constexpr int DEFAULT_FAST_LEVEL = 1;
+    static constexpr int DEFAULT_MAX_LEVEL = 9;
+    static constexpr size_t ENTROPY_PROBE_SIZE = 8 * 1024;  // 8KB
+    
+    enum class CompressionMode { Adaptive, Max, Fast, Store };
+    
+    // ZIPPER_COMPRESSION: "adaptive" (default), "max", "fast" or "store"
+    static CompressionMode getCompressionMode() {
+        const char* env = lookup("ZIPPER_COMPRESSION");
+        if (!env) return CompressionMode::Adaptive;
+        const std::string_view mode(env);
+        if (mode == "max") return CompressionMode::Max;
+        if (mode == "fast") return CompressionMode::Fast;
+        if (mode == "store") return CompressionMode::Store;
+        return CompressionMode::Adaptive;
+    }
+    
+    static int getFastLevel() {
+        return std::clamp(getIntFromEnv("ZIPPER_FAST_LEVEL", DEFAULT_FAST_LEVEL), 1, 9);
+    }
+    
+    static int getMaxLevel() {
+        return std::clamp(getIntFromEnv("ZIPPER_MAX_LEVEL", DEFAULT_MAX_LEVEL), 1, 9);
+    }
+    
+    // Bytes sampled for the entropy probe (0 disables probing)
+    static size_t getEntropyProbeSize() {
+        return std::min(getSizeFromEnv("ZIPPER_ENTROPY_PROBE_SIZE", ENTROPY_PROBE_SIZE), MAX_BUFFER_SIZE);
+    }
+    
+    // Files whose extension has no MIME type are typed from their first
+    // bytes, for the listing and the compression policy (0 disables)
+    static bool getSniffTypes() {
+        return getIntFromEnv("ZIPPER_SNIFF_TYPES", 1) != 0;
+    }
+    
+    enum class WriterMode { Auto, Native, Libzip };
+    
+    // ZIPPER_WRITER: "auto" uses the native writer for files past the pipeline
+    // threshold, "native" for every file, "libzip" never
+    static WriterMode getWriterMode() {
+        const char* env = lookup("ZIPPER_WRITER");
+        if (!env) return WriterMode::Auto;
+        const std::string_view mode(env);
+        if (mode == "native") return WriterMode::Native;
+        if (mode == "libzip") return WriterMode::Libzip;
+        return WriterMode::Auto;
+    }
+    
+    // Files at or above this size use the pipelined AES writer (0 disables)
+    static size_t getPipelineThreshold() {
+        return getSizeFromEnv("ZIPPER_PIPELINE_THRESHOLD", PIPELINE_THRESHOLD);
+    }
+    
+    // Files at or above this size are deflated block-parallel (0 disables)
+    static size_t getParallelDeflateThreshold() {
+        return getSizeFromEnv("ZIPPER_PARALLEL_DEFLATE_THRESHOLD", PARALLEL_DEFLATE_THRESHOLD);
+    }
+    
+    static size_t getParallelDeflateBlockSize() {
+        const size_t size = getSizeFromEnv("ZIPPER_DEFLATE_BLOCK_SIZE", PARALLEL_DEFLATE_BLOCK_SIZE);
+        return std::clamp(size, BUFFER_SIZE, MAX_BUFFER_SIZE);
+    }
+    
+    static constexpr size_t CHUNKED_THRESHOLD = 64 * 1024 * 1024;  // 64MB
+    static constexpr size_t CHUNK_SIZE = 1024 * 1024;  // average content-defined chunk
+    
+    // ZIPPER_CHUNKED=1 zips large inputs in content-defined chunks and keeps
+    // a chunk map per archive in .zipper/chunks, so that rezipping an edited
+    // file only compresses the chunks that changed
+    static bool getChunked() {
+        return getIntFromEnv("ZIPPER_CHUNKED", 0) != 0;
+    }
+    
+    // Inputs at or above this size are chunked when chunking is on
+    static size_t getChunkedThreshold() {
+        return getSizeFromEnv("ZIPPER_CHUNKED_THRESHOLD", CHUNKED_THRESHOLD);
+    }
+    
+    // Average chunk size; chunks fall between a quarter and four times this
+    static size_t getChunkSize() {
+        return std::clamp(getSizeFromEnv("ZIPPER_CHUNK_SIZE", CHUNK_SIZE), BUFFER_SIZE, 16 * CHUNK_SIZE);
+    }
+    
+    static int getIntFromEnv(const char* name, int fallback) {
+        const char* env = lookup(name);
+        if (!env || *env == '\0') return fallback;
+        char* end = nullptr;
+        const long value = std::strtol(env, &end, 10);
+        return (end == env || *end != '\0') ? fallback : static_cast<int>(value);
+    }
+    
+    // Parse a byte count such as "65536", "256K", "4M" or "1G". Anything else,
+    // including "4MB" or a count that overflows, falls back to the default.
+    static size_t getSizeFromEnv(const char* name, size_t fallback) {
+        const char* env = lookup(name);
+        if (!env || !std::isdigit(static_cast<unsigned char>(*env))) return fallback;
+        
+        errno = 0;
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(env, &end, 10);
+        if (errno == ERANGE) return fallback;
+        
+        int shift = 0;
+        switch (std::toupper(static_cast<unsigned char>(*end))) {
+            case '\0': break;
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            default: return fallback;
+        }
+        if (shift > 0 && *++end != '\0') return fallback;
+        if (value > (std::numeric_limits<size_t>::max() >> shift)) return fallback;
+        return static_cast<size_t>(value) << shift;
+    }
+    
+    static void displayHeader() {
+        console() << "=== High-Performance File Zipper with Password Protection ===\n";
+        console() << "Source folder: " << getInputFolder() << '\n';
+        console() << "Output folder: " << getOutputFolder() << '\n';
+        if (const auto url = getOutputUrl(); !url.empty()) {
+            console() << "Archives: streamed to " << url << " (" << getS3PartSize() / (1024 * 1024) << " MB parts, "
+                      << getS3Uploads() << " uploads in flight)\n";
+        }
+        console() << "Encryption: AES-256" << (hasHardwareAes() ? " (AES-NI)" : "") << '\n';
+        const auto& topology = CpuTopology::get();
+        console() << "Max threads: " << getOptimalThreadCount() << " (" << topology.cpuCount() << " CPUs";
+        if (topology.cgroupQuota() > 0) console() << ", cgroup quota " << topology.cgroupQuota();
+        if (topology.nodeCount() > 1) console() << ", " << topology.nodeCount() << " NUMA nodes";
+        console() << ")\n";
+        console() << "Read buffer: " << getBufferSize() / 1024 << " KB\n";
+        console() << "I/O: " << (getIoBackend() == IoBackend::Uring ? "io_uring (depth " + std::to_string(getIoDepth()) + ")" : "synchronous")
+                  << (getDirectIo() ? ", O_DIRECT output" : "") << '\n';
+        console() << "Codec: " << (lookup("ZIPPER_CODEC") ? lookup("ZIPPER_CODEC") : "zlib") << '\n';
+        if (getMaxMemory() > 0) console() << "Memory budget: " << getMaxMemory() / (1024 * 1024) << " MB in flight\n";
+        console() << "Password: [USER PROVIDED]\n\n";
+    }
+    
+    // OpenSSL picks AES-NI/VAES code paths on its own; this is for reporting
+    static bool hasHardwareAes() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_cpu_supports("aes");
+#else
+        return false;
+#endif
+    }
+    
+    // ZIPPER_RECURSIVE=1 also zips files in subfolders, mirroring the layout
+    static bool getRecursive() {
+        return getIntFromEnv("ZIPPER_RECURSIVE", 0) != 0;
+    }
+    
+    // Metadata lookups in flight during the scan; raise it on high-latency mounts
+    static size_t getScanThreads() {
+        const int threads = getIntFromEnv("ZIPPER_SCAN_THREADS", static_cast<int>(getOptimalThreadCount()));
+        return static_cast<size_t>(std::clamp(threads, 1, 256));
+    }
+    
+    enum class DedupMode { Copy, Link, Off };
+    
+    // ZIPPER_DEDUP: "copy" (default) clones the first zip of identical content
+    // and renames its entry, "link" hard-links it unchanged, "off" disables
+    static DedupMode getDedupMode() {
+        const char* env = lookup("ZIPPER_DEDUP");
+        if (!env) return DedupMode::Copy;
+        const std::string_view mode(env);
+        if (mode == "link") return DedupMode::Link;
+        if (mode == "off") return DedupMode::Off;
+        return DedupMode::Copy;
+    }
+    
+    // ZIPPER_BUNDLE_SIZE packs small inputs into shared archives holding about
+    // this many input bytes each (0, the default, gives every input its own zip)
+    static size_t getBundleSize() {
+        return getSizeFromEnv("ZIPPER_BUNDLE_SIZE", 0);
+    }
+    
+    // Inputs at or below this size are bundled when bundling is on
+    static size_t getBundleMaxFile() {
+        return getSizeFromEnv("ZIPPER_BUNDLE_MAX_FILE", BUNDLE_MAX_FILE);
+    }
+    
+    // ZIPPER_REBUILD=1 ignores the incremental manifest and rezips every input
+    static bool getForceRebuild() {
+        return getIntFromEnv("ZIPPER_REBUILD", 0) != 0;
+    }
+    
+    // ZIPPER_THREADS, or every CPU in our affinity mask within the cgroup quota
+    static size_t getOptimalThreadCount() {
+        static const size_t threads = []() {
+            const int requested = getIntFromEnv("ZIPPER_THREADS", 0);
+            if (requested > 0) return std::min(static_cast<size_t>(requested), MAX_THREADS);
+            
+            const auto& topology = CpuTopology::get();
+            size_t cpus = topology.cpuCount();
+            if (topology.cgroupQuota() > 0) cpus = std::min(cpus, topology.cgroupQuota());
+            return std::clamp<size_t>(cpus, 1, MAX_THREADS);
+        }();
+        return threads;
+    }
+    
+    // ZIPPER_NUMA=off leaves worker placement to the kernel
+    static bool getNumaPinning() {
+        const char* env = lookup("ZIPPER_NUMA");
+        return !env || std::string_view(env) != "off";
+    }
+    
+    enum class IoBackend { Sync, Uring };
+    
+    // ZIPPER_IO: "auto" (default) and "uring" use io_uring when the kernel
+    // allows it. "sync" keeps plain read/write.
+    static IoBackend getIoBackend() {
+        static const IoBackend backend = []() {
+            const char* env = lookup("ZIPPER_IO");
+            const std::string_view mode = env ? env : "auto";
+            if (mode == "sync") return IoBackend::Sync;
+            if (IoUring::available()) return IoBackend::Uring;
+            if (mode == "uring") std::cerr << "Warning: io_uring unavailable, using synchronous I/O\n";
+            return IoBackend::Sync;
+        }();
+        return backend;
+    }
+    
+    // 1MB reads or writes each stream keeps in flight
+    static size_t getIoDepth() {
+        return static_cast<size_t>(std::clamp(getIntFromEnv("ZIPPER_IO_DEPTH", 4), 1, 64));
+    }
+    
+    // ZIPPER_MAX_MEMORY caps the buffer bytes in flight across all workers
+    // (K/M/G suffixes); 0, the default, leaves them unbounded
+    static size_t getMaxMemory() {
+        return getSizeFromEnv("ZIPPER_MAX_MEMORY", 0);
+    }
+    
+    // ZIPPER_DIRECT_IO=1 writes archives with O_DIRECT, bypassing the page cache
+    static bool getDirectIo() {
+        return getIntFromEnv("ZIPPER_DIRECT_IO", 0) != 0;
+    }
+    
+    // ZIPPER_FSYNC=1 syncs each output and its folder around the rename, so a
+    // power loss never leaves an empty archive that the journal counts as done.
+    // Off by default: that is two fsyncs per file, which dominates small ones.
+    static bool getFsync() {
+        return getIntFromEnv("ZIPPER_FSYNC", 0) != 0;
+    }
+    
+    // ZIPPER_MMAP=1 compresses large inputs straight from a read-only mapping.
+    // Inputs must not be truncated while they are zipped (that raises SIGBUS).
+    static bool getMmapInput() {
+        return getIntFromEnv("ZIPPER_MMAP", 0) != 0;
+    }
+    
+    // ZIPPER_EVENTS streams NDJSON progress to "fd:N", "unix:/path/to/socket"
+    // or a file path. Unset keeps the human-readable output only.
+    static std::string getEventsTarget() {
+        const char* env = lookup("ZIPPER_EVENTS");
+        return env ? std::string(env) : std::string();
+    }
+    
+    // Milliseconds between progress samples on the event stream
+    static int getEventsInterval() {
+        return std::clamp(getIntFromEnv("ZIPPER_EVENTS_INTERVAL_MS", 500), 50, 60000);
+    }
+    
+    // ZIPPER_METRICS_PORT serves Prometheus text metrics on 127.0.0.1; 0 is off
+    static int getMetricsPort() {
+        return std::clamp(getIntFromEnv("ZIPPER_METRICS_PORT", 0), 0, 65535);
+    }
+    
+    // ZIPPER_VERIFY=1 checks the archives in the output folder instead of
+    // zipping: every entry is decrypted and decompressed in memory and checked
+    // against its authentication code, CRC and the manifest
+    static bool getVerify() {
+        return getIntFromEnv("ZIPPER_VERIFY", 0) != 0;
+    }
+    
+    // Nothing on stdout; a library caller follows the job's progress callback
+    static bool getQuiet() {
+        return getIntFromEnv("ZIPPER_QUIET", 0) != 0;
+    }
+    
+    enum class Schedule { Throughput, Latency };
+    
+    // ZIPPER_SCHEDULE: "throughput" (default) starts the largest files first
+    // for the shortest run. "latency" starts the smallest first, holds back
+    // files big enough to be split into block jobs until the rest are done,
+    // and publishes the listing as files finish.
+    static Schedule getSchedule() {
+        const char* env = lookup("ZIPPER_SCHEDULE");
+        return env && std::string_view(env) == "latency" ? Schedule::Latency : Schedule::Throughput;
+    }
+    
+    // Most milliseconds between a file finishing and a listing that shows it,
+    // in latency mode; files finishing within it share one write
+    static int getPublishDelay() {
+        return std::clamp(getIntFromEnv("ZIPPER_PUBLISH_DELAY_MS", 200), 0, 10000);
+    }
+    
+    // ZIPPER_WATCH=1 keeps running after the first pass and zips inputs as
+    // they are written or moved into the input folder (Linux only)
+    static bool getWatch() {
+        return getIntFromEnv("ZIPPER_WATCH", 0) != 0;
+    }
+    
+    // Quiet period before a batch of watched changes is zipped, so a file
+    // written in several goes or a burst of uploads goes out as one batch
+    static int getWatchSettle() {
+        return std::clamp(getIntFromEnv("ZIPPER_WATCH_SETTLE_MS", 500), 10, 60000);
+    }
+    
+    // ZIPPER_INDEX_PAGE_SIZE: entries per page of the paged listing in
+    // files-index/ next to files-list.json; 0 writes only files-list.json
+    static size_t getIndexPageSize() {
+        return static_cast<size_t>(std::clamp(getIntFromEnv("ZIPPER_INDEX_PAGE_SIZE", 500), 0, 100000));
+    }
+    
+    // ZIPPER_OUTPUT_URL=s3://bucket/prefix streams archives to an S3-compatible
+    // object store instead of the output folder, which then only keeps the
+    // manifest and files-list.json
+    static std::string getOutputUrl() {
+        const char* env = lookup("ZIPPER_OUTPUT_URL");
+        return env ? std::string(env) : std::string();
+    }
+    
+    // ZIPPER_S3_ENDPOINT, e.g. "http://127.0.0.1:9000" for MinIO; unset uses
+    // AWS for the region, addressing the bucket by host name
+    static std::string getS3Endpoint() {
+        const char* env = lookup("ZIPPER_S3_ENDPOINT");
+        return env ? std::string(env) : std::string();
+    }
+    
+    static std::string getS3Region() {
+        const char* env = lookup("ZIPPER_S3_REGION");
+        if (!env || *env == '\0') env = lookup("AWS_REGION");
+        return env && *env != '\0' ? std::string(env) : std::string("us-east-1");
+    }
+    
+    // Multipart part size; S3 wants at least 5MB for every part but the last
+    static size_t getS3PartSize() {
+        return std::clamp(getSizeFromEnv("ZIPPER_S3_PART_SIZE", S3_PART_SIZE), S3_MIN_PART_SIZE, S3_MAX_PART_SIZE);
+    }
+    
+    // Requests on the wire at once across all uploads, which is also the most
+    // parts one archive keeps in flight
+    static size_t getS3Uploads() {
+        return static_cast<size_t>(std::clamp(getIntFromEnv("ZIPPER_S3_UPLOADS", 8), 1, 64));
+    }
+    
+private:
+    static constexpr size_t S3_PART_SIZE = 8 * 1024 * 1024;          // 8MB
+    static constexpr size_t S3_MIN_PART_SIZE = 5 * 1024 * 1024;      // 5MB
+    static constexpr size_t S3_MAX_PART_SIZE = 5ull * 1024 * 1024 * 1024;  // 5GB
+    
+    struct Overrides {
+        std::mutex mutex;
+        std::unordered_map<std::string, const char*> values;
+        std::deque<std::string> storage;  // never shrinks, so values handed out stay valid
+    };
+    
+    static Overrides& overridden() {
+        static Overrides overrides;
+        return overrides;
+    }
+};
+
+// Accepts and drops everything. It has no put area and no state, so one
+// buffer serves every thread.
+class DiscardBuffer final : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+std::ostream& console() {
+    static const bool quiet = Config::getQuiet();
+    if (!quiet) return std::cout;
+    // Per thread, since manipulators still set the stream's format flags
+    static DiscardBuffer buffer;
+    thread_local std::ostream discard(&buffer);
+    return discard;
+}
+
+MemoryBudget& MemoryBudget::global() {
+    static MemoryBudget budget = []() {
+        const size_t limit = Config::getMaxMemory();
+#ifdef __GLIBC__
+        // Blocks given back under the budget should leave the process: with a
+        // fixed threshold they are mmapped and unmapped on free, rather than
+        // kept in whichever thread's malloc arena last used them
+        if (limit > 0) mallopt(M_MMAP_THRESHOLD, static_cast<int>(MMAP_THRESHOLD));
+#endif
+        return MemoryBudget(limit);
+    }();
+    return budget;
+}
+
+// Chooses STORE, fast deflate or maximum deflate per file from its MIME type
+// and a Shannon-entropy probe of the first few KB, so already-compressed
+// media doesn't burn level-9 CPU for a fraction of a percent of savings.
+// The same read sniffs the type of files without a known extension.
+class CompressionPolicy {
+public:
+    enum class Tier { Store, Fast, Max };
+    
+    struct Decision {
+        Tier tier;
+        int level;  // 0 means STORE
+        std::string_view type = MimeTypeMapper::DEFAULT_TYPE;  // MIME type for the listing
+    };
+    
+private:
+    static constexpr double STORE_ENTROPY = 7.5;   // bits per byte
+    static constexpr double FAST_ENTROPY = 6.0;
+    static constexpr size_t MIN_PROBE_BYTES = 512; // too little data to judge below this
+    
+    enum class Kind { Compressed, Mixed, Text, Unknown };
+    
+public:
+    // `name` is the entry's name; its extension gives the MIME type
+    static Decision choose(const fs::path& file, const std::string& name) {
+        const auto mode = Config::getCompressionMode();
+        const bool adaptive = mode == Config::CompressionMode::Adaptive;
+        auto mime = MimeTypeMapper::getMimeType(MimeTypeMapper::getFileExtension(name));
+        const bool sniffing = mime == MimeTypeMapper::DEFAULT_TYPE && Config::getSniffTypes();
+        
+        // One read of the head serves the sniffer and the entropy probe
+        size_t headBytes = adaptive && classify(mime) != Kind::Text ? Config::getEntropyProbeSize() : 0;
+        if (sniffing) headBytes = std::max(headBytes, MimeTypeMapper::SNIFF_BYTES);
+        return choose(readHead(file, headBytes), name);
+    }
+    
+    // For an input whose leading bytes, or all of it, are already in memory
+    static Decision choose(std::span<const unsigned char> head, const std::string& name) {
+        const auto mode = Config::getCompressionMode();
+        auto mime = MimeTypeMapper::getMimeType(MimeTypeMapper::getFileExtension(name));
+        if (mime == MimeTypeMapper::DEFAULT_TYPE && Config::getSniffTypes()) {
+            const auto sniffed = MimeTypeMapper::sniff(head);
+            if (!sniffed.empty()) mime = sniffed;
+        }
+        
+        switch (mode) {
+            case Config::CompressionMode::Store: return store(mime);
+            case Config::CompressionMode::Fast: return fast(mime);
+            case Config::CompressionMode::Max: return max(mime);
+            case Config::CompressionMode::Adaptive: break;
+        }
+        
+        const Kind kind = classify(mime);
+        if (kind == Kind::Text) return max(mime);
+        
+        const double entropy = entropyOf(head.first(std::min(head.size(), Config::getEntropyProbeSize())));
+        const bool probed = entropy >= 0.0;
+        
+        if (kind == Kind::Compressed) {
+            // Trust the container unless the sample is clearly redundant
+            return (probed && entropy < FAST_ENTROPY) ? fast(mime) : store(mime);
+        }
+        if (probed && entropy >= STORE_ENTROPY) return store(mime);
+        if (kind == Kind::Mixed || (probed && entropy >= FAST_ENTROPY)) return fast(mime);
+        return max(mime);
+    }
+    
+    // The listing type of a file that is not compressed afresh
+    static std::string_view typeOf(const fs::path& file, const std::string& name) {
+        const auto mime = MimeTypeMapper::getMimeType(MimeTypeMapper::getFileExtension(name));
+        if (mime != MimeTypeMapper::DEFAULT_TYPE || !Config::getSniffTypes()) return mime;
+        const auto sniffed = MimeTypeMapper::sniff(readHead(file, MimeTypeMapper::SNIFF_BYTES));
+        return sniffed.empty() ? mime : sniffed;
+    }
+    
+    // choose() without the entropy probe, for planning before any file is read
+    static Decision expected(const std::string& name) {
+        const auto mime = MimeTypeMapper::getMimeType(MimeTypeMapper::getFileExtension(name));
+        switch (Config::getCompressionMode()) {
+            case Config::CompressionMode::Store: return store(mime);
+            case Config::CompressionMode::Fast: return fast(mime);
+            case Config::CompressionMode::Max: return max(mime);
+            case Config::CompressionMode::Adaptive: break;
+        }
+        
+        switch (classify(mime)) {
+            case Kind::Compressed: return store(mime);
+            case Kind::Mixed: return fast(mime);
+            case Kind::Text:
+            case Kind::Unknown: break;
+        }
+        return max(mime);
+    }
+    
+private:
+    static Decision store(std::string_view type) { return {Tier::Store, 0, type}; }
+    static Decision fast(std::string_view type) { return {Tier::Fast, Config::getFastLevel(), type}; }
+    static Decision max(std::string_view type) { return {Tier::Max, Config::getMaxLevel(), type}; }
+    
+    // Up to `bytes` from the start of the file, in this thread's read buffer;
+    // empty when it can't be read. Plain pread: the pages stay cached for
+    // the compressor that follows.
+    static std::span<const unsigned char> readHead(const fs::path& file, size_t bytes) {
+        if (bytes == 0) return {};
+        const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return {};
+        
+        const auto sample = WorkerArena::buffer(WorkerArena::Buffer::Read, bytes);
+        ssize_t n;
+        do {
+            n = ::pread(fd, sample.data(), sample.size(), 0);
+        } while (n < 0 && errno == EINTR);
+        ::close(fd);
+        return sample.first(n > 0 ? static_cast<size_t>(n) : 0);
+    }
+    
+    // Shannon entropy of the sample in bits per byte, -1 if not measurable
+    static double entropyOf(std::span<const unsigned char> sample) {
+        if (sample.size() < MIN_PROBE_BYTES) return -1.0;
+        
+        std::array<size_t, 256> histogram{};
+        for (const unsigned char byte : sample) {
+            ++histogram[byte];
+        }
+        
+        double entropy = 0.0;
+        for (const size_t count : histogram) {
+            if (count == 0) continue;
+            const double p = static_cast<double>(count) / static_cast<double>(sample.size());
+            entropy -= p * std::log2(p);
+        }
+        return entropy;
+    }
+    
+    static Kind classify(std::string_view mime) {
+        if (mime == "image/jpeg" || mime == "image/png" || mime == "image/gif" || mime == "application/zip" ||
+            mime == "application/gzip" || mime == "application/zstd" || mime == "application/x-7z-compressed" ||
+            mime.substr(0, 31) == "application/vnd.openxmlformats-") {
+            return Kind::Compressed;
+        }
+        if (mime == "application/pdf") return Kind::Mixed;
+        if (mime.substr(0, 5) == "text/" || mime == "image/svg+xml") return Kind::Text;
+        return Kind::Unknown;
+    }
+};
+
+// RAII wrapper for zip archives with better error handling
+class ZipArchive {
+private:
+    zip_t* archive = nullptr;
+    fs::path filePath;
+    std::vector<std::shared_ptr<const void>> retained;  // memory sources read during zip_close
+    
+public:
+    explicit ZipArchive(const fs::path& path) : filePath(path) {
+        int error = 0;
+        archive = zip_open(path.c_str(), ZIP_CREATE | ZIP_TRUNCATE, &error);
+        if (!archive) {
+            std::string errorMsg = "Failed to create zip archive: " + path.string();
+            if (error != 0) {
+                zip_error_t zipError;
+                zip_error_init_with_code(&zipError, error);
+                errorMsg += " (Error: " + std::string(zip_error_strerror(&zipError)) + ")";
+                zip_error_fini(&zipError);
+            }
+            throw std::runtime_error(errorMsg);
+        }
+    }
+    
+    ~ZipArchive() { close(); }
+    
+    zip_t* get() const { return archive; }
+    
+    // Write the archive out. False if libzip could not, in which case the
+    // archive is discarded. libzip reads, compresses and encrypts inside
+    // zip_close, so for these archives the close stage spans all of that.
+    bool close() {
+        if (!archive) return true;
+        const StageTimers::Scope timer(StageTimers::Stage::Close);
+        const bool written = zip_close(archive) == 0;
+        if (!written) {
+            std::cerr << "Warning: Failed to properly close zip archive: " << filePath << " (" << zip_strerror(archive) << ")\n";
+            zip_discard(archive);
+        }
+        archive = nullptr;
+        retained.clear();
+        return written;
+    }
+    
+    // Keep a buffer source's backing memory alive until the archive is written
+    void retain(std::shared_ptr<const void> owner) { retained.push_back(std::move(owner)); }
+    
+    // Non-copyable, moveable
+    ZipArchive(const ZipArchive&) = delete;
+    ZipArchive& operator=(const ZipArchive&) = delete;
+    ZipArchive(ZipArchive&& other) noexcept
+        : archive(other.archive), filePath(std::move(other.filePath)), retained(std::move(other.retained)) {
+        other.archive = nullptr;
+    }
+    ZipArchive& operator=(ZipArchive&& other) noexcept {
+        if (this != &other) {
+            close();
+            archive = other.archive;
+            filePath = std::move(other.filePath);
+            retained = std::move(other.retained);
+            other.archive = nullptr;
+        }
+        return *this;
+    }
+};
+
+// Streaming XXH64: a fast non-cryptographic content hash for change detection
+class ContentHasher {
+private:
+    static constexpr uint64_t PRIME1 = 11400714785074694791ULL;
+    static constexpr uint64_t PRIME2 = 14029467366897019727ULL;
+    static constexpr uint64_t PRIME3 = 1609587929392839161ULL;
+    static constexpr uint64_t PRIME4 = 9650029242287828579ULL;
+    static constexpr uint64_t PRIME5 = 2870177450012600261ULL;
+    static constexpr size_t STRIPE = 32;
+    
+    std::array<uint64_t, 4> acc;
+    std::array<unsigned char, STRIPE> pending{};
+    size_t pendingLen = 0;
+    uint64_t totalLen = 0;
+    const uint64_t seed;
+    
+public:
+    explicit ContentHasher(uint64_t seedValue = 0) : seed(seedValue) { reset(); }
+    
+    // Start over, for a reader that rewinds to the beginning
+    void reset() {
+        acc = {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1};
+        pendingLen = 0;
+        totalLen = 0;
+    }
+    
+    void update(const void* data, size_t len) {
+        const auto* p = static_cast<const unsigned char*>(data);
+        totalLen += len;
+        
+        if (pendingLen + len < STRIPE) {
+            std::memcpy(pending.data() + pendingLen, p, len);
+            pendingLen += len;
+            return;
+        }
+        if (pendingLen > 0) {
+            const size_t fill = STRIPE - pendingLen;
+            std::memcpy(pending.data() + pendingLen, p, fill);
+            consumeStripe(pending.data());
+            p += fill;
+            len -= fill;
+            pendingLen = 0;
+        }
+        for (; len >= STRIPE; p += STRIPE, len -= STRIPE) {
+            consumeStripe(p);
+        }
+        std::memcpy(pending.data(), p, len);
+        pendingLen = len;
+    }
+    
+    uint64_t digest() const {
+        uint64_t h;
+        if (totalLen >= STRIPE) {
+            h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            for (const auto v : acc) {
+                h = (h ^ round(0, v)) * PRIME1 + PRIME4;
+            }
+        } else {
+            h = seed + PRIME5;
+        }
+        h += totalLen;
+        
+        const unsigned char* p = pending.data();
+        size_t len = pendingLen;
+        for (; len >= 8; p += 8, len -= 8) {
+            h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+        }
+        if (len >= 4) {
+            h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+            len -= 4;
+        }
+        for (; len > 0; ++p, --len) {
+            h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+        }
+        
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+    
+    // Hash a whole file; throws fs::filesystem_error if it cannot be read
+    static uint64_t ofFile(const fs::path& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw fs::filesystem_error("Cannot hash input", path, std::error_code(errno, std::generic_category()));
+        }
+        
+        ContentHasher hasher;
+        const auto buffer = WorkerArena::buffer(WorkerArena::Buffer::Read, Config::getBufferSize());
+        while (true) {
+            const ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                const std::error_code ec(errno, std::generic_category());
+                ::close(fd);
+                throw fs::filesystem_error("Cannot hash input", path, ec);
+            }
+            if (n == 0) break;
+            hasher.update(buffer.data(), static_cast<size_t>(n));
+        }
+        ::close(fd);
+        return hasher.digest();
+    }
+    
+private:
+    void consumeStripe(const unsigned char* p) {
+        for (size_t lane = 0; lane < acc.size(); ++lane) {
+            acc[lane] = round(acc[lane], read64(p + lane * 8));
+        }
+    }
+    
+    static uint64_t round(uint64_t accumulator, uint64_t input) {
+        return rotl(accumulator + input * PRIME2, 31) * PRIME1;
+    }
+    
+    static uint64_t rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+    
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    
+    static uint64_t read32(const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+// Sequential POSIX reader that releases already-consumed pages from the page
+// cache as it goes, so streaming a multi-GB input doesn't evict everything
+// else. With io_uring it keeps a few 1MB reads in flight ahead of the caller,
+// into registered buffers, so the next chunk is already loading while the
+// current one is compressed.
+class SequentialFileReader {
+private:
+    static constexpr off_t DROP_BEHIND_BYTES = 8 * 1024 * 1024;  // 8MB
+    static constexpr size_t READ_AHEAD_BYTES = 1024 * 1024;      // per in-flight read
+    
+    struct Block {
+        std::unique_ptr<char[]> data;
+        off_t offset = 0;
+        size_t requested = 0;
+        size_t length = 0;
+        size_t consumed = 0;
+        bool pending = false;
+        int error = 0;
+    };
+    
+    int fd = -1;
+    off_t readOffset = 0;
+    off_t droppedOffset = 0;
+    off_t fileSize = 0;
+    off_t nextReadAhead = 0;
+    std::vector<Block> blocks;
+    size_t current = 0;
+    std::unique_ptr<IoUring> ring;  // destroyed before the buffers it has pinned
+    MemoryBudget::Lease readAheadLease;
+    ContentHasher* hasher = nullptr;
+    
+public:
+    SequentialFileReader() = default;
+    ~SequentialFileReader() { close(); }
+    
+    SequentialFileReader(const SequentialFileReader&) = delete;
+    SequentialFileReader& operator=(const SequentialFileReader&) = delete;
+    
+    // Returns false and leaves errno set on failure
+    bool open(const fs::path& path) {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        readOffset = droppedOffset = 0;
+        
+        struct stat st{};
+        if (Config::getIoBackend() == Config::IoBackend::Uring && ::fstat(fd, &st) == 0 &&
+            st.st_size > static_cast<off_t>(READ_AHEAD_BYTES)) {
+            fileSize = st.st_size;
+            startReadAhead();
+        }
+        return true;
+    }
+    
+    void close() {
+        if (fd >= 0) {
+            stopReadAhead();
+            dropConsumedPages(true);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    
+    bool isOpen() const { return fd >= 0; }
+    
+    // Every byte read from here on is also fed to `contentHasher` (null
+    // stops), so a writer hashes its input without reading it twice
+    void hashInto(ContentHasher* contentHasher) { hasher = contentHasher; }
+    
+    // Fill up to len bytes, short only at EOF. Returns -1 (errno set) on error.
+    ssize_t read(void* out, size_t len) {
+        const StageTimers::Scope timer(StageTimers::Stage::Read);
+        auto* dest = static_cast<char*>(out);
+        size_t total = 0;
+        
+        while (ring && total < len) {
+            const ssize_t n = takeReadAhead(dest + total, len - total);
+            if (n < 0) return -1;
+            // Read-ahead covers the size seen at open; anything appended since is read below
+            if (n == 0) stopReadAhead();
+            total += static_cast<size_t>(n);
+        }
+        
+        while (total < len) {
+            const ssize_t n = ::pread(fd, dest + total, len - total, readOffset + static_cast<off_t>(total));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (n == 0) break;
+            total += static_cast<size_t>(n);
+        }
+        
+        readOffset += static_cast<off_t>(total);
+        dropConsumedPages(false);
+        StageTimers::global().addBytes(StageTimers::Stage::Read, total);
+        if (hasher) hasher->update(out, total);
+        return static_cast<ssize_t>(total);
+    }
+    
+    // The rest of the file into `out`; `sizeHint` is its expected length.
+    // Returns false (errno set) on error.
+    bool readAll(std::vector<unsigned char>& out, size_t sizeHint) {
+        // Reads are short only at the end, so one spare byte shows it was reached
+        out.resize(sizeHint + 1);
+        size_t filled = 0;
+        while (true) {
+            const ssize_t n = read(out.data() + filled, out.size() - filled);
+            if (n < 0) return false;
+            filled += static_cast<size_t>(n);
+            if (filled < out.size()) break;
+            out.resize(out.size() * 2);  // it grew since the size was taken
+        }
+        out.resize(filled);
+        return true;
+    }
+    
+private:
+    void startReadAhead() {
+        const auto depth = Config::getIoDepth();
+        // Read-ahead is an extra: over budget, plain preads do
+        auto lease = MemoryBudget::global().tryPin(depth * READ_AHEAD_BYTES);
+        if (!lease) return;
+        readAheadLease = std::move(*lease);
+        ring = std::make_unique<IoUring>(static_cast<unsigned>(depth));
+        if (!ring->valid()) {
+            ring.reset();
+            readAheadLease.reset();
+            return;
+        }
+        
+        blocks.resize(depth);
+        std::vector<iovec> buffers;
+        for (auto& block : blocks) {
+            block.data.reset(new char[READ_AHEAD_BYTES]);
+            buffers.push_back({block.data.get(), READ_AHEAD_BYTES});
+        }
+        ring->registerBuffers(buffers);
+        
+        current = 0;
+        nextReadAhead = 0;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            queueBlock(i);
+        }
+        ring->submit();
+    }
+    
+    void stopReadAhead() {
+        if (!ring) return;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (blocks[i].pending && !awaitBlock(i)) {
+                // The kernel may still write into these, so they must never be reused
+                for (auto& block : blocks) {
+                    if (block.pending) (void)block.data.release();
+                }
+                break;
+            }
+        }
+        ring.reset();
+        blocks.clear();
+        readAheadLease.reset();
+    }
+    
+    void queueBlock(size_t index) {
+        auto& block = blocks[index];
+        block.offset = nextReadAhead;
+        block.requested = nextReadAhead < fileSize
+            ? std::min(READ_AHEAD_BYTES, static_cast<size_t>(fileSize - nextReadAhead)) : 0;
+        block.length = block.consumed = 0;
+        block.error = 0;
+        block.pending = false;
+        if (block.requested == 0) return;
+        
+        nextReadAhead += static_cast<off_t>(block.requested);
+        block.pending = ring->queueRead(fd, block.data.get(), static_cast<unsigned>(block.requested),
+                                        static_cast<uint64_t>(block.offset), index,
+                                        ring->hasRegisteredBuffers() ? static_cast<int>(index) : -1);
+        if (!block.pending) completeBlock(block, 0);
+    }
+    
+    bool awaitBlock(size_t index) {
+        while (blocks[index].pending) {
+            IoUring::Completion completion;
+            if (!ring->wait(completion)) return false;
+            completeBlock(blocks[completion.tag], completion.result);
+        }
+        return true;
+    }
+    
+    // Short or failed ring reads (old kernels lack some opcodes) finish with pread
+    void completeBlock(Block& block, int result) {
+        block.pending = false;
+        size_t got = result > 0 ? static_cast<size_t>(result) : 0;
+        while (got < block.requested) {
+            const ssize_t n = ::pread(fd, block.data.get() + got, block.requested - got, block.offset + static_cast<off_t>(got));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                block.error = errno;
+                break;
+            }
+            if (n == 0) break;
+            got += static_cast<size_t>(n);
+        }
+        block.length = got;
+    }
+    
+    ssize_t takeReadAhead(char* dest, size_t len) {
+        auto& block = blocks[current];
+        if (block.pending && !awaitBlock(current)) return -1;
+        if (block.error != 0) {
+            errno = block.error;
+            return -1;
+        }
+        if (block.consumed == block.length) return 0;
+        
+        const size_t n = std::min(len, block.length - block.consumed);
+        std::memcpy(dest, block.data.get() + block.consumed, n);
+        block.consumed += n;
+        
+        // A short block means the file shrank; leave it drained so the next call stops
+        if (block.consumed == block.length && block.length == block.requested) {
+            queueBlock(current);
+            if (block.pending) ring->submit();
+            current = (current + 1) % blocks.size();
+        }
+        return static_cast<ssize_t>(n);
+    }
+    
+    void dropConsumedPages(bool force) {
+#ifdef POSIX_FADV_DONTNEED
+        if (force || readOffset - droppedOffset >= DROP_BEHIND_BYTES) {
+            ::posix_fadvise(fd, droppedOffset, readOffset - droppedOffset, POSIX_FADV_DONTNEED);
+            droppedOffset = readOffset;
+        }
+#else
+        (void)force;
+#endif
+    }
+};
+
+// Read-only mapping of an input that libzip compresses straight from the
+// mapped pages through zip_source_buffer, so there is no read() into a private
+// buffer first. The mapping is read sequentially, and on release the input's
+// pages are dropped from the page cache: a batch of read-once inputs then does
+// not evict everything else.
+class MappedInputFile {
+private:
+    int fd = -1;
+    void* data = nullptr;
+    size_t length = 0;
+    time_t mtime = 0;
+    
+    MappedInputFile() = default;
+    
+public:
+    // nullptr (errno set) if the file can't be opened or mapped
+    static std::shared_ptr<MappedInputFile> open(const fs::path& path) {
+        std::shared_ptr<MappedInputFile> file(new MappedInputFile());
+        file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file->fd < 0) return nullptr;
+        
+        struct stat st{};
+        if (::fstat(file->fd, &st) != 0 || st.st_size <= 0) return nullptr;
+        file->length = static_cast<size_t>(st.st_size);
+        file->mtime = st.st_mtime;
+        
+        void* mapping = ::mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (mapping == MAP_FAILED) return nullptr;
+        file->data = mapping;
+#ifdef MADV_SEQUENTIAL
+        ::madvise(mapping, file->length, MADV_SEQUENTIAL);
+#endif
+        return file;
+    }
+    
+    ~MappedInputFile() {
+        if (data) ::munmap(data, length);
+        if (fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            ::close(fd);
+        }
+    }
+    
+    MappedInputFile(const MappedInputFile&) = delete;
+    MappedInputFile& operator=(const MappedInputFile&) = delete;
+    
+    const void* bytes() const { return data; }
+    size_t size() const { return length; }
+    time_t modified() const { return mtime; }
+};
+
+// An in-memory input made readable by path, so the readers, the hasher and
+// the entropy probe treat it like any file. Linux keeps the bytes in a memfd
+// reached through /proc/self/fd; elsewhere they go to a temp file.
+class StagedBuffer {
+private:
+    int fd = -1;
+    fs::path location;
+    bool temporary = false;
+    
+public:
+    StagedBuffer(const void* data, size_t size) {
+#ifdef __linux__
+        fd = ::memfd_create("zipper-input", MFD_CLOEXEC);
+        if (fd >= 0) location = "/proc/self/fd/" + std::to_string(fd);
+#endif
+        if (fd < 0) {
+            std::string name = (fs::temp_directory_path() / "zipper-input-XXXXXX").string();
+            fd = ::mkstemp(name.data());
+            if (fd < 0) throw fs::filesystem_error("Cannot stage input", name, std::error_code(errno, std::generic_category()));
+            location = name;
+            temporary = true;
+        }
+        
+        const auto* bytes = static_cast<const char*>(data);
+        for (size_t done = 0; done < size;) {
+            const ssize_t n = ::write(fd, bytes + done, size - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                const std::error_code error(errno, std::generic_category());
+                release();
+                throw fs::filesystem_error("Cannot stage input", location, error);
+            }
+            done += static_cast<size_t>(n);
+        }
+    }
+    
+    ~StagedBuffer() { release(); }
+    
+    StagedBuffer(const StagedBuffer&) = delete;
+    StagedBuffer& operator=(const StagedBuffer&) = delete;
+    
+    const fs::path& path() const { return location; }
+    
+private:
+    void release() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        if (temporary) ::unlink(location.c_str());
+        temporary = false;
+    }
+};
+
+// Streaming zip source for large files. libzip pulls data through this
+// callback during zip_close, so only one chunk of the input is resident at a
+// time and already-consumed pages are released from the page cache.
+class StreamingFileSource {
+private:
+    const fs::path filePath;
+    std::vector<char> buffer;
+    size_t bufferPos = 0;
+    size_t bufferLen = 0;
+    SequentialFileReader reader;
+    ContentHasher* const hasher;
+    struct stat fileStat{};
+    bool haveStat = false;
+    zip_error_t error;
+    
+    StreamingFileSource(const fs::path& path, size_t chunkSize, ContentHasher* contentHasher)
+        : filePath(path), buffer(chunkSize), hasher(contentHasher) {
+        zip_error_init(&error);
+        haveStat = ::stat(filePath.c_str(), &fileStat) == 0;
+    }
+    
+    ~StreamingFileSource() {
+        zip_error_fini(&error);
+    }
+    
+public:
+    // Create a libzip source that owns a new StreamingFileSource. `hasher`,
+    // if given, ends up with the XXH64 of the bytes libzip pulled.
+    static zip_source_t* create(zip_t* archive, const fs::path& path, size_t chunkSize,
+                                ContentHasher* hasher = nullptr) {
+        auto* state = new StreamingFileSource(path, chunkSize, hasher);
+        zip_source_t* source = zip_source_function(archive, &StreamingFileSource::callback, state);
+        if (!source) {
+            delete state;
+        }
+        return source;
+    }
+    
+    StreamingFileSource(const StreamingFileSource&) = delete;
+    StreamingFileSource& operator=(const StreamingFileSource&) = delete;
+    
+private:
+    static zip_int64_t callback(void* userdata, void* data, zip_uint64_t len, zip_source_cmd_t cmd) {
+        auto* self = static_cast<StreamingFileSource*>(userdata);
+        
+        switch (cmd) {
+            case ZIP_SOURCE_OPEN:
+                if (!self->reader.open(self->filePath)) {
+                    zip_error_set(&self->error, ZIP_ER_OPEN, errno);
+                    return -1;
+                }
+                if (self->hasher) self->hasher->reset();
+                self->reader.hashInto(self->hasher);
+                self->bufferPos = self->bufferLen = 0;
+                return 0;
+                
+            case ZIP_SOURCE_READ:
+                return self->read(static_cast<char*>(data), len);
+                
+            case ZIP_SOURCE_CLOSE:
+                self->reader.close();
+                return 0;
+                
+            case ZIP_SOURCE_STAT: {
+                if (len < sizeof(zip_stat_t)) {
+                    zip_error_set(&self->error, ZIP_ER_INVAL, 0);
+                    return -1;
+                }
+                auto* st = static_cast<zip_stat_t*>(data);
+                zip_stat_init(st);
+                if (self->haveStat) {
+                    st->size = static_cast<zip_uint64_t>(self->fileStat.st_size);
+                    st->mtime = self->fileStat.st_mtime;
+                    st->valid |= ZIP_STAT_SIZE | ZIP_STAT_MTIME;
+                }
+                return sizeof(zip_stat_t);
+            }
+                
+            case ZIP_SOURCE_ERROR:
+                return zip_error_to_data(&self->error, data, len);
+                
+            case ZIP_SOURCE_FREE:
+                delete self;
+                return 0;
+                
+            case ZIP_SOURCE_SUPPORTS:
+                return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE,
+                                                      ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE,
+                                                      static_cast<zip_source_cmd_t>(-1));
+                
+            default:
+                zip_error_set(&self->error, ZIP_ER_OPNOTSUPP, 0);
+                return -1;
+        }
+    }
+    
+    zip_int64_t read(char* out, zip_uint64_t len) {
+        zip_uint64_t copied = 0;
+        
+        while (copied < len) {
+            if (bufferPos == bufferLen) {
+                const ssize_t n = reader.read(buffer.data(), buffer.size());
+                if (n < 0) {
+                    zip_error_set(&error, ZIP_ER_READ, errno);
+                    return -1;
+                }
+                bufferPos = 0;
+                bufferLen = static_cast<size_t>(n);
+                if (bufferLen == 0) break;  // EOF
+            }
+            
+            const size_t n = static_cast<size_t>(std::min<zip_uint64_t>(len - copied, bufferLen - bufferPos));
+            std::memcpy(out + copied, buffer.data() + bufferPos, n);
+            bufferPos += n;
+            copied += n;
+        }
+        
+        return static_cast<zip_int64_t>(copied);
+    }
+};
+
+// Compression backend for entries we compress ourselves. Input arrives in
+// ordered blocks; compress() may run concurrently for different blocks, and
+// the concatenated outputs followed by trailer() form the entry data for
+// zipMethod(). Codecs that can't produce concatenable pieces report
+// wholeInputOnly() and must be given the entire entry as one block.
+class BlockCodec {
+public:
+    static constexpr size_t DICTIONARY_SIZE = 32 * 1024;  // deflate window
+    
+    using Chunk = std::vector<unsigned char>;
+    
+    struct Block {
+        Chunk data;
+        uLong crc = 0;
+        size_t rawSize = 0;
+    };
+    
+    virtual ~BlockCodec() = default;
+    
+    virtual std::string_view name() const = 0;
+    virtual uint16_t zipMethod() const = 0;
+    virtual bool usesDictionary() const { return false; }
+    virtual bool wholeInputOnly() const { return false; }
+    virtual Chunk trailer() const { return {}; }
+    
+    // Rough single-core compression cost, used to plan work across threads
+    virtual double nanosPerByte(int level) const = 0;
+    
+    // dict holds the uncompressed bytes immediately preceding raw
+    Block compress(const Chunk& raw, const Chunk& dict, int level) const {
+        const StageTimers::Scope timer(StageTimers::Stage::Compress);
+        Block block;
+        block.rawSize = raw.size();
+        block.crc = crc32(crc32(0L, Z_NULL, 0), raw.data(), static_cast<uInt>(raw.size()));
+        block.data = encode(raw, dict, level);
+        return block;
+    }
+    
+protected:
+    virtual Chunk encode(const Chunk& raw, const Chunk& dict, int level) const = 0;
+};
+
+// zlib deflate pieces: each block is primed with its predecessor's tail as a
+// preset dictionary and ended with a sync flush, so pieces compressed in
+// parallel concatenate into a single valid raw deflate stream.
+class ZlibDeflateCodec final : public BlockCodec {
+public:
+    std::string_view name() const override { return "zlib"; }
+    uint16_t zipMethod() const override { return ZIP_CM_DEFLATE; }
+    bool usesDictionary() const override { return true; }
+    double nanosPerByte(int level) const override { return level <= 1 ? 6.0 : level <= 6 ? 15.0 : 30.0; }
+    
+    // Final empty fixed-Huffman block that terminates a sync-flushed stream
+    Chunk trailer() const override { return {0x03, 0x00}; }
+    
+protected:
+    Chunk encode(const Chunk& raw, const Chunk& dict, int level) const override {
+        // Stream state (~270KB at level 9) comes from this thread's pool
+        z_stream zs{};
+        zs.zalloc = &WorkerArena::zlibAlloc;
+        zs.zfree = &WorkerArena::zlibFree;
+        if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+        if (!dict.empty()) {
+            deflateSetDictionary(&zs, dict.data(), static_cast<uInt>(dict.size()));
+        }
+        
+        // Room for the sync-flush marker on top of the worst-case bound
+        Chunk out(deflateBound(&zs, static_cast<uLong>(raw.size())) + 16);
+        zs.next_in = const_cast<Bytef*>(raw.data());
+        zs.avail_in = static_cast<uInt>(raw.size());
+        
+        size_t produced = 0;
+        do {
+            if (produced == out.size()) {
+                out.resize(out.size() * 2);
+            }
+            zs.next_out = out.data() + produced;
+            zs.avail_out = static_cast<uInt>(out.size() - produced);
+            const int ret = deflate(&zs, Z_SYNC_FLUSH);
+            produced = out.size() - zs.avail_out;
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                deflateEnd(&zs);
+                throw std::runtime_error("deflate failed");
+            }
+        } while (zs.avail_out == 0);
+        
+        deflateEnd(&zs);
+        out.resize(produced);
+        return out;
+    }
+};
+
+#ifdef ZIPPER_WITH_LIBDEFLATE
+// libdeflate: markedly faster at high levels, but only compresses whole
+// buffers into complete streams, so an entry must arrive as a single block.
+class LibdeflateCodec final : public BlockCodec {
+public:
+    std::string_view name() const override { return "libdeflate"; }
+    uint16_t zipMethod() const override { return ZIP_CM_DEFLATE; }
+    bool wholeInputOnly() const override { return true; }
+    double nanosPerByte(int level) const override { return level <= 1 ? 3.0 : level <= 6 ? 6.0 : 15.0; }
+    
+protected:
+    Chunk encode(const Chunk& raw, const Chunk&, int level) const override {
+        // Compressors are not thread-safe; keep one per thread and level
+        thread_local std::array<std::unique_ptr<libdeflate_compressor, decltype(&libdeflate_free_compressor)>, 13> compressors{
+            makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(),
+            makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty(), makeEmpty()};
+        const int lvl = std::clamp(level, 1, 12);
+        auto& compressor = compressors[static_cast<size_t>(lvl)];
+        if (!compressor) {
+            compressor.reset(libdeflate_alloc_compressor(lvl));
+            if (!compressor) throw std::runtime_error("libdeflate_alloc_compressor failed");
+        }
+        
+        Chunk out(libdeflate_deflate_compress_bound(compressor.get(), raw.size()));
+        const size_t n = libdeflate_deflate_compress(compressor.get(), raw.data(), raw.size(), out.data(), out.size());
+        if (n == 0) throw std::runtime_error("libdeflate compression failed");
+        out.resize(n);
+        return out;
+    }
+    
+private:
+    static std::unique_ptr<libdeflate_compressor, decltype(&libdeflate_free_compressor)> makeEmpty() {
+        return {nullptr, &libdeflate_free_compressor};
+    }
+};
+#endif
+
+#ifdef ZIPPER_WITH_ISAL
+// Intel ISA-L igzip: high-throughput deflate with the same dictionary and
+// sync-flush piece scheme as zlib. Levels 1-9 map onto igzip's 1-3.
+class IsalDeflateCodec final : public BlockCodec {
+public:
+    std::string_view name() const override { return "isal"; }
+    uint16_t zipMethod() const override { return ZIP_CM_DEFLATE; }
+    bool usesDictionary() const override { return true; }
+    double nanosPerByte(int) const override { return 1.0; }
+    Chunk trailer() const override { return {0x03, 0x00}; }
+    
+protected:
+    Chunk encode(const Chunk& raw, const Chunk& dict, int level) const override {
+        static constexpr std::array<uint32_t, 4> levelBufSizes = {
+            ISAL_DEF_LVL0_DEFAULT, ISAL_DEF_LVL1_DEFAULT, ISAL_DEF_LVL2_DEFAULT, ISAL_DEF_LVL3_DEFAULT};
+        const uint32_t isalLevel = level <= 2 ? 1 : (level <= 6 ? 2 : 3);
+        thread_local std::vector<uint8_t> levelBuf;
+        levelBuf.resize(levelBufSizes[isalLevel]);
+        
+        isal_zstream zs;
+        isal_deflate_init(&zs);
+        zs.level = isalLevel;
+        zs.level_buf = levelBuf.data();
+        zs.level_buf_size = static_cast<uint32_t>(levelBuf.size());
+        zs.end_of_stream = 0;
+        zs.flush = SYNC_FLUSH;
+        if (!dict.empty() &&
+            isal_deflate_set_dict(&zs, const_cast<uint8_t*>(dict.data()), static_cast<uint32_t>(dict.size())) != COMP_OK) {
+            throw std::runtime_error("isal_deflate_set_dict failed");
+        }
+        
+        Chunk out(raw.size() + raw.size() / 8 + 1024);
+        zs.next_in = const_cast<uint8_t*>(raw.data());
+        zs.avail_in = static_cast<uint32_t>(raw.size());
+        
+        size_t produced = 0;
+        do {
+            if (produced == out.size()) {
+                out.resize(out.size() * 2);
+            }
+            zs.next_out = out.data() + produced;
+            zs.avail_out = static_cast<uint32_t>(out.size() - produced);
+            if (isal_deflate(&zs) != COMP_OK) {
+                throw std::runtime_error("isal_deflate failed");
+            }
+            produced = out.size() - zs.avail_out;
+        } while (zs.avail_in > 0 || zs.avail_out == 0);
+        
+        out.resize(produced);
+        return out;
+    }
+};
+#endif
+
+#ifdef ZIPPER_WITH_ZSTD
+// Zstandard as ZIP method 93. Every block becomes an independent frame;
+// decoders treat concatenated frames as one stream. Frames can't share a
+// prefix dictionary portably, so blocks are compressed without carry-over.
+class ZstdCodec final : public BlockCodec {
+public:
+    std::string_view name() const override { return "zstd"; }
+    uint16_t zipMethod() const override { return ZIP_CM_ZSTD; }
+    double nanosPerByte(int level) const override { return level <= 3 ? 2.5 : level <= 9 ? 10.0 : 30.0; }
+    
+protected:
+    Chunk encode(const Chunk& raw, const Chunk&, int level) const override {
+        thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+        if (!cctx) throw std::runtime_error("ZSTD_createCCtx failed");
+        
+        Chunk out(ZSTD_compressBound(raw.size()));
+        const size_t n = ZSTD_compressCCtx(cctx.get(), out.data(), out.size(), raw.data(), raw.size(),
+                                           std::clamp(level, 1, ZSTD_maxCLevel()));
+        if (ZSTD_isError(n)) {
+            throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(n));
+        }
+        out.resize(n);
+        return out;
+    }
+};
+#endif
+
+// Runtime codec selection among the backends compiled in (see the Makefile's
+// WITH_ZSTD / WITH_LIBDEFLATE / WITH_ISAL knobs). Unavailable choices fall
+// back to zlib.
+class CodecRegistry {
+public:
+    static constexpr size_t WHOLE_INPUT_LIMIT = 64 * 1024 * 1024;  // 64MB
+    
+    static const BlockCodec& zlib() {
+        static const ZlibDeflateCodec codec;
+        return codec;
+    }
+    
+    // ZIPPER_CODEC: zlib (default), libdeflate, isal, zstd, or auto to pick the
+    // fastest deflate backend for the level (ISA-L for fast, libdeflate for max)
+    static const BlockCodec& select(int level) {
+        const char* env = Config::lookup("ZIPPER_CODEC");
+        const std::string_view choice = env ? env : "zlib";
+        
+        if (choice == "auto") {
+            const BlockCodec* preferred = level <= Config::getFastLevel() ? find("isal") : find("libdeflate");
+            if (!preferred) preferred = level <= Config::getFastLevel() ? find("libdeflate") : find("isal");
+            return preferred ? *preferred : zlib();
+        }
+        
+        const BlockCodec* codec = find(choice);
+        if (!codec) {
+            static std::once_flag warned;
+            std::call_once(warned, [&]() {
+                std::cerr << "Warning: codec '" << choice << "' not available, using zlib (built with: "
+                          << availableCodecs() << ")\n";
+            });
+            return zlib();
+        }
+        return *codec;
+    }
+    
+    // Whole-input codecs can only take entries that fit in one block, and
+    // under a memory budget only blocks that leave room for the other workers
+    static const BlockCodec& forEntry(const BlockCodec& codec, size_t fileSize) {
+        if (!codec.wholeInputOnly()) return codec;
+        const auto& budget = MemoryBudget::global();
+        const bool tooBig = fileSize > WHOLE_INPUT_LIMIT || (budget.limited() && fileSize > budget.limit() / 4);
+        return tooBig ? zlib() : codec;
+    }
+    
+    static size_t blockSizeFor(const BlockCodec& codec, size_t fileSize, size_t blockSize) {
+        return codec.wholeInputOnly() ? std::max<size_t>(fileSize, 1) : blockSize;
+    }
+    
+    static std::string availableCodecs() {
+        std::string names;
+        for (const auto* codec : all()) {
+            if (!names.empty()) names += ", ";
+            names += codec->name();
+        }
+        return names;
+    }
+    
+private:
+    static const BlockCodec* find(std::string_view name) {
+        for (const auto* codec : all()) {
+            if (codec->name() == name) return codec;
+        }
+        return nullptr;
+    }
+    
+    static const std::vector<const BlockCodec*>& all() {
+        static const std::vector<const BlockCodec*> codecs = []() {
+            std::vector<const BlockCodec*> list{&zlib()};
+#ifdef ZIPPER_WITH_LIBDEFLATE
+            static const LibdeflateCodec libdeflate;
+            list.push_back(&libdeflate);
+#endif
+#ifdef ZIPPER_WITH_ISAL
+            static const IsalDeflateCodec isal;
+            list.push_back(&isal);
+#endif
+#ifdef ZIPPER_WITH_ZSTD
+            static const ZstdCodec zstd;
+            list.push_back(&zstd);
+#endif
+            return list;
+        }();
+        return codecs;
+    }
+};
+
+// Persistent worker threads with per-worker deques. File tasks are placed on
+// a worker up front; block jobs split off a large file go to the submitting
+// worker's sub-task deque (or a shared one from threads outside the pool).
+// A worker looks for work in this order: its own block jobs, shared block
+// jobs, other workers' block jobs, its own files, then other workers' files.
+// Files already under way finish before new ones start, and a huge file that
+// lands last is spread over every worker that would otherwise sit idle.
+class WorkStealingPool {
+public:
+    using Job = std::function<void()>;
+    
+private:
+    static constexpr size_t NO_WORKER = static_cast<size_t>(-1);
+    
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> tasks;
+        std::deque<Job> subtasks;
+        size_t node = 0;
+        std::vector<size_t> victims;  // same-node workers first
+    };
+    
+    std::vector<std::unique_ptr<Worker>> workers;
+    Worker shared;
+    bool pinned = false;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> queuedBlocks{0};  // of queued, the block jobs
+    std::atomic<size_t> unfinished{0};
+    std::mutex idleMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    std::condition_variable blockProgress;  // a block job was queued or finished, for await()
+    bool stopping = false;
+    const StageTimers::Clock::time_point created = StageTimers::Clock::now();
+    std::atomic<uint64_t> idleNs{0};  // workers waiting for work, or waiting on a block no one can run yet
+    std::atomic<bool> cheapestFirst{false};
+    
+    inline static thread_local const WorkStealingPool* currentPool = nullptr;
+    inline static thread_local size_t currentIndex = NO_WORKER;
+    
+public:
+    // With pinning on a multi-node machine, workers are split into contiguous
+    // groups, one per NUMA node, and confined to that node's CPUs
+    explicit WorkStealingPool(size_t threadCount, bool pinToNodes = false) {
+        threadCount = std::max<size_t>(threadCount, 1);
+        const auto& topology = CpuTopology::get();
+        const size_t nodes = topology.nodeCount();
+        pinned = pinToNodes && nodes > 1;
+        
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+            workers.back()->node = pinned ? i * nodes / threadCount : 0;
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            auto& victims = workers[i]->victims;
+            for (size_t offset = 1; offset < threadCount; ++offset) {
+                victims.push_back((i + offset) % threadCount);
+            }
+            std::stable_partition(victims.begin(), victims.end(),
+                [&](size_t v) { return workers[v]->node == workers[i]->node; });
+        }
+        threads.reserve(threadCount);
+        for (size_t i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this, i]() { run(i); });
+        }
+    }
+    
+    // Queued work still runs before the workers exit
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        StageTimers::global().recordWorkers(workers.size(), StageTimers::Clock::now() - created, idleNs.load());
+    }
+    
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    
+    size_t size() const { return workers.size(); }
+    
+    // How the next batch's files are planned on each worker: costliest first
+    // (the default), or cheapest first in latency mode. It decides which end
+    // of a victim's files a thief takes; see steal().
+    void setCheapestFirst(bool planned) { cheapestFirst.store(planned, std::memory_order_relaxed); }
+    
+    // File-level task, planned for worker `index` but stealable by any
+    void submitTask(size_t index, Job job) {
+        push(*workers[index % workers.size()], &Worker::tasks, std::move(job));
+    }
+    
+    // Block job; pair with await() so the caller helps instead of blocking
+    template <typename Fn>
+    auto async(Fn&& fn) -> std::future<std::invoke_result_t<std::decay_t<Fn>&>> {
+        using Result = std::invoke_result_t<std::decay_t<Fn>&>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+        auto future = task->get_future();
+        Worker& target = currentPool == this ? *workers[currentIndex] : shared;
+        push(target, &Worker::subtasks, [this, task, file = StageTimers::current()]() {
+            {
+                const StageTimers::Adopt adopt(file);
+                (*task)();
+            }
+            notifyBlockProgress();
+        });
+        return future;
+    }
+    
+    // Wait for any future, running block jobs meanwhile. Every waiter can run
+    // the job it waits on, so a block never starves behind busy workers.
+    // With none to run it sleeps until a block is queued or one finishes.
+    template <typename T>
+    T await(std::future<T>& future) {
+        const size_t self = currentPool == this ? currentIndex : NO_WORKER;
+        const auto ready = [&future]() { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; };
+        while (!ready()) {
+            if (runOne(self, true)) continue;
+            const auto idleFrom = StageTimers::Clock::now();
+            {
+                std::unique_lock<std::mutex> lock(idleMutex);
+                blockProgress.wait(lock, [&]() { return ready() || queuedBlocks.load(std::memory_order_acquire) > 0; });
+            }
+            if (self != NO_WORKER) addIdle(idleFrom);
+        }
+        return future.get();
+    }
+    
+    // Block until everything submitted so far has run
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        allDone.wait(lock, [this]() { return unfinished.load(std::memory_order_acquire) == 0; });
+    }
+    
+private:
+    void push(Worker& worker, std::deque<Job> Worker::*queue, Job job) {
+        unfinished.fetch_add(1, std::memory_order_acq_rel);
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            (worker.*queue).push_back(std::move(job));
+            queued.fetch_add(1, std::memory_order_release);
+            if (queue == &Worker::subtasks) queuedBlocks.fetch_add(1, std::memory_order_release);
+        }
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+        }
+        workAvailable.notify_one();
+        if (queue == &Worker::subtasks) blockProgress.notify_all();
+    }
+    
+    // Taking idleMutex orders this after a waiter's check in await()
+    void notifyBlockProgress() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+        }
+        blockProgress.notify_all();
+    }
+    
+    void run(size_t index) {
+        currentPool = this;
+        currentIndex = index;
+        if (pinned) CpuTopology::get().pinCurrentThread(workers[index]->node);
+        while (true) {
+            if (runOne(index, false)) continue;
+            const auto idleFrom = StageTimers::Clock::now();
+            std::unique_lock<std::mutex> lock(idleMutex);
+            workAvailable.wait(lock, [this]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            addIdle(idleFrom);
+            if (stopping && queued.load(std::memory_order_acquire) == 0) return;
+        }
+    }
+    
+    void addIdle(StageTimers::Clock::time_point since) {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(StageTimers::Clock::now() - since);
+        idleNs.fetch_add(static_cast<uint64_t>(elapsed.count()), std::memory_order_relaxed);
+    }
+    
+    bool runOne(size_t self, bool subtasksOnly) {
+        auto job = take(self, subtasksOnly);
+        if (!job) return false;
+        
+        try {
+            (*job)();
+        } catch (const std::exception& e) {
+            std::cerr << "Worker task failed: " << e.what() << '\n';
+        } catch (...) {
+            std::cerr << "Worker task failed: unknown error\n";
+        }
+        
+        if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            allDone.notify_all();
+        }
+        return true;
+    }
+    
+    std::optional<Job> take(size_t self, bool subtasksOnly) {
+        const bool inPool = self != NO_WORKER;
+        if (inPool) {
+            if (auto job = pop(*workers[self], &Worker::subtasks, false)) return job;
+        }
+        if (auto job = pop(shared, &Worker::subtasks, true)) return job;
+        if (auto job = steal(self, &Worker::subtasks)) return job;
+        if (subtasksOnly || !inPool) return std::nullopt;
+        if (auto job = pop(*workers[self], &Worker::tasks, true)) return job;
+        return steal(self, &Worker::tasks);
+    }
+    
+    // Victims lose their oldest block job (the one needed first). Of their
+    // files they lose the last planned, the cheapest under costliest-first
+    // planning, which keeps a thief from starting a long file late. Under
+    // cheapest-first planning they lose the next one instead: small files
+    // still finish first, and large ones stay where the plan balanced them.
+    // Same-node victims are tried first so stolen blocks stay node-local.
+    std::optional<Job> steal(size_t self, std::deque<Job> Worker::*queue) {
+        const bool oldest = queue == &Worker::subtasks || cheapestFirst.load(std::memory_order_relaxed);
+        if (self == NO_WORKER) {
+            for (auto& worker : workers) {
+                if (auto job = pop(*worker, queue, oldest)) return job;
+            }
+            return std::nullopt;
+        }
+        for (const size_t victim : workers[self]->victims) {
+            if (auto job = pop(*workers[victim], queue, oldest)) return job;
+        }
+        return std::nullopt;
+    }
+    
+    std::optional<Job> pop(Worker& worker, std::deque<Job> Worker::*queue, bool front) {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        auto& jobs = worker.*queue;
+        if (jobs.empty()) return std::nullopt;
+        Job job = front ? std::move(jobs.front()) : std::move(jobs.back());
+        front ? jobs.pop_front() : jobs.pop_back();
+        queued.fetch_sub(1, std::memory_order_release);
+        if (queue == &Worker::subtasks) queuedBlocks.fetch_sub(1, std::memory_order_release);
+        return job;
+    }
+};
+
+// Zip source that compresses with a BlockCodec instead of libzip's built-in
+// zlib. Used pigz-style for single huge inputs: the file is cut into blocks
+// compressed concurrently (deflate pieces are primed with the previous block's
+// last 32KB and sync-flushed so they concatenate into one stream), and for
+// the alternative codec backends. libzip receives already-compressed data and
+// copies it through as long as the entry's method matches the codec's.
+class BlockCompressedSource {
+private:
+    using Block = BlockCodec::Block;
+    
+    const fs::path filePath;
+    const BlockCodec& codec;
+    const size_t blockSize;
+    const int level;
+    const size_t maxInFlight;
+    SequentialFileReader reader;
+    ContentHasher* const hasher;
+    struct stat fileStat{};
+    bool haveStat = false;
+    zip_error_t error;
+    
+    std::deque<std::pair<std::future<Block>, MemoryBudget::Lease>> inFlight;
+    std::vector<unsigned char> dictionary;
+    Block current;
+    MemoryBudget::Lease currentLease;
+    size_t currentPos = 0;
+    bool inputDone = false;
+    bool streamDone = false;
+    uLong crc = 0;
+    zip_uint64_t compressedSize = 0;
+    
+    WorkStealingPool* const pool;  // null or a single thread: blocks run inline
+    
+    BlockCompressedSource(const fs::path& path, const BlockCodec& blockCodec, size_t blockBytes, int compressionLevel,
+                          size_t threadCount, WorkStealingPool* workers, ContentHasher* contentHasher)
+        : filePath(path), codec(blockCodec), blockSize(blockBytes), level(compressionLevel),
+          maxInFlight(std::max<size_t>(threadCount, 1) * 2), hasher(contentHasher),
+          pool(threadCount > 1 ? workers : nullptr) {
+        zip_error_init(&error);
+        haveStat = ::stat(filePath.c_str(), &fileStat) == 0;
+    }
+    
+    ~BlockCompressedSource() {
+        inFlight.clear();  // queued jobs own their input and finish on their own
+        zip_error_fini(&error);
+    }
+    
+public:
+    // `hasher`, if given, ends up with the XXH64 of the input read
+    static zip_source_t* create(zip_t* archive, const fs::path& path, const BlockCodec& codec, size_t blockBytes,
+                                int compressionLevel, size_t threads, WorkStealingPool* pool,
+                                ContentHasher* hasher = nullptr) {
+        auto* state = new BlockCompressedSource(path, codec, blockBytes, compressionLevel, threads, pool, hasher);
+        zip_source_t* source = zip_source_function(archive, &BlockCompressedSource::callback, state);
+        if (!source) {
+            delete state;
+        }
+        return source;
+    }
+    
+    BlockCompressedSource(const BlockCompressedSource&) = delete;
+    BlockCompressedSource& operator=(const BlockCompressedSource&) = delete;
+    
+private:
+    static zip_int64_t callback(void* userdata, void* data, zip_uint64_t len, zip_source_cmd_t cmd) {
+        auto* self = static_cast<BlockCompressedSource*>(userdata);
+        
+        switch (cmd) {
+            case ZIP_SOURCE_OPEN:
+                return self->open() ? 0 : -1;
+                
+            case ZIP_SOURCE_READ:
+                try {
+                    return self->read(static_cast<unsigned char*>(data), len);
+                } catch (const std::exception&) {
+                    zip_error_set(&self->error, ZIP_ER_INTERNAL, 0);
+                    return -1;
+                }
+                
+            case ZIP_SOURCE_CLOSE:
+                self->inFlight.clear();
+                self->reader.close();
+                return 0;
+                
+            case ZIP_SOURCE_STAT: {
+                if (len < sizeof(zip_stat_t)) {
+                    zip_error_set(&self->error, ZIP_ER_INVAL, 0);
+                    return -1;
+                }
+                auto* st = static_cast<zip_stat_t*>(data);
+                zip_stat_init(st);
+                st->comp_method = self->codec.zipMethod();
+                st->encryption_method = ZIP_EM_NONE;
+                st->valid |= ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD;
+                if (self->haveStat) {
+                    st->size = static_cast<zip_uint64_t>(self->fileStat.st_size);
+                    st->mtime = self->fileStat.st_mtime;
+                    st->valid |= ZIP_STAT_SIZE | ZIP_STAT_MTIME;
+                }
+                // CRC and compressed size are only known once the stream is drained
+                if (self->streamDone) {
+                    st->crc = static_cast<zip_uint32_t>(self->crc);
+                    st->comp_size = self->compressedSize;
+                    st->valid |= ZIP_STAT_CRC | ZIP_STAT_COMP_SIZE;
+                }
+                return sizeof(zip_stat_t);
+            }
+                
+            case ZIP_SOURCE_ERROR:
+                return zip_error_to_data(&self->error, data, len);
+                
+            case ZIP_SOURCE_FREE:
+                delete self;
+                return 0;
+                
+            case ZIP_SOURCE_SUPPORTS:
+                return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE,
+                                                      ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE,
+                                                      static_cast<zip_source_cmd_t>(-1));
+                
+            default:
+                zip_error_set(&self->error, ZIP_ER_OPNOTSUPP, 0);
+                return -1;
+        }
+    }
+    
+    bool open() {
+        inFlight.clear();
+        if (!reader.open(filePath)) {
+            zip_error_set(&error, ZIP_ER_OPEN, errno);
+            return false;
+        }
+        if (hasher) hasher->reset();
+        reader.hashInto(hasher);
+        dictionary.clear();
+        current = Block{};
+        currentPos = 0;
+        inputDone = streamDone = false;
+        crc = crc32(0L, Z_NULL, 0);
+        compressedSize = 0;
+        return true;
+    }
+    
+    zip_int64_t read(unsigned char* out, zip_uint64_t len) {
+        zip_uint64_t copied = 0;
+        
+        while (copied < len) {
+            if (currentPos == current.data.size()) {
+                if (!nextBlock()) return -1;
+                if (streamDone && currentPos == current.data.size()) break;
+            }
+            
+            const size_t n = static_cast<size_t>(std::min<zip_uint64_t>(len - copied, current.data.size() - currentPos));
+            std::memcpy(out + copied, current.data.data() + currentPos, n);
+            currentPos += n;
+            copied += n;
+        }
+        
+        return static_cast<zip_int64_t>(copied);
+    }
+    
+    // Keep the window of compression jobs full, then take the oldest in order.
+    // Only the first block waits for memory; past that the window shrinks to
+    // what the budget allows, since this thread is the one that drains it.
+    bool nextBlock() {
+        currentLease.reset();
+        while (!inputDone && inFlight.size() < maxInFlight) {
+            MemoryBudget::Lease lease;
+            if (inFlight.empty()) {
+                lease = MemoryBudget::global().acquire(blockSize);
+            } else if (auto extra = MemoryBudget::global().tryAcquire(blockSize)) {
+                lease = std::move(*extra);
+            } else {
+                break;
+            }
+            
+            std::vector<unsigned char> raw(blockSize);
+            const ssize_t n = reader.read(raw.data(), raw.size());
+            if (n < 0) {
+                zip_error_set(&error, ZIP_ER_READ, errno);
+                return false;
+            }
+            if (n == 0) {
+                inputDone = true;
+                break;
+            }
+            raw.resize(static_cast<size_t>(n));
+            
+            std::vector<unsigned char> dict = std::move(dictionary);
+            if (codec.usesDictionary()) {
+                const size_t tail = std::min(raw.size(), BlockCodec::DICTIONARY_SIZE);
+                dictionary.assign(raw.end() - static_cast<std::ptrdiff_t>(tail), raw.end());
+            }
+            
+            auto job = [codec = &codec, level = level, raw = std::move(raw), dict = std::move(dict)]() {
+                return codec->compress(raw, dict, level);
+            };
+            inFlight.emplace_back(pool ? pool->async(std::move(job)) : std::async(std::launch::deferred, std::move(job)),
+                                  std::move(lease));
+        }
+        
+        current = Block{};
+        currentPos = 0;
+        
+        if (inFlight.empty()) {
+            if (!streamDone) {
+                current.data = codec.trailer();
+                compressedSize += current.data.size();
+                streamDone = true;
+            }
+            return true;
+        }
+        
+        auto& [oldest, lease] = inFlight.front();
+        current = pool ? pool->await(oldest) : oldest.get();
+        currentLease = std::move(lease);
+        inFlight.pop_front();
+        crc = crc32_combine(crc, current.crc, static_cast<z_off_t>(current.rawSize));
+        compressedSize += current.data.size();
+        return true;
+    }
+};
+
+// Bounded blocking queue connecting the stages of the archive pipeline.
+// close() lets consumers drain what's left; cancel() unblocks everyone at once.
+template <typename T>
+class BoundedQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed = false;
+    bool cancelled = false;
+    
+public:
+    explicit BoundedQueue(size_t maxItems) : capacity(std::max<size_t>(maxItems, 1)) {}
+    
+    // Returns false if the queue was cancelled while waiting
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity || cancelled; });
+        if (cancelled) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    // Returns nullopt once closed and drained, or immediately when cancelled
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed || cancelled; });
+        if (cancelled || items.empty()) return std::nullopt;
+        T item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+    
+    // Whether pop() would have to wait right now
+    bool starved() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.empty() && !closed && !cancelled;
+    }
+    
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// WinZip AES-256 entry encryption (AE-1/AE-2): PBKDF2-HMAC-SHA1 key stretching,
+// AES in little-endian CTR mode, and HMAC-SHA1 over the ciphertext truncated
+// to 10 bytes. The keystream is produced in batches through OpenSSL's EVP ECB
+// path, which dispatches to AES-NI/VAES when the CPU has them. Verify mode
+// runs the same keystream backwards to decrypt.
+class WinZipAesEncryptor {
+public:
+    static constexpr size_t SALT_SIZE = 16;
+    static constexpr size_t KEY_SIZE = 32;
+    static constexpr size_t VERIFIER_SIZE = 2;
+    static constexpr size_t AUTH_CODE_SIZE = 10;
+    static constexpr int PBKDF2_ITERATIONS = 1000;
+    static constexpr unsigned char AES_STRENGTH_256 = 3;
+    
+    struct KeyMaterial {
+        std::array<unsigned char, SALT_SIZE> salt{};
+        std::array<unsigned char, 2 * KEY_SIZE + VERIFIER_SIZE> derived{};
+        
+        const unsigned char* encryptionKey() const { return derived.data(); }
+        const unsigned char* macKey() const { return derived.data() + KEY_SIZE; }
+        const unsigned char* verifier() const { return derived.data() + 2 * KEY_SIZE; }
+    };
+    
+private:
+    static constexpr size_t AES_BLOCK = 16;
+    static constexpr size_t KEYSTREAM_BLOCKS = 256;  // 4KB per EVP call keeps the AES units busy
+    
+    EVP_CIPHER_CTX* cipher = nullptr;
+    EVP_MAC* mac = nullptr;
+    EVP_MAC_CTX* hmac = nullptr;
+    std::array<unsigned char, AES_BLOCK * KEYSTREAM_BLOCKS> counterBlocks{};
+    std::array<unsigned char, AES_BLOCK * KEYSTREAM_BLOCKS> keystream{};
+    size_t keystreamPos = 0;
+    uint64_t counter = 0;
+    
+public:
+    // Fresh random salt per entry; reusing a salt would reuse the CTR keystream
+    static KeyMaterial deriveKeys(const std::string& password) {
+        std::array<unsigned char, SALT_SIZE> salt{};
+        if (RAND_bytes(salt.data(), static_cast<int>(salt.size())) != 1) {
+            throw std::runtime_error("Failed to generate AES salt");
+        }
+        auto keys = deriveKeys(password, salt.data());
+        OPENSSL_cleanse(salt.data(), salt.size());
+        return keys;
+    }
+    
+    // The keys of an existing entry, from the salt stored in front of its data
+    static KeyMaterial deriveKeys(const std::string& password, const unsigned char* salt) {
+        KeyMaterial keys;
+        std::copy_n(salt, SALT_SIZE, keys.salt.begin());
+        if (PKCS5_PBKDF2_HMAC_SHA1(password.data(), static_cast<int>(password.size()),
+                                   keys.salt.data(), static_cast<int>(keys.salt.size()), PBKDF2_ITERATIONS,
+                                   static_cast<int>(keys.derived.size()), keys.derived.data()) != 1) {
+            OPENSSL_cleanse(&keys, sizeof(keys));
+            throw std::runtime_error("PBKDF2 key derivation failed");
+        }
+        return keys;
+    }
+    
+    explicit WinZipAesEncryptor(const KeyMaterial& keys) : keystreamPos(keystream.size()) {
+        cipher = EVP_CIPHER_CTX_new();
+        if (!cipher || EVP_EncryptInit_ex(cipher, EVP_aes_256_ecb(), nullptr, keys.encryptionKey(), nullptr) != 1) {
+            cleanup();
+            throw std::runtime_error("AES-256 initialisation failed");
+        }
+        EVP_CIPHER_CTX_set_padding(cipher, 0);
+        
+        char digest[] = "SHA1";
+        const OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+            OSSL_PARAM_construct_end()
+        };
+        mac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+        hmac = mac ? EVP_MAC_CTX_new(mac) : nullptr;
+        if (!hmac || EVP_MAC_init(hmac, keys.macKey(), KEY_SIZE, params) != 1) {
+            cleanup();
+            throw std::runtime_error("HMAC-SHA1 initialisation failed");
+        }
+    }
+    
+    ~WinZipAesEncryptor() { cleanup(); }
+    
+    WinZipAesEncryptor(const WinZipAesEncryptor&) = delete;
+    WinZipAesEncryptor& operator=(const WinZipAesEncryptor&) = delete;
+    
+    // Encrypt in place and feed the ciphertext to the authenticator
+    void encrypt(unsigned char* data, size_t len) {
+        const StageTimers::Scope timer(StageTimers::Stage::Encrypt);
+        applyKeystream(data, len);
+        if (EVP_MAC_update(hmac, data, len) != 1) {
+            throw std::runtime_error("HMAC-SHA1 update failed");
+        }
+    }
+    
+    // Authenticate the ciphertext, then decrypt it in place
+    void decrypt(unsigned char* data, size_t len) {
+        const StageTimers::Scope timer(StageTimers::Stage::Encrypt);
+        if (EVP_MAC_update(hmac, data, len) != 1) {
+            throw std::runtime_error("HMAC-SHA1 update failed");
+        }
+        applyKeystream(data, len);
+    }
+    
+    // Decrypt bytes from `offset` into the entry data without authenticating
+    // them, e.g. one chunk copied out of an older archive. The caller has to
+    // check the plaintext itself.
+    void decryptAt(uint64_t offset, unsigned char* data, size_t len) {
+        const StageTimers::Scope timer(StageTimers::Stage::Encrypt);
+        counter = offset / AES_BLOCK;
+        refillKeystream();
+        keystreamPos = static_cast<size_t>(offset % AES_BLOCK);
+        applyKeystream(data, len);
+    }
+    
+    std::array<unsigned char, AUTH_CODE_SIZE> finish() {
+        const StageTimers::Scope timer(StageTimers::Stage::Encrypt);
+        std::array<unsigned char, EVP_MAX_MD_SIZE> digest{};
+        size_t digestLen = 0;
+        if (EVP_MAC_final(hmac, digest.data(), &digestLen, digest.size()) != 1 || digestLen < AUTH_CODE_SIZE) {
+            throw std::runtime_error("HMAC-SHA1 finalisation failed");
+        }
+        std::array<unsigned char, AUTH_CODE_SIZE> code{};
+        std::copy_n(digest.begin(), AUTH_CODE_SIZE, code.begin());
+        return code;
+    }
+    
+private:
+    void applyKeystream(unsigned char* data, size_t len) {
+        size_t done = 0;
+        while (done < len) {
+            if (keystreamPos == keystream.size()) {
+                refillKeystream();
+            }
+            const size_t n = std::min(len - done, keystream.size() - keystreamPos);
+            const unsigned char* ks = keystream.data() + keystreamPos;
+            for (size_t i = 0; i < n; ++i) {
+                data[done + i] ^= ks[i];
+            }
+            keystreamPos += n;
+            done += n;
+        }
+    }
+    
+    // WinZip's counter is a 64-bit little-endian value starting at 1
+    void refillKeystream() {
+        for (size_t b = 0; b < KEYSTREAM_BLOCKS; ++b) {
+            ++counter;
+            unsigned char* block = counterBlocks.data() + b * AES_BLOCK;
+            for (size_t i = 0; i < 8; ++i) {
+                block[i] = static_cast<unsigned char>(counter >> (8 * i));
+            }
+        }
+        int outLen = 0;
+        if (EVP_EncryptUpdate(cipher, keystream.data(), &outLen, counterBlocks.data(),
+                              static_cast<int>(counterBlocks.size())) != 1) {
+            throw std::runtime_error("AES keystream generation failed");
+        }
+        keystreamPos = 0;
+    }
+    
+    void cleanup() {
+        if (hmac) EVP_MAC_CTX_free(hmac);
+        if (mac) EVP_MAC_free(mac);
+        if (cipher) EVP_CIPHER_CTX_free(cipher);
+        hmac = nullptr;
+        mac = nullptr;
+        cipher = nullptr;
+    }
+};
+
+// fsync a file, or a directory's entries; false with errno set on failure
+static bool syncPath(const fs::path& path, bool directory = false) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : 0));
+    if (fd < 0) return false;
+    const bool ok = ::fsync(fd) == 0;
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return ok;
+}
+
+// Rename a finished temp file into place. With ZIPPER_FSYNC its data is on
+// disk before the new name is, and the name is by the time this returns.
+// `synced` says the caller has already fsynced the file.
+static void durableRename(const fs::path& from, const fs::path& to, bool synced = false) {
+    const bool sync = Config::getFsync();
+    if (sync && !synced && !syncPath(from)) {
+        throw std::runtime_error("Cannot sync " + from.string() + ": " + std::strerror(errno));
+    }
+    fs::rename(from, to);
+    const auto directory = to.parent_path().empty() ? fs::path(".") : to.parent_path();
+    if (sync && !syncPath(directory, true)) {
+        throw std::runtime_error("Cannot sync " + directory.string() + ": " + std::strerror(errno));
+    }
+}
+
+// Read exactly `len` bytes at `offset`; false with errno set on failure, or
+// with errno 0 when the file ends first
+static bool preadFully(int fd, unsigned char* out, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        const ssize_t n = ::pread(fd, out + done, len - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = 0;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Create a state folder (.zipper and below) the first time it is needed,
+// with a .gitignore that keeps it out of the storage repository
+static void ensureStateDirectory(const fs::path& directory) {
+    if (fs::exists(directory)) return;
+    fs::create_directories(directory);
+    std::ofstream(directory / ".gitignore") << "*\n";
+}
+
+// Fields of the tab-separated state files (manifest, journal, chunk maps).
+// The last field of a line has no tab after it; callers that expect more
+// check that `rest` is not empty.
+static std::string_view nextText(std::string_view& rest) {
+    const auto tab = rest.find('\t');
+    const auto text = rest.substr(0, tab);
+    rest.remove_prefix(tab == std::string_view::npos ? rest.size() : tab + 1);
+    return text;
+}
+
+template <typename T>
+static bool parseField(std::string_view text, T& value, int base) {
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+    return ec == std::errc() && end == text.data() + text.size();
+}
+
+template <typename T>
+static bool nextField(std::string_view& rest, T& value, int base) {
+    return parseField(nextText(rest), value, base);
+}
+
+// Write-behind archive file. Bytes are staged in aligned 1MB buffers. Full
+// buffers go out through io_uring while the caller keeps compressing, or
+// through pwrite when there is no ring. With ZIPPER_DIRECT_IO=1 the file is
+// opened O_DIRECT; the unaligned tail is padded and then trimmed back with
+// ftruncate.
+class AsyncFileWriter {
+private:
+    static constexpr size_t STAGE_BYTES = 1024 * 1024;
+    static constexpr size_t ALIGNMENT = 4096;
+    // Smaller archives leave little writing to overlap with compression, and
+    // setting up a ring and registering its buffers would cost more than it
+    // saves. They get a single stage, no larger than the archive, and plain
+    // buffered writes.
+    static constexpr uint64_t ASYNC_MIN_BYTES = 4 * STAGE_BYTES;
+    
+    struct Stage {
+        std::unique_ptr<char, decltype(&std::free)> data{nullptr, &std::free};
+        uint64_t offset = 0;
+        size_t used = 0;
+        size_t submitted = 0;
+        bool pending = false;
+    };
+    
+    const fs::path filePath;
+    const size_t stageBytes;
+    int fd = -1;
+    bool direct = false;
+    uint64_t written = 0;
+    int failure = 0;  // first errno from a background write
+    std::vector<Stage> stages;
+    size_t current = 0;
+    std::vector<MemoryBudget::Lease> stageLeases;
+    std::unique_ptr<IoUring> ring;  // destroyed before the buffers it has pinned
+    
+public:
+    // sizeHint is an upper bound on the archive's size, or 0 if unknown
+    AsyncFileWriter(const fs::path& path, uint64_t sizeHint)
+        : filePath(path),
+          stageBytes(sizeHint > 0 && sizeHint < STAGE_BYTES
+                     ? static_cast<size_t>((sizeHint + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT) : STAGE_BYTES) {
+        const bool large = sizeHint == 0 || sizeHint >= ASYNC_MIN_BYTES;
+        // Replace rather than truncate so a hard-linked duplicate keeps its data
+        ::unlink(path.c_str());
+        const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+        if (large && Config::getDirectIo()) {
+            // Filesystems without O_DIRECT support (tmpfs, some FUSE) refuse it
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+#endif
+        if (fd < 0) fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create zip archive: " + path.string() + " (" + std::strerror(errno) + ")");
+        }
+        
+        // One stage is required and waits for memory; further ones deepen
+        // the write queue only while the budget has room for them
+        const bool async = large && Config::getIoBackend() == Config::IoBackend::Uring;
+        auto& budget = MemoryBudget::global();
+        stageLeases.push_back(budget.pin(stageBytes));
+        const size_t wanted = async ? Config::getIoDepth() : 1;
+        while (stageLeases.size() < wanted) {
+            auto extra = budget.tryPin(stageBytes);
+            if (!extra) break;
+            stageLeases.push_back(std::move(*extra));
+        }
+        stages.resize(stageLeases.size());
+        std::vector<iovec> buffers;
+        for (auto& stage : stages) {
+            stage.data.reset(static_cast<char*>(std::aligned_alloc(ALIGNMENT, stageBytes)));
+            if (!stage.data) throw std::bad_alloc();
+            buffers.push_back({stage.data.get(), stageBytes});
+        }
+        if (async) {
+            ring = std::make_unique<IoUring>(static_cast<unsigned>(stages.size()));
+            if (ring->valid()) {
+                ring->registerBuffers(buffers);
+            } else {
+                ring.reset();
+            }
+        }
+    }
+    
+    ~AsyncFileWriter() {
+        drain();
+        if (fd >= 0) ::close(fd);
+    }
+    
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+    
+    void write(const void* data, size_t len) {
+        const StageTimers::Scope timer(StageTimers::Stage::Write);
+        StageTimers::global().addBytes(StageTimers::Stage::Write, len);
+        const auto* src = static_cast<const char*>(data);
+        while (len > 0) {
+            auto& stage = stages[current];
+            const size_t n = std::min(len, stageBytes - stage.used);
+            std::memcpy(stage.data.get() + stage.used, src, n);
+            stage.used += n;
+            src += n;
+            len -= n;
+            written += n;
+            if (stage.used == stageBytes) rotate();
+        }
+    }
+    
+    // Flush, wait for every write and close. Throws on any I/O error.
+    void close() {
+        const StageTimers::Scope timer(StageTimers::Stage::Close);
+        auto& stage = stages[current];
+        size_t length = stage.used;
+        if (direct && length % ALIGNMENT != 0) {
+            const size_t padded = (length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            std::memset(stage.data.get() + length, 0, padded - length);
+            length = padded;
+        }
+        if (length > 0) submit(current, length);
+        drain();
+        throwIfFailed();
+        
+        if (direct && ::ftruncate(fd, static_cast<off_t>(written)) != 0) {
+            failure = errno;
+            throwIfFailed();
+        }
+        if (Config::getFsync() && ::fdatasync(fd) != 0) {
+            failure = errno;
+            throwIfFailed();
+        }
+        const int rc = ::close(fd);
+        fd = -1;
+        if (rc != 0) {
+            throw std::runtime_error("Failed to close zip archive: " + filePath.string());
+        }
+    }
+    
+private:
+    void rotate() {
+        const uint64_t nextOffset = stages[current].offset + stages[current].used;
+        submit(current, stages[current].used);
+        current = (current + 1) % stages.size();
+        await(current);
+        throwIfFailed();
+        stages[current].offset = nextOffset;
+        stages[current].used = 0;
+    }
+    
+    void submit(size_t index, size_t length) {
+        auto& stage = stages[index];
+        stage.submitted = length;
+        stage.pending = ring && ring->queueWrite(fd, stage.data.get(), static_cast<unsigned>(length), stage.offset, index,
+                                                 ring->hasRegisteredBuffers() ? static_cast<int>(index) : -1);
+        if (stage.pending) {
+            ring->submit();
+        } else {
+            complete(stage, 0);
+        }
+    }
+    
+    void await(size_t index) {
+        while (stages[index].pending) {
+            IoUring::Completion completion;
+            if (!ring->wait(completion)) {
+                if (failure == 0) failure = errno;
+                // The kernel may still read from these, so they must never be reused
+                for (auto& stage : stages) {
+                    if (stage.pending) (void)stage.data.release();
+                    stage.pending = false;
+                }
+                return;
+            }
+            complete(stages[completion.tag], completion.result);
+        }
+    }
+    
+    void drain() {
+        for (size_t i = 0; i < stages.size(); ++i) {
+            await(i);
+        }
+    }
+    
+    // Short or failed ring writes finish synchronously with pwrite
+    void complete(Stage& stage, int result) {
+        stage.pending = false;
+        size_t done = result > 0 ? static_cast<size_t>(result) : 0;
+        while (done < stage.submitted) {
+            const ssize_t n = ::pwrite(fd, stage.data.get() + done, stage.submitted - done,
+                                       static_cast<off_t>(stage.offset + done));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (failure == 0) failure = errno;
+                return;
+            }
+            done += static_cast<size_t>(n);
+        }
+    }
+    
+    void throwIfFailed() const {
+        if (failure != 0) {
+            throw std::runtime_error("Write failed for " + filePath.string() + ": " + std::strerror(failure));
+        }
+    }
+};
+
+// Where one archive is written, front to back. Nothing appears under the
+// archive's name until commit() returns; a sink destroyed without a commit
+// discards whatever was written to it.
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    
+    virtual void write(const void* data, size_t len) = 0;
+    
+    // Flush and publish under the final name. Throws on any failure.
+    virtual void commit() = 0;
+};
+
+// Writes under a hidden name beside the final one and renames it into place
+// on commit, so a crash never leaves a truncated zip behind
+class LocalFileSink final : public OutputSink {
+private:
+    const fs::path finalPath;
+    const fs::path partialPath;
+    AsyncFileWriter file;
+    bool committed = false;
+    
+public:
+    LocalFileSink(const fs::path& output, uint64_t sizeHint)
+        : finalPath(output), partialPath(partialPathFor(output)), file(partialPath, sizeHint) {}
+    
+    ~LocalFileSink() override {
+        if (committed) return;
+        std::error_code ec;
+        fs::remove(partialPath, ec);
+    }
+    
+    void write(const void* data, size_t len) override { file.write(data, len); }
+    
+    void commit() override {
+        file.close();  // synced there, so only the rename is left
+        durableRename(partialPath, finalPath, true);
+        committed = true;
+    }
+    
+    static fs::path partialPathFor(const fs::path& output) {
+        return output.parent_path() / ("." + output.filename().string() + ".part");
+    }
+};
+
+// One keep-alive HTTP/1.1 connection, TLS through OpenSSL for https. Just what
+// the object store client needs: a request whose body is in memory, and a
+// response read by Content-Length or chunked encoding. Any error throws and
+// leaves the connection unusable.
+class HttpConnection {
+public:
+    struct Response {
+        int status = 0;
+        std::unordered_map<std::string, std::string> headers;  // lower-case names
+        std::string body;
+        
+        std::string header(const std::string& name) const {
+            const auto it = headers.find(name);
+            return it != headers.end() ? it->second : std::string();
+        }
+    };
+    
+private:
+    static constexpr int TIMEOUT_SECONDS = 60;
+    
+    int fd = -1;
+    SSL* ssl = nullptr;
+    bool keepAlive = true;
+    std::string pending;  // received past the last response
+    
+public:
+    HttpConnection(const std::string& host, const std::string& port, SSL_CTX* tls) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (const int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses); rc != 0) {
+            throw std::runtime_error("Cannot resolve " + host + ": " + gai_strerror(rc));
+        }
+        for (auto* address = addresses; address && fd < 0; address = address->ai_next) {
+            fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd < 0) continue;
+            if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(addresses);
+        if (fd < 0) throw std::runtime_error("Cannot connect to " + host + ":" + port + ": " + std::strerror(errno));
+        
+        const timeval timeout{TIMEOUT_SECONDS, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        const int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        
+        if (tls) {
+            ssl = SSL_new(tls);
+            if (!ssl || SSL_set_fd(ssl, fd) != 1 || SSL_set_tlsext_host_name(ssl, host.c_str()) != 1 ||
+                SSL_set1_host(ssl, host.c_str()) != 1 || SSL_connect(ssl) != 1) {
+                const auto reason = ERR_reason_error_string(ERR_get_error());
+                close();
+                throw std::runtime_error("TLS handshake with " + host + " failed" +
+                                         (reason ? std::string(": ") + reason : std::string()));
+            }
+        }
+    }
+    
+    ~HttpConnection() { close(); }
+    
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+    
+    // Sends head (request line and headers, ending in a blank line) and body
+    Response send(std::string_view head, std::span<const unsigned char> body) {
+        writeAll(head.data(), head.size());
+        if (!body.empty()) writeAll(body.data(), body.size());
+        
+        Response response;
+        do {
+            const auto statusLine = readLine();
+            if (statusLine.compare(0, 5, "HTTP/") != 0 || statusLine.size() < 12) {
+                throw std::runtime_error("Malformed HTTP response");
+            }
+            response.status = std::atoi(statusLine.c_str() + 9);
+            response.headers.clear();
+            for (auto line = readLine(); !line.empty(); line = readLine()) {
+                const auto colon = line.find(':');
+                if (colon == std::string::npos) continue;
+                std::string name = line.substr(0, colon);
+                for (auto& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                const auto start = line.find_first_not_of(" \t", colon + 1);
+                response.headers[name] = start == std::string::npos ? std::string() : line.substr(start);
+            }
+        } while (response.status == 100);
+        
+        std::string connectionHeader = response.header("connection");
+        for (auto& c : connectionHeader) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        keepAlive = connectionHeader != "close";
+        if (response.header("transfer-encoding").find("chunked") != std::string::npos) {
+            while (true) {
+                const size_t size = std::strtoull(readLine().c_str(), nullptr, 16);
+                if (size == 0) break;
+                readExact(response.body, size);
+                readLine();
+            }
+            while (!readLine().empty()) {}  // trailers
+        } else if (const auto length = response.header("content-length"); !length.empty()) {
+            readExact(response.body, std::strtoull(length.c_str(), nullptr, 10));
+        } else if (response.status != 204 && response.status != 304) {
+            // Delimited by the end of the connection
+            char chunk[16384];
+            while (const size_t n = readSome(chunk, sizeof(chunk))) response.body.append(chunk, n);
+            keepAlive = false;
+        }
+        return response;
+    }
+    
+    bool reusable() const { return keepAlive && fd >= 0; }
+    
+private:
+    void close() {
+        if (ssl) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    
+    void writeAll(const void* data, size_t len) {
+        const auto* bytes = static_cast<const char*>(data);
+        while (len > 0) {
+            const ssize_t n = ssl ? SSL_write(ssl, bytes, static_cast<int>(std::min<size_t>(len, INT_MAX)))
+                                  : ::send(fd, bytes, len, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (!ssl && n < 0 && errno == EINTR) continue;
+                keepAlive = false;
+                throw std::runtime_error(std::string("HTTP send failed: ") + (ssl ? "TLS error" : std::strerror(errno)));
+            }
+            bytes += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+    
+    // 0 at the end of the connection
+    size_t readSome(char* out, size_t capacity) {
+        while (true) {
+            const ssize_t n = ssl ? SSL_read(ssl, out, static_cast<int>(std::min<size_t>(capacity, INT_MAX)))
+                                  : ::recv(fd, out, capacity, 0);
+            if (n > 0) return static_cast<size_t>(n);
+            if (n == 0 || (ssl && SSL_get_error(ssl, static_cast<int>(n)) == SSL_ERROR_ZERO_RETURN)) return 0;
+            if (!ssl && errno == EINTR) continue;
+            keepAlive = false;
+            throw std::runtime_error(std::string("HTTP receive failed: ") + (ssl ? "TLS error" : std::strerror(errno)));
+        }
+    }
+    
+    bool fill() {
+        char chunk[16384];
+        const size_t n = readSome(chunk, sizeof(chunk));
+        pending.append(chunk, n);
+        return n > 0;
+    }
+    
+    std::string readLine() {
+        size_t end;
+        while ((end = pending.find("\r\n")) == std::string::npos) {
+            if (!fill()) throw std::runtime_error("HTTP connection closed mid-response");
+        }
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 2);
+        return line;
+    }
+    
+    void readExact(std::string& out, size_t len) {
+        while (pending.size() < len) {
+            if (!fill()) throw std::runtime_error("HTTP connection closed mid-response");
+        }
+        out.append(pending, 0, len);
+        pending.erase(0, len);
+    }
+};
+
+// Client for S3-compatible object stores (AWS S3, MinIO, Ceph RGW, R2, ...):
+// SigV4-signed PUT, multipart upload and DELETE over keep-alive connections
+// pooled across threads, with retries and backoff on transient failures.
+// Parts are uploaded on a few background threads, so an archive keeps being
+// compressed while its earlier parts are on the wire.
+class ObjectStore {
+private:
+    using Clock = std::chrono::steady_clock;
+    
+    static constexpr int MAX_ATTEMPTS = 4;
+    static constexpr auto FIRST_BACKOFF = std::chrono::milliseconds(200);
+    
+    struct Request {
+        const char* method = "GET";
+        std::string key;
+        std::vector<std::pair<std::string, std::string>> query;    // unencoded
+        std::vector<std::pair<std::string, std::string>> headers;  // lower-case names, all signed
+        std::span<const unsigned char> body;
+    };
+    
+    std::string outputUrl;
+    std::string bucket;
+    std::string prefix;  // "" or ending in '/'
+    std::string region;
+    std::string host;  // Host header, with the port when it isn't the scheme's
+    std::string connectHost;
+    std::string port;
+    std::string basePath;  // "/bucket/" path-style, "/" virtual-hosted
+    std::string accessKey;
+    std::string secretKey;
+    std::string sessionToken;
+    size_t partBytes = 0;
+    SSL_CTX* tls = nullptr;
+    
+    std::mutex idleMutex;
+    std::vector<std::unique_ptr<HttpConnection>> idle;
+    
+    std::mutex jobsMutex;
+    std::condition_variable jobReady;
+    std::deque<std::packaged_task<std::string()>> jobs;
+    std::vector<std::thread> uploaders;
+    bool stopping = false;
+    
+    std::atomic<uint64_t> objects{0};
+    std::atomic<uint64_t> multipart{0};
+    std::atomic<uint64_t> parts{0};
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> retries{0};
+    std::atomic<uint64_t> aborted{0};
+    
+public:
+    // The store ZIPPER_OUTPUT_URL names; null when it is unset or unusable,
+    // with the reason on stderr
+    static ObjectStore* global() {
+        static const std::unique_ptr<ObjectStore> store = create();
+        return store.get();
+    }
+    
+    ~ObjectStore() {
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto& uploader : uploaders) {
+            uploader.join();
+        }
+        idle.clear();
+        if (tls) SSL_CTX_free(tls);
+    }
+    
+    ObjectStore(const ObjectStore&) = delete;
+    ObjectStore& operator=(const ObjectStore&) = delete;
+    
+    // S3 numbers parts 1-10000 and takes up to 5GB in each. An archive is
+    // planned in at most PLANNED_PARTS; the rest are for one that outgrows
+    // its size hint.
+    static constexpr int MAX_PARTS = 10000;
+    static constexpr int PLANNED_PARTS = 9000;
+    static constexpr size_t MAX_PART_BYTES = 5ull * 1024 * 1024 * 1024;
+    
+    const std::string& url() const { return outputUrl; }
+    size_t partSize() const { return partBytes; }
+    
+    // The configured part size, raised to whole MB so that an archive of
+    // about sizeHint bytes fits in PLANNED_PARTS
+    size_t partSizeFor(uint64_t sizeHint) const {
+        constexpr uint64_t MB = 1024 * 1024;
+        const uint64_t needed = (sizeHint + PLANNED_PARTS - 1) / PLANNED_PARTS;
+        return static_cast<size_t>(std::clamp<uint64_t>((needed + MB - 1) / MB * MB, partBytes, MAX_PART_BYTES));
+    }
+    
+    // Object key for a path relative to the output folder
+    std::string keyFor(const std::string& relative) const { return prefix + relative; }
+    
+    void putObject(const std::string& key, std::span<const unsigned char> data, const char* contentType) {
+        Request request;
+        request.method = "PUT";
+        request.key = key;
+        request.headers = {{"content-type", contentType}};
+        request.body = data;
+        expectOk(perform(request), "PUT " + key);
+        objects.fetch_add(1, std::memory_order_relaxed);
+        bytesSent.fetch_add(data.size(), std::memory_order_relaxed);
+    }
+    
+    std::string createUpload(const std::string& key, const char* contentType) {
+        Request request;
+        request.method = "POST";
+        request.key = key;
+        request.query = {{"uploads", ""}};
+        request.headers = {{"content-type", contentType}};
+        const auto response = perform(request);
+        expectOk(response, "multipart upload of " + key);
+        auto uploadId = xmlField(response.body, "UploadId");
+        if (uploadId.empty()) throw std::runtime_error("No UploadId for " + key);
+        return uploadId;
+    }
+    
+    // Returns the part's ETag
+    std::string uploadPart(const std::string& key, const std::string& uploadId, int number,
+                           std::span<const unsigned char> data) {
+        Request request;
+        request.method = "PUT";
+        request.key = key;
+        request.query = {{"partNumber", std::to_string(number)}, {"uploadId", uploadId}};
+        request.body = data;
+        const auto response = perform(request);
+        expectOk(response, "part " + std::to_string(number) + " of " + key);
+        auto etag = response.header("etag");
+        if (etag.empty()) throw std::runtime_error("No ETag for part " + std::to_string(number) + " of " + key);
+        parts.fetch_add(1, std::memory_order_relaxed);
+        bytesSent.fetch_add(data.size(), std::memory_order_relaxed);
+        return etag;
+    }
+    
+    void completeUpload(const std::string& key, const std::string& uploadId, const std::vector<std::string>& etags) {
+        std::string xml = "<CompleteMultipartUpload>";
+        for (size_t i = 0; i < etags.size(); ++i) {
+            xml += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+        }
+        xml += "</CompleteMultipartUpload>";
+        
+        Request request;
+        request.method = "POST";
+        request.key = key;
+        request.query = {{"uploadId", uploadId}};
+        request.headers = {{"content-type", "application/xml"}};
+        request.body = {reinterpret_cast<const unsigned char*>(xml.data()), xml.size()};
+        const auto response = perform(request);
+        // S3 can fail a completion after it has sent 200
+        if (response.body.find("<Error>") != std::string::npos) {
+            throw std::runtime_error("Completing " + key + " failed: " + xmlField(response.body, "Code") + " " +
+                                     xmlField(response.body, "Message"));
+        }
+        expectOk(response, "completing " + key);
+        objects.fetch_add(1, std::memory_order_relaxed);
+        multipart.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // Best effort; a lifecycle rule can sweep uploads that were never aborted
+    void abortUpload(const std::string& key, const std::string& uploadId) noexcept {
+        try {
+            Request request;
+            request.method = "DELETE";
+            request.key = key;
+            request.query = {{"uploadId", uploadId}};
+            (void)perform(request);
+            aborted.fetch_add(1, std::memory_order_relaxed);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: could not abort the upload of " << key << ": " << e.what() << '\n';
+        }
+    }
+    
+    void deleteObject(const std::string& key) {
+        Request request;
+        request.method = "DELETE";
+        request.key = key;
+        const auto response = perform(request);
+        if (response.status != 404) expectOk(response, "DELETE " + key);
+    }
+    
+    // Run a request on an upload thread
+    std::future<std::string> submit(std::function<std::string()> job) {
+        std::packaged_task<std::string()> task(std::move(job));
+        auto result = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            jobs.push_back(std::move(task));
+        }
+        jobReady.notify_one();
+        return result;
+    }
+    
+    void display() const {
+        console() << "\n=== Object Storage ===\n";
+        console() << "Uploaded: " << objects.load() << " objects (" << multipart.load() << " multipart, "
+                  << parts.load() << " parts), " << std::fixed << std::setprecision(1)
+                  << static_cast<double>(bytesSent.load()) / (1024.0 * 1024.0) << " MB to " << outputUrl << '\n';
+        const auto retried = retries.load();
+        const auto dropped = aborted.load();
+        if (retried > 0 || dropped > 0) {
+            console() << "Retried requests: " << retried << ", aborted uploads: " << dropped << '\n';
+        }
+    }
+    
+private:
+    ObjectStore() = default;
+    
+    static std::unique_ptr<ObjectStore> create() {
+        const auto url = Config::getOutputUrl();
+        if (url.empty()) return nullptr;
+        
+        std::unique_ptr<ObjectStore> store(new ObjectStore());
+        store->outputUrl = url;
+        constexpr std::string_view scheme = "s3://";
+        const std::string_view location = std::string_view(url).substr(std::min(url.size(), scheme.size()));
+        const auto slash = location.find('/');
+        store->bucket = std::string(location.substr(0, slash));
+        if (url.compare(0, scheme.size(), scheme) != 0 || store->bucket.empty()) {
+            std::cerr << "ZIPPER_OUTPUT_URL must look like s3://bucket/prefix, got " << url << '\n';
+            return nullptr;
+        }
+        if (slash != std::string_view::npos) {
+            store->prefix = std::string(location.substr(slash + 1));
+            if (!store->prefix.empty() && store->prefix.back() != '/') store->prefix += '/';
+        }
+        
+        const char* access = Config::lookup("AWS_ACCESS_KEY_ID");
+        const char* secret = Config::lookup("AWS_SECRET_ACCESS_KEY");
+        if (!access || !*access || !secret || !*secret) {
+            std::cerr << "Uploading to " << url << " needs AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY\n";
+            return nullptr;
+        }
+        store->accessKey = access;
+        store->secretKey = secret;
+        if (const char* token = Config::lookup("AWS_SESSION_TOKEN")) store->sessionToken = token;
+        store->region = Config::getS3Region();
+        store->partBytes = Config::getS3PartSize();
+        
+        // Custom endpoints get path-style addressing, which every S3 clone speaks
+        std::string endpoint = Config::getS3Endpoint();
+        bool secure = true;
+        if (endpoint.empty()) {
+            store->connectHost = store->bucket + ".s3." + store->region + ".amazonaws.com";
+            store->basePath = "/";
+        } else {
+            if (endpoint.compare(0, 7, "http://") == 0) {
+                secure = false;
+                endpoint.erase(0, 7);
+            } else if (endpoint.compare(0, 8, "https://") == 0) {
+                endpoint.erase(0, 8);
+            }
+            while (!endpoint.empty() && endpoint.back() == '/') endpoint.pop_back();
+            store->connectHost = endpoint;
+            store->basePath = "/" + store->bucket + "/";
+        }
+        store->port = secure ? "443" : "80";
+        store->host = store->connectHost;
+        if (const auto colon = store->connectHost.rfind(':');
+            colon != std::string::npos && store->connectHost.find(']', colon) == std::string::npos) {
+            store->port = store->connectHost.substr(colon + 1);
+            store->connectHost.erase(colon);
+            if (store->port == (secure ? "443" : "80")) store->host = store->connectHost;
+        }
+        if (store->connectHost.size() > 2 && store->connectHost.front() == '[') {
+            store->connectHost = store->connectHost.substr(1, store->connectHost.size() - 2);
+        }
+        
+        if (secure) {
+            store->tls = SSL_CTX_new(TLS_client_method());
+            if (!store->tls || SSL_CTX_set_default_verify_paths(store->tls) != 1) {
+                std::cerr << "Cannot set up TLS for " << url << '\n';
+                return nullptr;
+            }
+            SSL_CTX_set_verify(store->tls, SSL_VERIFY_PEER, nullptr);
+            SSL_CTX_set_min_proto_version(store->tls, TLS1_2_VERSION);
+        }
+        
+        // A peer hanging up mid-request is an error to retry, not a reason to exit
+        std::signal(SIGPIPE, SIG_IGN);
+        
+        const size_t threads = Config::getS3Uploads();
+        store->uploaders.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            store->uploaders.emplace_back([raw = store.get()]() { raw->run(); });
+        }
+        return store;
+    }
+    
+    void run() {
+        while (true) {
+            std::packaged_task<std::string()> task;
+            {
+                std::unique_lock<std::mutex> lock(jobsMutex);
+                jobReady.wait(lock, [&] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                task = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            task();
+        }
+    }
+    
+    HttpConnection::Response perform(const Request& request) {
+        auto backoff = std::chrono::duration_cast<Clock::duration>(FIRST_BACKOFF);
+        for (int attempt = 1;; ++attempt) {
+            try {
+                auto connection = borrow();
+                auto response = connection->send(signedHead(request), request.body);
+                if (connection->reusable()) giveBack(std::move(connection));
+                const bool transient = response.status >= 500 || response.status == 429 || response.status == 408;
+                if (!transient || attempt == MAX_ATTEMPTS) return response;
+            } catch (const std::runtime_error&) {
+                if (attempt == MAX_ATTEMPTS) throw;
+            }
+            retries.fetch_add(1, std::memory_order_relaxed);
+            std::this_thread::sleep_for(backoff);
+            backoff *= 2;
+        }
+    }
+    
+    std::unique_ptr<HttpConnection> borrow() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            if (!idle.empty()) {
+                auto connection = std::move(idle.back());
+                idle.pop_back();
+                return connection;
+            }
+        }
+        return std::make_unique<HttpConnection>(connectHost, port, tls);
+    }
+    
+    void giveBack(std::unique_ptr<HttpConnection> connection) {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        idle.push_back(std::move(connection));
+    }
+    
+    // Request line and headers, signed with AWS Signature Version 4
+    std::string signedHead(const Request& request) const {
+        const auto path = basePath + uriEncode(request.key, false);
+        
+        auto query = request.query;
+        for (auto& [name, value] : query) {
+            name = uriEncode(name, true);
+            value = uriEncode(value, true);
+        }
+        std::sort(query.begin(), query.end());
+        std::string canonicalQuery;
+        for (const auto& [name, value] : query) {
+            if (!canonicalQuery.empty()) canonicalQuery += '&';
+            canonicalQuery += name + '=' + value;
+        }
+        
+        // TLS already protects the body, so it isn't hashed a second time
+        const std::string payloadHash = tls ? "UNSIGNED-PAYLOAD" : hex(sha256(request.body));
+        
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        struct tm utc{};
+        gmtime_r(&now, &utc);
+        char amzDate[17];
+        std::strftime(amzDate, sizeof(amzDate), "%Y%m%dT%H%M%SZ", &utc);
+        const std::string day(amzDate, 8);
+        
+        auto headers = request.headers;
+        headers.emplace_back("host", host);
+        headers.emplace_back("x-amz-content-sha256", payloadHash);
+        headers.emplace_back("x-amz-date", amzDate);
+        if (!sessionToken.empty()) headers.emplace_back("x-amz-security-token", sessionToken);
+        std::sort(headers.begin(), headers.end());
+        
+        std::string canonicalHeaders;
+        std::string signedHeaders;
+        for (const auto& [name, value] : headers) {
+            canonicalHeaders += name + ':' + value + '\n';
+            if (!signedHeaders.empty()) signedHeaders += ';';
+            signedHeaders += name;
+        }
+        const std::string canonicalRequest = std::string(request.method) + '\n' + path + '\n' + canonicalQuery + '\n' +
+                                             canonicalHeaders + '\n' + signedHeaders + '\n' + payloadHash;
+        
+        const std::string scope = day + '/' + region + "/s3/aws4_request";
+        const std::string stringToSign = "AWS4-HMAC-SHA256\n" + std::string(amzDate) + '\n' + scope + '\n' +
+                                         hex(sha256(asBytes(canonicalRequest)));
+        auto key = hmac(asBytes("AWS4" + secretKey), day);
+        key = hmac(key, region);
+        key = hmac(key, "s3");
+        key = hmac(key, "aws4_request");
+        const auto signature = hex(hmac(key, stringToSign));
+        
+        std::string head = std::string(request.method) + ' ' + path;
+        if (!canonicalQuery.empty()) head += '?' + canonicalQuery;
+        head += " HTTP/1.1\r\n";
+        for (const auto& [name, value] : headers) {
+            head += name + ": " + value + "\r\n";
+        }
+        head += "authorization: AWS4-HMAC-SHA256 Credential=" + accessKey + '/' + scope + ", SignedHeaders=" +
+                signedHeaders + ", Signature=" + signature + "\r\n";
+        head += "content-length: " + std::to_string(request.body.size()) + "\r\n\r\n";
+        return head;
+    }
+    
+    static void expectOk(const HttpConnection::Response& response, const std::string& what) {
+        if (response.status >= 200 && response.status < 300) return;
+        std::string message = "Object store " + what + " failed: HTTP " + std::to_string(response.status);
+        if (const auto code = xmlField(response.body, "Code"); !code.empty()) message += " " + code;
+        if (const auto detail = xmlField(response.body, "Message"); !detail.empty()) message += ": " + detail;
+        throw std::runtime_error(message);
+    }
+    
+    static std::string xmlField(const std::string& xml, const std::string& name) {
+        const auto start = xml.find('<' + name + '>');
+        if (start == std::string::npos) return {};
+        const auto from = start + name.size() + 2;
+        const auto end = xml.find("</" + name + '>', from);
+        return end == std::string::npos ? std::string() : xml.substr(from, end - from);
+    }
+    
+    // RFC 3986 unreserved characters stay; '/' too in paths
+    static std::string uriEncode(std::string_view text, bool slash) {
+        static constexpr char DIGITS[] = "0123456789ABCDEF";
+        std::string encoded;
+        encoded.reserve(text.size());
+        for (const char c : text) {
+            const auto byte = static_cast<unsigned char>(c);
+            if (std::isalnum(byte) || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && !slash)) {
+                encoded += c;
+            } else {
+                encoded += '%';
+                encoded += DIGITS[byte >> 4];
+                encoded += DIGITS[byte & 0x0F];
+            }
+        }
+        return encoded;
+    }
+    
+    using Digest = std::array<unsigned char, 32>;
+    
+    static std::span<const unsigned char> asBytes(std::string_view text) {
+        return {reinterpret_cast<const unsigned char*>(text.data()), text.size()};
+    }
+    
+    static Digest sha256(std::span<const unsigned char> data) {
+        Digest digest{};
+        size_t length = 0;
+        if (EVP_Q_digest(nullptr, "SHA256", nullptr, data.data(), data.size(), digest.data(), &length) != 1) {
+            throw std::runtime_error("SHA-256 failed");
+        }
+        return digest;
+    }
+    
+    static Digest hmac(std::span<const unsigned char> key, std::string_view data) {
+        Digest digest{};
+        size_t length = 0;
+        if (!EVP_Q_mac(nullptr, "HMAC", nullptr, "SHA256", nullptr, key.data(), key.size(),
+                       reinterpret_cast<const unsigned char*>(data.data()), data.size(), digest.data(), digest.size(),
+                       &length)) {
+            throw std::runtime_error("HMAC-SHA256 failed");
+        }
+        return digest;
+    }
+    
+    static std::string hex(const Digest& digest) {
+        static constexpr char DIGITS[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(digest.size() * 2);
+        for (const auto byte : digest) {
+            out += DIGITS[byte >> 4];
+            out += DIGITS[byte & 0x0F];
+        }
+        return out;
+    }
+};
+
+// Streams an archive into the object store. Bytes collect in part-sized
+// buffers and each full one is uploaded on the store's threads while the next
+// fills, so at commit only the last part is left to send. An archive that
+// fits in one part goes up as a single PUT. Nothing is visible under the key
+// before commit, and an upload that is given up on is aborted.
+class S3MultipartSink final : public OutputSink {
+private:
+    struct Part {
+        std::vector<unsigned char> data;
+        MemoryBudget::Lease lease;
+    };
+    
+    struct Upload {
+        std::future<std::string> etag;
+        Part part;  // kept until the request is done with it
+    };
+    
+    ObjectStore& store;
+    const std::string key;
+    size_t partSize;
+    size_t plannedParts;  // what the size hint needs; past them the parts grow
+    const size_t maxInFlight;
+    std::string uploadId;
+    Part current;
+    std::deque<Upload> inFlight;
+    std::vector<std::string> etags;
+    bool committed = false;
+    
+public:
+    // sizeHint sets the part size, so a large archive stays within S3's part
+    // limit, and bounds the first part's buffer, so a small archive doesn't
+    // reserve a whole part of the memory budget
+    S3MultipartSink(ObjectStore& objectStore, std::string objectKey, uint64_t sizeHint)
+        : store(objectStore), key(std::move(objectKey)), partSize(objectStore.partSizeFor(sizeHint)),
+          plannedParts(static_cast<size_t>((sizeHint + partSize - 1) / partSize)),
+          maxInFlight(Config::getS3Uploads()) {
+        const auto first = static_cast<size_t>(std::min<uint64_t>(partSize, std::max<uint64_t>(sizeHint, 1)));
+        current.lease = MemoryBudget::global().reserve(first);
+        current.data.reserve(first);
+    }
+    
+    ~S3MultipartSink() override {
+        if (committed) return;
+        for (auto& upload : inFlight) {
+            if (upload.etag.valid()) upload.etag.wait();  // a failed part's error was already taken
+        }
+        if (!uploadId.empty()) store.abortUpload(key, uploadId);
+    }
+    
+    void write(const void* data, size_t len) override {
+        const StageTimers::Scope timer(StageTimers::Stage::Write);
+        StageTimers::global().addBytes(StageTimers::Stage::Write, len);
+        const auto* src = static_cast<const unsigned char*>(data);
+        while (len > 0) {
+            const size_t n = std::min(len, partSize - current.data.size());
+            current.data.insert(current.data.end(), src, src + n);
+            src += n;
+            len -= n;
+            if (current.data.size() == partSize) {
+                send();
+                current = nextBuffer();
+            }
+        }
+    }
+    
+    void commit() override {
+        const StageTimers::Scope timer(StageTimers::Stage::Close);
+        if (uploadId.empty()) {
+            store.putObject(key, current.data, "application/zip");
+        } else {
+            if (!current.data.empty()) send();
+            while (!inFlight.empty()) {
+                etags.push_back(inFlight.front().etag.get());
+                inFlight.pop_front();
+            }
+            store.completeUpload(key, uploadId, etags);
+        }
+        committed = true;
+    }
+    
+private:
+    void send() {
+        const int number = static_cast<int>(etags.size() + inFlight.size() + 1);
+        if (number > ObjectStore::MAX_PARTS) {
+            throw std::runtime_error("archive needs more than " + std::to_string(ObjectStore::MAX_PARTS) + " parts");
+        }
+        if (uploadId.empty()) uploadId = store.createUpload(key, "application/zip");
+        // Past its hint the archive could be any size: double the parts every
+        // hundred, which reaches over 40TB from 8MB parts before the limit
+        if (static_cast<size_t>(number) > plannedParts && number % 100 == 0) {
+            partSize = std::min(partSize * 2, ObjectStore::MAX_PART_BYTES);
+        }
+        const std::span<const unsigned char> bytes(current.data.data(), current.data.size());
+        auto etag = store.submit([&objectStore = store, name = key, id = uploadId, number, bytes]() {
+            return objectStore.uploadPart(name, id, number, bytes);
+        });
+        inFlight.push_back({std::move(etag), std::move(current)});
+    }
+    
+    // A fresh buffer while the budget and the in-flight limit allow,
+    // otherwise the oldest part's once its upload is done
+    Part nextBuffer() {
+        if (inFlight.size() < maxInFlight) {
+            if (auto lease = MemoryBudget::global().tryPin(partSize)) {
+                Part part;
+                part.lease = std::move(*lease);
+                part.data.reserve(partSize);
+                return part;
+            }
+        }
+        auto& oldest = inFlight.front();
+        etags.push_back(oldest.etag.get());
+        Part part = std::move(oldest.part);
+        inFlight.pop_front();
+        part.data.clear();
+        if (part.data.capacity() < partSize) {
+            // The parts grew; a larger lease if it is free, else the old one stands
+            if (auto lease = MemoryBudget::global().tryPin(partSize)) part.lease = std::move(*lease);
+            part.data.reserve(partSize);
+        }
+        return part;
+    }
+};
+
+// Where a zipper's archives go: its output folder, or with ZIPPER_OUTPUT_URL
+// an object store, keyed by their path under the output folder. The folder
+// keeps the manifest and files-list.json either way; the listing is also
+// uploaded so whatever reads the archives finds it beside them.
+class OutputTarget {
+private:
+    const fs::path folder;
+    const bool wanted;
+    ObjectStore* const store;
+    
+public:
+    explicit OutputTarget(fs::path outputFolder)
+        : folder(std::move(outputFolder)), wanted(!Config::getOutputUrl().empty()),
+          store(wanted ? ObjectStore::global() : nullptr) {}
+    
+    bool remote() const { return store != nullptr; }
+    
+    // Memory a sink holds before any of the archive is out
+    size_t bufferBytes(uint64_t sizeHint) const {
+        return store ? static_cast<size_t>(std::min<uint64_t>(store->partSizeFor(sizeHint), sizeHint)) : 0;
+    }
+    
+    // False when an object store was asked for but can't be used
+    bool usable() const { return !wanted || store; }
+    
+    std::unique_ptr<OutputSink> open(const fs::path& output, uint64_t sizeHint) const {
+        if (store) return std::make_unique<S3MultipartSink>(*store, keyFor(output), sizeHint);
+        return std::make_unique<LocalFileSink>(output, sizeHint);
+    }
+    
+    void remove(const fs::path& output) const {
+        if (!store) {
+            std::error_code ec;
+            fs::remove(output, ec);
+            return;
+        }
+        try {
+            store->deleteObject(keyFor(output));
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: " << e.what() << '\n';
+        }
+    }
+    
+    // Upload a file from the output folder under its own key
+    void publish(const fs::path& file, const char* contentType) const {
+        if (!store) return;
+        try {
+            std::ifstream in(file, std::ios::binary);
+            if (!in.is_open()) throw std::runtime_error("Cannot read " + file.string());
+            const std::vector<unsigned char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            store->putObject(keyFor(file), data, contentType);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: " << e.what() << '\n';
+        }
+    }
+    
+    void display() const {
+        if (store) store->display();
+    }
+    
+private:
+    std::string keyFor(const fs::path& output) const {
+        return store->keyFor(output.lexically_relative(folder).generic_string());
+    }
+};
+
+// Minimal streaming ZIP writer for WinZip-AES entries. Sizes and CRC go into
+// a data descriptor after each entry, so nothing has to be seeked back over
+// and the output can be produced strictly front to back. Zip64 records are
+// emitted for entries or archives past the 4GB limits.
+class ZipStreamWriter {
+public:
+    struct EntryInfo {
+        std::string name;
+        time_t mtime = 0;
+        uint16_t method = ZIP_CM_DEFLATE;   // actual method inside the AES layer
+        uint32_t mode = 0644;
+        uint64_t expectedSize = 0;          // decides zip64 and AE-1 vs AE-2 up front
+    };
+    
+private:
+    static constexpr uint16_t METHOD_WINZIP_AES = 99;
+    static constexpr uint16_t VERSION_NEEDED_AES = 51;
+    static constexpr uint16_t VERSION_NEEDED_ZIP64 = 45;
+    static constexpr uint16_t VERSION_MADE_BY = (3 << 8) | 63;  // Unix, spec 6.3
+    static constexpr uint16_t FLAG_ENCRYPTED = 0x0001;
+    static constexpr uint16_t FLAG_DATA_DESCRIPTOR = 0x0008;
+    static constexpr uint16_t FLAG_UTF8 = 0x0800;
+    static constexpr uint32_t MAX_32 = 0xFFFFFFFFu;
+    static constexpr uint64_t ZIP64_ENTRY_THRESHOLD = 0xFFFF0000ull;  // headroom for deflate expansion
+    static constexpr uint64_t AE2_SIZE_LIMIT = 20;  // tiny entries hide their CRC (AE-2)
+    
+    struct CentralEntry {
+        EntryInfo info;
+        uint16_t dosTime = 0;
+        uint16_t dosDate = 0;
+        uint16_t aesVersion = 1;
+        bool zip64 = false;
+        uint32_t crc = 0;
+        uint64_t compressedSize = 0;
+        uint64_t uncompressedSize = 0;
+        uint64_t localHeaderOffset = 0;
+    };
+    
+    std::unique_ptr<OutputSink> output;
+    uint64_t offset = 0;
+    uint64_t entryDataStart = 0;
+    bool entryOpen = false;
+    std::vector<CentralEntry> entries;
+    
+public:
+    explicit ZipStreamWriter(std::unique_ptr<OutputSink> sink) : output(std::move(sink)) {}
+    
+    ZipStreamWriter(const ZipStreamWriter&) = delete;
+    ZipStreamWriter& operator=(const ZipStreamWriter&) = delete;
+    
+    void beginEntry(const EntryInfo& info) {
+        if (entryOpen) throw std::logic_error("Previous zip entry not finished");
+        
+        CentralEntry entry;
+        entry.info = info;
+        entry.zip64 = info.expectedSize >= ZIP64_ENTRY_THRESHOLD;
+        entry.aesVersion = info.expectedSize < AE2_SIZE_LIMIT ? 2 : 1;
+        entry.localHeaderOffset = offset;
+        toDosTime(info.mtime, entry.dosTime, entry.dosDate);
+        
+        std::vector<unsigned char> header;
+        header.reserve(64 + info.name.size());
+        put32(header, 0x04034b50);
+        put16(header, VERSION_NEEDED_AES);
+        put16(header, FLAG_ENCRYPTED | FLAG_DATA_DESCRIPTOR | FLAG_UTF8);
+        put16(header, METHOD_WINZIP_AES);
+        put16(header, entry.dosTime);
+        put16(header, entry.dosDate);
+        put32(header, 0);                                   // CRC in descriptor
+        put32(header, entry.zip64 ? MAX_32 : 0);            // compressed size in descriptor
+        put32(header, entry.zip64 ? MAX_32 : 0);            // uncompressed size in descriptor
+        put16(header, static_cast<uint16_t>(info.name.size()));
+        put16(header, static_cast<uint16_t>((entry.zip64 ? 20 : 0) + 11));
+        header.insert(header.end(), info.name.begin(), info.name.end());
+        if (entry.zip64) {
+            put16(header, 0x0001);
+            put16(header, 16);
+            put64(header, 0);
+            put64(header, 0);
+        }
+        putAesExtra(header, entry);
+        
+        writeAll(header.data(), header.size());
+        entryDataStart = offset;
+        entries.push_back(std::move(entry));
+        entryOpen = true;
+    }
+    
+    void write(const void* data, size_t len) {
+        writeAll(data, len);
+    }
+    
+    void endEntry(uint32_t crc, uint64_t uncompressedSize) {
+        if (!entryOpen) throw std::logic_error("No zip entry in progress");
+        
+        auto& entry = entries.back();
+        entry.crc = entry.aesVersion == 2 ? 0 : crc;
+        entry.compressedSize = offset - entryDataStart;
+        entry.uncompressedSize = uncompressedSize;
+        if (!entry.zip64 && (entry.compressedSize >= MAX_32 || uncompressedSize >= MAX_32)) {
+            throw std::runtime_error("Entry grew past 4GB without zip64 headers: " + entry.info.name);
+        }
+        
+        std::vector<unsigned char> descriptor;
+        put32(descriptor, 0x08074b50);
+        put32(descriptor, entry.crc);
+        if (entry.zip64) {
+            put64(descriptor, entry.compressedSize);
+            put64(descriptor, entry.uncompressedSize);
+        } else {
+            put32(descriptor, static_cast<uint32_t>(entry.compressedSize));
+            put32(descriptor, static_cast<uint32_t>(entry.uncompressedSize));
+        }
+        writeAll(descriptor.data(), descriptor.size());
+        entryOpen = false;
+    }
+    
+    // Write the central directory and commit the output
+    void finish() {
+        if (entryOpen) throw std::logic_error("Zip entry still in progress");
+        
+        const uint64_t centralStart = offset;
+        for (const auto& entry : entries) {
+            writeCentralHeader(entry);
+        }
+        const uint64_t centralSize = offset - centralStart;
+        const uint64_t count = entries.size();
+        
+        std::vector<unsigned char> tail;
+        const bool zip64 = count >= 0xFFFF || centralStart >= MAX_32 || centralSize >= MAX_32;
+        if (zip64) {
+            const uint64_t recordOffset = offset;
+            put32(tail, 0x06064b50);
+            put64(tail, 44);
+            put16(tail, VERSION_MADE_BY);
+            put16(tail, VERSION_NEEDED_ZIP64);
+            put32(tail, 0);
+            put32(tail, 0);
+            put64(tail, count);
+            put64(tail, count);
+            put64(tail, centralSize);
+            put64(tail, centralStart);
+            
+            put32(tail, 0x07064b50);
+            put32(tail, 0);
+            put64(tail, recordOffset);
+            put32(tail, 1);
+        }
+        
+        put32(tail, 0x06054b50);
+        put16(tail, 0);
+        put16(tail, 0);
+        put16(tail, static_cast<uint16_t>(std::min<uint64_t>(count, 0xFFFF)));
+        put16(tail, static_cast<uint16_t>(std::min<uint64_t>(count, 0xFFFF)));
+        put32(tail, static_cast<uint32_t>(std::min<uint64_t>(centralSize, MAX_32)));
+        put32(tail, static_cast<uint32_t>(std::min<uint64_t>(centralStart, MAX_32)));
+        put16(tail, 0);
+        writeAll(tail.data(), tail.size());
+        output->commit();
+    }
+    
+    uint64_t bytesWritten() const { return offset; }
+    bool inEntry() const { return entryOpen; }
+    
+private:
+    void writeCentralHeader(const CentralEntry& entry) {
+        const bool bigUncompressed = entry.uncompressedSize >= MAX_32;
+        const bool bigCompressed = entry.compressedSize >= MAX_32;
+        const bool bigOffset = entry.localHeaderOffset >= MAX_32;
+        const uint16_t zip64Len = static_cast<uint16_t>(8 * (bigUncompressed + bigCompressed + bigOffset));
+        
+        std::vector<unsigned char> header;
+        header.reserve(80 + entry.info.name.size());
+        put32(header, 0x02014b50);
+        put16(header, VERSION_MADE_BY);
+        put16(header, VERSION_NEEDED_AES);
+        put16(header, FLAG_ENCRYPTED | FLAG_DATA_DESCRIPTOR | FLAG_UTF8);
+        put16(header, METHOD_WINZIP_AES);
+        put16(header, entry.dosTime);
+        put16(header, entry.dosDate);
+        put32(header, entry.crc);
+        put32(header, bigCompressed ? MAX_32 : static_cast<uint32_t>(entry.compressedSize));
+        put32(header, bigUncompressed ? MAX_32 : static_cast<uint32_t>(entry.uncompressedSize));
+        put16(header, static_cast<uint16_t>(entry.info.name.size()));
+        put16(header, static_cast<uint16_t>((zip64Len ? zip64Len + 4 : 0) + 11));
+        put16(header, 0);                                   // comment
+        put16(header, 0);                                   // disk number
+        put16(header, 0);                                   // internal attributes
+        put32(header, (entry.info.mode | 0100000u) << 16);  // regular file, Unix mode
+        put32(header, bigOffset ? MAX_32 : static_cast<uint32_t>(entry.localHeaderOffset));
+        header.insert(header.end(), entry.info.name.begin(), entry.info.name.end());
+        if (zip64Len) {
+            put16(header, 0x0001);
+            put16(header, zip64Len);
+            if (bigUncompressed) put64(header, entry.uncompressedSize);
+            if (bigCompressed) put64(header, entry.compressedSize);
+            if (bigOffset) put64(header, entry.localHeaderOffset);
+        }
+        putAesExtra(header, entry);
+        writeAll(header.data(), header.size());
+    }
+    
+    static void putAesExtra(std::vector<unsigned char>& out, const CentralEntry& entry) {
+        put16(out, 0x9901);
+        put16(out, 7);
+        put16(out, entry.aesVersion);
+        out.push_back('A');
+        out.push_back('E');
+        out.push_back(WinZipAesEncryptor::AES_STRENGTH_256);
+        put16(out, entry.info.method);
+    }
+    
+    void writeAll(const void* data, size_t len) {
+        output->write(data, len);
+        offset += len;
+    }
+    
+    static void toDosTime(time_t t, uint16_t& dosTime, uint16_t& dosDate) {
+        struct tm tmv{};
+        localtime_r(&t, &tmv);
+        if (tmv.tm_year < 80) {
+            dosTime = 0;
+            dosDate = (1 << 5) | 1;  // 1980-01-01
+            return;
+        }
+        dosTime = static_cast<uint16_t>((tmv.tm_hour << 11) | (tmv.tm_min << 5) | (tmv.tm_sec / 2));
+        dosDate = static_cast<uint16_t>(((tmv.tm_year - 80) << 9) | ((tmv.tm_mon + 1) << 5) | tmv.tm_mday);
+    }
+    
+    static void put16(std::vector<unsigned char>& out, uint16_t v) {
+        out.push_back(static_cast<unsigned char>(v));
+        out.push_back(static_cast<unsigned char>(v >> 8));
+    }
+    
+    static void put32(std::vector<unsigned char>& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+    }
+    
+    static void put64(std::vector<unsigned char>& out, uint64_t v) {
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+    }
+};
+
+// Precomputes WinZip-AES key material on background threads so writers don't
+// pay PBKDF2 on their critical path. Each entry still gets its own random salt
+// and derived keys: WinZip-AES keys are salt-bound, and sharing one between
+// entries would reuse the CTR keystream. What is cached is the work, not keys.
+class AesKeyPool {
+private:
+    using Clock = std::chrono::steady_clock;
+    
+    struct PooledKey {
+        WinZipAesEncryptor::KeyMaterial keys;
+        std::chrono::nanoseconds cost;
+    };
+    
+    const std::string password;
+    const size_t capacity;
+    size_t remaining;
+    ThreadSafeStats& stats;
+    std::mutex mutex;
+    std::condition_variable spaceAvailable;
+    std::deque<PooledKey> ready;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    bool failed = false;  // a derivation threw; acquire() derives inline from then on
+    
+public:
+    // budget caps how many keys are precomputed so none are derived for nothing
+    AesKeyPool(std::string pwd, size_t workerCount, size_t maxReady, size_t budget, ThreadSafeStats& statistics)
+        : password(std::move(pwd)), capacity(std::max<size_t>(maxReady, 1)), remaining(budget), stats(statistics) {
+        workerCount = std::clamp<size_t>(workerCount, 1, std::max<size_t>(budget, 1));
+        workers.reserve(workerCount);
+        for (size_t i = 0; i < workerCount; ++i) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+    
+    ~AesKeyPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        spaceAvailable.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (auto& pooled : ready) {
+            OPENSSL_cleanse(&pooled.keys, sizeof(pooled.keys));
+        }
+    }
+    
+    AesKeyPool(const AesKeyPool&) = delete;
+    AesKeyPool& operator=(const AesKeyPool&) = delete;
+    
+    // Hand out a precomputed key, or derive one inline if the pool ran dry or
+    // stopped on an error; an inline derivation that fails throws to the caller
+    WinZipAesEncryptor::KeyMaterial acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ready.empty()) {
+                PooledKey pooled = ready.front();
+                OPENSSL_cleanse(&ready.front().keys, sizeof(pooled.keys));
+                ready.pop_front();
+                spaceAvailable.notify_one();
+                stats.recordPooledKey(pooled.cost);
+                return pooled.keys;
+            }
+        }
+        
+        return deriveTimed(password, stats);
+    }
+    
+    // Allow `keys` more to be precomputed, e.g. for the next batch of a watching run
+    void extend(size_t keys) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            remaining += keys;
+        }
+        spaceAvailable.notify_all();
+    }
+    
+    static WinZipAesEncryptor::KeyMaterial deriveTimed(const std::string& password, ThreadSafeStats& stats) {
+        const auto start = Clock::now();
+        auto keys = WinZipAesEncryptor::deriveKeys(password);
+        stats.recordInlineKey(Clock::now() - start);
+        return keys;
+    }
+    
+private:
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                spaceAvailable.wait(lock, [&] { return stopping || failed || (remaining > 0 && ready.size() < capacity); });
+                if (stopping || failed) return;
+                --remaining;
+            }
+            
+            PooledKey pooled{};
+            try {
+                const auto start = Clock::now();
+                pooled.keys = WinZipAesEncryptor::deriveKeys(password);
+                pooled.cost = Clock::now() - start;
+            } catch (const std::exception& e) {
+                // Thrown out of the thread it would terminate the process
+                OPENSSL_cleanse(&pooled.keys, sizeof(pooled.keys));
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (failed) return;
+                    failed = true;
+                }
+                spaceAvailable.notify_all();
+                std::cerr << "Warning: key precomputation stopped (" << e.what() << "); deriving keys per archive\n";
+                return;
+            }
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(pooled);
+            OPENSSL_cleanse(&pooled.keys, sizeof(pooled.keys));
+        }
+    }
+};
+
+// Pipelined archive writer: read -> deflate -> AES-CTR + HMAC -> write, each
+// stage on its own thread with bounded queues in between, so the crypto cost
+// of a long file overlaps its compression instead of adding to it. Deflate
+// runs as ordered block jobs, fanned out across threads for huge inputs.
+class PipelinedArchiveWriter {
+private:
+    static constexpr size_t QUEUE_DEPTH = 8;
+    
+    using Chunk = std::vector<unsigned char>;
+    using Block = BlockCodec::Block;
+    
+    // A block on its way to the output, with the budget it was read under.
+    // The lease is charged at the raw size and travels with the compressed
+    // and encrypted forms until the bytes are written.
+    struct Piece {
+        Chunk data;
+        MemoryBudget::Lease lease;
+    };
+    
+public:
+    // Most blocks one pipelined entry holds at once: three queues plus the
+    // deflate window of a fully parallel entry
+    static size_t maxBlocksInFlight(size_t deflateThreads) {
+        return 3 * QUEUE_DEPTH + std::max<size_t>(deflateThreads, 1) * 2;
+    }
+    
+    struct Options {
+        const BlockCodec* codec = &CodecRegistry::zlib();
+        int level = 9;              // 0 stores the data without compression
+        size_t blockSize = Config::PARALLEL_DEFLATE_BLOCK_SIZE;
+        size_t deflateThreads = 1;  // concurrent block jobs in the deflate stage
+        WorkStealingPool* pool = nullptr;  // runs those jobs; without it they run on the deflate thread
+        bool pipelined = true;      // false runs every stage on the calling thread
+        ContentHasher* hasher = nullptr;  // fed the input as it is read
+    };
+    
+    // Returns the archive's size
+    static uint64_t write(const fs::path& inputFile, const std::string& entryName, std::unique_ptr<OutputSink> output,
+                          const WinZipAesEncryptor::KeyMaterial& keys, const Options& options) {
+        ZipStreamWriter writer(std::move(output));
+        if (!options.pipelined) {
+            appendEntry(writer, inputFile, entryName, keys, options);
+            writer.finish();
+            return writer.bytesWritten();
+        }
+        
+        WinZipAesEncryptor encryptor(keys);
+        beginEntry(writer, inputFile, entryName, keys, options);
+        
+        BoundedQueue<Piece> rawQueue(QUEUE_DEPTH);
+        BoundedQueue<Piece> compressedQueue(QUEUE_DEPTH);
+        BoundedQueue<Piece> encryptedQueue(QUEUE_DEPTH);
+        const auto cancelAll = [&]() {
+            rawQueue.cancel();
+            compressedQueue.cancel();
+            encryptedQueue.cancel();
+        };
+        
+        uLong crc = crc32(0L, Z_NULL, 0);
+        uint64_t totalIn = 0;
+        
+        // Stage threads time their work against the file being written
+        auto* const file = StageTimers::current();
+        auto reader = std::async(std::launch::async, [&]() {
+            const StageTimers::Adopt adopt(file);
+            guardStage(cancelAll, [&]() { readStage(inputFile, options.blockSize, options.hasher, rawQueue); });
+        });
+        auto deflater = std::async(std::launch::async, [&]() {
+            const StageTimers::Adopt adopt(file);
+            guardStage(cancelAll, [&]() { deflateStage(options, rawQueue, compressedQueue, crc, totalIn); });
+        });
+        auto crypto = std::async(std::launch::async, [&]() {
+            const StageTimers::Adopt adopt(file);
+            guardStage(cancelAll, [&]() {
+                while (auto piece = compressedQueue.pop()) {
+                    encryptor.encrypt(piece->data.data(), piece->data.size());
+                    if (!encryptedQueue.push(std::move(*piece))) return;
+                }
+                encryptedQueue.close();
+            });
+        });
+        
+        try {
+            while (auto piece = encryptedQueue.pop()) {
+                writer.write(piece->data.data(), piece->data.size());
+            }
+        } catch (...) {
+            cancelAll();
+            reader.wait();
+            deflater.wait();
+            crypto.wait();
+            throw;
+        }
+        
+        // Surface the first stage failure, if any
+        reader.get();
+        deflater.get();
+        crypto.get();
+        
+        const auto authCode = encryptor.finish();
+        writer.write(authCode.data(), authCode.size());
+        writer.endEntry(static_cast<uint32_t>(crc), totalIn);
+        writer.finish();
+        return writer.bytesWritten();
+    }
+    
+    // Add one entry to an archive that may hold others (bundles), compressed
+    // on the calling thread. A missing input throws before anything is written.
+    static void appendEntry(ZipStreamWriter& writer, const fs::path& inputFile, const std::string& entryName,
+                            const WinZipAesEncryptor::KeyMaterial& keys, const Options& options) {
+        WinZipAesEncryptor encryptor(keys);
+        const auto expectedSize = beginEntry(writer, inputFile, entryName, keys, options);
+        
+        SequentialFileReader input;
+        if (!input.open(inputFile)) {
+            throw std::runtime_error("Cannot open input: " + inputFile.string() + " (" + std::strerror(errno) + ")");
+        }
+        input.hashInto(options.hasher);
+        writeInline([&](unsigned char* out, size_t len) {
+            const ssize_t n = input.read(out, len);
+            if (n < 0) throw std::runtime_error("Read failed for " + inputFile.string() + ": " + std::strerror(errno));
+            return static_cast<size_t>(n);
+        }, expectedSize, options, encryptor, writer);
+    }
+    
+    // The same from the input's bytes, which the caller has already read
+    static void appendEntry(ZipStreamWriter& writer, const fs::path& inputFile, std::span<const unsigned char> contents,
+                            const std::string& entryName, const WinZipAesEncryptor::KeyMaterial& keys,
+                            const Options& options) {
+        WinZipAesEncryptor encryptor(keys);
+        beginEntry(writer, inputFile, entryName, keys, options);
+        writeInline([&contents](unsigned char* out, size_t len) {
+            const size_t n = std::min(len, contents.size());
+            std::memcpy(out, contents.data(), n);
+            contents = contents.subspan(n);
+            return n;
+        }, contents.size(), options, encryptor, writer);
+    }
+    
+    // Local header, salt and password verifier. Returns the input size seen
+    // at the start.
+    static uint64_t beginEntry(ZipStreamWriter& writer, const fs::path& inputFile, const std::string& entryName,
+                               const WinZipAesEncryptor::KeyMaterial& keys, const Options& options) {
+        struct stat inputStat{};
+        if (::stat(inputFile.c_str(), &inputStat) != 0) {
+            throw std::runtime_error("Cannot stat input: " + inputFile.string());
+        }
+        
+        ZipStreamWriter::EntryInfo info;
+        info.name = entryName;
+        info.mtime = inputStat.st_mtime;
+        info.mode = inputStat.st_mode & 0777;
+        info.method = options.level == 0 ? ZIP_CM_STORE : options.codec->zipMethod();
+        info.expectedSize = static_cast<uint64_t>(inputStat.st_size);
+        
+        writer.beginEntry(info);
+        writer.write(keys.salt.data(), keys.salt.size());
+        writer.write(keys.verifier(), WinZipAesEncryptor::VERIFIER_SIZE);
+        return info.expectedSize;
+    }
+    
+    // Small inputs aren't worth three hand-offs; same stream, one thread.
+    // Reads are sized to the file, so a small one doesn't hold a whole block.
+    // `read` fills up to len bytes, short only at the end.
+    template <typename ReadFn>
+    static void writeInline(const ReadFn& read, uint64_t expectedSize, const Options& options,
+                            WinZipAesEncryptor& encryptor, ZipStreamWriter& writer) {
+        uLong crc = crc32(0L, Z_NULL, 0);
+        uint64_t totalIn = 0;
+        Chunk dictionary;
+        
+        const auto emit = [&](Chunk& data) {
+            encryptor.encrypt(data.data(), data.size());
+            writer.write(data.data(), data.size());
+        };
+        
+        const size_t readSize = static_cast<size_t>(std::clamp<uint64_t>(expectedSize, 1, options.blockSize));
+        while (true) {
+            const auto lease = MemoryBudget::global().acquire(readSize);
+            Chunk raw(readSize);
+            const size_t n = read(raw.data(), raw.size());
+            if (n == 0) break;
+            raw.resize(n);
+            totalIn += raw.size();
+            
+            if (options.level == 0) {
+                crc = crc32(crc, raw.data(), static_cast<uInt>(raw.size()));
+                emit(raw);
+                continue;
+            }
+            
+            Block block = options.codec->compress(raw, dictionary, options.level);
+            crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(block.rawSize));
+            if (options.codec->usesDictionary()) {
+                const size_t tail = std::min(raw.size(), BlockCodec::DICTIONARY_SIZE);
+                dictionary.assign(raw.end() - static_cast<std::ptrdiff_t>(tail), raw.end());
+            }
+            emit(block.data);
+        }
+        
+        if (options.level != 0) {
+            Chunk trailer = options.codec->trailer();
+            if (!trailer.empty()) emit(trailer);
+        }
+        
+        const auto authCode = encryptor.finish();
+        writer.write(authCode.data(), authCode.size());
+        writer.endEntry(static_cast<uint32_t>(crc), totalIn);
+    }
+    
+    template <typename CancelFn, typename StageFn>
+    static void guardStage(const CancelFn& cancelAll, const StageFn& stage) {
+        try {
+            stage();
+        } catch (...) {
+            cancelAll();
+            throw;
+        }
+    }
+    
+    // Over budget, this is where the pipeline waits: holding nothing, until
+    // blocks written by this or another archive give memory back
+    static void readStage(const fs::path& inputFile, size_t blockSize, ContentHasher* hasher, BoundedQueue<Piece>& out) {
+        SequentialFileReader input;
+        if (!input.open(inputFile)) {
+            throw std::runtime_error("Cannot open input: " + inputFile.string() + " (" + std::strerror(errno) + ")");
+        }
+        input.hashInto(hasher);
+        
+        while (true) {
+            Piece piece{{}, MemoryBudget::global().acquire(blockSize)};
+            piece.data.resize(blockSize);
+            const ssize_t n = input.read(piece.data.data(), piece.data.size());
+            if (n < 0) {
+                throw std::runtime_error("Read failed for " + inputFile.string() + ": " + std::strerror(errno));
+            }
+            if (n == 0) break;
+            piece.data.resize(static_cast<size_t>(n));
+            if (!out.push(std::move(piece))) return;
+        }
+        out.close();
+    }
+    
+    static void deflateStage(const Options& options, BoundedQueue<Piece>& in, BoundedQueue<Piece>& out,
+                             uLong& crc, uint64_t& totalIn) {
+        if (options.level == 0) {
+            while (auto piece = in.pop()) {
+                crc = crc32(crc, piece->data.data(), static_cast<uInt>(piece->data.size()));
+                totalIn += piece->data.size();
+                if (!out.push(std::move(*piece))) return;
+            }
+            out.close();
+            return;
+        }
+        
+        std::deque<std::pair<std::future<Block>, MemoryBudget::Lease>> inFlight;
+        Chunk dictionary;
+        const size_t window = std::max<size_t>(options.deflateThreads, 1) * 2;
+        
+        WorkStealingPool* const pool = options.deflateThreads > 1 ? options.pool : nullptr;
+        
+        const auto emitOldest = [&]() {
+            auto& [oldest, lease] = inFlight.front();
+            Block block = pool ? pool->await(oldest) : oldest.get();
+            Piece piece{std::move(block.data), std::move(lease)};
+            inFlight.pop_front();
+            crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(block.rawSize));
+            totalIn += block.rawSize;
+            return out.push(std::move(piece));
+        };
+        
+        // Under a budget the reader may be waiting for exactly the blocks held
+        // here, so they go out as soon as input stalls instead of once the
+        // window is full
+        const bool budgeted = MemoryBudget::global().limited();
+        while (true) {
+            if (budgeted && !inFlight.empty() && in.starved()) {
+                if (!emitOldest()) return;
+                continue;
+            }
+            auto piece = in.pop();
+            if (!piece) break;
+            
+            const Chunk& chunk = piece->data;
+            Chunk dict = std::move(dictionary);
+            if (options.codec->usesDictionary()) {
+                const size_t tail = std::min(chunk.size(), BlockCodec::DICTIONARY_SIZE);
+                dictionary.assign(chunk.end() - static_cast<std::ptrdiff_t>(tail), chunk.end());
+            }
+            
+            // Jobs capture by value: an abandoned one may outlive this stage
+            auto job = [codec = options.codec, level = options.level, raw = std::move(piece->data), dict = std::move(dict)]() {
+                return codec->compress(raw, dict, level);
+            };
+            inFlight.emplace_back(pool ? pool->async(std::move(job)) : std::async(std::launch::deferred, std::move(job)),
+                                  std::move(piece->lease));
+            
+            if (inFlight.size() >= window && !emitOldest()) return;
+        }
+        
+        while (!inFlight.empty()) {
+            if (!emitOldest()) return;
+        }
+        
+        Chunk trailer = options.codec->trailer();
+        if (!trailer.empty() && !out.push(Piece{std::move(trailer), {}})) return;
+        out.close();
+    }
+};
+
+// Verify mode's reader. The central directory is found with a few preads at
+// the end of the archive; the entries are then streamed front to back through
+// SequentialFileReader, so a large archive gets the same read-ahead and
+// drop-behind as an input. Each entry's ciphertext is authenticated and
+// decrypted, and inflated into a scratch buffer that is never written
+// anywhere. Its CRC and size are checked against the central directory and
+// its size and XXH64 against what the manifest recorded when it was zipped.
+class ArchiveVerifier {
+public:
+    struct Expected {
+        uint64_t size = 0;
+        uint64_t contentHash = 0;  // 0 = unknown
+    };
+    
+    // By entry name; "" stands for an archive's only entry, whatever it is called
+    using Expectations = std::unordered_map<std::string, Expected>;
+    
+    struct Report {
+        size_t entries = 0;
+        uint64_t plainBytes = 0;
+        std::vector<std::string> problems;  // empty when the archive is sound
+        
+        bool ok() const { return problems.empty(); }
+    };
+    
+private:
+    static constexpr uint32_t LOCAL_SIGNATURE = 0x04034b50;
+    static constexpr uint32_t CENTRAL_SIGNATURE = 0x02014b50;
+    static constexpr uint32_t END_SIGNATURE = 0x06054b50;
+    static constexpr uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+    static constexpr uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+    static constexpr uint16_t METHOD_WINZIP_AES = 99;
+    static constexpr uint32_t MAX_32 = 0xFFFFFFFFu;
+    static constexpr size_t LOCAL_HEADER_SIZE = 30;
+    static constexpr size_t CENTRAL_HEADER_SIZE = 46;
+    static constexpr size_t END_RECORD_SIZE = 22;
+    static constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+    static constexpr size_t ZIP64_END_SIZE = 56;
+    static constexpr size_t MAX_COMMENT = 0xFFFF;
+    static constexpr size_t CHUNK_SIZE = 256 * 1024;
+    static constexpr size_t AES_OVERHEAD = WinZipAesEncryptor::SALT_SIZE + WinZipAesEncryptor::VERIFIER_SIZE +
+                                           WinZipAesEncryptor::AUTH_CODE_SIZE;
+    
+    struct WrongPassword : std::runtime_error {
+        WrongPassword() : std::runtime_error("wrong password") {}
+    };
+    
+    struct Entry {
+        std::string name;
+        uint16_t method = 0;        // as stored: 99 for WinZip AES
+        uint16_t innerMethod = 0;   // inside the AES layer
+        uint16_t aesVersion = 0;    // 0 when there is no AES extra field
+        unsigned char aesStrength = 0;
+        uint32_t crc = 0;
+        uint64_t compressedSize = 0;
+        uint64_t uncompressedSize = 0;
+        uint64_t localOffset = 0;
+    };
+    
+    // Decompresses into scratch memory, keeping only the CRC, size and hash
+    class PlainSink {
+    private:
+        uint16_t method;
+        z_stream zs{};
+        bool zlibReady = false;
+#ifdef ZIPPER_WITH_ZSTD
+        std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> zstd{nullptr, &ZSTD_freeDCtx};
+#endif
+        std::span<unsigned char> scratch;
+        bool ended = false;
+        
+    public:
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        ContentHasher hasher;
+        
+        explicit PlainSink(uint16_t innerMethod) : method(innerMethod) {
+            if (method == ZIP_CM_DEFLATE) {
+                zs.zalloc = WorkerArena::zlibAlloc;
+                zs.zfree = WorkerArena::zlibFree;
+                zs.opaque = Z_NULL;
+                if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+                zlibReady = true;
+#ifdef ZIPPER_WITH_ZSTD
+            } else if (method == ZIP_CM_ZSTD) {
+                zstd.reset(ZSTD_createDCtx());
+                if (!zstd) throw std::runtime_error("ZSTD_createDCtx failed");
+#endif
+            } else if (method != ZIP_CM_STORE) {
+                throw std::runtime_error("compression method " + std::to_string(method) + " is not supported");
+            }
+            scratch = WorkerArena::buffer(WorkerArena::Buffer::Compare, CHUNK_SIZE);
+        }
+        
+        ~PlainSink() {
+            if (zlibReady) inflateEnd(&zs);
+        }
+        
+        PlainSink(const PlainSink&) = delete;
+        PlainSink& operator=(const PlainSink&) = delete;
+        
+        void feed(const unsigned char* data, size_t len) {
+            const StageTimers::Scope timer(StageTimers::Stage::Compress);
+            if (method == ZIP_CM_STORE) {
+                consume(data, len);
+                return;
+            }
+            if (ended) {
+                if (len > 0) throw std::runtime_error("data after the end of the compressed stream");
+                return;
+            }
+#ifdef ZIPPER_WITH_ZSTD
+            if (method == ZIP_CM_ZSTD) {
+                ZSTD_inBuffer in{data, len, 0};
+                while (in.pos < in.size) {
+                    ZSTD_outBuffer out{scratch.data(), scratch.size(), 0};
+                    const size_t rc = ZSTD_decompressStream(zstd.get(), &out, &in);
+                    if (ZSTD_isError(rc)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(rc));
+                    consume(scratch.data(), out.pos);
+                    if (rc == 0) {
+                        ended = true;
+                        if (in.pos < in.size) throw std::runtime_error("data after the end of the compressed stream");
+                    }
+                }
+                return;
+            }
+#endif
+            zs.next_in = const_cast<Bytef*>(data);
+            zs.avail_in = static_cast<uInt>(len);
+            do {
+                zs.next_out = scratch.data();
+                zs.avail_out = static_cast<uInt>(scratch.size());
+                const int rc = inflate(&zs, Z_NO_FLUSH);
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                    throw std::runtime_error(std::string("inflate: ") + (zs.msg ? zs.msg : "corrupt data"));
+                }
+                consume(scratch.data(), scratch.size() - zs.avail_out);
+                if (rc == Z_STREAM_END) {
+                    ended = true;
+                    if (zs.avail_in > 0) throw std::runtime_error("data after the end of the compressed stream");
+                    return;
+                }
+                if (rc == Z_BUF_ERROR && zs.avail_out != 0) break;  // wants more input
+            } while (zs.avail_in > 0 || zs.avail_out == 0);
+        }
+        
+        bool complete() const { return method == ZIP_CM_STORE || ended; }
+        
+    private:
+        void consume(const unsigned char* data, size_t len) {
+            if (len == 0) return;
+            crc = updateCrc(crc, data, len);
+            hasher.update(data, len);
+            size += len;
+        }
+    };
+    
+public:
+    static Report verify(const fs::path& archive, const std::string& password, const Expectations& expected) {
+        Report report;
+        try {
+            auto entries = readCentralDirectory(archive);
+            std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) { return a.localOffset < b.localOffset; });
+            
+            const bool singleExpected = expected.size() == 1 && expected.count("") > 0;
+            if (singleExpected && entries.size() != 1) {
+                report.problems.push_back("holds " + std::to_string(entries.size()) + " entries instead of 1");
+            }
+            
+            SequentialFileReader reader;
+            if (!reader.open(archive)) throw std::runtime_error(std::strerror(errno));
+            uint64_t position = 0;
+            size_t wrongPassword = 0;
+            std::unordered_set<std::string> seen;
+            for (const auto& entry : entries) {
+                if (entry.localOffset < position) {
+                    report.problems.push_back(entry.name + ": overlaps the previous entry");
+                    break;
+                }
+                skip(reader, position, entry.localOffset - position);
+                
+                const Expected* want = nullptr;
+                if (singleExpected) {
+                    want = &expected.begin()->second;
+                } else if (const auto it = expected.find(entry.name); it != expected.end()) {
+                    want = &it->second;
+                }
+                seen.insert(entry.name);
+                
+                try {
+                    report.plainBytes += verifyEntry(reader, position, entry, password, want);
+                } catch (const WrongPassword&) {
+                    ++wrongPassword;
+                } catch (const std::exception& e) {
+                    report.problems.push_back(entry.name + ": " + e.what());
+                    if (position == UINT64_MAX) break;  // lost our place in the stream
+                }
+                ++report.entries;
+            }
+            if (wrongPassword > 0) {
+                report.problems.push_back("wrong password: " + std::to_string(wrongPassword) + " of " +
+                                          std::to_string(entries.size()) + " entries fail the password check");
+            }
+            
+            if (!singleExpected) {
+                for (const auto& [name, want] : expected) {
+                    if (seen.count(name) == 0) report.problems.push_back(name + ": missing from the archive");
+                }
+            }
+        } catch (const std::exception& e) {
+            report.problems.push_back(e.what());
+        }
+        return report;
+    }
+    
+    // CRC-32 through libdeflate's PCLMUL/AVX folding when it is built in,
+    // otherwise zlib's
+    static uint32_t updateCrc(uint32_t crc, const unsigned char* data, size_t len) {
+#ifdef ZIPPER_WITH_LIBDEFLATE
+        return libdeflate_crc32(crc, data, len);
+#else
+        while (len > 0) {
+            const auto n = static_cast<uInt>(std::min<size_t>(len, UINT_MAX));
+            crc = static_cast<uint32_t>(crc32(crc, data, n));
+            data += n;
+            len -= n;
+        }
+        return crc;
+#endif
+    }
+    
+private:
+    // Returns the entry's plaintext size. `position` follows the reader and
+    // is set to UINT64_MAX when a short read leaves it unknown.
+    static uint64_t verifyEntry(SequentialFileReader& reader, uint64_t& position, const Entry& entry,
+                                const std::string& password, const Expected* want) {
+        unsigned char header[LOCAL_HEADER_SIZE];
+        readExactly(reader, position, header, sizeof(header));
+        if (get32(header) != LOCAL_SIGNATURE) throw std::runtime_error("no local header where the directory points");
+        skip(reader, position, static_cast<uint64_t>(get16(header + 26)) + get16(header + 28));
+        
+        if (entry.method != METHOD_WINZIP_AES || entry.aesVersion == 0) {
+            throw std::runtime_error("not encrypted with WinZip AES");
+        }
+        if (entry.aesStrength != WinZipAesEncryptor::AES_STRENGTH_256) {
+            throw std::runtime_error("AES strength " + std::to_string(entry.aesStrength) + " is not AES-256");
+        }
+        if (entry.compressedSize < AES_OVERHEAD) throw std::runtime_error("too short for its AES header");
+        
+        unsigned char prefix[WinZipAesEncryptor::SALT_SIZE + WinZipAesEncryptor::VERIFIER_SIZE];
+        readExactly(reader, position, prefix, sizeof(prefix));
+        auto keys = WinZipAesEncryptor::deriveKeys(password, prefix);
+        const bool passwordMatches = CRYPTO_memcmp(keys.verifier(), prefix + WinZipAesEncryptor::SALT_SIZE,
+                                                   WinZipAesEncryptor::VERIFIER_SIZE) == 0;
+        uint64_t remaining = entry.compressedSize - AES_OVERHEAD;
+        if (!passwordMatches) {
+            OPENSSL_cleanse(&keys, sizeof(keys));
+            skip(reader, position, remaining + WinZipAesEncryptor::AUTH_CODE_SIZE);
+            throw WrongPassword();
+        }
+        
+        WinZipAesEncryptor decryptor(keys);
+        OPENSSL_cleanse(&keys, sizeof(keys));
+        PlainSink plain(entry.innerMethod);
+        const auto chunk = WorkerArena::buffer(WorkerArena::Buffer::Read, CHUNK_SIZE);
+        std::string failure;
+        while (remaining > 0) {
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, chunk.size()));
+            readExactly(reader, position, chunk.data(), n);
+            remaining -= n;
+            decryptor.decrypt(chunk.data(), n);
+            // Keep authenticating after a decompression error so the report says whether the bytes were altered
+            if (failure.empty()) {
+                try {
+                    plain.feed(chunk.data(), n);
+                } catch (const std::exception& e) {
+                    failure = e.what();
+                }
+            }
+        }
+        
+        unsigned char stored[WinZipAesEncryptor::AUTH_CODE_SIZE];
+        readExactly(reader, position, stored, sizeof(stored));
+        const auto code = decryptor.finish();
+        if (CRYPTO_memcmp(code.data(), stored, sizeof(stored)) != 0) {
+            throw std::runtime_error("authentication code mismatch (data altered or damaged)");
+        }
+        if (!failure.empty()) throw std::runtime_error(failure);
+        if (!plain.complete()) throw std::runtime_error("compressed stream is truncated");
+        
+        if (plain.size != entry.uncompressedSize) {
+            throw std::runtime_error("size " + std::to_string(plain.size) + " differs from the directory's " +
+                                     std::to_string(entry.uncompressedSize));
+        }
+        // AE-2 leaves the CRC out and relies on the authentication code
+        if (entry.aesVersion == 1 && plain.crc != entry.crc) throw std::runtime_error("CRC mismatch");
+        if (want) {
+            if (plain.size != want->size) {
+                throw std::runtime_error("size " + std::to_string(plain.size) + " differs from the manifest's " +
+                                         std::to_string(want->size));
+            }
+            if (want->contentHash != 0 && plain.hasher.digest() != want->contentHash) {
+                throw std::runtime_error("content differs from what the manifest recorded");
+            }
+        }
+        return plain.size;
+    }
+    
+    static std::vector<Entry> readCentralDirectory(const fs::path& archive) {
+        const int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error(std::strerror(errno));
+        struct Closer {
+            int fd;
+            ~Closer() { ::close(fd); }
+        } closer{fd};
+        
+        struct stat st{};
+        if (::fstat(fd, &st) != 0) throw std::runtime_error(std::strerror(errno));
+        const auto fileSize = static_cast<uint64_t>(st.st_size);
+        if (fileSize < END_RECORD_SIZE) throw std::runtime_error("too short to be a zip");
+        
+        // The end record sits before a comment of up to 64KB
+        const uint64_t tailSize = std::min<uint64_t>(fileSize, END_RECORD_SIZE + MAX_COMMENT + ZIP64_LOCATOR_SIZE);
+        std::vector<unsigned char> tail(tailSize);
+        readAt(fd, tail.data(), tail.size(), fileSize - tailSize);
+        size_t end = tail.size() - END_RECORD_SIZE + 1;
+        do {
+            --end;
+        } while (end > 0 && get32(tail.data() + end) != END_SIGNATURE);
+        if (get32(tail.data() + end) != END_SIGNATURE) throw std::runtime_error("no end of central directory record");
+        
+        const unsigned char* record = tail.data() + end;
+        uint64_t count = get16(record + 10);
+        uint64_t directorySize = get32(record + 12);
+        uint64_t directoryOffset = get32(record + 16);
+        if (end >= ZIP64_LOCATOR_SIZE && get32(record - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_SIGNATURE) {
+            unsigned char zip64[ZIP64_END_SIZE];
+            readAt(fd, zip64, sizeof(zip64), get64(record - ZIP64_LOCATOR_SIZE + 8));
+            if (get32(zip64) != ZIP64_END_SIGNATURE) throw std::runtime_error("bad zip64 end of central directory");
+            count = get64(zip64 + 32);
+            directorySize = get64(zip64 + 40);
+            directoryOffset = get64(zip64 + 48);
+        }
+        if (directoryOffset > fileSize || directorySize > fileSize - directoryOffset) {
+            throw std::runtime_error("central directory lies outside the file");
+        }
+        
+        std::vector<unsigned char> directory(directorySize);
+        readAt(fd, directory.data(), directory.size(), directoryOffset);
+        std::vector<Entry> entries;
+        entries.reserve(count);
+        size_t pos = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (directory.size() - pos < CENTRAL_HEADER_SIZE || get32(directory.data() + pos) != CENTRAL_SIGNATURE) {
+                throw std::runtime_error("central directory is damaged");
+            }
+            const unsigned char* h = directory.data() + pos;
+            const size_t nameLen = get16(h + 28);
+            const size_t extraLen = get16(h + 30);
+            const size_t commentLen = get16(h + 32);
+            if (directory.size() - pos - CENTRAL_HEADER_SIZE < nameLen + extraLen + commentLen) {
+                throw std::runtime_error("central directory is damaged");
+            }
+            
+            Entry entry;
+            entry.method = get16(h + 10);
+            entry.crc = get32(h + 16);
+            entry.compressedSize = get32(h + 20);
+            entry.uncompressedSize = get32(h + 24);
+            entry.localOffset = get32(h + 42);
+            entry.name.assign(reinterpret_cast<const char*>(h + CENTRAL_HEADER_SIZE), nameLen);
+            parseExtra(h + CENTRAL_HEADER_SIZE + nameLen, extraLen, entry);
+            if (entry.localOffset >= fileSize || entry.compressedSize > fileSize - entry.localOffset) {
+                throw std::runtime_error(entry.name + ": entry lies outside the file");
+            }
+            entries.push_back(std::move(entry));
+            pos += CENTRAL_HEADER_SIZE + nameLen + extraLen + commentLen;
+        }
+        return entries;
+    }
+    
+    static void parseExtra(const unsigned char* p, size_t len, Entry& entry) {
+        while (len >= 4) {
+            const uint16_t id = get16(p);
+            const size_t size = std::min<size_t>(get16(p + 2), len - 4);
+            const unsigned char* data = p + 4;
+            if (id == 0x0001) {
+                // Zip64: only the fields whose 32-bit slot is saturated, in this order
+                size_t at = 0;
+                const auto take = [&](uint64_t& field) {
+                    if (field == MAX_32 && at + 8 <= size) {
+                        field = get64(data + at);
+                        at += 8;
+                    }
+                };
+                take(entry.uncompressedSize);
+                take(entry.compressedSize);
+                take(entry.localOffset);
+            } else if (id == 0x9901 && size >= 7) {
+                entry.aesVersion = get16(data);
+                entry.aesStrength = data[4];
+                entry.innerMethod = get16(data + 5);
+            }
+            p += 4 + size;
+            len -= 4 + size;
+        }
+    }
+    
+    static void readAt(int fd, unsigned char* out, size_t len, uint64_t offset) {
+        if (!preadFully(fd, out, len, offset)) {
+            throw std::runtime_error(errno != 0 ? std::strerror(errno) : "unexpected end of file");
+        }
+    }
+    
+    static void readExactly(SequentialFileReader& reader, uint64_t& position, unsigned char* out, size_t len) {
+        const ssize_t n = reader.read(out, len);
+        if (n < 0 || static_cast<size_t>(n) != len) {
+            position = UINT64_MAX;
+            throw std::runtime_error(n < 0 ? std::strerror(errno) : "unexpected end of file");
+        }
+        position += len;
+    }
+    
+    static void skip(SequentialFileReader& reader, uint64_t& position, uint64_t len) {
+        const auto scratch = WorkerArena::buffer(WorkerArena::Buffer::Read, CHUNK_SIZE);
+        while (len > 0) {
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(len, scratch.size()));
+            readExactly(reader, position, scratch.data(), n);
+            len -= n;
+        }
+    }
+    
+    static uint16_t get16(const unsigned char* p) {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+    
+    static uint32_t get32(const unsigned char* p) {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+               (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+    
+    static uint64_t get64(const unsigned char* p) {
+        return static_cast<uint64_t>(get32(p)) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+    }
+};
+
+// On-disk record of every input already zipped: size, mtime, ctime, inode and
+// content hash, kept in the output folder. A rerun stats each input once and
+// compares it against its entry instead of listing the output folder and
+// comparing timestamps, so unchanged inputs cost one hash-map lookup. ctime
+// catches rewrites that restore the original mtime; a same-size file whose
+// metadata moved (touch, copy back) is hashed before it is recompressed.
+// Each finished input is also appended to a journal, so a run that dies
+// part way resumes from there instead of redoing every file.
+class IncrementalManifest {
+public:
+    struct Snapshot {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        int64_t ctimeNs = 0;
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        
+        bool operator==(const Snapshot&) const = default;
+    };
+    
+    struct Entry {
+        Snapshot meta;
+        uint64_t contentHash = 0;  // 0 = unknown (adopted from a pre-manifest output)
+        std::string archive;       // bundle holding the input, relative to the output; empty for its own zip
+    };
+    
+    static constexpr std::string_view DIRECTORY = ".zipper";
+    static constexpr std::string_view FILE_NAME = "manifest";
+    static constexpr std::string_view JOURNAL_NAME = "journal";
+    static constexpr std::string_view FORMAT_TAG = "zipper-manifest 2";
+    static constexpr std::string_view FORMAT_TAG_V1 = "zipper-manifest 1";  // before bundles; no archive column
+    
+private:
+    const fs::path outputFolder;
+    const fs::path manifestPath;
+    const fs::path journalPath;
+    int journalFd = -1;
+    std::unordered_map<std::string, Entry> entries;
+    mutable std::mutex entriesMutex;
+    
+    bool loaded = false;
+    bool outputsTrusted = false;  // output folder untouched since the manifest was saved
+    bool outputsRemote = false;   // archives live in an object store, not the folder
+    bool dirty = false;
+    std::unordered_set<std::string> legacyZips;
+    
+public:
+    explicit IncrementalManifest(const fs::path& outputDir)
+        : outputFolder(outputDir), manifestPath(outputDir / DIRECTORY / FILE_NAME),
+          journalPath(outputDir / DIRECTORY / JOURNAL_NAME) {}
+    
+    ~IncrementalManifest() {
+        if (journalFd >= 0) ::close(journalFd);
+    }
+    
+    IncrementalManifest(const IncrementalManifest&) = delete;
+    IncrementalManifest& operator=(const IncrementalManifest&) = delete;
+    
+    // Uploaded archives can't be checked on disk; the manifest is the record
+    void setOutputsRemote() { outputsRemote = true; }
+    
+    static std::optional<Snapshot> snapshot(const fs::path& path) {
+        struct stat st {};
+        if (::stat(path.c_str(), &st) != 0) return std::nullopt;
+        return toSnapshot(st);
+    }
+    
+    static Snapshot toSnapshot(const struct stat& st) {
+        Snapshot snap;
+        snap.size = static_cast<uint64_t>(st.st_size);
+        snap.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        snap.ctimeNs = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+        snap.device = static_cast<uint64_t>(st.st_dev);
+        snap.inode = static_cast<uint64_t>(st.st_ino);
+        return snap;
+    }
+    
+    // Read the stored manifest; without one, existing zips are adopted once
+    // by the old timestamp comparison so an upgrade does not redo everything
+    void load(bool ignoreStored) {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        loaded = !ignoreStored && parse();
+        if (!loaded) {
+            entries.clear();
+            if (!ignoreStored) collectLegacyZips();
+        }
+        dirty = !loaded;
+        
+        if (ignoreStored) {
+            std::error_code ec;
+            fs::remove(journalPath, ec);
+        } else if (const size_t resumed = replayJournal(); resumed > 0) {
+            console() << "Resuming interrupted run: " << resumed << " inputs already finished\n";
+            dirty = true;
+        }
+    }
+    
+    // True when the input matches its entry and its zip can be kept
+    bool isUnchanged(const std::string& name, const Snapshot& current, const fs::path& inputFile,
+                     const fs::path& zipFile) {
+        std::unique_lock<std::mutex> lock(entriesMutex);
+        auto it = entries.find(name);
+        if (!loaded && it == entries.end()) return adoptLegacyOutput(name, current, zipFile);
+        
+        if (it == entries.end() || it->second.meta.size != current.size) return false;
+        
+        std::error_code ec;
+        if (!outputsTrusted && !outputsRemote && !fs::exists(zipFile, ec)) return false;
+        if (it->second.meta == current) return true;
+        
+        // Same size but moved metadata: only recompress if the bytes changed.
+        // The hash reads the whole input, so other workers' lookups go on meanwhile.
+        const auto recorded = it->second.contentHash;
+        if (recorded == 0) return false;
+        lock.unlock();
+        try {
+            if (ContentHasher::ofFile(inputFile) != recorded) return false;
+        } catch (const fs::filesystem_error&) {
+            return false;
+        }
+        lock.lock();
+        
+        // Only if nothing replaced the entry while it was hashed
+        it = entries.find(name);
+        if (it == entries.end() || it->second.contentHash != recorded) return false;
+        it->second.meta = current;
+        dirty = true;
+        return true;
+    }
+    
+    // Called once the input's zip is in place; journaled before returning
+    void record(const std::string& name, const Entry& entry) {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        entries.insert_or_assign(name, entry);
+        dirty = true;
+        appendJournal(name, entry);
+    }
+    
+    void forget(const std::string& name) {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        dirty |= entries.erase(name) > 0;
+    }
+    
+    struct ContentRef {
+        std::string name;
+        uint64_t size;
+    };
+    
+    // Content hash -> an input already zipped on its own with that content
+    std::unordered_map<uint64_t, ContentRef> contentIndex() const {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        std::unordered_map<uint64_t, ContentRef> index;
+        index.reserve(entries.size());
+        for (const auto& [name, entry] : entries) {
+            if (entry.contentHash != 0 && entry.archive.empty()) {
+                index.try_emplace(entry.contentHash, ContentRef{name, entry.meta.size});
+            }
+        }
+        return index;
+    }
+    
+    // Every recorded input, copied out for verify mode
+    std::unordered_map<std::string, Entry> recorded() const {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        return entries;
+    }
+    
+    // The bundle recorded for an input, or empty if it has its own zip
+    std::string archiveOf(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        const auto it = entries.find(name);
+        return it == entries.end() ? std::string() : it->second.archive;
+    }
+    
+    // True when the input was last zipped on its own rather than into a bundle
+    bool hasOwnZip(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        const auto it = entries.find(name);
+        return it != entries.end() && it->second.archive.empty();
+    }
+    
+    // Bundle -> the inputs recorded in it
+    std::unordered_map<std::string, std::vector<std::string>> bundles() const {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        std::unordered_map<std::string, std::vector<std::string>> members;
+        for (const auto& [name, entry] : entries) {
+            if (!entry.archive.empty()) members[entry.archive].push_back(name);
+        }
+        return members;
+    }
+    
+    // Drop entries whose input no longer exists. Returns the ones that had
+    // their own zip; bundled ones go when their bundle is rebuilt.
+    std::vector<std::string> retainOnly(const std::unordered_set<std::string>& names) {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        std::vector<std::string> dropped;
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (names.count(it->first) == 0) {
+                if (it->second.archive.empty()) dropped.push_back(it->first);
+                it = entries.erase(it);
+                dirty = true;
+            } else {
+                ++it;
+            }
+        }
+        return dropped;
+    }
+    
+    // Write to a temp file and rename it into place. The manifest lives in its
+    // own subdirectory so saving it leaves the output folder's mtime alone;
+    // that mtime is stored in the header and tells the next run whether any
+    // zip could have been deleted behind our back.
+    bool save() {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        if (!dirty && outputsTrusted) return true;
+        
+        try {
+            ensureDirectory();
+            
+            const auto tempPath = fs::path(manifestPath).concat(".tmp");
+            {
+                std::ofstream out(tempPath, std::ios::trunc);
+                if (!out.is_open()) {
+                    std::cerr << "Failed to write manifest: " << tempPath << '\n';
+                    return false;
+                }
+                out << FORMAT_TAG << '\t' << outputFolderTime().value_or(0) << '\n';
+                for (const auto& [name, entry] : entries) {
+                    if (name.find('\n') != std::string::npos) continue;  // cannot be stored; redone every run
+                    out << formatLine(name, entry);
+                }
+                out.flush();
+                if (!out) {
+                    std::cerr << "Failed to write manifest: " << tempPath << '\n';
+                    return false;
+                }
+            }
+            durableRename(tempPath, manifestPath);
+            dirty = false;
+            
+            // Everything journaled is in the manifest now
+            if (journalFd >= 0) ::close(journalFd);
+            journalFd = -1;
+            std::error_code ec;
+            fs::remove(journalPath, ec);
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to save manifest: " << e.what() << '\n';
+            return false;
+        }
+    }
+    
+private:
+    void ensureDirectory() const {
+        ensureStateDirectory(manifestPath.parent_path());
+    }
+    
+    // Journal lines are written per file from the workers, so no stream and
+    // no shared heap: the line is built in the caller's task arena
+    static std::pmr::string formatLine(const std::string& name, const Entry& entry,
+                                       std::pmr::memory_resource* memory = WorkerArena::taskResource()) {
+        std::pmr::string line(memory);
+        line.reserve(6 * 21 + entry.archive.size() + name.size() + 2);
+        const auto put = [&line](auto value, int base) {
+            char digits[24];
+            line.append(digits, std::to_chars(digits, digits + sizeof(digits), value, base).ptr).append(1, '\t');
+        };
+        put(entry.contentHash, 16);
+        put(entry.meta.size, 10);
+        put(entry.meta.mtimeNs, 10);
+        put(entry.meta.ctimeNs, 10);
+        put(entry.meta.device, 10);
+        put(entry.meta.inode, 10);
+        line.append(entry.archive).append(1, '\t').append(name).append(1, '\n');
+        return line;
+    }
+    
+    // One write per line on an O_APPEND descriptor, so a crash can cut off at
+    // most the last line. That line fails to parse and its input is redone.
+    void appendJournal(const std::string& name, const Entry& entry) {
+        if (name.find('\n') != std::string::npos) return;
+        if (journalFd < 0) {
+            try {
+                ensureDirectory();
+            } catch (const fs::filesystem_error&) {
+                return;
+            }
+            journalFd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (journalFd < 0) return;
+        }
+        const auto line = formatLine(name, entry);
+        while (::write(journalFd, line.data(), line.size()) < 0 && errno == EINTR) {}
+    }
+    
+    size_t replayJournal() {
+        std::ifstream in(journalPath);
+        std::string line;
+        size_t replayed = 0;
+        while (std::getline(in, line)) {
+            std::string name;
+            Entry entry;
+            if (in.eof() || !parseLine(line, false, name, entry)) continue;  // an unterminated line was cut off
+            entries.insert_or_assign(std::move(name), std::move(entry));
+            ++replayed;
+        }
+        return replayed;
+    }
+    
+    std::optional<int64_t> outputFolderTime() const {
+        const auto snap = snapshot(outputFolder);
+        if (!snap) return std::nullopt;
+        return snap->mtimeNs;
+    }
+    
+    bool parse() {
+        std::ifstream in(manifestPath);
+        if (!in.is_open()) return false;
+        
+        std::string line;
+        if (!std::getline(in, line)) return false;
+        const bool v1 = line.rfind(FORMAT_TAG_V1, 0) == 0;
+        if (!v1 && line.rfind(FORMAT_TAG, 0) != 0) return false;
+        int64_t savedFolderTime = 0;
+        if (!parseField(std::string_view(line).substr(FORMAT_TAG.size() + 1), savedFolderTime, 10)) return false;
+        outputsTrusted = outputFolderTime() == savedFolderTime;
+        
+        entries.clear();
+        while (std::getline(in, line)) {
+            std::string name;
+            Entry entry;
+            if (!parseLine(line, v1, name, entry)) continue;  // skip damaged lines; those inputs are simply redone
+            entries.insert_or_assign(std::move(name), std::move(entry));
+        }
+        return true;
+    }
+    
+    static bool parseLine(std::string_view rest, bool v1, std::string& name, Entry& entry) {
+        if (!nextField(rest, entry.contentHash, 16) || !nextField(rest, entry.meta.size, 10) ||
+            !nextField(rest, entry.meta.mtimeNs, 10) || !nextField(rest, entry.meta.ctimeNs, 10) ||
+            !nextField(rest, entry.meta.device, 10) || !nextField(rest, entry.meta.inode, 10) || rest.empty()) {
+            return false;
+        }
+        if (!v1) {
+            const auto tab = rest.find('\t');
+            if (tab == std::string_view::npos || tab + 1 == rest.size()) return false;
+            entry.archive = rest.substr(0, tab);
+            rest.remove_prefix(tab + 1);
+        }
+        name = rest;
+        return true;
+    }
+    
+    void collectLegacyZips() {
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(outputFolder, ec)) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".zip") {
+                legacyZips.insert(entry.path().filename().string());
+            }
+        }
+    }
+    
+    bool adoptLegacyOutput(const std::string& name, const Snapshot& current, const fs::path& zipFile) {
+        if (legacyZips.count(zipFile.lexically_relative(outputFolder).generic_string()) == 0) return false;
+        const auto zip = snapshot(zipFile);
+        if (!zip || current.mtimeNs > zip->mtimeNs) return false;
+        entries.insert_or_assign(name, Entry{current, 0, {}});
+        return true;
+    }
+};
+
+// FastCDC content-defined chunking. A Gear rolling hash picks cut points
+// from the bytes themselves, so an edit only moves the boundaries next to
+// it and every other chunk comes out as before. No cut is taken in the
+// first quarter of the average size. The mask is stricter up to the
+// average and looser after it (normalized chunking), which keeps sizes
+// close to the average, and a chunk ends at four times the average anyway.
+class ContentDefinedChunker {
+private:
+    // Fixed table, so cut points stay where they are from run to run
+    static constexpr std::array<uint64_t, 256> GEAR = []() {
+        std::array<uint64_t, 256> table{};
+        uint64_t state = 0;
+        for (auto& value : table) {
+            state += 0x9E3779B97F4A7C15ull;  // splitmix64
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    
+    const size_t minSize;
+    const size_t averageSize;
+    const size_t maxSize;
+    const uint64_t strictMask;
+    const uint64_t looseMask;
+    
+public:
+    explicit ContentDefinedChunker(size_t average)
+        : minSize(average / 4), averageSize(average), maxSize(average * 4),
+          strictMask(topBits(log2(average) + 2)), looseMask(topBits(log2(average) - 2)) {}
+    
+    size_t maxChunk() const { return maxSize; }
+    
+    // Length of the chunk that starts at data. Fewer than maxChunk() bytes
+    // means the input ends there.
+    size_t cut(const unsigned char* data, size_t n) const {
+        if (n <= minSize) return n;
+        const size_t limit = std::min(n, maxSize);
+        const size_t normal = std::min(limit, averageSize);
+        
+        // The top bits of the hash depend on the last 64 bytes only
+        uint64_t hash = 0;
+        size_t i = minSize;
+        for (; i < normal; ++i) {
+            hash = (hash << 1) + GEAR[data[i]];
+            if ((hash & strictMask) == 0) return i + 1;
+        }
+        for (; i < limit; ++i) {
+            hash = (hash << 1) + GEAR[data[i]];
+            if ((hash & looseMask) == 0) return i + 1;
+        }
+        return limit;
+    }
+    
+private:
+    static int log2(size_t value) { return 63 - __builtin_clzll(static_cast<unsigned long long>(value)); }
+    
+    static uint64_t topBits(int bits) { return ~0ull << (64 - bits); }
+};
+
+// Chunk maps of the archives written in chunks, in .zipper/chunks/. A map
+// lists where each chunk's compressed bytes sit in its archive's entry data,
+// with the chunk's length and hash, and the size and salt of the archive it
+// describes; a map whose archive has been replaced is not used. All maps are
+// indexed by chunk hash, so a chunk can come from any chunked archive in the
+// output folder.
+class ChunkStore {
+public:
+    struct ChunkRef {
+        uint64_t hash = 0;     // XXH64 of the raw chunk
+        uint64_t offset = 0;   // of its compressed bytes, from the start of the entry data
+        uint32_t rawSize = 0;
+        uint32_t size = 0;     // compressed
+    };
+    
+    struct ChunkMap {
+        std::string archive;   // relative to the output folder
+        uint64_t archiveSize = 0;
+        uint64_t dataStart = 0;  // first compressed byte, after the salt and verifier
+        int level = 0;
+        std::array<unsigned char, WinZipAesEncryptor::SALT_SIZE> salt{};
+        std::vector<ChunkRef> chunks;
+    };
+    
+    struct Location {
+        std::shared_ptr<const ChunkMap> map;
+        ChunkRef chunk;
+    };
+    
+    static constexpr std::string_view FOLDER = "chunks";
+    static constexpr std::string_view FORMAT_TAG = "zipper-chunks 1";
+    
+private:
+    const fs::path outputFolder;
+    const fs::path folder;
+    std::mutex mutex;
+    bool loaded = false;
+    std::unordered_map<std::string, std::shared_ptr<const ChunkMap>> maps;  // by archive
+    std::unordered_map<uint64_t, Location> byHash;
+    
+public:
+    explicit ChunkStore(const fs::path& outputDir)
+        : outputFolder(outputDir), folder(outputDir / IncrementalManifest::DIRECTORY / FOLDER) {}
+    
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+    
+    fs::path archivePath(const ChunkMap& map) const { return outputFolder / map.archive; }
+    
+    // Where a chunk compressed at this level is stored, if anywhere
+    std::optional<Location> lookup(uint64_t hash, size_t rawSize, int level) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ensureLoaded();
+        const auto it = byHash.find(hash);
+        if (it == byHash.end() || it->second.chunk.rawSize != rawSize || it->second.map->level != level) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+    
+    // Record the map of an archive just written, replacing its old one. A
+    // map that cannot be saved still serves the rest of this run.
+    void save(ChunkMap map) {
+        auto saved = std::make_shared<const ChunkMap>(std::move(map));
+        try {
+            write(*saved);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to save chunk map for " << saved->archive << ": " << e.what() << '\n';
+        }
+        const auto archive = saved->archive;
+        std::lock_guard<std::mutex> lock(mutex);
+        ensureLoaded();
+        replace(archive, std::move(saved));
+    }
+    
+    // Drop the map of an archive that was rewritten without chunks
+    void discard(const std::string& archive) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ensureLoaded();
+        if (!replace(archive, nullptr)) return;
+        std::error_code ec;
+        fs::remove(pathFor(archive), ec);
+    }
+    
+private:
+    fs::path pathFor(const std::string& archive) const {
+        ContentHasher hasher;
+        hasher.update(archive.data(), archive.size());
+        char name[24];
+        std::snprintf(name, sizeof(name), "%016llx.map", static_cast<unsigned long long>(hasher.digest()));
+        return folder / name;
+    }
+    
+    bool replace(const std::string& archive, std::shared_ptr<const ChunkMap> map) {
+        bool replaced = false;
+        if (const auto it = maps.find(archive); it != maps.end()) {
+            for (const auto& chunk : it->second->chunks) {
+                const auto entry = byHash.find(chunk.hash);
+                if (entry != byHash.end() && entry->second.map == it->second) byHash.erase(entry);
+            }
+            maps.erase(it);
+            replaced = true;
+        }
+        if (map) {
+            index(map);
+            maps.emplace(archive, std::move(map));
+        }
+        return replaced;
+    }
+    
+    void index(const std::shared_ptr<const ChunkMap>& map) {
+        for (const auto& chunk : map->chunks) {
+            byHash.insert_or_assign(chunk.hash, Location{map, chunk});
+        }
+    }
+    
+    void ensureLoaded() {
+        if (loaded) return;
+        loaded = true;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(folder, ec)) {
+            if (entry.path().extension() != ".map") continue;
+            auto map = parse(entry.path());
+            if (map && maps.count(map->archive) == 0) {
+                index(map);
+                maps.emplace(map->archive, std::move(map));
+            }
+        }
+    }
+    
+    // Temp file and rename, as for the manifest
+    void write(const ChunkMap& map) const {
+        ensureStateDirectory(folder.parent_path());
+        fs::create_directories(folder);
+        
+        const auto path = pathFor(map.archive);
+        const auto tempPath = fs::path(path).concat(".tmp");
+        {
+            std::ofstream out(tempPath, std::ios::trunc);
+            if (!out.is_open()) throw std::runtime_error("cannot create " + tempPath.string());
+            char salt[2 * WinZipAesEncryptor::SALT_SIZE + 1];
+            for (size_t i = 0; i < map.salt.size(); ++i) {
+                std::snprintf(salt + 2 * i, 3, "%02x", map.salt[i]);
+            }
+            out << FORMAT_TAG << '\t' << map.level << '\t' << map.archiveSize << '\t' << map.dataStart << '\t'
+                << salt << '\t' << map.archive << '\n';
+            for (const auto& chunk : map.chunks) {
+                out << std::hex << chunk.hash << std::dec << '\t' << chunk.offset << '\t' << chunk.rawSize << '\t'
+                    << chunk.size << '\n';
+            }
+            out.flush();
+            if (!out) throw std::runtime_error("cannot write " + tempPath.string());
+        }
+        durableRename(tempPath, path);
+    }
+    
+    static std::shared_ptr<const ChunkMap> parse(const fs::path& path) {
+        std::ifstream in(path);
+        std::string line;
+        if (!std::getline(in, line) || line.rfind(FORMAT_TAG, 0) != 0 || line.size() <= FORMAT_TAG.size()) return nullptr;
+        
+        auto map = std::make_shared<ChunkMap>();
+        std::string_view rest = std::string_view(line).substr(FORMAT_TAG.size() + 1);
+        if (!nextField(rest, map->level, 10) || !nextField(rest, map->archiveSize, 10) ||
+            !nextField(rest, map->dataStart, 10)) {
+            return nullptr;
+        }
+        const auto salt = nextText(rest);
+        if (salt.size() != 2 * map->salt.size() || rest.empty()) return nullptr;
+        for (size_t i = 0; i < map->salt.size(); ++i) {
+            std::string_view byte = salt.substr(2 * i, 2);
+            if (!nextField(byte, map->salt[i], 16)) return nullptr;
+        }
+        map->archive = rest;
+        
+        // Damaged lines are skipped; those chunks are compressed again
+        while (std::getline(in, line)) {
+            rest = line;
+            ChunkRef chunk;
+            if (nextField(rest, chunk.hash, 16) && nextField(rest, chunk.offset, 10) &&
+                nextField(rest, chunk.rawSize, 10) && nextField(rest, chunk.size, 10) && rest.empty()) {
+                map->chunks.push_back(chunk);
+            }
+        }
+        return map;
+    }
+};
+
+// Writes a single-entry archive from content-defined chunks. Each chunk is
+// deflated on its own, without a preset dictionary, and sync-flushed, so its
+// compressed bytes are a self-contained run of deflate blocks that any later
+// archive can copy as they are. A chunk that a chunked archive already holds
+// is decrypted out of it instead of compressed again; the copy is inflated
+// and compared with the new chunk byte for byte before it is used. A chunk
+// repeated within the file reuses the compressed bytes of its last copy while
+// that is still in a small window. Compression and copying run on the pool;
+// reading, chunking, encryption and writing stay on the calling thread.
+class ChunkedArchiveWriter {
+private:
+    static constexpr size_t REPEAT_WINDOW_BYTES = 32 * 1024 * 1024;  // raw and compressed
+    
+    using Chunk = std::vector<unsigned char>;
+    
+    // An earlier archive chunks are copied from, checked once per write: the
+    // size and salt must be the ones its map recorded, and the password the
+    // one it was written with
+    class Source {
+    private:
+        int fd = -1;
+        uint64_t dataStart = 0;
+        WinZipAesEncryptor::KeyMaterial keys;
+    
+    public:
+        explicit Source(int descriptor, uint64_t start) : fd(descriptor), dataStart(start) {}
+        ~Source() {
+            ::close(fd);
+            OPENSSL_cleanse(&keys, sizeof(keys));
+        }
+        
+        Source(const Source&) = delete;
+        Source& operator=(const Source&) = delete;
+        
+        static std::shared_ptr<const Source> open(const fs::path& path, const ChunkStore::ChunkMap& map,
+                                                  const std::string& password) {
+            constexpr size_t prefix = WinZipAesEncryptor::SALT_SIZE + WinZipAesEncryptor::VERIFIER_SIZE;
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return nullptr;
+            auto source = std::make_shared<Source>(fd, map.dataStart);
+            
+            struct stat st{};
+            std::array<unsigned char, prefix> stored{};
+            if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != map.archiveSize ||
+                map.dataStart < prefix || !preadFully(fd, stored.data(), stored.size(), map.dataStart - prefix) ||
+                !std::equal(map.salt.begin(), map.salt.end(), stored.begin())) {
+                return nullptr;
+            }
+            source->keys = WinZipAesEncryptor::deriveKeys(password, stored.data());
+            if (!std::equal(stored.begin() + WinZipAesEncryptor::SALT_SIZE, stored.end(), source->keys.verifier())) {
+                return nullptr;
+            }
+            return source;
+        }
+        
+        // The chunk's compressed bytes, if they still inflate to raw
+        std::optional<Chunk> read(const ChunkStore::ChunkRef& chunk, const Chunk& raw) const {
+            Chunk piece(chunk.size);
+            if (!preadFully(fd, piece.data(), piece.size(), dataStart + chunk.offset)) return std::nullopt;
+            WinZipAesEncryptor decryptor(keys);
+            decryptor.decryptAt(chunk.offset, piece.data(), piece.size());
+            if (!inflatesTo(piece, raw)) return std::nullopt;
+            return piece;
+        }
+    
+    private:
+        // A reusable piece ends on a sync flush, not on a final block
+        static bool inflatesTo(const Chunk& piece, const Chunk& raw) {
+            z_stream zs{};
+            zs.zalloc = &WorkerArena::zlibAlloc;
+            zs.zfree = &WorkerArena::zlibFree;
+            if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return false;
+            
+            const auto out = WorkerArena::buffer(WorkerArena::Buffer::Compare, raw.size() + 1);
+            zs.next_in = const_cast<Bytef*>(piece.data());
+            zs.avail_in = static_cast<uInt>(piece.size());
+            zs.next_out = out.data();
+            zs.avail_out = static_cast<uInt>(out.size());
+            const int ret = inflate(&zs, Z_SYNC_FLUSH);
+            const size_t produced = out.size() - zs.avail_out;
+            const bool drained = zs.avail_in == 0;
+            inflateEnd(&zs);
+            return (ret == Z_OK || ret == Z_BUF_ERROR) && drained && produced == raw.size() &&
+                   std::memcmp(out.data(), raw.data(), raw.size()) == 0;
+        }
+    };
+    
+    struct Produced {
+        Chunk raw;
+        Chunk data;  // compressed
+        uLong crc = 0;
+        bool reused = false;
+    };
+    
+    struct Pending {
+        uint64_t hash = 0;
+        std::optional<Produced> ready;  // repeats and chunks compressed inline
+        std::future<Produced> job;
+        bool repeat = false;
+        MemoryBudget::Lease lease;
+    };
+    
+    // Chunks written lately, for repeats within the file
+    struct Recent {
+        uint64_t hash;
+        Chunk raw;
+        Chunk data;
+        uLong crc;
+    };
+    
+public:
+    struct Options {
+        const BlockCodec* codec = &CodecRegistry::zlib();
+        int level = 9;
+        size_t averageChunk = Config::CHUNK_SIZE;
+        size_t threads = 1;
+        WorkStealingPool* pool = nullptr;  // without it chunks are compressed on the calling thread
+        ContentHasher* hasher = nullptr;   // fed the input as it is read
+    };
+    
+    struct Result {
+        uint64_t archiveBytes = 0;
+        uint64_t reusedBytes = 0;    // raw bytes copied from earlier archives
+        uint64_t repeatedBytes = 0;  // raw bytes repeating a chunk earlier in the file
+        ChunkStore::ChunkMap map;    // all but the archive's name
+    };
+    
+    // Chunks must concatenate without a dictionary into one deflate stream
+    static bool supports(const BlockCodec& codec) {
+        return codec.zipMethod() == ZIP_CM_DEFLATE && !codec.wholeInputOnly();
+    }
+    
+    static Result write(const fs::path& inputFile, const std::string& entryName, std::unique_ptr<OutputSink> output,
+                        const WinZipAesEncryptor::KeyMaterial& keys, const std::string& password,
+                        const Options& options, ChunkStore& store) {
+        ZipStreamWriter writer(std::move(output));
+        PipelinedArchiveWriter::Options entry;
+        entry.codec = options.codec;
+        entry.level = options.level;
+        PipelinedArchiveWriter::beginEntry(writer, inputFile, entryName, keys, entry);
+        
+        Result result;
+        result.map.level = options.level;
+        result.map.salt = keys.salt;
+        result.map.dataStart = writer.bytesWritten();
+        
+        SequentialFileReader input;
+        if (!input.open(inputFile)) {
+            throw std::runtime_error("Cannot open input: " + inputFile.string() + " (" + std::strerror(errno) + ")");
+        }
+        input.hashInto(options.hasher);
+        
+        WinZipAesEncryptor encryptor(keys);
+        const ContentDefinedChunker chunker(options.averageChunk);
+        WorkStealingPool* const pool = options.threads > 1 ? options.pool : nullptr;
+        const size_t window = std::max<size_t>(options.threads, 1) * 2;
+        const bool budgeted = MemoryBudget::global().limited();
+        
+        std::deque<Pending> inFlight;
+        std::deque<Recent> recent;
+        size_t recentBytes = 0;
+        std::unordered_map<std::string, std::shared_ptr<const Source>> sources;
+        
+        uLong crc = crc32(0L, Z_NULL, 0);
+        uint64_t totalIn = 0;
+        uint64_t dataOffset = 0;
+        
+        const auto emitOldest = [&]() {
+            Pending pending = std::move(inFlight.front());
+            inFlight.pop_front();
+            Produced piece = pending.ready ? std::move(*pending.ready) : pool ? pool->await(pending.job) : pending.job.get();
+            
+            crc = crc32_combine(crc, piece.crc, static_cast<z_off_t>(piece.raw.size()));
+            totalIn += piece.raw.size();
+            if (pending.repeat) {
+                result.repeatedBytes += piece.raw.size();
+            } else if (piece.reused) {
+                result.reusedBytes += piece.raw.size();
+            }
+            result.map.chunks.push_back({pending.hash, dataOffset, static_cast<uint32_t>(piece.raw.size()),
+                                         static_cast<uint32_t>(piece.data.size())});
+            dataOffset += piece.data.size();
+            
+            Chunk data = piece.data;
+            recentBytes += piece.raw.size() + piece.data.size();
+            recent.push_back({pending.hash, std::move(piece.raw), std::move(piece.data), piece.crc});
+            while (recentBytes > REPEAT_WINDOW_BYTES && recent.size() > 1) {
+                recentBytes -= recent.front().raw.size() + recent.front().data.size();
+                recent.pop_front();
+            }
+            
+            encryptor.encrypt(data.data(), data.size());
+            writer.write(data.data(), data.size());
+        };
+        
+        // Over budget, chunks held here go out before more are read
+        const auto leaseFor = [&](size_t bytes) {
+            if (budgeted) {
+                while (!inFlight.empty()) {
+                    if (auto lease = MemoryBudget::global().tryAcquire(bytes)) return std::move(*lease);
+                    emitOldest();
+                }
+            }
+            return MemoryBudget::global().acquire(bytes);
+        };
+        
+        const auto sourceFor = [&](const ChunkStore::ChunkMap& map) {
+            auto [it, inserted] = sources.try_emplace(map.archive);
+            if (inserted) it->second = Source::open(store.archivePath(map), map, password);
+            return it->second;
+        };
+        
+        const auto dispatch = [&](Chunk raw, MemoryBudget::Lease lease) {
+            ContentHasher hasher;
+            hasher.update(raw.data(), raw.size());
+            Pending pending;
+            pending.hash = hasher.digest();
+            pending.lease = std::move(lease);
+            
+            const auto seen = std::find_if(recent.rbegin(), recent.rend(), [&](const Recent& r) {
+                return r.hash == pending.hash && r.raw == raw;
+            });
+            if (seen != recent.rend()) {
+                pending.repeat = true;
+                pending.ready = Produced{std::move(raw), seen->data, seen->crc, true};
+                inFlight.push_back(std::move(pending));
+                return;
+            }
+            
+            std::shared_ptr<const Source> source;
+            ChunkStore::ChunkRef chunk;
+            if (const auto location = store.lookup(pending.hash, raw.size(), options.level)) {
+                source = sourceFor(*location->map);
+                chunk = location->chunk;
+            }
+            
+            // A failed write leaves its queued jobs running, so each holds its
+            // own chunk and a shared reference to the archive it copies from
+            auto job = [raw = std::move(raw), source, chunk, codec = options.codec, level = options.level]() mutable {
+                Produced piece;
+                if (source) {
+                    if (auto copied = source->read(chunk, raw)) {
+                        piece.data = std::move(*copied);
+                        piece.crc = crc32(crc32(0L, Z_NULL, 0), raw.data(), static_cast<uInt>(raw.size()));
+                        piece.reused = true;
+                    }
+                }
+                if (!piece.reused) {
+                    auto block = codec->compress(raw, {}, level);
+                    piece.data = std::move(block.data);
+                    piece.crc = block.crc;
+                }
+                piece.raw = std::move(raw);
+                return piece;
+            };
+            if (pool) {
+                pending.job = pool->async(std::move(job));
+            } else {
+                pending.ready = job();
+            }
+            inFlight.push_back(std::move(pending));
+        };
+        
+        // Keep at least one maximum chunk buffered so every cut but the last
+        // sees as far ahead as it may reach
+        const size_t maxChunk = chunker.maxChunk();
+        Chunk buffer(2 * maxChunk);
+        size_t begin = 0;
+        size_t end = 0;
+        bool eof = false;
+        while (true) {
+            if (!eof && end - begin < maxChunk) {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+                while (!eof && end < buffer.size()) {
+                    const ssize_t n = input.read(buffer.data() + end, buffer.size() - end);
+                    if (n < 0) {
+                        throw std::runtime_error("Read failed for " + inputFile.string() + ": " + std::strerror(errno));
+                    }
+                    if (n == 0) eof = true;
+                    end += static_cast<size_t>(n);
+                }
+            }
+            if (begin == end) break;
+            
+            const size_t length = chunker.cut(buffer.data() + begin, end - begin);
+            auto lease = leaseFor(length);
+            dispatch(Chunk(buffer.begin() + static_cast<std::ptrdiff_t>(begin),
+                           buffer.begin() + static_cast<std::ptrdiff_t>(begin + length)),
+                     std::move(lease));
+            begin += length;
+            if (inFlight.size() >= window) emitOldest();
+        }
+        while (!inFlight.empty()) {
+            emitOldest();
+        }
+        
+        Chunk trailer = options.codec->trailer();
+        encryptor.encrypt(trailer.data(), trailer.size());
+        writer.write(trailer.data(), trailer.size());
+        const auto authCode = encryptor.finish();
+        writer.write(authCode.data(), authCode.size());
+        writer.endEntry(static_cast<uint32_t>(crc), totalIn);
+        writer.finish();
+        
+        result.archiveBytes = writer.bytesWritten();
+        result.map.archiveSize = result.archiveBytes;
+        return result;
+    }
+};
+
+// Parallel input walker. Directories and batches of names to stat are work
+// items on per-worker deques; an idle worker steals from the others, so one
+// huge or deep directory does not serialize the scan. On Linux, directories
+// are read with large getdents64 batches and entries are statx'd relative to
+// the open directory, which keeps per-file metadata round trips down on
+// network mounts.
+class DirectoryScanner {
+public:
+    struct Entry {
+        std::string relative;  // generic path below the root, e.g. "docs/a.pdf"
+        IncrementalManifest::Snapshot snapshot;
+    };
+    
+private:
+    static constexpr size_t STAT_BATCH = 256;
+    static constexpr size_t LISTING_BUFFER = 256 * 1024;
+    
+    struct OpenDirectory {
+        fs::path path;
+        std::string prefix;  // relative path of the directory plus '/', empty at the root
+        int fd = -1;
+        
+        ~OpenDirectory() {
+            if (fd >= 0) ::close(fd);
+        }
+    };
+    
+    struct Name {
+        std::string name;
+        unsigned char type;  // DT_* from the listing
+    };
+    
+    // No names: list the directory. Otherwise: stat these names inside it
+    struct WorkItem {
+        std::shared_ptr<OpenDirectory> directory;
+        std::vector<Name> names;
+    };
+    
+    struct Worker {
+        std::mutex mutex;
+        std::deque<WorkItem> queue;
+        std::vector<Entry> found;
+    };
+    
+    const bool recursive;
+    const fs::path excluded;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> pending{0};  // items queued or running; the scan is done at 0
+    std::atomic<size_t> queued{0};   // of those, the ones waiting in a queue
+    std::mutex idleMutex;
+    std::condition_variable wake;    // something was queued, or the scan is done
+    
+public:
+    // Regular files under root (following symlinks to files); subdirectories
+    // only when recursive, never the `exclude` directory or symlinked ones
+    static std::vector<Entry> scan(const fs::path& root, bool recursive, size_t threads, const fs::path& exclude) {
+        std::error_code ec;
+        const auto canonicalRoot = fs::weakly_canonical(root, ec);
+        const auto canonicalExclude = fs::weakly_canonical(exclude, ec);
+        
+        DirectoryScanner scanner(recursive, canonicalExclude, std::max<size_t>(threads, 1));
+        auto rootDir = std::make_shared<OpenDirectory>();
+        rootDir->path = canonicalRoot.empty() ? root : canonicalRoot;
+        if (!scanner.openDirectory(*rootDir)) {
+            throw fs::filesystem_error("Cannot open input folder", root, std::error_code(errno, std::generic_category()));
+        }
+        scanner.push(0, WorkItem{std::move(rootDir), {}});
+        return scanner.run();
+    }
+    
+private:
+    DirectoryScanner(bool recurse, fs::path exclude, size_t threads) : recursive(recurse), excluded(std::move(exclude)) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+    }
+    
+    std::vector<Entry> run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers.size(); ++i) {
+            threads.emplace_back([this, i]() { work(i); });
+        }
+        work(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        
+        std::vector<Entry> entries;
+        for (auto& worker : workers) {
+            std::move(worker->found.begin(), worker->found.end(), std::back_inserter(entries));
+        }
+        return entries;
+    }
+    
+    void work(size_t self) {
+        while (true) {
+            auto item = take(self);
+            if (!item) {
+                std::unique_lock<std::mutex> lock(idleMutex);
+                wake.wait(lock, [this]() {
+                    return queued.load(std::memory_order_acquire) > 0 || pending.load(std::memory_order_acquire) == 0;
+                });
+                if (pending.load(std::memory_order_acquire) == 0) break;
+                continue;
+            }
+            
+            if (item->names.empty()) {
+                list(self, item->directory);
+            } else {
+                statNames(self, *item);
+            }
+            
+            // The last item finishing wakes everyone up to exit
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) notify(true);
+        }
+    }
+    
+    void push(size_t self, WorkItem item) {
+        pending.fetch_add(1, std::memory_order_acq_rel);
+        {
+            std::lock_guard<std::mutex> lock(workers[self]->mutex);
+            workers[self]->queue.push_back(std::move(item));
+            queued.fetch_add(1, std::memory_order_acq_rel);
+        }
+        notify(false);
+    }
+    
+    // Taking idleMutex orders this after a waiter's check of the counters,
+    // so the wakeup cannot slip in between its check and its wait
+    void notify(bool all) {
+        { std::lock_guard<std::mutex> lock(idleMutex); }
+        if (all) {
+            wake.notify_all();
+        } else {
+            wake.notify_one();
+        }
+    }
+    
+    // Own work newest-first (depth-first, warm dentries); stolen work oldest-first
+    std::optional<WorkItem> take(size_t self) {
+        {
+            auto& own = *workers[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.queue.empty()) {
+                WorkItem item = std::move(own.queue.back());
+                own.queue.pop_back();
+                queued.fetch_sub(1, std::memory_order_acq_rel);
+                return item;
+            }
+        }
+        for (size_t offset = 1; offset < workers.size(); ++offset) {
+            auto& victim = *workers[(self + offset) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.queue.empty()) {
+                WorkItem item = std::move(victim.queue.front());
+                victim.queue.pop_front();
+                queued.fetch_sub(1, std::memory_order_acq_rel);
+                return item;
+            }
+        }
+        return std::nullopt;
+    }
+    
+    void list(size_t self, const std::shared_ptr<OpenDirectory>& directory) {
+        if (directory->fd < 0 && !openDirectory(*directory)) {
+            reportError("Cannot open directory", directory->path);
+            return;
+        }
+        
+        std::vector<Name> names;
+        if (!readNames(*directory, names)) {
+            reportError("Cannot read directory", directory->path);
+        }
+        
+        std::vector<Name> batch;
+        for (auto& name : names) {
+            if (name.type == DT_DIR) {
+                if (recursive) pushDirectory(self, *directory, name.name);
+                continue;
+            }
+            batch.push_back(std::move(name));
+            if (batch.size() == STAT_BATCH) {
+                push(self, WorkItem{directory, std::move(batch)});
+                batch.clear();
+            }
+        }
+        if (!batch.empty()) statNames(self, WorkItem{directory, std::move(batch)});
+    }
+    
+    void pushDirectory(size_t self, const OpenDirectory& parent, const std::string& name) {
+        auto child = std::make_shared<OpenDirectory>();
+        child->path = parent.path / name;
+        if (child->path == excluded) return;
+        child->prefix = parent.prefix + name + '/';
+        push(self, WorkItem{std::move(child), {}});
+    }
+    
+    void statNames(size_t self, const WorkItem& item) {
+        auto& worker = *workers[self];
+        const auto& directory = *item.directory;
+        for (const auto& name : item.names) {
+            mode_t mode = 0;
+            IncrementalManifest::Snapshot snapshot;
+            if (!statEntry(directory, name.name, mode, snapshot)) {
+                reportError("Cannot stat", directory.path / name.name);
+                continue;
+            }
+            if (S_ISREG(mode)) {
+                worker.found.push_back(Entry{directory.prefix + name.name, snapshot});
+            } else if (S_ISDIR(mode) && recursive && name.type != DT_LNK) {
+                // Filesystems that report DT_UNKNOWN only reveal directories
+                // here, and stat followed the name, so a symlink to a parent
+                // would otherwise be walked forever
+                if (name.type == DT_UNKNOWN && isSymlink(directory, name.name)) continue;
+                pushDirectory(self, directory, name.name);
+            }
+        }
+    }
+    
+#ifdef __linux__
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    
+    static bool openDirectory(OpenDirectory& directory) {
+        directory.fd = ::open(directory.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return directory.fd >= 0;
+    }
+    
+    static bool readNames(const OpenDirectory& directory, std::vector<Name>& names) {
+        std::vector<char> buffer(LISTING_BUFFER);
+        while (true) {
+            const long n = ::syscall(SYS_getdents64, directory.fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            if (n == 0) return true;
+            
+            for (long offset = 0; offset < n;) {
+                const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+                offset += entry->d_reclen;
+                const std::string_view name(entry->d_name);
+                if (name == "." || name == "..") continue;
+                names.push_back(Name{std::string(name), entry->d_type});
+            }
+        }
+    }
+    
+    static bool statEntry(const OpenDirectory& directory, const std::string& name, mode_t& mode,
+                          IncrementalManifest::Snapshot& snapshot) {
+        struct statx stx {};
+        constexpr unsigned mask = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_INO;
+        if (::statx(directory.fd, name.c_str(), 0, mask, &stx) != 0) return false;
+        
+        mode = stx.stx_mode;
+        snapshot.size = stx.stx_size;
+        snapshot.mtimeNs = static_cast<int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+        snapshot.ctimeNs = static_cast<int64_t>(stx.stx_ctime.tv_sec) * 1000000000 + stx.stx_ctime.tv_nsec;
+        snapshot.device = static_cast<uint64_t>(makedev(stx.stx_dev_major, stx.stx_dev_minor));
+        snapshot.inode = stx.stx_ino;
+        return true;
+    }
+    
+    static bool isSymlink(const OpenDirectory& directory, const std::string& name) {
+        struct statx stx {};
+        return ::statx(directory.fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) != 0 || S_ISLNK(stx.stx_mode);
+    }
+#else
+    static bool openDirectory(OpenDirectory& directory) {
+        std::error_code ec;
+        return fs::is_directory(directory.path, ec);
+    }
+    
+    static bool readNames(const OpenDirectory& directory, std::vector<Name>& names) {
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(directory.path, ec)) {
+            const auto status = entry.symlink_status(ec);
+            const unsigned char type = fs::is_directory(status) ? DT_DIR : fs::is_symlink(status) ? DT_LNK : DT_UNKNOWN;
+            names.push_back(Name{entry.path().filename().string(), type});
+        }
+        return !ec;
+    }
+    
+    static bool statEntry(const OpenDirectory& directory, const std::string& name, mode_t& mode,
+                          IncrementalManifest::Snapshot& snapshot) {
+        struct stat st {};
+        if (::stat((directory.path / name).c_str(), &st) != 0) return false;
+        mode = st.st_mode;
+        snapshot = IncrementalManifest::toSnapshot(st);
+        return true;
+    }
+    
+    static bool isSymlink(const OpenDirectory& directory, const std::string& name) {
+        struct stat st {};
+        return ::lstat((directory.path / name).c_str(), &st) != 0 || S_ISLNK(st.st_mode);
+    }
+#endif
+    
+    static void reportError(const char* what, const fs::path& path) {
+        static std::mutex outputMutex;
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cerr << what << ' ' << path << ": " << std::strerror(errno) << '\n';
+    }
+};
+
+// Inotify watches on the input folder, and on its subdirectories when
+// recursive, reporting inputs closed after writing or moved in. New
+// subdirectories are watched as they appear and reported too; the caller
+// lists each one once, since files can land in it before its watch exists.
+// Deletions are not reported: the next full pass drops them.
+class DirectoryWatcher {
+public:
+    struct Changes {
+        std::vector<std::string> files;        // relative paths, named like DirectoryScanner::Entry
+        std::vector<std::string> directories;  // new subdirectories, relative
+        bool overflowed = false;               // the kernel dropped events; rescan everything
+        
+        bool empty() const { return files.empty() && directories.empty() && !overflowed; }
+    };
+    
+private:
+    const fs::path root;
+    const bool recursive;
+    const fs::path excluded;
+    int fd = -1;
+    int rootWatch = -1;
+    std::unordered_map<int, std::string> prefixes;  // watch descriptor -> relative directory plus '/'
+    bool warnedLimit = false;
+    
+public:
+    DirectoryWatcher(const fs::path& folder, bool recurse, const fs::path& exclude)
+        : root(canonical(folder)), recursive(recurse), excluded(canonical(exclude)) {
+#ifdef __linux__
+        fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0) rootWatch = addTree(root, {});
+#endif
+    }
+    
+    ~DirectoryWatcher() {
+        if (fd >= 0) ::close(fd);
+    }
+    
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+    
+    bool ok() const { return fd >= 0 && rootWatch >= 0; }
+    
+    // Wait up to `timeout` for events and append them to `changes`. False once
+    // the input folder itself is deleted or moved away.
+    bool poll(std::chrono::milliseconds timeout, Changes& changes) {
+#ifdef __linux__
+        pollfd pending{fd, POLLIN, 0};
+        if (::poll(&pending, 1, static_cast<int>(timeout.count())) <= 0) return true;  // timeout, or EINTR from a stop signal
+        
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (true) {
+            const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return true;
+            for (ssize_t offset = 0; offset < n;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+                if (!handle(*event, changes)) return false;
+            }
+        }
+#else
+        std::this_thread::sleep_for(timeout);
+        (void)changes;
+        return false;
+#endif
+    }
+    
+private:
+    static fs::path canonical(const fs::path& path) {
+        std::error_code ec;
+        auto resolved = fs::weakly_canonical(path, ec);
+        return ec || resolved.empty() ? path : resolved;
+    }
+    
+#ifdef __linux__
+    static constexpr uint32_t MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVE_SELF | IN_ONLYDIR;
+    
+    int addTree(const fs::path& directory, const std::string& prefix) {
+        const int wd = ::inotify_add_watch(fd, directory.c_str(), MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC && !warnedLimit) {
+                std::cerr << "Warning: Out of inotify watches at " << directory
+                          << "; raise fs.inotify.max_user_watches to watch every subdirectory\n";
+                warnedLimit = true;
+            }
+            return -1;
+        }
+        // A directory moved within the tree keeps its descriptor and gets its new name here
+        prefixes[wd] = prefix;
+        if (!recursive) return wd;
+        
+        std::error_code ec;
+        for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+            std::error_code statusError;
+            if (!fs::is_directory(it->symlink_status(statusError)) || it->path() == excluded) continue;
+            addTree(it->path(), prefix + it->path().filename().string() + '/');
+        }
+        return wd;
+    }
+    
+    bool handle(const inotify_event& event, Changes& changes) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            changes.overflowed = true;
+            return true;
+        }
+        const auto it = prefixes.find(event.wd);
+        if (it == prefixes.end()) return true;
+        if (event.mask & (IN_IGNORED | IN_MOVE_SELF)) {
+            if (event.wd == rootWatch) return false;
+            if (event.mask & IN_IGNORED) prefixes.erase(it);
+            return true;
+        }
+        if (event.len == 0) return true;
+        
+        const std::string relative = it->second + event.name;
+        if (event.mask & IN_ISDIR) {
+            if (recursive && (event.mask & (IN_CREATE | IN_MOVED_TO)) && root / relative != excluded) {
+                addTree(root / relative, relative + '/');
+                changes.directories.push_back(relative);
+            }
+        } else if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            changes.files.push_back(relative);
+        }
+        return true;
+    }
+#endif
+};
+
+// File processing task for better parallelization
+struct FileTask {
+    std::string key;  // path relative to the input folder; names the entry in the manifest
     fs::path inputFile;
     fs::path outputFile;
     size_t fileSize;
+    IncrementalManifest::Snapshot snapshot;  // input metadata as seen by the scan
+    uint64_t contentHash = 0;                // filled in by the dedup stage when it hashed the input
+    fs::path cloneFrom;                      // zip of identical content to reuse, if any
+    fs::path cloneInput;                     // the input that zip was made from
+    
+    FileTask(std::string relative, fs::path input, fs::path output, size_t size, IncrementalManifest::Snapshot snap)
+        : key(std::move(relative)), inputFile(std::move(input)), outputFile(std::move(output)), fileSize(size),
+          snapshot(snap) {}
+    
+    // Name of the entry inside its zip. It comes from the key, not the input
+    // path, which for a listed file or an in-memory buffer may differ.
+    std::string entryName() const { return fs::path(key).filename().string(); }
+};
+
+// files-list.json, kept current while a run progresses. Existing entries are
+// loaded once and merged by name with what this run produces. The listing is
+// rewritten to a temp file and renamed over the old one at most every couple
+// of seconds, and once more at the end, so the MyStorage page never reads a
+// half-written file and earlier uploads stay listed. In latency mode a
+// background thread writes it shortly after every change instead.
+class FileListWriter {
+public:
+    using Publisher = std::function<void(const std::vector<fs::path>&)>;
+    
+private:
+    static constexpr std::string_view FILE_NAME = "files-list.json";
+    static constexpr auto FLUSH_INTERVAL = std::chrono::seconds(2);
+    static constexpr std::string_view INDEX_FOLDER = "files-index";
+    static constexpr std::string_view INDEX_NAME = "index.json";
+    
+    // One member of an entry. Strings are kept unescaped; any other value as
+    // its JSON text, so members added by hand survive a rewrite.
+    struct Field {
+        std::string key;
+        std::string value;
+        bool raw = false;
+    };
+    using Fields = std::vector<Field>;  // in file order
+    // Shared and never changed once listed, so a write renders a snapshot of
+    // the listing without holding up add()
+    using Entry = std::shared_ptr<const Fields>;
+    
+    struct IndexPage {
+        uint64_t hash = 0;
+        size_t count = 0;
+        size_t bytes = 0;
+        int64_t mtime = 0;
+    };
+    
+    const fs::path listPath;
+    const fs::path indexFolder;
+    const size_t pageSize;
+    
+    // The files on disk, under writeMutex; taken before `mutex` when both are
+    std::mutex writeMutex;
+    std::vector<IndexPage> pages;    // as last written
+    bool pagesKnown = false;         // false until compared with the pages on disk
+    std::vector<size_t> dirtyPages;  // rewritten since takeIndexWrites()
+    bool rootDirty = false;
+    
+    // The entries, under mutex
+    std::vector<Entry> items;
+    std::unordered_map<std::string, size_t> byName;
+    size_t added = 0;
+    bool changed = false;
+    std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    
+    std::thread publisher;
+    std::condition_variable publishWake;
+    std::chrono::milliseconds publishDelay{0};
+    Publisher publish;
+    bool unpublished = false;
+    bool stopping = false;
+    
+public:
+    explicit FileListWriter(const fs::path& outputFolder)
+        : listPath(outputFolder / FILE_NAME),
+          indexFolder(outputFolder / INDEX_FOLDER),
+          pageSize(Config::getIndexPageSize()) {}
+    
+    ~FileListWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        publishWake.notify_all();
+        if (publisher.joinable()) publisher.join();
+    }
+    
+    FileListWriter(const FileListWriter&) = delete;
+    FileListWriter& operator=(const FileListWriter&) = delete;
+    
+    // Write the listing, and hand the files written to onWrite, at most
+    // `delay` after each add() from now on, rather than on the first add()
+    // once FLUSH_INTERVAL has passed. Later calls keep the first settings.
+    void publishContinuously(std::chrono::milliseconds delay, Publisher onWrite) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (publisher.joinable()) return;
+        publishDelay = delay;
+        publish = std::move(onWrite);
+        publisher = std::thread([this]() { publishLoop(); });
+    }
+    
+    void load() {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.clear();
+        byName.clear();
+        
+        std::ifstream in(listPath, std::ios::binary);
+        if (!in.is_open()) return;
+        const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        
+        std::vector<Fields> parsed;
+        if (!JsonReader(text).readListing(parsed)) {
+            // Kept for whoever can repair it; the new listing would replace it
+            in.close();
+            auto aside = listPath;
+            aside += ".bad";
+            std::error_code ec;
+            fs::rename(listPath, aside, ec);
+            if (ec) {
+                throw std::runtime_error(listPath.string() + " is not a valid listing and cannot be moved aside: " +
+                                         ec.message());
+            }
+            std::cerr << "Warning: " << listPath << " is not a valid listing; moved it to " << aside
+                      << " and starting a new one\n";
+            return;
+        }
+        for (auto& fields : parsed) {
+            const auto name = field(fields, "name");
+            if (name.empty()) continue;
+            const auto slot = byName.try_emplace(name, items.size());
+            auto entry = std::make_shared<const Fields>(std::move(fields));
+            if (slot.second) {
+                items.push_back(std::move(entry));
+            } else {
+                items[slot.first->second] = std::move(entry);
+            }
+        }
+    }
+    
+    // Add or replace the entry for one finished output
+    void add(const FileMetadata& file) {
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        // An input moving into or out of a bundle changes its listed name
+        std::string name(file.name);
+        const auto other = file.bundle.empty() ? unbundledName(name) : name + ".zip";
+        if (const auto it = byName.find(other); it != byName.end()) {
+            const bool bundled = !field(*items[it->second], "bundle").empty();
+            if (bundled == file.bundle.empty()) erase(it->second);
+        }
+        
+        Fields fields{{"name", name}, {"type", std::string(file.type)}};
+        if (!file.bundle.empty()) fields.push_back({"bundle", std::string(file.bundle)});
+        const auto slot = byName.try_emplace(std::move(name), items.size());
+        if (slot.second) {
+            items.push_back(std::make_shared<const Fields>(std::move(fields)));
+        } else {
+            // Keep members this program doesn't write, e.g. ones added by hand
+            auto& existing = items[slot.first->second];
+            for (const auto& member : *existing) {
+                if (member.key != "name" && member.key != "type" && member.key != "bundle") {
+                    fields.push_back(member);
+                }
+            }
+            existing = std::make_shared<const Fields>(std::move(fields));
+        }
+        ++added;
+        changedLocked();
+    }
+    
+    // Drop the entry of an output that no longer exists
+    void remove(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = byName.find(name);
+        if (it == byName.end()) return;
+        erase(it->second);
+        changedLocked();
+    }
+    
+    // Drop the members still listed in a bundle that was deleted, or those of
+    // a rebuilt one that are not in `keep`
+    void removeBundle(const std::string& bundle, const std::unordered_set<std::string>& keep = {}) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool removed = false;
+        // Backwards, since erase() moves the last entry into the gap
+        for (size_t i = items.size(); i-- > 0;) {
+            if (field(*items[i], "bundle") != bundle || keep.count(field(*items[i], "name")) > 0) continue;
+            erase(i);
+            removed = true;
+        }
+        if (removed) changedLocked();
+    }
+    
+    // Whether finish() has anything to write
+    bool hasChanges() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return changed;
+    }
+    
+    // Final write; skipped when the run produced nothing. True if written.
+    bool finish() {
+        std::lock_guard<std::mutex> writing(writeMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!changed) {
+            console() << "No files processed, skipping JSON generation.\n";
+            return false;
+        }
+        unpublished = false;
+        const auto snapshot = items;
+        const size_t updated = added;
+        lock.unlock();
+        if (!writeEntries(snapshot)) return false;
+        console() << "📄 Updated " << FILE_NAME << ": " << updated << " added or updated, " << snapshot.size()
+                  << " entries";
+        if (pageSize > 0) console() << " (" << pages.size() << " index pages)";
+        console() << '\n';
+        return true;
+    }
+    
+    const fs::path& path() const { return listPath; }
+    
+    // Index files rewritten since the last call, pages first and index.json
+    // last, so a copy made in this order never names a missing page
+    std::vector<fs::path> takeIndexWrites() {
+        std::lock_guard<std::mutex> writing(writeMutex);
+        return takeIndexWritesLocked();
+    }
+    
+    static std::string escape(std::string_view str) {
+        std::string escaped;
+        escaped.reserve(str.size() + 16); // Reserve some extra space for escapes
+        
+        for (char c : str) {
+            switch (c) {
+                case '"':  escaped += "\\\""; break;
+                case '\\': escaped += "\\\\"; break;
+                case '\b': escaped += "\\b"; break;
+                case '\f': escaped += "\\f"; break;
+                case '\n': escaped += "\\n"; break;
+                case '\r': escaped += "\\r"; break;
+                case '\t': escaped += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        // Control characters; UTF-8 bytes pass through
+                        escaped += "\\u";
+                        char buf[5];
+                        std::snprintf(buf, sizeof(buf), "%04x", static_cast<unsigned char>(c));
+                        escaped += buf;
+                    } else {
+                        escaped += c;
+                    }
+                    break;
+            }
+        }
+        
+        return escaped;
+    }
+    
+private:
+    std::vector<fs::path> takeIndexWritesLocked() {
+        std::sort(dirtyPages.begin(), dirtyPages.end());
+        dirtyPages.erase(std::unique(dirtyPages.begin(), dirtyPages.end()), dirtyPages.end());
+        std::vector<fs::path> files;
+        for (const auto page : dirtyPages) {
+            if (page < pages.size()) files.push_back(indexFolder / pageName(page));
+        }
+        if (rootDirty) files.push_back(indexFolder / INDEX_NAME);
+        dirtyPages.clear();
+        rootDirty = false;
+        return files;
+    }
+    
+    // The first change after a quiet spell waits out the delay, so the files
+    // finishing with it go out in the same write. The listing is rendered and
+    // written from a snapshot, so workers finishing files meanwhile only wait
+    // for the copy of the entry pointers.
+    void publishLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            publishWake.wait(lock, [this]() { return stopping || unpublished; });
+            if (stopping) return;
+            if (publishWake.wait_for(lock, publishDelay, [this]() { return stopping; })) return;
+            if (!unpublished) continue;  // finish() wrote it meanwhile
+            
+            lock.unlock();
+            std::unique_lock<std::mutex> writing(writeMutex);
+            lock.lock();
+            if (stopping) return;
+            if (!unpublished) continue;
+            unpublished = false;
+            const auto snapshot = items;
+            lock.unlock();
+            
+            std::vector<fs::path> files;
+            const bool written = writeEntries(snapshot);
+            if (written) files = takeIndexWritesLocked();
+            writing.unlock();
+            if (written) {
+                files.insert(files.begin(), listPath);
+                publish(files);
+            }
+            lock.lock();
+        }
+    }
+    
+    static std::string field(const Fields& fields, std::string_view key) {
+        for (const auto& member : fields) {
+            if (member.key == key && !member.raw) return member.value;
+        }
+        return {};
+    }
+    
+    static std::string unbundledName(const std::string& zipName) {
+        constexpr std::string_view suffix = ".zip";
+        if (zipName.size() <= suffix.size() || zipName.compare(zipName.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return {};
+        }
+        return zipName.substr(0, zipName.size() - suffix.size());
+    }
+    
+    void changedLocked() {
+        changed = true;
+        if (publisher.joinable()) {
+            unpublished = true;
+            publishWake.notify_one();
+        } else if (std::chrono::steady_clock::now() - lastFlush >= FLUSH_INTERVAL) {
+            // Under `mutex` already, so only if no other write is under way
+            std::unique_lock<std::mutex> writing(writeMutex, std::try_to_lock);
+            if (!writing) return;
+            lastFlush = std::chrono::steady_clock::now();
+            writeEntries(items);
+        }
+    }
+    
+    void erase(size_t index) {
+        // Swap with the last entry to keep removal O(1)
+        byName.erase(field(*items[index], "name"));
+        if (index + 1 != items.size()) {
+            items[index] = std::move(items.back());
+            byName[field(*items[index], "name")] = index;
+        }
+        items.pop_back();
+    }
+    
+    // The listing and its index as of `snapshot`; under writeMutex
+    bool writeEntries(std::span<const Entry> snapshot) {
+        std::vector<const Fields*> entries;
+        entries.reserve(snapshot.size());
+        for (const auto& fields : snapshot) entries.push_back(fields.get());
+        
+        if (!replaceFile(listPath, render(entries))) return false;
+        if (pageSize > 0) {
+            writeIndexLocked(entries);
+        } else if (!pagesKnown) {
+            // Paging turned off: drop the index so the page falls back to the full listing
+            std::error_code ec;
+            fs::remove_all(indexFolder, ec);
+            pagesKnown = true;
+        }
+        return true;
+    }
+    
+    // The listing again in pages of pageSize entries, in listing order, plus
+    // index.json with each page's count, size, mtime and hash. Entries are
+    // replaced in place and added at the end, so a run only rewrites the
+    // pages it touched and the page can keep the rest cached by hash.
+    void writeIndexLocked(std::span<const Fields* const> entries) {
+        std::error_code ec;
+        fs::create_directories(indexFolder, ec);
+        
+        const size_t count = (entries.size() + pageSize - 1) / pageSize;
+        const size_t previous = pages.size();
+        bool indexChanged = !pagesKnown || count != previous;
+        pages.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            const auto slice = entries.subspan(i * pageSize, std::min(pageSize, entries.size() - i * pageSize));
+            const auto text = render(slice);
+            ContentHasher hasher;
+            hasher.update(text.data(), text.size());
+            const uint64_t hash = hasher.digest();
+            
+            auto& page = pages[i];
+            const auto file = indexFolder / pageName(i);
+            if (i < previous && pagesKnown && page.hash == hash && page.count == slice.size()) continue;
+            // After a restart, compare with what the last run left on disk
+            if (!pagesKnown && sameContent(file, text)) {
+                page = {hash, slice.size(), text.size(), modifiedTime(file)};
+                continue;
+            }
+            if (!replaceFile(file, text)) {
+                // Unknown state; compare again on the next write
+                pagesKnown = false;
+                return;
+            }
+            page = {hash, slice.size(), text.size(), modifiedTime(file)};
+            dirtyPages.push_back(i);
+            indexChanged = true;
+        }
+        
+        // Pages past the end, from this process or an earlier one
+        for (size_t i = count; pagesKnown ? i < previous : fs::exists(indexFolder / pageName(i), ec); ++i) {
+            fs::remove(indexFolder / pageName(i), ec);
+        }
+        pagesKnown = true;
+        if (!indexChanged) return;
+        
+        std::string root = "{\n    \"version\": 1,\n    \"total\": " + std::to_string(entries.size()) +
+                           ",\n    \"pageSize\": " + std::to_string(pageSize) + ",\n    \"pages\": [\n";
+        char hex[17];
+        for (size_t i = 0; i < count; ++i) {
+            const auto& page = pages[i];
+            std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(page.hash));
+            root += "        {\"file\": \"" + pageName(i) + "\", \"count\": " + std::to_string(page.count) +
+                    ", \"bytes\": " + std::to_string(page.bytes) + ", \"mtime\": " + std::to_string(page.mtime) +
+                    ", \"hash\": \"" + hex + "\"}" + (i + 1 < count ? ",\n" : "\n");
+        }
+        root += "    ]\n}\n";
+        if (replaceFile(indexFolder / INDEX_NAME, root)) rootDirty = true;
+    }
+    
+    static std::string pageName(size_t index) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "page-%05zu.json", index);
+        return name;
+    }
+    
+    static std::string render(std::span<const Fields* const> entries) {
+        std::string out = "[\n";
+        for (size_t i = 0; i < entries.size(); ++i) {
+            out += "    {\n";
+            const auto& fields = *entries[i];
+            for (size_t f = 0; f < fields.size(); ++f) {
+                const auto& member = fields[f];
+                out += "        \"" + escape(member.key) + "\": ";
+                out += member.raw ? member.value : '"' + escape(member.value) + '"';
+                out += f + 1 < fields.size() ? ",\n" : "\n";
+            }
+            out += i + 1 < entries.size() ? "    },\n" : "    }\n";
+        }
+        out += "]\n";
+        return out;
+    }
+    
+    // Write to a temp file renamed over the target, so readers never see a partial file
+    static bool replaceFile(const fs::path& target, std::string_view text) {
+        const auto name = target.filename().string();
+        const auto tempPath = target.parent_path() / ("." + name + ".part");
+        {
+            std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                std::cerr << "Failed to create " << name << '\n';
+                return false;
+            }
+            out.write(text.data(), static_cast<std::streamsize>(text.size()));
+            out.flush();
+            if (!out) {
+                std::cerr << "Error generating " << name << ": write failed\n";
+                return false;
+            }
+        }
+        
+        try {
+            durableRename(tempPath, target);
+        } catch (const std::exception& e) {
+            std::cerr << "Error generating " << name << ": " << e.what() << '\n';
+            return false;
+        }
+        return true;
+    }
+    
+    static bool sameContent(const fs::path& file, std::string_view text) {
+        std::error_code ec;
+        if (fs::file_size(file, ec) != text.size() || ec) return false;
+        std::ifstream in(file, std::ios::binary);
+        const std::string existing((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return existing == text;
+    }
+    
+    static int64_t modifiedTime(const fs::path& file) {
+        struct stat st{};
+        return ::stat(file.c_str(), &st) == 0 ? static_cast<int64_t>(st.st_mtime) : static_cast<int64_t>(std::time(nullptr));
+    }
+    
+    // Just enough JSON for the listing: an array of objects. String members
+    // are unescaped; any other value is checked and kept as written.
+    class JsonReader {
+    private:
+        std::string_view text;
+        size_t pos = 0;
+        
+    public:
+        explicit JsonReader(std::string_view input) : text(input) {}
+        
+        bool readListing(std::vector<Fields>& out) {
+            if (!consume('[')) return false;
+            if (consume(']')) return atEnd();
+            do {
+                Fields fields;
+                if (!readObject(fields)) return false;
+                out.push_back(std::move(fields));
+            } while (consume(','));
+            return consume(']') && atEnd();
+        }
+        
+    private:
+        void skipSpace() {
+            while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+        }
+        
+        bool consume(char c) {
+            skipSpace();
+            if (pos < text.size() && text[pos] == c) {
+                ++pos;
+                return true;
+            }
+            return false;
+        }
+        
+        bool atEnd() {
+            skipSpace();
+            return pos == text.size();
+        }
+        
+        bool readObject(Fields& fields) {
+            if (!consume('{')) return false;
+            if (consume('}')) return true;
+            do {
+                std::string key;
+                std::string value;
+                if (!readString(key) || !consume(':')) return false;
+                skipSpace();
+                if (pos < text.size() && text[pos] == '"') {
+                    if (!readString(value)) return false;
+                    fields.push_back({std::move(key), std::move(value)});
+                } else {
+                    const size_t start = pos;
+                    if (!skipValue()) return false;
+                    fields.push_back({std::move(key), std::string(text.substr(start, pos - start)), true});
+                }
+            } while (consume(','));
+            return consume('}');
+        }
+        
+        bool skipValue() {
+            skipSpace();
+            if (pos >= text.size()) return false;
+            std::string ignored;
+            switch (text[pos]) {
+                case '"': return readString(ignored);
+                case '{': {
+                    Fields nested;
+                    return readObject(nested);
+                }
+                case '[':
+                    ++pos;
+                    if (consume(']')) return true;
+                    do {
+                        if (!skipValue()) return false;
+                    } while (consume(','));
+                    return consume(']');
+                default: {
+                    // Numbers, true, false, null
+                    const size_t start = pos;
+                    while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) ||
+                                                 text[pos] == '-' || text[pos] == '+' || text[pos] == '.')) {
+                        ++pos;
+                    }
+                    return pos > start;
+                }
+            }
+        }
+        
+        bool readString(std::string& out) {
+            if (!consume('"')) return false;
+            while (pos < text.size()) {
+                const char c = text[pos++];
+                if (c == '"') return true;
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+                if (pos >= text.size()) return false;
+                switch (text[pos++]) {
+                    case '"': out += '"'; break;
+                    case '\\': out += '\\'; break;
+                    case '/': out += '/'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u': {
+                        uint32_t code = 0;
+                        if (!readHex4(code)) return false;
+                        // Surrogate pair
+                        if (code >= 0xD800 && code < 0xDC00 && text.substr(pos, 2) == "\\u") {
+                            pos += 2;
+                            uint32_t low = 0;
+                            if (!readHex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        appendUtf8(out, code);
+                        break;
+                    }
+                    default: return false;
+                }
+            }
+            return false;
+        }
+        
+        bool readHex4(uint32_t& code) {
+            if (pos + 4 > text.size()) return false;
+            const auto [end, ec] = std::from_chars(text.data() + pos, text.data() + pos + 4, code, 16);
+            if (ec != std::errc() || end != text.data() + pos + 4) return false;
+            pos += 4;
+            return true;
+        }
+        
+        static void appendUtf8(std::string& out, uint32_t code) {
+            if (code < 0x80) {
+                out += static_cast<char>(code);
+            } else if (code < 0x800) {
+                out += static_cast<char>(0xC0 | (code >> 6));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            } else if (code < 0x10000) {
+                out += static_cast<char>(0xE0 | (code >> 12));
+                out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            } else {
+                out += static_cast<char>(0xF0 | (code >> 18));
+                out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (code & 0x3F));
+            }
+        }
+    };
+};
+
+// Machine-readable progress for the GUI and monitoring: one JSON object per
+// line (NDJSON) on a file descriptor, a Unix socket or a file, per
+// ZIPPER_EVENTS. Workers format their event and append it to a batch under a
+// short lock; a sampler thread writes the batch out every interval followed
+// by a progress sample, so the consumer gets one write per interval however
+// fast files finish. Run counters are kept even without a stream, for the
+// metrics endpoint.
+class ProgressEvents {
+public:
+    using Clock = std::chrono::steady_clock;
+    
+private:
+    // A consumer that stops reading costs at most this much memory, and the
+    // end of a run waits at most FLUSH_WAIT for it before moving on
+    static constexpr size_t BACKLOG_LIMIT = 1024 * 1024;
+    static constexpr std::chrono::milliseconds FLUSH_WAIT{1000};
+    
+    const ThreadSafeStats& stats;
+    int fd = -1;
+    bool ownsFd = false;
+    std::atomic<bool> broken{false};
+    std::chrono::milliseconds interval{500};
+    std::string backlog;   // whole lines the stream has not taken yet; one writer at a time
+    uint64_t dropped = 0;  // lines discarded while the backlog was full
+    
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::string pending;
+    std::string finale;  // last sample and summary, written when the sampler stops
+    bool stopping = false;
+    std::thread sampler;
+    
+    std::atomic<bool> active{false};
+    std::atomic<uint64_t> runFiles{0};
+    std::atomic<uint64_t> runBytes{0};
+    std::atomic<uint64_t> filesDone{0};
+    std::atomic<uint64_t> filesFailed{0};
+    std::atomic<uint64_t> bytesDone{0};
+    Clock::time_point runStart = Clock::now();
+    std::function<void()> listener;
+    uint64_t readBase = 0;
+    uint64_t writtenBase = 0;
+    
+    // Previous sample, relative to the run, for per-interval rates
+    Clock::time_point lastSample;
+    uint64_t lastDone = 0;
+    uint64_t lastRead = 0;
+    uint64_t lastWritten = 0;
+    
+public:
+    explicit ProgressEvents(const ThreadSafeStats& statistics) : stats(statistics) {}
+    
+    ~ProgressEvents() {
+        stopSampler();
+        if (ownsFd && fd >= 0) ::close(fd);
+    }
+    
+    ProgressEvents(const ProgressEvents&) = delete;
+    ProgressEvents& operator=(const ProgressEvents&) = delete;
+    
+    // Connect the stream ZIPPER_EVENTS names, if any. A bad target only warns.
+    void open() {
+        const auto target = Config::getEventsTarget();
+        if (target.empty() || fd >= 0) return;
+        
+        if (target.rfind("fd:", 0) == 0) {
+            int number = -1;
+            const auto* begin = target.data() + 3;
+            const auto [end, ec] = std::from_chars(begin, target.data() + target.size(), number);
+            if (ec == std::errc() && end == target.data() + target.size() && number >= 0 && ::fcntl(number, F_GETFD) != -1) {
+                fd = number;
+            }
+        } else if (target.rfind("unix:", 0) == 0) {
+            const auto path = target.substr(5);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            const int sock = path.size() < sizeof(addr.sun_path) ? ::socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+            if (sock >= 0) {
+                std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+                if (::connect(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+                    fd = sock;
+                    ownsFd = true;
+                } else {
+                    ::close(sock);
+                }
+            }
+        } else {
+            fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ownsFd = fd >= 0;
+        }
+        
+        if (fd < 0) {
+            std::cerr << "Warning: Cannot open event stream " << target << "; continuing without it\n";
+            return;
+        }
+        interval = std::chrono::milliseconds(Config::getEventsInterval());
+        // A consumer that goes away must not take the run down with it, and
+        // one that stalls must not stall it
+        std::signal(SIGPIPE, SIG_IGN);
+        if (const int flags = ::fcntl(fd, F_GETFL); flags >= 0) ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    
+    bool enabled() const { return fd >= 0 && !broken.load(std::memory_order_relaxed); }
+    
+    bool running() const { return active.load(std::memory_order_relaxed); }
+    uint64_t plannedFiles() const { return runFiles.load(std::memory_order_relaxed); }
+    uint64_t plannedBytes() const { return runBytes.load(std::memory_order_relaxed); }
+    uint64_t doneFiles() const { return filesDone.load(std::memory_order_relaxed); }
+    uint64_t failedFiles() const { return filesFailed.load(std::memory_order_relaxed); }
+    uint64_t doneBytes() const { return bytesDone.load(std::memory_order_relaxed); }
+    
+    // Called at the start of a run and after each finished or failed file,
+    // on the thread that did it. Set between runs only.
+    void setListener(std::function<void()> callback) { listener = std::move(callback); }
+    
+    void runStarted(size_t files, uint64_t bytes, size_t bundles, size_t workers) {
+        stopSampler();
+        runFiles = files;
+        runBytes = bytes;
+        filesDone = 0;
+        filesFailed = 0;
+        bytesDone = 0;
+        runStart = lastSample = Clock::now();
+        readBase = StageTimers::global().bytesIn(StageTimers::Stage::Read);
+        writtenBase = StageTimers::global().bytesIn(StageTimers::Stage::Write);
+        lastDone = lastRead = lastWritten = 0;
+        active = true;
+        if (listener) listener();
+        if (!enabled()) return;
+        
+        std::string line = "{\"event\":\"start\",\"files\":" + std::to_string(files) + ",\"bytes\":" + std::to_string(bytes)
+            + ",\"bundles\":" + std::to_string(bundles) + ",\"skipped\":" + std::to_string(stats.totals().skipped)
+            + ",\"workers\":" + std::to_string(workers) + "}\n";
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending += line;
+            stopping = false;
+        }
+        sampler = std::thread([this]() { sampleLoop(); });
+    }
+    
+    // `output` is the archive holding the input, relative to the output folder
+    void fileDone(const std::string& name, const std::string& output, const std::string& bundle,
+                  uint64_t inputBytes, uint64_t outputBytes, Clock::duration elapsed, bool deduplicated) {
+        filesDone.fetch_add(1, std::memory_order_relaxed);
+        bytesDone.fetch_add(inputBytes, std::memory_order_relaxed);
+        if (listener) listener();
+        if (!enabled()) return;
+        
+        std::string line = "{\"event\":\"file\",\"status\":\"done\",\"name\":\"" + FileListWriter::escape(name)
+            + "\",\"output\":\"" + FileListWriter::escape(output) + '"';
+        if (!bundle.empty()) line += ",\"bundle\":\"" + FileListWriter::escape(bundle) + '"';
+        line += ",\"input_bytes\":" + std::to_string(inputBytes) + ",\"output_bytes\":" + std::to_string(outputBytes)
+            + ",\"ms\":" + formatMillis(elapsed);
+        if (deduplicated) line += ",\"deduplicated\":true";
+        line += "}\n";
+        append(line);
+    }
+    
+    void fileFailed(const std::string& name, std::string_view error) {
+        filesFailed.fetch_add(1, std::memory_order_relaxed);
+        if (listener) listener();
+        if (!enabled()) return;
+        append("{\"event\":\"file\",\"status\":\"failed\",\"name\":\"" + FileListWriter::escape(name)
+               + "\",\"error\":\"" + FileListWriter::escape(error) + "\"}\n");
+    }
+    
+    void bundleDone(const std::string& name, size_t files, uint64_t inputBytes, uint64_t outputBytes) {
+        if (!enabled()) return;
+        append("{\"event\":\"bundle\",\"name\":\"" + FileListWriter::escape(name) + "\",\"files\":" + std::to_string(files)
+               + ",\"input_bytes\":" + std::to_string(inputBytes) + ",\"output_bytes\":" + std::to_string(outputBytes) + "}\n");
+    }
+    
+    // Final sample and the run summary, written out before this returns
+    void runFinished(bool ok) {
+        active = false;
+        if (!enabled()) {
+            stopSampler();
+            return;
+        }
+        
+        const auto t = stats.totals();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - runStart);
+        const std::string summary = "{\"event\":\"summary\",\"ok\":" + std::string(ok ? "true" : "false")
+            + ",\"files\":" + std::to_string(t.files) + ",\"processed\":" + std::to_string(t.processed)
+            + ",\"skipped\":" + std::to_string(t.skipped) + ",\"failed\":" + std::to_string(t.failed)
+            + ",\"deduplicated\":" + std::to_string(t.deduplicated) + ",\"input_bytes\":" + std::to_string(t.inputBytes)
+            + ",\"output_bytes\":" + std::to_string(t.outputBytes) + ",\"ms\":" + std::to_string(elapsed.count())
+            + ",\"stage_ms\":" + stageMillis() + "}\n";
+        
+        if (sampler.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finale = summary;
+            }
+            stopSampler();
+        } else {
+            writeOut(summary, true);
+        }
+    }
+    
+private:
+    void append(const std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += line;
+    }
+    
+    void stopSampler() {
+        if (!sampler.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        sampler.join();
+    }
+    
+    void sampleLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait_for(lock, interval, [this]() { return stopping; });
+            const bool last = stopping;
+            std::string batch = std::move(pending);
+            pending.clear();
+            std::string tail = last ? std::move(finale) : std::string();
+            finale.clear();
+            lock.unlock();
+            
+            batch += progressLine();
+            batch += tail;
+            writeOut(batch, last);
+            
+            lock.lock();
+            if (last) return;
+        }
+    }
+    
+    std::string progressLine() {
+        const auto now = Clock::now();
+        const uint64_t done = doneBytes();
+        const uint64_t read = StageTimers::global().bytesIn(StageTimers::Stage::Read) - readBase;
+        const uint64_t written = StageTimers::global().bytesIn(StageTimers::Stage::Write) - writtenBase;
+        const double seconds = std::chrono::duration<double>(now - lastSample).count();
+        const auto rate = [seconds](uint64_t current, uint64_t previous) {
+            return std::to_string(seconds > 0 ? static_cast<uint64_t>(static_cast<double>(current - previous) / seconds) : 0);
+        };
+        
+        std::string line = "{\"event\":\"progress\",\"elapsed_ms\":"
+            + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - runStart).count())
+            + ",\"files_done\":" + std::to_string(doneFiles()) + ",\"files_failed\":" + std::to_string(failedFiles())
+            + ",\"files_total\":" + std::to_string(plannedFiles()) + ",\"bytes_done\":" + std::to_string(done)
+            + ",\"bytes_total\":" + std::to_string(plannedBytes()) + ",\"bytes_read\":" + std::to_string(read)
+            + ",\"bytes_written\":" + std::to_string(written) + ",\"done_bps\":" + rate(done, lastDone)
+            + ",\"read_bps\":" + rate(read, lastRead) + ",\"write_bps\":" + rate(written, lastWritten)
+            + "}\n";
+        
+        lastSample = now;
+        lastDone = done;
+        lastRead = read;
+        lastWritten = written;
+        return line;
+    }
+    
+    // Writes what the non-blocking stream takes now and keeps the rest for
+    // the next batch. Batches that find the backlog full are dropped, and a
+    // "dropped" event says how many lines were lost. `flush` waits up to
+    // FLUSH_WAIT for the stream to take everything.
+    void writeOut(const std::string& data, bool flush = false) {
+        if (backlog.size() + data.size() > BACKLOG_LIMIT) {
+            dropped += static_cast<uint64_t>(std::count(data.begin(), data.end(), '\n'));
+        } else {
+            if (dropped > 0) {
+                backlog += "{\"event\":\"dropped\",\"lines\":" + std::to_string(dropped) + "}\n";
+                dropped = 0;
+            }
+            backlog += data;
+        }
+        
+        const auto deadline = Clock::now() + FLUSH_WAIT;
+        size_t done = 0;
+        while (done < backlog.size() && !broken.load(std::memory_order_relaxed)) {
+            const ssize_t n = ::write(fd, backlog.data() + done, backlog.size() - done);
+            if (n > 0) {
+                done += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+                if (!flush || left.count() <= 0) break;
+                pollfd ready{fd, POLLOUT, 0};
+                ::poll(&ready, 1, static_cast<int>(left.count()));
+                continue;
+            }
+            std::cerr << "Warning: Event stream closed (" << std::strerror(errno) << "); continuing without it\n";
+            broken = true;
+            backlog.clear();
+            return;
+        }
+        backlog.erase(0, done);
+    }
+    
+    // Stage totals since the process started, worker idle time included
+    static std::string stageMillis() {
+        const auto& timers = StageTimers::global();
+        std::string out = "{";
+        for (size_t i = 0; i < StageTimers::STAGE_COUNT; ++i) {
+            out += '"' + std::string(StageTimers::STAGE_NAMES[i]) + "\":"
+                + formatMillis(std::chrono::nanoseconds(timers.nanosIn(static_cast<StageTimers::Stage>(i)))) + ',';
+        }
+        out += "\"worker_idle\":" + formatMillis(std::chrono::nanoseconds(timers.workerIdleNanos()))
+            + ",\"worker_total\":" + formatMillis(std::chrono::nanoseconds(timers.workerNanos())) + '}';
+        return out;
+    }
     
-    FileTask(fs::path input, fs::path output, size_t size)
-        : inputFile(std::move(input)), outputFile(std::move(output)), fileSize(size) {}
+    static std::string formatMillis(Clock::duration elapsed) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", std::chrono::duration<double, std::milli>(elapsed).count());
+        return buf;
+    }
+};
+
+// Prometheus text exposition on 127.0.0.1:ZIPPER_METRICS_PORT, for runs long
+// enough to be scraped. One thread answers every request, whatever its path,
+// with the counters as they are now.
+class MetricsEndpoint {
+private:
+    const ThreadSafeStats& stats;
+    const ProgressEvents& progress;
+    int listenFd = -1;
+    std::atomic<bool> stopping{false};
+    std::thread server;
+    
+public:
+    MetricsEndpoint(const ThreadSafeStats& statistics, const ProgressEvents& events)
+        : stats(statistics), progress(events) {}
+    
+    ~MetricsEndpoint() {
+        stopping = true;
+        if (server.joinable()) server.join();
+        if (listenFd >= 0) ::close(listenFd);
+    }
+    
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+    
+    // A port that can't be bound only warns
+    void start(int port) {
+        listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) return;
+        const int reuse = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listenFd, 16) != 0) {
+            std::cerr << "Warning: Cannot serve metrics on port " << port << " (" << std::strerror(errno) << ")\n";
+            ::close(listenFd);
+            listenFd = -1;
+            return;
+        }
+        std::signal(SIGPIPE, SIG_IGN);
+        console() << "Metrics: http://127.0.0.1:" << port << "/metrics\n";
+        server = std::thread([this]() { serve(); });
+    }
+    
+private:
+    void serve() {
+        while (!stopping.load(std::memory_order_relaxed)) {
+            pollfd ready{listenFd, POLLIN, 0};
+            if (::poll(&ready, 1, 200) <= 0) continue;
+            const int client = ::accept(listenFd, nullptr, nullptr);
+            if (client < 0) continue;
+            respond(client);
+            ::close(client);
+        }
+    }
+    
+    void respond(int client) const {
+        // Read the request so closing doesn't reset the connection; its content doesn't matter
+        const timeval timeout{1, 0};
+        ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[4096];
+        [[maybe_unused]] const auto received = ::recv(client, request, sizeof(request), 0);
+        
+        const auto body = render();
+        const auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            const ssize_t n = ::send(client, response.data() + sent, response.size() - sent, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            sent += static_cast<size_t>(n);
+        }
+    }
+    
+    std::string render() const {
+        using Stage = StageTimers::Stage;
+        const auto& timers = StageTimers::global();
+        const auto t = stats.totals();
+        std::ostringstream out;
+        out << std::setprecision(9);
+        
+        family(out, "zipper_files_total", "counter", "Input files by outcome.");
+        out << "zipper_files_total{outcome=\"processed\"} " << t.processed << '\n'
+            << "zipper_files_total{outcome=\"failed\"} " << t.failed << '\n'
+            << "zipper_files_total{outcome=\"skipped\"} " << t.skipped << '\n';
+        family(out, "zipper_files_deduplicated_total", "counter", "Outputs reused from an identical input.");
+        out << "zipper_files_deduplicated_total " << t.deduplicated << '\n';
+        family(out, "zipper_input_bytes_total", "counter", "Input bytes taken on for zipping.");
+        out << "zipper_input_bytes_total " << t.inputBytes << '\n';
+        family(out, "zipper_output_bytes_total", "counter", "Archive bytes produced.");
+        out << "zipper_output_bytes_total " << t.outputBytes << '\n';
+        
+        family(out, "zipper_stage_seconds_total", "counter", "Time in each pipeline stage, summed over threads.");
+        for (size_t i = 0; i < StageTimers::STAGE_COUNT; ++i) {
+            out << "zipper_stage_seconds_total{stage=\"" << StageTimers::STAGE_NAMES[i] << "\"} "
+                << timers.nanosIn(static_cast<Stage>(i)) / 1e9 << '\n';
+        }
+        family(out, "zipper_stage_bytes_total", "counter", "Bytes read from inputs and written to archives.");
+        out << "zipper_stage_bytes_total{stage=\"read\"} " << timers.bytesIn(Stage::Read) << '\n'
+            << "zipper_stage_bytes_total{stage=\"write\"} " << timers.bytesIn(Stage::Write) << '\n';
+        family(out, "zipper_worker_seconds_total", "counter", "Worker time of finished pools.");
+        out << "zipper_worker_seconds_total " << timers.workerNanos() / 1e9 << '\n';
+        family(out, "zipper_worker_idle_seconds_total", "counter", "Worker time of finished pools spent with nothing to run.");
+        out << "zipper_worker_idle_seconds_total " << timers.workerIdleNanos() / 1e9 << '\n';
+        
+        family(out, "zipper_run_active", "gauge", "1 while a run is in progress.");
+        out << "zipper_run_active " << (progress.running() ? 1 : 0) << '\n';
+        family(out, "zipper_run_files", "gauge", "Inputs in the current or last run.");
+        out << "zipper_run_files{state=\"planned\"} " << progress.plannedFiles() << '\n'
+            << "zipper_run_files{state=\"done\"} " << progress.doneFiles() << '\n'
+            << "zipper_run_files{state=\"failed\"} " << progress.failedFiles() << '\n';
+        family(out, "zipper_run_bytes", "gauge", "Input bytes in the current or last run.");
+        out << "zipper_run_bytes{state=\"planned\"} " << progress.plannedBytes() << '\n'
+            << "zipper_run_bytes{state=\"done\"} " << progress.doneBytes() << '\n';
+        return out.str();
+    }
+    
+    static void family(std::ostringstream& out, std::string_view name, std::string_view type, std::string_view help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    }
+};
+
+// Small inputs packed into one multi-entry archive; entries are named by key
+struct BundleTask {
+    std::string name;  // relative to the output folder, e.g. "bundle-0001.zip"
+    fs::path outputFile;
+    std::vector<FileTask> members;
+    size_t inputBytes = 0;
 };
 
 class HighPerformanceFileZipper {
@@ -278,61 +8269,393 @@ private:
     const fs::path outputFolder;
     const std::string password;
     mutable ThreadSafeStats stats;
-    MemoryPool memPool;
     
-    // Cache for file modification times to avoid repeated filesystem calls
-    mutable std::unordered_map<std::string, fs::file_time_type> timeCache;
-    mutable std::mutex timeCacheMutex;
+    // The output folder, or the object store archives are streamed to
+    const OutputTarget outputs;
     
-    // Track processed files for JSON output
-    mutable std::vector<FileMetadata> processedFiles;
-    mutable std::mutex processedFilesMutex;
+    // Precomputed WinZip-AES keys for files going through the native writer
+    std::unique_ptr<AesKeyPool> keyPool;
+    
+    // Runs file tasks and the block jobs split off large files
+    std::unique_ptr<WorkStealingPool> workers;
+    mutable size_t splitBytes = std::numeric_limits<size_t>::max();  // set per batch by runTasks
+    
+    static constexpr double FILE_COST_NS = 2e6;
+    static constexpr double CRYPTO_NS_PER_BYTE = 1.0;  // AES-CTR, HMAC, CRC and I/O
+    static constexpr double COPY_NS_PER_BYTE = 0.5;
+    static constexpr size_t MIN_SPLIT_BLOCKS = 4;
+    static constexpr double BUNDLE_ENTRY_NS = 1e5;  // local header and a pooled key
+    
+    // Inputs already zipped by earlier runs
+    mutable IncrementalManifest manifest;
+    
+    // Bundles from earlier runs: untouched ones, and ones being rebuilt whose
+    // files are deleted after the run unless a new bundle reuses the name
+    mutable std::unordered_set<std::string> keptBundles;
+    mutable std::vector<std::string> retiredBundles;
+    
+    // files-list.json, updated as outputs finish. Uploads of it are
+    // serialized, so the last one sent carries the newest listing.
+    mutable std::mutex publishMutex;
+    mutable FileListWriter fileList;
+    
+    // Chunk maps of archives zipped in chunks, for the next rezip
+    mutable ChunkStore chunks;
+    
+    // NDJSON progress stream and Prometheus endpoint, both opt-in
+    mutable ProgressEvents events{stats};
+    MetricsEndpoint metrics{stats, events};
+    
+    // Inputs named by a file list, by output name; read from where they are
+    bool listedInputs = false;
+    std::unordered_map<std::string, fs::path> inputPaths;
+    
+    // Watch mode and library engines keep the pools for the next batch
+    bool keepWarm = false;
+    std::unique_ptr<DirectoryWatcher> watcher;
+    bool prepared = false;  // manifest and listing loaded for library jobs
+    const std::atomic<bool>* cancelled = nullptr;
+    static inline volatile std::sig_atomic_t stopRequested = 0;
+    static constexpr auto WATCH_POLL = std::chrono::milliseconds(200);
+    static constexpr int WATCH_MAX_DELAY = 10;  // settle periods a steady stream of changes may hold a batch back
 
 public:
     explicit HighPerformanceFileZipper(std::string_view inputDir, std::string_view outputDir, std::string_view pwd)
-        : inputFolder(inputDir), outputFolder(outputDir), password(pwd) {}
+        : inputFolder(inputDir), outputFolder(outputDir), password(pwd), outputs(outputFolder), manifest(outputFolder),
+          fileList(outputFolder), chunks(outputFolder) {
+        if (outputs.remote()) manifest.setOutputsRemote();
+        events.open();
+        if (const int port = Config::getMetricsPort(); port > 0) metrics.start(port);
+    }
 
+    // Zip exactly these files instead of scanning the input folder. Each is
+    // named by its file name in the output; later ones sharing a name get
+    // "_1", "_2", ... before the extension.
+    void setInputFiles(const std::vector<fs::path>& files) {
+        std::vector<std::pair<std::string, fs::path>> named;
+        named.reserve(files.size());
+        for (const auto& file : files) {
+            named.emplace_back(file.filename().string(), file);
+        }
+        setInputs(named);
+    }
+    
+    // The same with output names chosen by the caller, e.g. "docs/a.pdf"
+    void setInputs(const std::vector<std::pair<std::string, fs::path>>& inputs) {
+        listedInputs = true;
+        inputPaths.clear();
+        std::unordered_set<std::string> listed;
+        for (const auto& [requested, file] : inputs) {
+            std::error_code ec;
+            auto path = fs::absolute(file, ec).lexically_normal();
+            if (ec) path = file;
+            if (!listed.insert(path.string()).second) continue;
+            
+            const fs::path wanted(requested);
+            const auto stem = (wanted.parent_path() / wanted.stem()).generic_string();
+            const auto extension = wanted.extension().string();
+            auto name = wanted.generic_string();
+            for (int counter = 1; inputPaths.count(name) > 0; ++counter) {
+                name = stem + "_" + std::to_string(counter) + extension;
+            }
+            inputPaths.emplace(std::move(name), std::move(path));
+        }
+    }
+    
+    size_t listedFileCount() const { return inputPaths.size(); }
+    
+    ThreadSafeStats::Totals totals() const { return stats.totals(); }
+    
+    // Library jobs: files that have not started when `flag` is set are left
+    // alone, and `listener` hears about every file. Set between jobs only.
+    void setJobHooks(const std::atomic<bool>* flag, std::function<void()> listener) {
+        cancelled = flag;
+        events.setListener(std::move(listener));
+    }
+    
+    const ProgressEvents& progress() const { return events; }
+    
+    // One library job: the inputs setInputs() named, or a scan of the input
+    // folder. The manifest and listing are loaded by the first job and the
+    // pools stay warm for the next.
+    bool runJob(bool scan) noexcept {
+        try {
+            listedInputs = !scan;
+            if (scan) inputPaths.clear();
+            if (!prepared) {
+                stats.setStartTime();
+                keepWarm = true;
+                if (!validateDirectories()) return false;
+                removeStalePartials();
+                manifest.load(Config::getForceRebuild());
+                fileList.load();
+                prepared = true;
+            }
+            const auto before = stats.totals();
+            
+            auto filesToProcess = scan ? getFilesToProcess() : getListedFiles();
+            if (filesToProcess.empty()) {
+                events.runStarted(0, 0, 0, 0);
+                removeRetiredBundles();
+                if (fileList.hasChanges()) finishListing();
+            } else {
+                zipBatch(std::move(filesToProcess));
+                finishListing();
+            }
+            removeRetiredBundles();
+            manifest.save();
+            
+            const bool ok = stats.totals().failed == before.failed;
+            events.runFinished(ok);
+            return ok;
+        } catch (const std::exception& e) {
+            std::cerr << "Critical error: " << e.what() << '\n';
+            events.runFinished(false);
+            return false;
+        }
+    }
+    
     bool processAllFiles() noexcept {
         try {
             stats.setStartTime();
             
             // Early validation
-            if (!validateDirectories()) return false;
+            if (!validateDirectories()) {
+                events.runFinished(false);
+                return false;
+            }
             
-            // Get files to process with pre-filtering and sizing
-            auto filesToProcess = getFilesToProcess();
+            // Get files to process with pre-filtering and sizing. The listing
+            // is loaded first, since planning drops entries whose output is gone.
+            removeStalePartials();
+            manifest.load(Config::getForceRebuild());
+            fileList.load();
+            auto filesToProcess = listedInputs ? getListedFiles() : getFilesToProcess();
             if (filesToProcess.empty()) {
-                std::cout << "No new files to process.\n";
-                return true;
+                console() << "No new files to process.\n";
+                events.runStarted(0, 0, 0, 0);
+                removeRetiredBundles();
+                if (fileList.hasChanges()) finishListing();
+                manifest.save();
+                events.runFinished(!stats.hasFailures());
+                return !stats.hasFailures();  // a listed file may have been unreadable
             }
+            zipBatch(std::move(filesToProcess));
+            
+            // Display comprehensive results
+            stats.displayResults();
+            outputs.display();
+            
+            // Final files-list.json, merged with what earlier runs listed
+            finishListing();
+            
+            // Saved last: it records the output folder's final state
+            manifest.save();
+            
+            events.runFinished(!stats.hasFailures());
+            return !stats.hasFailures();
 
-            std::cout << "Found " << filesToProcess.size() << " files to process\n";
+        } catch (const std::exception& e) {
+            std::cerr << "Critical error: " << e.what() << '\n';
+            events.runFinished(false);
+            return false;
+        }
+    }
+    
+    // Daemon mode: a full pass, then zip inputs as they are written until
+    // SIGINT or SIGTERM. The worker and key pools, the manifest and the
+    // listing stay loaded between batches, so a new upload costs only its own
+    // compression. Deletions wait for the next full pass.
+    bool watch() noexcept {
+        if (!validateDirectories()) return false;
+        
+        // Armed before the first scan so nothing written during it is missed
+        keepWarm = true;
+        watcher = std::make_unique<DirectoryWatcher>(inputFolder, Config::getRecursive(), outputFolder);
+        if (!watcher->ok()) {
+            std::cerr << "Cannot watch " << inputFolder << ": " << std::strerror(errno) << '\n';
+            return false;
+        }
+        stopRequested = 0;
+        std::signal(SIGINT, requestStop);
+        std::signal(SIGTERM, requestStop);
+        
+        bool ok = processAllFiles();
+        try {
+            fileList.load();
+            console() << "\nWatching " << inputFolder << " for new or changed files (Ctrl+C to stop)\n";
             
-            // Sort by file size (largest first) for better load balancing
-            std::sort(filesToProcess.begin(), filesToProcess.end(),
-                [](const FileTask& a, const FileTask& b) {
-                    return a.fileSize > b.fileSize;
-                });
+            const auto settle = std::chrono::milliseconds(Config::getWatchSettle());
+            std::unordered_set<std::string> files;
+            std::vector<std::string> directories;
+            bool rescan = false;
+            auto firstChange = std::chrono::steady_clock::now();
+            auto lastChange = firstChange;
+            
+            while (!stopRequested) {
+                const bool idle = files.empty() && directories.empty() && !rescan;
+                const auto now = std::chrono::steady_clock::now();
+                const auto wait = idle ? WATCH_POLL
+                    : std::clamp(std::chrono::ceil<std::chrono::milliseconds>(lastChange + settle - now),
+                                 std::chrono::milliseconds(0), WATCH_POLL);
+                
+                DirectoryWatcher::Changes changes;
+                if (!watcher->poll(wait, changes)) {
+                    std::cerr << "Input folder " << inputFolder << " went away; stopping\n";
+                    ok = false;
+                    break;
+                }
+                if (!changes.empty()) {
+                    lastChange = std::chrono::steady_clock::now();
+                    if (idle) firstChange = lastChange;
+                    files.insert(changes.files.begin(), changes.files.end());
+                    directories.insert(directories.end(), changes.directories.begin(), changes.directories.end());
+                    rescan |= changes.overflowed;
+                }
+                if (files.empty() && directories.empty() && !rescan) continue;
+                
+                const auto elapsed = std::chrono::steady_clock::now();
+                if (elapsed - lastChange < settle && elapsed - firstChange < settle * WATCH_MAX_DELAY) continue;
+                ok &= processChanges(files, directories, rescan);
+                files.clear();
+                directories.clear();
+                rescan = false;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Critical error: " << e.what() << '\n';
+            ok = false;
+        }
+        
+        watcher.reset();
+        workers.reset();
+        keyPool.reset();
+        keepWarm = false;
+        console() << "\nStopped watching\n";
+        stats.displayResults();
+        outputs.display();
+        return ok && !stats.hasFailures();
+    }
+    
+    // Verify mode: re-open every zip in the output folder on the worker pool,
+    // largest first, and check each entry's authentication code, CRC and size,
+    // and its size and content hash against the manifest. Plaintext stays in
+    // memory; nothing in the output folder is changed.
+    bool verifyOutputs() noexcept {
+        try {
+            const auto started = std::chrono::steady_clock::now();
+            if (outputs.remote()) {
+                std::cerr << "ZIPPER_VERIFY reads archives from the output folder; ones in object storage "
+                             "can't be verified\n";
+                return false;
+            }
+            if (!fs::is_directory(outputFolder)) {
+                std::cerr << "Output folder does not exist: " << outputFolder << '\n';
+                return false;
+            }
             
-            // Determine processing strategy based on file sizes and count
-            const bool useParallel = shouldUseParallelProcessing(filesToProcess);
+            // What each archive should hold, by its path in the output folder
+            manifest.load(false);
+            std::unordered_map<std::string, ArchiveVerifier::Expectations> expected;
+            for (const auto& [name, entry] : manifest.recorded()) {
+                const ArchiveVerifier::Expected want{entry.meta.size, entry.contentHash};
+                if (entry.archive.empty()) {
+                    expected[getZipFileName(name)].emplace("", want);
+                } else {
+                    expected[entry.archive].emplace(name, want);
+                }
+            }
             
-            if (useParallel) {
-                std::cout << "Using parallel processing with " << Config::getOptimalThreadCount() << " threads\n";
-                processFilesParallel(filesToProcess);
-            } else {
-                std::cout << "Using sequential processing\n";
-                processFilesSequential(filesToProcess);
+            struct Check {
+                std::string name;
+                fs::path path;
+                uint64_t size;
+                const ArchiveVerifier::Expectations* expected;
+                ArchiveVerifier::Report report;
+            };
+            static const ArchiveVerifier::Expectations unrecorded;
+            std::vector<Check> checks;
+            std::unordered_set<std::string> found;
+            // An archive that can't be stat'ed is a failed check, and a folder
+            // that can't be listed fails the run; neither stops the others
+            std::error_code scanError;
+            for (auto it = fs::recursive_directory_iterator(outputFolder, fs::directory_options::skip_permission_denied, scanError);
+                 !scanError && it != fs::recursive_directory_iterator(); it.increment(scanError)) {
+                std::error_code ec;
+                const auto fileName = it->path().filename().string();
+                if (fileName == IncrementalManifest::DIRECTORY && it->is_directory(ec)) {
+                    it.disable_recursion_pending();
+                    continue;
+                }
+                if (it->path().extension() != ".zip" || fileName.front() == '.') continue;
+                const bool regular = it->is_regular_file(ec);
+                if (!ec && !regular) continue;
+                const uint64_t size = ec ? 0 : it->file_size(ec);
+                auto name = it->path().lexically_relative(outputFolder).generic_string();
+                const auto want = expected.find(name);
+                checks.push_back({name, it->path(), ec ? 0 : size, want != expected.end() ? &want->second : &unrecorded, {}});
+                if (ec) checks.back().report.problems.push_back("cannot stat: " + ec.message());
+                found.insert(std::move(name));
+            }
+            if (scanError) {
+                std::cerr << "❌ Cannot list " << outputFolder << ": " << scanError.message() << '\n';
             }
+            std::sort(checks.begin(), checks.end(), [](const Check& a, const Check& b) { return a.size > b.size; });
             
-            // Display comprehensive results
-            stats.displayResults();
+            std::vector<std::string> missing;
+            for (const auto& [name, want] : expected) {
+                if (found.count(name) == 0) missing.push_back(name);
+            }
+            std::sort(missing.begin(), missing.end());
             
-            // Generate files-list.json
-            generateFileListJson();
+            const uint64_t totalBytes = std::accumulate(checks.begin(), checks.end(), uint64_t{0},
+                [](uint64_t sum, const Check& check) { return sum + check.size; });
+            console() << "Verifying " << checks.size() << " archives (" << formatBytes(totalBytes) << ")\n";
             
-            return !stats.hasFailures();
-
+            if (!workers) workers = std::make_unique<WorkStealingPool>(Config::getOptimalThreadCount(), Config::getNumaPinning());
+            std::mutex outputMutex;
+            for (size_t i = 0; i < checks.size(); ++i) {
+                if (!checks[i].report.ok()) {
+                    std::cerr << "❌ " << checks[i].name << ": " << checks[i].report.problems.front() << '\n';
+                    continue;
+                }
+                workers->submitTask(i % workers->size(), [&, &check = checks[i]]() {
+                    const WorkerArena::TaskScope arena;
+                    check.report = ArchiveVerifier::verify(check.path, password, *check.expected);
+                    if (check.report.ok()) return;
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    for (const auto& problem : check.report.problems) {
+                        std::cerr << "❌ " << check.name << ": " << problem << '\n';
+                    }
+                });
+            }
+            workers->waitIdle();
+            
+            size_t failed = 0;
+            size_t entries = 0;
+            size_t unlisted = 0;
+            uint64_t plainBytes = 0;
+            for (const auto& check : checks) {
+                failed += check.report.ok() ? 0 : 1;
+                entries += check.report.entries;
+                plainBytes += check.report.plainBytes;
+                unlisted += check.expected == &unrecorded ? 1 : 0;
+            }
+            for (const auto& name : missing) {
+                std::cerr << "❌ " << name << ": recorded in the manifest but missing\n";
+            }
+            
+            const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started);
+            console() << "\n=== Verify Summary ===\n";
+            console() << "Archives checked: " << checks.size() << " (" << entries << " entries)\n";
+            console() << "Archives failed: " << failed << '\n';
+            console() << "Archives missing: " << missing.size() << '\n';
+            if (unlisted > 0) console() << "Not in the manifest: " << unlisted << " (checked without expected sizes or hashes)\n";
+            console() << "Archive bytes read: " << formatBytes(totalBytes) << '\n';
+            console() << "Plaintext checked: " << formatBytes(plainBytes) << '\n';
+            console() << "Verify time: " << static_cast<uint64_t>(elapsed.count() * 1000) << " ms";
+            if (elapsed.count() > 0) console() << " (" << formatBytes(static_cast<size_t>(totalBytes / elapsed.count())) << "/s)";
+            console() << '\n';
+            return failed == 0 && missing.empty() && !scanError;
         } catch (const std::exception& e) {
             std::cerr << "Critical error: " << e.what() << '\n';
             return false;
@@ -340,19 +8663,36 @@ public:
     }
 
 private:
+    // The listing goes up beside uploaded archives once it is final
+    void finishListing() const {
+        if (!fileList.finish()) return;
+        auto files = fileList.takeIndexWrites();
+        files.insert(files.begin(), fileList.path());
+        publishListing(files);
+    }
+    
+    // Each upload reads the files as they are when it runs
+    void publishListing(const std::vector<fs::path>& files) const {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        for (const auto& file : files) outputs.publish(file, "application/json");
+    }
+    
     bool validateDirectories() const {
+        if (!outputs.usable()) return false;
+        
         // Create output directory if needed
         if (!fs::exists(outputFolder)) {
             try {
                 fs::create_directories(outputFolder);
-                std::cout << "Created output folder: " << outputFolder << '\n';
+                console() << "Created output folder: " << outputFolder << '\n';
             } catch (const fs::filesystem_error& e) {
                 std::cerr << "Failed to create output folder: " << e.what() << '\n';
                 return false;
             }
         }
 
-        // Validate input folder
+        // Validate input folder; a file list does without one
+        if (listedInputs) return true;
         if (!fs::exists(inputFolder)) {
             std::cerr << "Input folder does not exist: " << inputFolder << '\n';
             return false;
@@ -366,177 +8706,1077 @@ private:
         return true;
     }
     
+    // Temp files a killed run left beside its outputs: ".<name>.part" in the
+    // output tree. Removed before the journal is replayed, so a resumed run
+    // starts from whole archives only.
+    void removeStalePartials() const {
+        std::error_code ec;
+        size_t removed = 0;
+        for (fs::recursive_directory_iterator it(outputFolder, ec), end; !ec && it != end; it.increment(ec)) {
+            const auto name = it->path().filename().string();
+            if (it->is_directory(ec) && name == IncrementalManifest::DIRECTORY) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (name.size() > 6 && name.front() == '.' && name.ends_with(".part") && it->is_regular_file(ec)) {
+                std::error_code removeError;
+                if (fs::remove(it->path(), removeError)) ++removed;
+            }
+        }
+        if (removed > 0) console() << "Removed " << removed << " partial files left by an interrupted run\n";
+    }
+    
+    static void requestStop(int signal) {
+        stopRequested = 1;
+        std::signal(signal, SIG_DFL);  // a second one stops at once
+    }
+    
+    // Bundle, deduplicate and zip one batch of inputs. The worker and key
+    // pools are created on first use and, when watching, kept for the next.
+    void zipBatch(std::vector<FileTask> filesToProcess) {
+        const uint64_t runBytes = std::accumulate(filesToProcess.begin(), filesToProcess.end(), uint64_t{0},
+            [](uint64_t sum, const FileTask& task) { return sum + task.fileSize; });
+        const size_t runFiles = filesToProcess.size();
+        console() << "Found " << filesToProcess.size() << " files to process\n";
+        
+        // Sort by file size (largest first) for better load balancing
+        std::sort(filesToProcess.begin(), filesToProcess.end(),
+            [](const FileTask& a, const FileTask& b) {
+                return a.fileSize > b.fileSize;
+            });
+        
+        const auto bundles = planBundles(filesToProcess);
+        
+        const auto threads = Config::getOptimalThreadCount();
+        if (!workers) workers = std::make_unique<WorkStealingPool>(threads, Config::getNumaPinning());
+        if (Config::getSchedule() == Config::Schedule::Latency) {
+            fileList.publishContinuously(std::chrono::milliseconds(Config::getPublishDelay()),
+                                         [this](const std::vector<fs::path>& files) { publishListing(files); });
+        }
+        events.runStarted(runFiles, runBytes, bundles.size(), workers->size());
+        
+        // Identical inputs are compressed once; the rest reuse that zip afterwards
+        const auto duplicates = planDeduplication(filesToProcess);
+        
+        // Start deriving keys ahead of the writers that will need them. A
+        // warm engine keeps a worker's worth spare for the next upload.
+        size_t nativeEntries = std::count_if(filesToProcess.begin(), filesToProcess.end(),
+            [this](const FileTask& task) { return useNativeWriter(task.fileSize); });
+        for (const auto& bundle : bundles) {
+            nativeEntries += bundle.members.size();
+        }
+        if (keyPool) {
+            keyPool->extend(nativeEntries);
+        } else if (const size_t spare = keepWarm ? threads : 0; nativeEntries + spare > 0) {
+            keyPool = std::make_unique<AesKeyPool>(password, std::max<size_t>(threads / 4, 1),
+                                                   threads * 4, nativeEntries + spare, stats);
+        }
+        
+        runTasks(filesToProcess, bundles);
+        
+        if (!duplicates.empty()) {
+            console() << "Reusing outputs for " << duplicates.size() << " duplicate files\n";
+            runTasks(duplicates);
+        }
+        
+        if (!keepWarm) {
+            workers.reset();
+            keyPool.reset();
+        }
+        removeRetiredBundles();
+    }
+    
+    // One watch batch: stat what changed, list new directories, and zip
+    // whatever the manifest says is new. Lost events fall back to a full scan.
+    bool processChanges(const std::unordered_set<std::string>& files, const std::vector<std::string>& directories,
+                        bool rescan) {
+        const auto started = std::chrono::steady_clock::now();
+        const auto before = stats.totals();
+        try {
+            std::vector<DirectoryScanner::Entry> entries;
+            if (rescan) {
+                console() << "Watch events were lost; rescanning " << inputFolder << '\n';
+                const StageTimers::Scope timer(StageTimers::Stage::Scan);
+                entries = DirectoryScanner::scan(inputFolder, Config::getRecursive(), Config::getScanThreads(), outputFolder);
+            } else {
+                const StageTimers::Scope timer(StageTimers::Stage::Scan);
+                std::unordered_set<std::string> listed;
+                for (const auto& directory : directories) {
+                    std::error_code ec;
+                    if (!fs::is_directory(inputFolder / directory, ec)) continue;
+                    for (auto& entry : DirectoryScanner::scan(inputFolder / directory, true, 1, outputFolder)) {
+                        entry.relative = directory + '/' + entry.relative;
+                        if (listed.insert(entry.relative).second) entries.push_back(std::move(entry));
+                    }
+                }
+                for (const auto& file : files) {
+                    if (listed.count(file) > 0) continue;
+                    if (const auto snapshot = regularFile(inputFolder / file)) {
+                        entries.push_back(DirectoryScanner::Entry{file, *snapshot});
+                    }
+                }
+            }
+            
+            auto filesToProcess = planInputs(entries, rescan);
+            if (filesToProcess.empty()) {
+                removeRetiredBundles();
+                if (fileList.hasChanges()) finishListing();
+                manifest.save();
+                return true;
+            }
+            zipBatch(std::move(filesToProcess));
+            finishListing();
+            manifest.save();
+            events.runFinished(stats.totals().failed == before.failed);
+        } catch (const std::exception& e) {
+            std::cerr << "Error processing changes: " << e.what() << '\n';
+            events.runFinished(false);
+            return false;
+        }
+        
+        const auto after = stats.totals();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        console() << "Watch batch: " << after.processed - before.processed << " zipped, " << after.failed - before.failed
+                  << " failed in " << elapsed.count() << " ms\n";
+        return after.failed == before.failed;
+    }
+    
     std::vector<FileTask> getFilesToProcess() const {
+        try {
+            // Scan input directory; the scanner's stat decides against the manifest
+            const auto entries = [&]() {
+                const StageTimers::Scope timer(StageTimers::Stage::Scan);
+                return DirectoryScanner::scan(inputFolder, Config::getRecursive(), Config::getScanThreads(), outputFolder);
+            }();
+            return planInputs(entries, true);
+        } catch (const fs::filesystem_error& e) {
+            std::cerr << "Error scanning input directory: " << e.what() << '\n';
+        }
+        return {};
+    }
+    
+    // The files a file list named; ones that cannot be read count as failed
+    std::vector<FileTask> getListedFiles() const {
+        std::vector<DirectoryScanner::Entry> entries;
+        {
+            const StageTimers::Scope timer(StageTimers::Stage::Scan);
+            entries.reserve(inputPaths.size());
+            for (const auto& [name, path] : inputPaths) {
+                if (const auto snapshot = regularFile(path)) {
+                    entries.push_back(DirectoryScanner::Entry{name, *snapshot});
+                } else {
+                    std::cerr << "❌ Not a readable file: " << path << '\n';
+                    stats.incrementFailedFiles();
+                }
+            }
+        }
+        return planInputs(entries, false);
+    }
+    
+    // Where an input is read from: the input folder, or wherever a file list named it
+    fs::path inputPath(const std::string& key) const {
+        if (const auto it = inputPaths.find(key); it != inputPaths.end()) return it->second;
+        return inputFolder / key;
+    }
+    
+    // The inputs among `entries` that need zipping. A complete listing also
+    // drops manifest entries of inputs that are gone; a partial one, from
+    // watch mode, only speaks for the inputs it names.
+    std::vector<FileTask> planInputs(const std::vector<DirectoryScanner::Entry>& entries, bool complete) const {
         std::vector<FileTask> filesToProcess;
-        filesToProcess.reserve(100);
+        filesToProcess.reserve(std::min<size_t>(entries.size(), 100));
         
-        try {
-            // Pre-build cache of existing zip files for faster lookup
-            std::unordered_set<std::string> existingZips;
-            if (fs::exists(outputFolder)) {
-                for (const auto& entry : fs::directory_iterator(outputFolder)) {
-                    if (entry.is_regular_file() && entry.path().extension() == ".zip") {
-                        existingZips.insert(entry.path().filename().string());
+        std::unordered_set<std::string> seen;
+        std::unordered_map<std::string, const DirectoryScanner::Entry*> bundledUnchanged;
+        seen.reserve(entries.size());
+        
+        for (const auto& entry : entries) {
+            // Nested inputs keep their relative path in the output layout
+            const auto inputFile = inputPath(entry.relative);
+            const auto zipFile = outputFolder / getZipFileName(entry.relative);
+            const auto bundle = manifest.archiveOf(entry.relative);
+            seen.insert(entry.relative);
+            
+            if (manifest.isUnchanged(entry.relative, entry.snapshot, inputFile,
+                                     bundle.empty() ? zipFile : outputFolder / bundle)) {
+                if (bundle.empty()) {
+                    stats.incrementSkippedFiles();
+                } else {
+                    bundledUnchanged.emplace(entry.relative, &entry);
+                }
+                continue;
+            }
+            filesToProcess.emplace_back(entry.relative, inputFile, zipFile, entry.snapshot.size, entry.snapshot);
+            stats.incrementTotalFiles();
+        }
+        
+        reopenBundles(filesToProcess, bundledUnchanged, seen, complete);
+        if (complete) {
+            // A deleted input's zip stays listed while it is there
+            for (const auto& name : manifest.retainOnly(seen)) {
+                const auto zipName = getZipFileName(name);
+                std::error_code ec;
+                if (!outputs.remote() && !fs::exists(outputFolder / zipName, ec)) fileList.remove(zipName);
+            }
+        }
+        return filesToProcess;
+    }
+    
+    static std::optional<IncrementalManifest::Snapshot> regularFile(const fs::path& path) {
+        struct stat st {};
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return std::nullopt;
+        return IncrementalManifest::toSnapshot(st);
+    }
+    
+    // A bundle is rewritten whole once any input in it changed or went away,
+    // so its unchanged inputs are queued again alongside the changed ones
+    void reopenBundles(std::vector<FileTask>& tasks,
+                       const std::unordered_map<std::string, const DirectoryScanner::Entry*>& bundledUnchanged,
+                       const std::unordered_set<std::string>& seen, bool complete) const {
+        const auto recorded = manifest.bundles();
+        std::unordered_set<std::string> reopened;
+        for (const auto& task : tasks) {
+            auto bundle = manifest.archiveOf(task.key);
+            if (!bundle.empty()) reopened.insert(std::move(bundle));
+        }
+        for (const auto& [bundle, members] : recorded) {
+            if (complete && std::any_of(members.begin(), members.end(), [&seen](const std::string& m) { return seen.count(m) == 0; })) {
+                reopened.insert(bundle);
+            }
+        }
+        
+        for (const auto& [bundle, members] : recorded) {
+            const bool rebuild = reopened.count(bundle) > 0;
+            if (!rebuild) keptBundles.insert(bundle);
+            for (const auto& member : members) {
+                const auto it = bundledUnchanged.find(member);
+                if (it == bundledUnchanged.end()) {
+                    // A partial listing leaves out the bundle's other inputs
+                    if (rebuild && !complete && seen.count(member) == 0) {
+                        if (const auto snapshot = regularFile(inputPath(member))) {
+                            tasks.emplace_back(member, inputPath(member), outputFolder / getZipFileName(member),
+                                               snapshot->size, *snapshot);
+                            stats.incrementTotalFiles();
+                        } else {
+                            manifest.forget(member);
+                        }
+                    }
+                    continue;
+                }
+                if (!rebuild) {
+                    stats.incrementSkippedFiles();
+                    continue;
+                }
+                const auto& entry = *it->second;
+                tasks.emplace_back(entry.relative, inputPath(entry.relative),
+                                   outputFolder / getZipFileName(entry.relative), entry.snapshot.size, entry.snapshot);
+                stats.incrementTotalFiles();
+            }
+        }
+        retiredBundles.assign(reopened.begin(), reopened.end());
+        std::sort(retiredBundles.begin(), retiredBundles.end());
+    }
+    
+    // Move inputs up to ZIPPER_BUNDLE_MAX_FILE out of `tasks` into bundles of
+    // about ZIPPER_BUNDLE_SIZE input bytes. They are packed in path order, so
+    // neighbouring files share an archive, and rebuilt bundles keep their names.
+    // Listed files are not bundled: a later list need not name the others in
+    // their bundle, and a rebuild could not find them.
+    std::vector<BundleTask> planBundles(std::vector<FileTask>& tasks) const {
+        std::vector<BundleTask> bundles;
+        const size_t bundleBytes = Config::getBundleSize();
+        if (bundleBytes == 0 || listedInputs) return bundles;
+        const size_t maxFile = std::min(Config::getBundleMaxFile(), bundleBytes);
+        
+        const auto small = std::stable_partition(tasks.begin(), tasks.end(),
+            [maxFile](const FileTask& task) { return task.fileSize > maxFile; });
+        std::vector<FileTask> packed(std::make_move_iterator(small), std::make_move_iterator(tasks.end()));
+        tasks.erase(small, tasks.end());
+        std::sort(packed.begin(), packed.end(), [](const FileTask& a, const FileTask& b) { return a.key < b.key; });
+        
+        for (auto& task : packed) {
+            if (bundles.empty() || (!bundles.back().members.empty() && bundles.back().inputBytes + task.fileSize > bundleBytes)) {
+                bundles.emplace_back();
+            }
+            bundles.back().inputBytes += task.fileSize;
+            bundles.back().members.push_back(std::move(task));
+        }
+        
+        std::deque<std::string> reusable(retiredBundles.begin(), retiredBundles.end());
+        const std::unordered_set<std::string> taken(retiredBundles.begin(), retiredBundles.end());
+        size_t counter = 0;
+        for (auto& bundle : bundles) {
+            if (!reusable.empty()) {
+                bundle.name = std::move(reusable.front());
+                reusable.pop_front();
+            } else {
+                // Skip names in use, including the zip an input called "bundle-0001" would get
+                do {
+                    std::ostringstream name;
+                    name << "bundle-" << std::setw(4) << std::setfill('0') << ++counter << ".zip";
+                    bundle.name = name.str();
+                } while (keptBundles.count(bundle.name) > 0 || taken.count(bundle.name) > 0 ||
+                         fs::exists(inputFolder / fs::path(bundle.name).stem()));
+            }
+            bundle.outputFile = outputFolder / bundle.name;
+            for (auto& member : bundle.members) {
+                member.outputFile = bundle.outputFile;
+            }
+        }
+        retiredBundles.assign(reusable.begin(), reusable.end());
+        return bundles;
+    }
+    
+    void removeRetiredBundles() const {
+        for (const auto& bundle : retiredBundles) {
+            outputs.remove(outputFolder / bundle);
+            fileList.removeBundle(bundle);
+        }
+        retiredBundles.clear();
+    }
+    
+    // Hash every candidate whose size matches another candidate or an input
+    // zipped earlier, then move each later copy of a content out of `tasks`
+    // and point it at the zip of the first. Unique sizes are never read here.
+    std::vector<FileTask> planDeduplication(std::vector<FileTask>& tasks) const {
+        std::vector<FileTask> duplicates;
+        // Clones are made from a local zip, so uploaded outputs are always compressed
+        if (Config::getDedupMode() == Config::DedupMode::Off || outputs.remote() || tasks.empty()) return duplicates;
+        
+        // Zips about to be rewritten cannot serve as a source
+        auto zipped = manifest.contentIndex();
+        std::unordered_set<std::string> rewritten;
+        for (const auto& task : tasks) rewritten.insert(task.key);
+        std::unordered_map<uint64_t, size_t> sizeUses;
+        for (auto it = zipped.begin(); it != zipped.end();) {
+            if (rewritten.count(it->second.name) > 0) {
+                it = zipped.erase(it);
+            } else {
+                ++sizeUses[it->second.size];
+                ++it;
+            }
+        }
+        for (const auto& task : tasks) ++sizeUses[task.fileSize];
+        
+        std::vector<size_t> toHash;
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            if (sizeUses[tasks[i].fileSize] > 1) toHash.push_back(i);
+        }
+        if (toHash.empty()) return duplicates;
+        
+        for (const size_t index : toHash) {
+            workers->submitTask(index, [&task = tasks[index]]() {
+                try {
+                    task.contentHash = ContentHasher::ofFile(task.inputFile);
+                } catch (const fs::filesystem_error&) {
+                    task.contentHash = 0;  // compressed normally; the error surfaces there
+                }
+            });
+        }
+        workers->waitIdle();
+        
+        std::unordered_map<uint64_t, size_t> firstWithContent;
+        std::vector<FileTask> unique;
+        unique.reserve(tasks.size());
+        for (auto& task : tasks) {
+            if (task.contentHash != 0) {
+                if (const auto prior = zipped.find(task.contentHash);
+                    prior != zipped.end() && prior->second.size == task.fileSize) {
+                    task.cloneFrom = outputFolder / getZipFileName(prior->second.name);
+                    task.cloneInput = inputPath(prior->second.name);
+                } else if (const auto first = firstWithContent.find(task.contentHash);
+                           first != firstWithContent.end() && unique[first->second].fileSize == task.fileSize) {
+                    task.cloneFrom = unique[first->second].outputFile;
+                    task.cloneInput = unique[first->second].inputFile;
+                } else {
+                    firstWithContent.try_emplace(task.contentHash, unique.size());
+                }
+            }
+            (task.cloneFrom.empty() ? unique : duplicates).push_back(std::move(task));
+        }
+        tasks = std::move(unique);
+        return duplicates;
+    }
+    
+    // Plan files costliest-first onto the least-loaded worker; stealing then
+    // evens out whatever the estimates got wrong
+    void runTasks(const std::vector<FileTask>& tasks, const std::vector<BundleTask>& bundles = {}) const {
+        if (tasks.empty() && bundles.empty()) return;
+        
+        // Jobs past tasks.size() are bundles
+        const size_t workerCount = workers->size();
+        const size_t jobCount = tasks.size() + bundles.size();
+        std::vector<double> costs(jobCount);
+        double totalCost = 0.0;
+        for (size_t i = 0; i < jobCount; ++i) {
+            costs[i] = i < tasks.size() ? estimateCost(tasks[i]) : estimateCost(bundles[i - tasks.size()]);
+            totalCost += costs[i];
+        }
+        
+        // A file costing more than a worker's fair share is split into block jobs
+        const double fairShare = totalCost / static_cast<double>(workerCount);
+        const size_t minSplitBytes = MIN_SPLIT_BLOCKS * Config::getParallelDeflateBlockSize();
+        splitBytes = std::numeric_limits<size_t>::max();
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            if (workerCount > 1 && costs[i] > fairShare && tasks[i].fileSize >= minSplitBytes) {
+                splitBytes = std::min(splitBytes, tasks[i].fileSize);
+            }
+        }
+        
+        // Latency mode plans shortest first. Files split into block jobs wait
+        // until the rest are done: their blocks run ahead of file tasks on
+        // every worker and would hold up the small files behind them.
+        const bool latency = Config::getSchedule() == Config::Schedule::Latency;
+        workers->setCheapestFirst(latency);
+        const auto first = [&costs, latency](size_t a, size_t b) {
+            return latency ? costs[a] < costs[b] : costs[a] > costs[b];
+        };
+        std::vector<size_t> order(jobCount);
+        std::iota(order.begin(), order.end(), size_t{0});
+        std::vector<size_t> held;
+        if (latency) {
+            const auto split = std::partition(order.begin(), order.end(), [&](size_t index) {
+                return index >= tasks.size() || !runsAsBlocks(tasks[index]);
+            });
+            held.assign(split, order.end());
+            order.erase(split, order.end());
+            std::sort(held.begin(), held.end(), first);
+        }
+        std::sort(order.begin(), order.end(), first);
+        
+        console() << "Scheduling " << tasks.size() << " files";
+        if (!bundles.empty()) console() << " and " << bundles.size() << " bundles";
+        console() << " on " << workerCount << " workers (~" << std::fixed << std::setprecision(1)
+                  << fairShare / 1e9 << " s of work each";
+        if (latency) console() << ", smallest first";
+        if (!held.empty()) console() << ", " << held.size() << " split files last";
+        console() << ")\n";
+        
+        using Load = std::pair<double, size_t>;
+        std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+        for (size_t w = 0; w < workerCount; ++w) {
+            loads.emplace(0.0, w);
+        }
+        
+        // Under a memory budget a large file only starts while the large ones
+        // already running leave room for its blocks. Otherwise the workers
+        // move on to smaller files and it runs once those are done, with its
+        // stages waiting for memory as they go.
+        auto& budget = MemoryBudget::global();
+        const size_t largeBytes = budget.limited() ? budget.limit() / workerCount : std::numeric_limits<size_t>::max();
+        std::atomic<size_t> claimed{0};
+        std::vector<size_t> deferred;
+        
+        size_t started = 0;
+        std::mutex progressMutex;
+        const auto submit = [&](size_t worker, size_t index, bool deferrable) {
+            workers->submitTask(worker, [&, index, deferrable, total = jobCount]() {
+                if (cancelled && cancelled->load(std::memory_order_relaxed)) return;
+                size_t claim = 0;
+                if (budget.limited() && index < tasks.size() && memoryNeed(tasks[index]) > largeBytes) {
+                    claim = memoryNeed(tasks[index]);
+                    size_t running = claimed.load(std::memory_order_relaxed);
+                    do {
+                        if (deferrable && running > 0 && running + claim > budget.limit()) {
+                            std::lock_guard<std::mutex> lock(progressMutex);
+                            deferred.push_back(index);
+                            budget.recordDeferred();
+                            return;
+                        }
+                    } while (!claimed.compare_exchange_weak(running, running + claim, std::memory_order_relaxed));
+                }
+                {
+                    std::lock_guard<std::mutex> lock(progressMutex);
+                    if (total > 1) {
+                        console() << "[" << ++started << "/" << total << "] ";
                     }
                 }
+                if (index < tasks.size()) {
+                    processFileTask(tasks[index]);
+                } else {
+                    processBundle(bundles[index - tasks.size()]);
+                }
+                claimed.fetch_sub(claim, std::memory_order_relaxed);
+            });
+        };
+        
+        const auto plan = [&](const std::vector<size_t>& indices) {
+            for (const size_t index : indices) {
+                const auto [load, worker] = loads.top();
+                loads.pop();
+                loads.emplace(load + costs[index], worker);
+                submit(worker, index, true);
+            }
+            workers->waitIdle();
+        };
+        plan(order);
+        if (!held.empty()) plan(held);
+        
+        // In planning order again, spread over the workers
+        std::sort(deferred.begin(), deferred.end(), first);
+        for (size_t i = 0; i < deferred.size(); ++i) {
+            submit(i % workerCount, deferred[i], false);
+        }
+        workers->waitIdle();
+    }
+    
+    // Whether the file's compression will be spread over the pool as block jobs
+    bool runsAsBlocks(const FileTask& task) const {
+        if (!task.cloneFrom.empty()) return false;
+        const int level = CompressionPolicy::expected(task.entryName()).level;
+        const auto& codec = CodecRegistry::forEntry(CodecRegistry::select(level), task.fileSize);
+        return blockParallelThreads(codec, task.fileSize, level) > 1;
+    }
+    
+    // Block bytes a file may hold at once: all of it when small or zipped
+    // as one block, else a full pipeline of blocks; plus the part an upload
+    // collects before it can be sent
+    size_t memoryNeed(const FileTask& task) const {
+        if (!task.cloneFrom.empty()) return 0;
+        const size_t pipeline = PipelinedArchiveWriter::maxBlocksInFlight(workers->size()) *
+                                Config::getParallelDeflateBlockSize();
+        return std::min(task.fileSize, pipeline) + outputs.bufferBytes(archiveSizeHint(task.fileSize, 1));
+    }
+    
+    // Rough single-core time for a task in ns: a fixed per-file cost (key
+    // derivation, archive create and close) plus per-byte compression and AES
+    double estimateCost(const FileTask& task) const {
+        const auto bytes = static_cast<double>(task.fileSize);
+        if (!task.cloneFrom.empty()) return FILE_COST_NS + bytes * COPY_NS_PER_BYTE;
+        
+        const int level = CompressionPolicy::expected(task.entryName()).level;
+        const double compress = level == 0 ? 0.0
+            : CodecRegistry::forEntry(CodecRegistry::select(level), task.fileSize).nanosPerByte(level);
+        return FILE_COST_NS + bytes * (compress + CRYPTO_NS_PER_BYTE);
+    }
+    
+    // One archive for the whole bundle; each entry still has its own salt and key
+    double estimateCost(const BundleTask& bundle) const {
+        double cost = FILE_COST_NS;
+        for (const auto& member : bundle.members) {
+            cost += estimateCost(member) - FILE_COST_NS + BUNDLE_ENTRY_NS;
+        }
+        return cost;
+    }
+    
+    void processFileTask(const FileTask& task) const {
+        const WorkerArena::TaskScope arena;
+        const StageTimers::FileScope timing;
+        const auto started = ProgressEvents::Clock::now();
+        const auto fileName = task.entryName();
+        const auto zipFileName = getZipFileName(task.key);
+
+        try {
+            stats.addInputSize(task.fileSize);
+            
+            manifest.forget(task.key);
+            if (task.key.find('/') != std::string::npos && !outputs.remote()) {
+                fs::create_directories(task.outputFile.parent_path());
             }
             
-            // Scan input directory
-            for (const auto& entry : fs::directory_iterator(inputFolder)) {
-                if (!entry.is_regular_file()) continue;
+            // A duplicate whose source zip is unusable falls back to compressing.
+            // Duplicates were hashed when they were found; anything else is
+            // hashed by the writer as it reads, so the hash is of the bytes zipped.
+            std::optional<ZipOutcome> written;
+            if (!task.cloneFrom.empty()) {
+                if (const auto size = reuseDuplicateZip(task)) {
+                    written = ZipOutcome{*size, task.contentHash, CompressionPolicy::typeOf(task.inputFile, fileName)};
+                }
+            }
+            const bool reused = written.has_value();
+            if (!reused) {
+                written = createPasswordProtectedZip(task.inputFile, fileName, task.outputFile, task.fileSize,
+                                                     task.contentHash);
+            }
+
+            if (written) {
+                const auto outputSize = written->archiveBytes;
+                stats.addOutputSize(outputSize);
+                stats.incrementProcessedFiles();
+                if (reused) stats.recordDeduplicated(task.fileSize);
+                manifest.record(task.key, {task.snapshot, written->contentHash, {}});
                 
-                const auto& inputFile = entry.path();
-                const auto zipFileName = getZipFileName(inputFile.filename().string());
-                const auto zipFile = outputFolder / zipFileName;
+                // List it for the MyStorage page
+                fileList.add(FileMetadata(zipFileName, written->type));
+                events.fileDone(task.key, zipFileName, {}, task.fileSize, outputSize,
+                                ProgressEvents::Clock::now() - started, reused);
                 
-                // Quick check using our cache
-                const bool zipExists = existingZips.find(zipFileName) != existingZips.end();
+                const auto compressionRatio = (1.0 - static_cast<double>(outputSize) / task.fileSize) * 100.0;
                 
-                // Only add if output doesn't exist or is older
-                if (!zipExists || isInputNewer(inputFile, zipFile)) {
-                    const auto fileSize = fs::file_size(inputFile);
-                    filesToProcess.emplace_back(inputFile, zipFile, fileSize);
-                    stats.incrementTotalFiles();
+                // Thread-safe output
+                {
+                    static std::mutex outputMutex;
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    console() << "✅ " << zipFileName << " (" << formatBytes(task.fileSize) 
+                              << " → " << formatBytes(outputSize) 
+                              << ", " << std::fixed << std::setprecision(1) << compressionRatio << "% compressed)";
+                    if (reused) console() << " [same as " << task.cloneInput.lexically_relative(inputFolder).generic_string() << "]";
+                    console() << '\n';
+                }
+            } else {
+                stats.incrementFailedFiles();
+                events.fileFailed(task.key, "could not create the archive");
+                {
+                    static std::mutex outputMutex;
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    std::cerr << "❌ Failed: " << fileName << '\n';
                 }
             }
         } catch (const fs::filesystem_error& e) {
-            std::cerr << "Error scanning input directory: " << e.what() << '\n';
+            stats.incrementFailedFiles();
+            events.fileFailed(task.key, e.what());
+            {
+                static std::mutex outputMutex;
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "❌ File error for " << fileName << ": " << e.what() << '\n';
+            }
         }
+    }
+
+    // Write every member into one archive through the native writer. A member
+    // that can't be read up front is skipped; a failure mid-entry loses the bundle.
+    void processBundle(const BundleTask& bundle) const {
+        const WorkerArena::TaskScope arena;
+        static std::mutex outputMutex;
+        struct Packed {
+            const FileTask* member;
+            uint64_t contentHash;
+            uint64_t archiveBytes;  // local header and entry data
+            ProgressEvents::Clock::duration elapsed;
+            std::string_view type;
+        };
+        std::vector<Packed> packed;
+        std::unordered_set<const FileTask*> hadOwnZip;  // zips this bundle replaces once it is in place
+        std::unordered_set<const FileTask*> skipped;
+        uint64_t memberBytes = 0;
+        for (const auto& member : bundle.members) memberBytes += member.fileSize;
         
-        return filesToProcess;
+        try {
+            ZipStreamWriter writer(outputs.open(bundle.outputFile, archiveSizeHint(memberBytes, bundle.members.size())));
+            for (const auto& member : bundle.members) {
+                stats.addInputSize(member.fileSize);
+                if (manifest.hasOwnZip(member.key)) hadOwnZip.insert(&member);
+                manifest.forget(member.key);
+                const StageTimers::FileScope timing;
+                const auto started = ProgressEvents::Clock::now();
+                const uint64_t startOffset = writer.bytesWritten();
+                try {
+                    // Members are small: one read serves the hash, the policy and the
+                    // entry, which charges the budget for a block of the same size
+                    ContentHasher hasher;
+                    SequentialFileReader input;
+                    if (!input.open(member.inputFile)) {
+                        throw std::runtime_error("Cannot open input: " + member.inputFile.string() + " (" +
+                                                 std::strerror(errno) + ")");
+                    }
+                    input.hashInto(&hasher);
+                    std::vector<unsigned char> contents;
+                    if (!input.readAll(contents, member.fileSize)) {
+                        throw std::runtime_error("Read failed for " + member.inputFile.string() + ": " +
+                                                 std::strerror(errno));
+                    }
+                    input.close();
+                    const auto contentHash = hasher.digest();
+                    const auto decision = CompressionPolicy::choose(contents, member.entryName());
+                    recordCompressionTier(decision.tier);
+                    
+                    PipelinedArchiveWriter::Options options;
+                    options.codec = &CodecRegistry::forEntry(CodecRegistry::select(decision.level), member.fileSize);
+                    options.level = decision.level;
+                    options.blockSize = CodecRegistry::blockSizeFor(*options.codec, member.fileSize,
+                                                                    Config::getParallelDeflateBlockSize());
+                    options.pipelined = false;
+                    
+                    auto keys = keyPool ? keyPool->acquire() : AesKeyPool::deriveTimed(password, stats);
+                    PipelinedArchiveWriter::appendEntry(writer, member.inputFile, contents, member.key, keys, options);
+                    OPENSSL_cleanse(&keys, sizeof(keys));
+                    packed.push_back({&member, contentHash, writer.bytesWritten() - startOffset,
+                                      ProgressEvents::Clock::now() - started, decision.type});
+                } catch (const std::exception& e) {
+                    if (writer.inEntry()) throw;
+                    skipped.insert(&member);
+                    stats.incrementFailedFiles();
+                    events.fileFailed(member.key, e.what());
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    std::cerr << "❌ Failed: " << member.key << " (" << e.what() << ")\n";
+                }
+            }
+            // Dropping the writer uncommitted leaves nothing behind
+            if (packed.empty()) return;
+            writer.finish();
+            for (const auto& [member, contentHash, archiveBytes, elapsed, type] : packed) {
+                if (hadOwnZip.count(member) == 0) continue;
+                outputs.remove(outputFolder / getZipFileName(member->key));
+                fileList.remove(getZipFileName(member->key));
+            }
+            
+            // The writer counted every byte, so the output needs no stat
+            const auto outputSize = writer.bytesWritten();
+            uint64_t packedBytes = 0;
+            stats.addOutputSize(outputSize);
+            std::unordered_set<std::string> members;
+            for (const auto& [member, contentHash, archiveBytes, elapsed, type] : packed) {
+                stats.incrementProcessedFiles();
+                manifest.record(member->key, {member->snapshot, contentHash, bundle.name});
+                fileList.add(FileMetadata(member->key, type, bundle.name));
+                events.fileDone(member->key, bundle.name, bundle.name, member->fileSize, archiveBytes, elapsed, false);
+                packedBytes += member->fileSize;
+                members.insert(member->key);
+            }
+            // A rebuilt bundle no longer holds the inputs deleted since
+            fileList.removeBundle(bundle.name, members);
+            events.bundleDone(bundle.name, packed.size(), packedBytes, outputSize);
+            
+            const auto compressionRatio = packedBytes > 0
+                ? (1.0 - static_cast<double>(outputSize) / static_cast<double>(packedBytes)) * 100.0 : 0.0;
+            std::lock_guard<std::mutex> lock(outputMutex);
+            console() << "📦 " << bundle.name << " (" << packed.size() << " files, " << formatBytes(packedBytes)
+                      << " → " << formatBytes(outputSize) << ", " << std::fixed << std::setprecision(1)
+                      << compressionRatio << "% compressed)\n";
+        } catch (const std::exception& e) {
+            for (const auto& member : bundle.members) {
+                if (skipped.count(&member) > 0) continue;
+                stats.incrementFailedFiles();
+                events.fileFailed(member.key, "bundle " + bundle.name + " failed: " + e.what());
+            }
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "❌ Failed bundle " << bundle.name << ": " << e.what() << '\n';
+        }
+    }
+
+    // One input's archive as written
+    struct ZipOutcome {
+        uint64_t archiveBytes;
+        uint64_t contentHash;   // XXH64 of the input bytes that went in
+        std::string_view type;  // the input's MIME type
+    };
+    
+    // Returns what went into the archive, or nothing if it could not be
+    // written. A nonzero `knownHash` is the input's XXH64 already; otherwise
+    // it is taken from the writer's reads.
+    std::optional<ZipOutcome> createPasswordProtectedZip(const fs::path& inputFile, const std::string& entryName,
+                                                         const fs::path& outputZipPath, size_t fileSize,
+                                                         uint64_t knownHash) const {
+        const auto partialPath = LocalFileSink::partialPathFor(outputZipPath);
+        try {
+            const auto decision = CompressionPolicy::choose(inputFile, entryName);
+            recordCompressionTier(decision.tier);
+            ContentHasher hasher;
+            ContentHasher* const feed = knownHash != 0 ? nullptr : &hasher;
+            const auto outcome = [&](uint64_t archiveBytes) {
+                return ZipOutcome{archiveBytes, feed ? hasher.digest() : knownHash, decision.type};
+            };
+            
+            if (useChunkedWriter(fileSize, decision.level)) {
+                const auto archiveBytes = createChunkedZip(inputFile, entryName, outputZipPath, fileSize,
+                                                           decision.level, feed);
+                return outcome(archiveBytes);
+            }
+            
+            // Long files overlap compression and encryption in the pipelined
+            // writer, whose sink commits the archive under its final name
+            std::optional<uint64_t> written;
+            if (useNativeWriter(fileSize)) {
+                written = createPipelinedZip(inputFile, entryName, outputZipPath, fileSize, decision.level, feed);
+            } else {
+                // libzip writes the file itself, so only this path needs a stat
+                ZipArchive archive(partialPath);
+                if (addFileToZipOptimized(archive, inputFile, entryName, decision.level, feed) && archive.close()) {
+                    written = fs::file_size(partialPath);
+                    durableRename(partialPath, outputZipPath);
+                }
+            }
+            if (written && Config::getChunked() && !outputs.remote()) {
+                chunks.discard(outputZipPath.lexically_relative(outputFolder).generic_string());
+            }
+            if (written) return outcome(*written);
+        } catch (const std::exception& e) {
+            std::cerr << "Zip creation error: " << e.what() << '\n';
+        }
+        
+        // Clean up the failed zip; a previous good one stays in place
+        std::error_code ec;
+        fs::remove(partialPath, ec);
+        return std::nullopt;
+    }
+    
+    // Room for headers, deflate's worst case and the AES trailers
+    static uint64_t archiveSizeHint(uint64_t inputBytes, size_t entries) {
+        return inputBytes + inputBytes / 256 + entries * 1024 + 64 * 1024;
+    }
+    
+    // Produce the duplicate's zip from the zip of identical content. The
+    // encrypted entry is copied as-is (same salt, same ciphertext) and only
+    // its name is rewritten, so no deflate or AES work is repeated. Returns
+    // the archive's size, or nothing if the zip has to be made afresh.
+    std::optional<uint64_t> reuseDuplicateZip(const FileTask& task) const {
+        const auto partialPath = LocalFileSink::partialPathFor(task.outputFile);
+        try {
+            // The 64-bit hash only nominates candidates; bytes decide
+            if (!fs::exists(task.cloneFrom) || !sameContent(task.inputFile, task.cloneInput)) return std::nullopt;
+            
+            fs::remove(partialPath);
+            bool linked = false;
+            if (Config::getDedupMode() == Config::DedupMode::Link) {
+                // Shares storage, but the entry inside keeps the first file's name
+                std::error_code ec;
+                fs::create_hard_link(task.cloneFrom, partialPath, ec);
+                linked = !ec;
+            }
+            if (!linked) {
+                fs::copy_file(task.cloneFrom, partialPath);
+                renameSingleEntry(partialPath, task.entryName());
+            }
+            
+            // The filesystem and libzip wrote it, so no sink counted the bytes
+            const auto size = fs::file_size(partialPath);
+            durableRename(partialPath, task.outputFile);
+            // rename() is a no-op when both names already link the same file
+            std::error_code ec;
+            fs::remove(partialPath, ec);
+            return size;
+        } catch (const std::exception& e) {
+            std::cerr << "Reuse of " << task.cloneFrom.filename() << " failed, compressing instead: " << e.what() << '\n';
+            std::error_code ec;
+            fs::remove(partialPath, ec);
+            return std::nullopt;
+        }
+    }
+    
+    static void renameSingleEntry(const fs::path& zipPath, const std::string& entryName) {
+        int error = 0;
+        zip_t* archive = zip_open(zipPath.c_str(), 0, &error);
+        if (!archive) {
+            throw std::runtime_error("Failed to open " + zipPath.string() + " (error " + std::to_string(error) + ")");
+        }
+        // Renaming leaves the entry's data untouched, so no password is needed
+        if (zip_get_num_entries(archive, 0) != 1 || zip_file_rename(archive, 0, entryName.c_str(), 0) < 0) {
+            const std::string message = zip_strerror(archive);
+            zip_discard(archive);
+            throw std::runtime_error("Failed to rename entry in " + zipPath.string() + ": " + message);
+        }
+        if (zip_close(archive) < 0) {
+            const std::string message = zip_strerror(archive);
+            zip_discard(archive);
+            throw std::runtime_error("Failed to rewrite " + zipPath.string() + ": " + message);
+        }
+    }
+    
+    static bool sameContent(const fs::path& a, const fs::path& b) {
+        std::ifstream first(a, std::ios::binary);
+        std::ifstream second(b, std::ios::binary);
+        if (!first.is_open() || !second.is_open()) return false;
+        
+        const auto bufferA = WorkerArena::buffer(WorkerArena::Buffer::Read, Config::getBufferSize());
+        const auto bufferB = WorkerArena::buffer(WorkerArena::Buffer::Compare, bufferA.size());
+        while (true) {
+            first.read(reinterpret_cast<char*>(bufferA.data()), static_cast<std::streamsize>(bufferA.size()));
+            second.read(reinterpret_cast<char*>(bufferB.data()), static_cast<std::streamsize>(bufferB.size()));
+            const auto n = first.gcount();
+            if (n != second.gcount() || std::memcmp(bufferA.data(), bufferB.data(), static_cast<size_t>(n)) != 0) {
+                return false;
+            }
+            if (!first || !second) return !first && !second;
+        }
+    }
+    
+    // Uploads need the native writer: libzip seeks back over what it wrote
+    bool useNativeWriter(size_t fileSize) const {
+        if (outputs.remote()) return true;
+        switch (Config::getWriterMode()) {
+            case Config::WriterMode::Native: return true;
+            case Config::WriterMode::Libzip: return false;
+            case Config::WriterMode::Auto: break;
+        }
+        const auto pipelineThreshold = Config::getPipelineThreshold();
+        return pipelineThreshold > 0 && fileSize >= pipelineThreshold;
+    }
+    
+    void recordCompressionTier(CompressionPolicy::Tier tier) const {
+        switch (tier) {
+            case CompressionPolicy::Tier::Store: stats.incrementStoredFiles(); break;
+            case CompressionPolicy::Tier::Fast: stats.incrementFastFiles(); break;
+            case CompressionPolicy::Tier::Max: stats.incrementMaxFiles(); break;
+        }
+    }
+    
+    uint64_t createPipelinedZip(const fs::path& inputFile, const std::string& entryName, const fs::path& outputZipPath,
+                                size_t fileSize, int level, ContentHasher* hasher) const {
+        const auto pipelineThreshold = Config::getPipelineThreshold();
+        const auto& codec = CodecRegistry::forEntry(CodecRegistry::select(level), fileSize);
+        
+        PipelinedArchiveWriter::Options options;
+        options.codec = &codec;
+        options.level = level;
+        options.blockSize = CodecRegistry::blockSizeFor(codec, fileSize, Config::getParallelDeflateBlockSize());
+        options.pipelined = pipelineThreshold > 0 && fileSize >= pipelineThreshold;
+        options.deflateThreads = blockParallelThreads(codec, fileSize, level);
+        options.pool = workers.get();
+        options.hasher = hasher;
+        
+        auto keys = keyPool ? keyPool->acquire() : AesKeyPool::deriveTimed(password, stats);
+        const auto archiveBytes = PipelinedArchiveWriter::write(
+            inputFile, entryName, outputs.open(outputZipPath, archiveSizeHint(fileSize, 1)), keys, options);
+        OPENSSL_cleanse(&keys, sizeof(keys));
+        return archiveBytes;
+    }
+    
+    // Chunks are copied out of the previous archive, so it has to be on disk
+    bool useChunkedWriter(size_t fileSize, int level) const {
+        return Config::getChunked() && !outputs.remote() && level > 0 && fileSize >= Config::getChunkedThreshold();
+    }
+    
+    uint64_t createChunkedZip(const fs::path& inputFile, const std::string& entryName, const fs::path& outputZipPath,
+                              size_t fileSize, int level, ContentHasher* hasher) const {
+        const auto& selected = CodecRegistry::select(level);
+        
+        ChunkedArchiveWriter::Options options;
+        options.codec = ChunkedArchiveWriter::supports(selected) ? &selected : &CodecRegistry::zlib();
+        options.level = level;
+        options.averageChunk = Config::getChunkSize();
+        options.threads = blockParallelThreads(*options.codec, fileSize, level);
+        options.pool = workers.get();
+        options.hasher = hasher;
+        
+        auto keys = keyPool ? keyPool->acquire() : AesKeyPool::deriveTimed(password, stats);
+        auto result = ChunkedArchiveWriter::write(inputFile, entryName, outputs.open(outputZipPath, archiveSizeHint(fileSize, 1)),
+                                                  keys, password, options, chunks);
+        OPENSSL_cleanse(&keys, sizeof(keys));
+        
+        result.map.archive = outputZipPath.lexically_relative(outputFolder).generic_string();
+        chunks.save(std::move(result.map));
+        stats.recordChunked(fileSize, result.reusedBytes, result.repeatedBytes);
+        return result.archiveBytes;
     }
     
-    bool shouldUseParallelProcessing(const std::vector<FileTask>& tasks) const {
-        if (tasks.size() < 2) return false;
+    // Huge inputs, and files the scheduler found dominating their batch, are
+    // split into block jobs any pool worker can pick up; everything else gets one
+    size_t blockParallelThreads(const BlockCodec& codec, size_t fileSize, int level) const {
+        const auto parallelThreshold = Config::getParallelDeflateThreshold();
+        const bool large = fileSize >= std::min(parallelThreshold, splitBytes);
+        const bool parallel = workers && level > 0 && !codec.wholeInputOnly() && parallelThreshold > 0 && large;
+        return parallel ? workers->size() : 1;
+    }
+
+    // `hasher`, if given, is fed the input as libzip's source reads it; the
+    // archive has to be closed before its digest is complete
+    bool addFileToZipOptimized(ZipArchive& zipArchive, const fs::path& filePath, const std::string& entryName,
+                               int level, ContentHasher* hasher = nullptr) const {
+        // For small files, use zip_source_file. For large files, use buffered approach
+        zip_t* archive = zipArchive.get();
+        const auto fileSize = fs::file_size(filePath);
+        const auto& codec = CodecRegistry::forEntry(CodecRegistry::select(level), fileSize);
         
-        // Use parallel processing if we have multiple files and at least one large file
-        const size_t largeFiles = std::count_if(tasks.begin(), tasks.end(),
-            [](const FileTask& task) { return task.fileSize >= Config::MIN_FILE_SIZE_FOR_THREADING; });
+        // Non-zlib backends compress outside libzip and hand it the result
+        if (level > 0 && &codec != &CodecRegistry::zlib()) {
+            return addFileToZipWithCodec(archive, filePath, entryName, codec, level, hasher);
+        }
         
-        return largeFiles > 0 || tasks.size() >= Config::getOptimalThreadCount();
+        if (fileSize <= Config::MIN_FILE_SIZE_FOR_THREADING) {
+            return addFileToZipSimple(zipArchive, filePath, entryName, level, hasher);
+        } else if (blockParallelThreads(codec, fileSize, level) > 1) {
+            return addFileToZipWithCodec(archive, filePath, entryName, codec, level, hasher);
+        } else if (Config::getMmapInput()) {
+            return addFileToZipMapped(zipArchive, filePath, entryName, level, hasher);
+        } else {
+            return addFileToZipBuffered(archive, filePath, entryName, level, hasher);
+        }
     }
     
-    void processFilesSequential(const std::vector<FileTask>& tasks) const {
-        for (size_t i = 0; i < tasks.size(); ++i) {
-            if (tasks.size() > 1) {
-                std::cout << "[" << (i + 1) << "/" << tasks.size() << "] ";
+    bool addFileToZipSimple(ZipArchive& zipArchive, const fs::path& filePath, const std::string& entryName, int level,
+                            ContentHasher* hasher) const {
+        if (!hasher) {
+            zip_source_t* source = zip_source_file(zipArchive.get(), filePath.c_str(), 0, 0);
+            if (!source) {
+                std::cerr << "Failed to create zip source for: " << filePath << '\n';
+                return false;
             }
-            processFileTask(tasks[i]);
+            return addSourceToZip(zipArchive.get(), source, entryName, level);
         }
-    }
-    
-    void processFilesParallel(const std::vector<FileTask>& tasks) const {
-        const size_t numThreads = std::min(Config::getOptimalThreadCount(), tasks.size());
-        std::vector<std::future<void>> futures;
-        futures.reserve(numThreads);
         
-        std::atomic<size_t> taskIndex{0};
-        std::mutex progressMutex;
-        
-        for (size_t i = 0; i < numThreads; ++i) {
-            futures.emplace_back(std::async(std::launch::async, [&]() {
-                while (true) {
-                    const size_t currentIndex = taskIndex.fetch_add(1, std::memory_order_relaxed);
-                    if (currentIndex >= tasks.size()) break;
-                    
-                    {
-                        std::lock_guard<std::mutex> lock(progressMutex);
-                        if (tasks.size() > 1) {
-                            std::cout << "[" << (currentIndex + 1) << "/" << tasks.size() << "] ";
-                        }
-                    }
-                    
-                    processFileTask(tasks[currentIndex]);
-                }
-            }));
+        // To be hashed it is read here once, and libzip deflates the copy
+        SequentialFileReader input;
+        struct stat st{};
+        if (!input.open(filePath) || ::stat(filePath.c_str(), &st) != 0) {
+            std::cerr << "Failed to open: " << filePath << " (" << std::strerror(errno) << ")\n";
+            return false;
+        }
+        input.hashInto(hasher);
+        auto bytes = std::make_shared<std::vector<unsigned char>>();
+        if (!input.readAll(*bytes, static_cast<size_t>(st.st_size))) {
+            std::cerr << "Read failed for " << filePath << ": " << std::strerror(errno) << '\n';
+            return false;
         }
         
-        // Wait for all threads to complete
-        for (auto& future : futures) {
-            future.wait();
+        zip_source_t* source = zip_source_buffer(zipArchive.get(), bytes->data(), bytes->size(), 0);
+        if (!source) {
+            std::cerr << "Failed to create zip source for: " << filePath << '\n';
+            return false;
         }
+        zipArchive.retain(bytes);
+        if (!addSourceToZip(zipArchive.get(), source, entryName, level)) return false;
+        
+        // A buffer source has no timestamp of its own
+        const zip_int64_t index = zip_get_num_entries(zipArchive.get(), 0) - 1;
+        if (index >= 0) zip_file_set_mtime(zipArchive.get(), static_cast<zip_uint64_t>(index), st.st_mtime, 0);
+        return true;
     }
     
-    void processFileTask(const FileTask& task) const {
-        const auto fileName = task.inputFile.filename().string();
-        const auto zipFileName = task.outputFile.filename().string();
-
-        try {
-            stats.addInputSize(task.fileSize);
-
-            if (createPasswordProtectedZip(task.inputFile, task.outputFile)) {
-                const auto outputSize = fs::file_size(task.outputFile);
-                stats.addOutputSize(outputSize);
-                stats.incrementProcessedFiles();
-                
-                // Add to processed files list for JSON output
-                {
-                    std::lock_guard<std::mutex> lock(processedFilesMutex);
-                    processedFiles.emplace_back(zipFileName, fileName);
-                }
-                
-                const auto compressionRatio = (1.0 - static_cast<double>(outputSize) / task.fileSize) * 100.0;
-                
-                // Thread-safe output
-                {
-                    static std::mutex outputMutex;
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    std::cout << "✅ " << zipFileName << " (" << formatBytes(task.fileSize) 
-                              << " → " << formatBytes(outputSize) 
-                              << ", " << std::fixed << std::setprecision(1) << compressionRatio << "% compressed)\n";
-                }
-            } else {
-                stats.incrementFailedFiles();
-                {
-                    static std::mutex outputMutex;
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    std::cerr << "❌ Failed: " << fileName << '\n';
-                }
-            }
-        } catch (const fs::filesystem_error& e) {
-            stats.incrementFailedFiles();
-            {
-                static std::mutex outputMutex;
-                std::lock_guard<std::mutex> lock(outputMutex);
-                std::cerr << "❌ File error for " << fileName << ": " << e.what() << '\n';
-            }
+    bool addFileToZipBuffered(zip_t* archive, const fs::path& filePath, const std::string& entryName, int level,
+                              ContentHasher* hasher) const {
+        // Stream large files in bounded chunks through a custom source callback
+        zip_source_t* source = StreamingFileSource::create(archive, filePath, Config::getBufferSize(), hasher);
+        if (!source) {
+            std::cerr << "Failed to create streaming source for: " << filePath << '\n';
+            return false;
         }
-    }
 
-    bool createPasswordProtectedZip(const fs::path& inputFile, const fs::path& outputZipPath) const {
-        try {
-            ZipArchive archive(outputZipPath);
-            return addFileToZipOptimized(archive.get(), inputFile);
-        } catch (const std::exception& e) {
-            std::cerr << "Zip creation error: " << e.what() << '\n';
-            // Clean up failed zip file
-            std::error_code ec;
-            fs::remove(outputZipPath, ec);
+        return addSourceToZip(archive, source, entryName, level);
+    }
+    
+    bool addFileToZipMapped(ZipArchive& zipArchive, const fs::path& filePath, const std::string& entryName,
+                            int level, ContentHasher* hasher) const {
+        // Deflate reads the mapped pages directly; the mapping outlives zip_close
+        const auto mapping = MappedInputFile::open(filePath);
+        if (!mapping) {
+            return addFileToZipBuffered(zipArchive.get(), filePath, entryName, level, hasher);
+        }
+        // Hashing faults the pages in, so deflate finds them resident
+        if (hasher) hasher->update(mapping->bytes(), mapping->size());
+        
+        zip_source_t* source = zip_source_buffer(zipArchive.get(), mapping->bytes(), mapping->size(), 0);
+        if (!source) {
+            std::cerr << "Failed to create mapped source for: " << filePath << '\n';
             return false;
         }
-    }
+        zipArchive.retain(mapping);
 
-    bool addFileToZipOptimized(zip_t* archive, const fs::path& filePath) const {
-        // For small files, use zip_source_file. For large files, use buffered approach
-        const auto fileSize = fs::file_size(filePath);
+        if (!addSourceToZip(zipArchive.get(), source, entryName, level)) return false;
         
-        if (fileSize <= Config::MIN_FILE_SIZE_FOR_THREADING) {
-            return addFileToZipSimple(archive, filePath);
-        } else {
-            return addFileToZipBuffered(archive, filePath);
-        }
+        // A buffer source has no timestamp of its own
+        const zip_int64_t index = zip_get_num_entries(zipArchive.get(), 0) - 1;
+        if (index >= 0) zip_file_set_mtime(zipArchive.get(), static_cast<zip_uint64_t>(index), mapping->modified(), 0);
+        return true;
     }
     
-    bool addFileToZipSimple(zip_t* archive, const fs::path& filePath) const {
-        // Create zip source from file
-        zip_source_t* source = zip_source_file(archive, filePath.c_str(), 0, 0);
+    bool addFileToZipWithCodec(zip_t* archive, const fs::path& filePath, const std::string& entryName,
+                               const BlockCodec& codec, int level, ContentHasher* hasher) const {
+        // Huge inputs are split into blocks compressed on separate threads
+        const auto fileSize = fs::file_size(filePath);
+        zip_source_t* source = BlockCompressedSource::create(
+            archive, filePath, codec, CodecRegistry::blockSizeFor(codec, fileSize, Config::getParallelDeflateBlockSize()),
+            level, blockParallelThreads(codec, fileSize, level), workers.get(), hasher);
         if (!source) {
-            std::cerr << "Failed to create zip source for: " << filePath << '\n';
+            std::cerr << "Failed to create " << codec.name() << " source for: " << filePath << '\n';
             return false;
         }
 
-        // Add file with just filename (not full path)
-        const auto fileName = filePath.filename().string();
+        return addSourceToZip(archive, source, entryName, level, &codec);
+    }
+    
+    bool addSourceToZip(zip_t* archive, zip_source_t* source, const std::string& fileName, int level,
+                        const BlockCodec* preCompressedWith = nullptr) const {
+        // Add file with just its name (not full path)
         const zip_int64_t index = zip_file_add(archive, fileName.c_str(), source, ZIP_FL_OVERWRITE);
         
         if (index < 0) {
@@ -551,20 +9791,26 @@ private:
             return false;
         }
         
-        // Set compression method (deflate with best compression)
-        if (zip_set_file_compression(archive, index, ZIP_CM_DEFLATE, 9) < 0) {
+        // Pre-compressed data is copied through while the entry's method matches
+        // the source's; the default already resolves to deflate
+        if (preCompressedWith) {
+            const auto method = preCompressedWith->zipMethod();
+            if (method != ZIP_CM_DEFLATE && zip_set_file_compression(archive, index, method, static_cast<zip_uint32_t>(level)) < 0) {
+                std::cerr << "Failed to set " << preCompressedWith->name() << " method for: " << fileName << '\n';
+                return false;
+            }
+            return true;
+        }
+        
+        // Set compression method chosen by the policy (level 0 stores)
+        const zip_int32_t method = level == 0 ? ZIP_CM_STORE : ZIP_CM_DEFLATE;
+        if (zip_set_file_compression(archive, index, method, static_cast<zip_uint32_t>(level)) < 0) {
             std::cerr << "Warning: Failed to set compression for: " << fileName << '\n';
             // Continue anyway - encryption is more important
         }
 
         return true;
     }
-    
-    bool addFileToZipBuffered(zip_t* archive, const fs::path& filePath) const {
-        // For large files, we could implement a custom source callback
-        // For now, fall back to simple method as libzip handles buffering internally
-        return addFileToZipSimple(archive, filePath);
-    }
 
     static std::string getZipFileName(const std::string& fileName) {
         // Keep the original filename with extension and add .zip
@@ -572,102 +9818,6 @@ private:
         return fileName + ".zip";
     }
 
-    bool isInputNewer(const fs::path& inputFile, const fs::path& zipFile) const {
-        try {
-            // Use cache for repeated lookups
-            std::lock_guard<std::mutex> lock(timeCacheMutex);
-            
-            const auto inputKey = inputFile.string();
-            auto inputTime = timeCache.find(inputKey);
-            if (inputTime == timeCache.end()) {
-                inputTime = timeCache.emplace(inputKey, fs::last_write_time(inputFile)).first;
-            }
-            
-            const auto zipKey = zipFile.string();
-            auto zipTime = timeCache.find(zipKey);
-            if (zipTime == timeCache.end()) {
-                if (!fs::exists(zipFile)) return true;
-                zipTime = timeCache.emplace(zipKey, fs::last_write_time(zipFile)).first;
-            }
-            
-            return inputTime->second > zipTime->second;
-        } catch (const fs::filesystem_error&) {
-            return true; // If we can't compare, assume input is newer
-        }
-    }
-    
-    void generateFileListJson() const {
-        try {
-            std::lock_guard<std::mutex> lock(processedFilesMutex);
-            
-            if (processedFiles.empty()) {
-                std::cout << "No files processed, skipping JSON generation.\n";
-                return;
-            }
-            
-            const fs::path jsonPath = outputFolder / "files-list.json";
-            std::ofstream jsonFile(jsonPath);
-            
-            if (!jsonFile.is_open()) {
-                std::cerr << "Failed to create files-list.json\n";
-                return;
-            }
-            
-            jsonFile << "[\n";
-            
-            for (size_t i = 0; i < processedFiles.size(); ++i) {
-                const auto& file = processedFiles[i];
-                jsonFile << "    {\n";
-                jsonFile << "        \"name\": \"" << escapeJsonString(file.name) << "\",\n";
-                jsonFile << "        \"type\": \"" << escapeJsonString(file.type) << "\"\n";
-                jsonFile << "    }";
-                
-                if (i < processedFiles.size() - 1) {
-                    jsonFile << ",";
-                }
-                jsonFile << "\n";
-            }
-            
-            jsonFile << "]\n";
-            jsonFile.close();
-            
-            std::cout << "📄 Generated files-list.json with " << processedFiles.size() << " entries\n";
-            
-        } catch (const std::exception& e) {
-            std::cerr << "Error generating files-list.json: " << e.what() << '\n';
-        }
-    }
-    
-    static std::string escapeJsonString(const std::string& str) {
-        std::string escaped;
-        escaped.reserve(str.size() + 16); // Reserve some extra space for escapes
-        
-        for (char c : str) {
-            switch (c) {
-                case '"':  escaped += "\\\""; break;
-                case '\\': escaped += "\\\\"; break;
-                case '\b': escaped += "\\b"; break;
-                case '\f': escaped += "\\f"; break;
-                case '\n': escaped += "\\n"; break;
-                case '\r': escaped += "\\r"; break;
-                case '\t': escaped += "\\t"; break;
-                default:
-                    if (c < 0x20) {
-                        // Control characters
-                        escaped += "\\u";
-                        char buf[5];
-                        std::snprintf(buf, sizeof(buf), "%04x", static_cast<unsigned char>(c));
-                        escaped += buf;
-                    } else {
-                        escaped += c;
-                    }
-                    break;
-            }
-        }
-        
-        return escaped;
-    }
-
     static std::string formatBytes(size_t bytes) {
         constexpr std::array<const char*, 6> units = {"B", "KB", "MB", "GB", "TB", "PB"};
         
@@ -680,33 +9830,62 @@ private:
         
         const auto value = static_cast<double>(bytes) / std::pow(1024.0, static_cast<double>(unitIndex));
         
-        std::ostringstream oss;
-        oss << std::fixed << std::setprecision(1) << value << " " << units[unitIndex];
-        return oss.str();
+        // "1023.9 KB" fits the small-string buffer, so this never allocates
+        char text[32];
+        const int length = std::snprintf(text, sizeof(text), "%.1f %s", value, units[unitIndex]);
+        return std::string(text, static_cast<size_t>(std::max(length, 0)));
     }
 };
 
-int main() {
+int zipper::runCommandLine(int argc, char* argv[]) {
     Config::displayHeader();
     
     try {
         const auto inputFolder = Config::getInputFolder();
         const auto outputFolder = Config::getOutputFolder();
         const auto password = Config::getPassword();
+        const auto inputFiles = Config::getInputFiles(argc, argv);
         
         HighPerformanceFileZipper zipper(inputFolder, outputFolder, password);
         
-        std::cout << "Source folder: " << inputFolder << "\n";
-        std::cout << "Output folder: " << outputFolder << "\n";
-        std::cout << "Scanning files...\n";
-        const bool success = zipper.processAllFiles();
+        if (Config::getVerify()) {
+            if (inputFiles || Config::getWatch()) {
+                std::cerr << "ZIPPER_VERIFY checks the output folder and cannot be combined with a file list or ZIPPER_WATCH\n";
+                return 1;
+            }
+            console() << "Verifying archives in " << outputFolder << "\n";
+            if (!zipper.verifyOutputs()) {
+                console() << "\n❌ Verification found problems!\n";
+                return 1;
+            }
+            console() << "\n🎉 Every archive is intact and opens with the current password.\n";
+            return 0;
+        }
+        
+        if (inputFiles) {
+            if (Config::getWatch()) {
+                std::cerr << "ZIPPER_WATCH watches the input folder and cannot be combined with a file list\n";
+                return 1;
+            }
+            zipper.setInputFiles(*inputFiles);
+            console() << "Input files: " << zipper.listedFileCount() << " listed\n";
+        } else {
+            console() << "Source folder: " << inputFolder << "\n";
+        }
+        console() << "Output folder: " << outputFolder << "\n";
+        console() << "Scanning files...\n";
+        const bool success = Config::getWatch() ? zipper.watch() : zipper.processAllFiles();
 
         if (success) {
-            std::cout << "\n🎉 Process completed successfully!\n";
-            std::cout << "Check the '" << outputFolder << "' folder for individual zip files.\n";
-            std::cout << "Each zip file is protected with AES-256 encryption.\n";
+            console() << "\n🎉 Process completed successfully!\n";
+            if (const auto url = Config::getOutputUrl(); !url.empty()) {
+                console() << "Zip files were uploaded to " << url << ".\n";
+            } else {
+                console() << "Check the '" << outputFolder << "' folder for individual zip files.\n";
+            }
+            console() << "Each zip file is protected with AES-256 encryption.\n";
         } else {
-            std::cout << "\n❌ Process completed with errors!\n";
+            console() << "\n❌ Process completed with errors!\n";
             return 1;
         }
 
@@ -717,3 +9896,291 @@ int main() {
 
     return 0;
 }
+
+// ---- Library API (zipper.h) ----
+
+// An output name must stay below the output folder and name a file
+static bool usableOutputName(const std::string& name) {
+    const fs::path path(name);
+    if (name.empty() || !path.is_relative() || path.filename().empty()) return false;
+    return std::none_of(path.begin(), path.end(), [](const fs::path& part) { return part == ".." || part == "."; });
+}
+
+struct zipper::Job::State {
+    std::atomic<bool> cancelled{false};
+    std::promise<Result> promise;
+    std::shared_future<Result> result = promise.get_future().share();
+    ProgressCallback onProgress;
+    std::vector<Input> inputs;
+};
+
+void zipper::Job::cancel() {
+    if (state) state->cancelled = true;
+}
+
+bool zipper::Job::ready() const {
+    return state && state->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+zipper::Result zipper::Job::wait() const {
+    if (!state) throw std::future_error(std::future_errc::no_state);
+    return state->result.get();
+}
+
+std::shared_future<zipper::Result> zipper::Job::future() const {
+    return state ? state->result : std::shared_future<Result>();
+}
+
+// One zipper per engine; a single runner thread takes jobs in order, since
+// a batch owns the zipper's pools, manifest and listing while it runs
+struct zipper::Engine::Impl {
+    HighPerformanceFileZipper zipper;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<Job::State>> queue;
+    bool stopping = false;
+    std::thread runner;  // last, so it starts once the rest exists
+    
+    explicit Impl(const Options& options)
+        : zipper(options.inputFolder.string(), options.outputFolder.string(), options.password),
+          runner([this]() { run(); }) {}
+    
+    ~Impl() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto& job : queue) job->cancelled = true;
+        }
+        wake.notify_all();
+        runner.join();
+    }
+    
+    void run() {
+        while (true) {
+            std::shared_ptr<Job::State> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            // A job that throws ends with the exception, not the runner thread
+            try {
+                job->promise.set_value(execute(*job));
+            } catch (...) {
+                zipper.setJobHooks(nullptr, {});
+                job->promise.set_exception(std::current_exception());
+            }
+        }
+    }
+    
+    Result execute(Job::State& job) {
+        Result result{};
+        if (job.cancelled) {
+            result.cancelled = 1;
+            return result;
+        }
+        
+        // Buffers are staged once and released; the zipper reads them by path
+        std::vector<std::unique_ptr<StagedBuffer>> staged;
+        std::vector<std::pair<std::string, fs::path>> named;
+        try {
+            for (auto& input : job.inputs) {
+                if (!input.path.empty()) {
+                    named.emplace_back(input.name.empty() ? input.path.filename().string() : input.name, input.path);
+                    continue;
+                }
+                staged.push_back(std::make_unique<StagedBuffer>(input.data.data(), input.data.size()));
+                std::vector<unsigned char>().swap(input.data);
+                named.emplace_back(input.name, staged.back()->path());
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Cannot stage inputs: " << e.what() << '\n';
+            result.failed = job.inputs.size();
+            return result;
+        }
+        
+        const bool scan = job.inputs.empty();
+        if (!scan) zipper.setInputs(named);
+        std::function<void()> listener;
+        if (job.onProgress) {
+            listener = [&job, &events = zipper.progress()]() {
+                const Progress progress{events.doneFiles(), events.failedFiles(), events.plannedFiles(),
+                                        events.doneBytes(), events.plannedBytes()};
+                job.onProgress(progress);
+            };
+        }
+        zipper.setJobHooks(&job.cancelled, std::move(listener));
+        
+        const auto before = zipper.totals();
+        const bool ok = zipper.runJob(scan);
+        const auto after = zipper.totals();
+        zipper.setJobHooks(nullptr, {});
+        
+        result.ok = ok ? 1 : 0;
+        result.cancelled = job.cancelled ? 1 : 0;
+        result.processed = after.processed - before.processed;
+        result.skipped = after.skipped - before.skipped;
+        result.failed = after.failed - before.failed;
+        result.input_bytes = after.inputBytes - before.inputBytes;
+        result.output_bytes = after.outputBytes - before.outputBytes;
+        return result;
+    }
+
+};
+
+zipper::Engine::Engine(const Options& options) {
+    if (options.password.empty()) throw std::invalid_argument("A password is required");
+    std::error_code ec;
+    fs::create_directories(options.outputFolder, ec);
+    if (ec) throw std::runtime_error("Cannot create output folder " + options.outputFolder.string() + ": " + ec.message());
+    for (const auto& [name, value] : options.settings) {
+        Config::setOverride(name, value);
+    }
+    impl = std::make_unique<Impl>(options);
+}
+
+zipper::Engine::~Engine() = default;
+
+zipper::Job zipper::Engine::submit(Request request, ProgressCallback onProgress) {
+    for (const auto& input : request.inputs) {
+        const auto name = input.name.empty() ? input.path.filename().string() : input.name;
+        if (!usableOutputName(name)) throw std::invalid_argument("Unusable output name: \"" + name + "\"");
+    }
+    
+    auto state = std::make_shared<Job::State>();
+    state->inputs = std::move(request.inputs);
+    state->onProgress = std::move(onProgress);
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        impl->queue.push_back(state);
+    }
+    impl->wake.notify_one();
+    return Job(std::move(state));
+}
+
+struct zipper_engine {
+    zipper::Engine engine;
+    explicit zipper_engine(const zipper::Options& options) : engine(options) {}
+};
+
+struct zipper_request {
+    zipper::Request request;
+};
+
+struct zipper_job {
+    zipper::Job job;
+};
+
+// The C functions never let an exception cross into the caller
+extern "C" {
+
+void zipper_set_option(const char* name, const char* value) {
+    if (!name || !value) return;
+    try {
+        Config::setOverride(name, value);
+    } catch (const std::exception& e) {
+        std::cerr << "zipper_set_option: " << e.what() << '\n';
+    } catch (...) {
+        std::cerr << "zipper_set_option: unknown error\n";
+    }
+}
+
+zipper_engine* zipper_engine_new(const char* output_folder, const char* password, const char* input_folder) {
+    try {
+        zipper::Options options;
+        options.outputFolder = output_folder ? output_folder : "";
+        options.password = password ? password : "";
+        if (input_folder) options.inputFolder = input_folder;
+        return new zipper_engine(options);
+    } catch (const std::exception& e) {
+        std::cerr << "zipper_engine_new: " << e.what() << '\n';
+        return nullptr;
+    } catch (...) {
+        std::cerr << "zipper_engine_new: unknown error\n";
+        return nullptr;
+    }
+}
+
+void zipper_engine_free(zipper_engine* engine) {
+    delete engine;
+}
+
+zipper_request* zipper_request_new(void) {
+    return new (std::nothrow) zipper_request();
+}
+
+void zipper_request_free(zipper_request* request) {
+    delete request;
+}
+
+int zipper_request_add_file(zipper_request* request, const char* path, const char* name) {
+    if (!request || !path) return -1;
+    try {
+        auto input = zipper::Input::file(path, name ? name : "");
+        if (!usableOutputName(input.name.empty() ? input.path.filename().string() : input.name)) return -1;
+        request->request.inputs.push_back(std::move(input));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int zipper_request_add_buffer(zipper_request* request, const char* name, const void* data, size_t size) {
+    if (!request || !name || (!data && size > 0) || !usableOutputName(name)) return -1;
+    try {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        request->request.inputs.push_back(zipper::Input::buffer(name, std::vector<unsigned char>(bytes, bytes + size)));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+zipper_job* zipper_submit(zipper_engine* engine, const zipper_request* request, zipper_progress_fn on_progress,
+                          void* user) {
+    if (!engine) return nullptr;
+    try {
+        zipper::ProgressCallback callback;
+        if (on_progress) {
+            callback = [on_progress, user](const zipper::Progress& progress) { on_progress(&progress, user); };
+        }
+        auto job = engine->engine.submit(request ? request->request : zipper::Request(), std::move(callback));
+        return new zipper_job{std::move(job)};
+    } catch (const std::exception& e) {
+        std::cerr << "zipper_submit: " << e.what() << '\n';
+        return nullptr;
+    } catch (...) {
+        std::cerr << "zipper_submit: unknown error\n";
+        return nullptr;
+    }
+}
+
+void zipper_job_cancel(zipper_job* job) {
+    if (job) job->job.cancel();
+}
+
+int zipper_job_ready(const zipper_job* job) {
+    return job && job->job.ready() ? 1 : 0;
+}
+
+void zipper_job_wait(zipper_job* job, zipper_result* result) {
+    if (!job) return;
+    try {
+        const auto outcome = job->job.wait();
+        if (result) *result = outcome;
+    } catch (const std::exception& e) {
+        std::cerr << "zipper_job_wait: " << e.what() << '\n';
+        if (result) *result = zipper_result{};
+    } catch (...) {
+        std::cerr << "zipper_job_wait: unknown error\n";
+        if (result) *result = zipper_result{};
+    }
+}
+
+void zipper_job_free(zipper_job* job) {
+    delete job;
+}
+
+}  // extern "C"
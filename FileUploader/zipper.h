@@ -0,0 +1,178 @@
+// libzipper: the high-performance zipper as an embeddable engine.
+//
+// An engine owns the worker pool, the AES key pool, the manifest and
+// files-list.json of one output folder, and keeps them warm between jobs.
+// Jobs run one at a time in submit order; each zips its inputs in parallel
+// with the same incremental, bundling and dedup rules as the command line.
+// Outputs and the listing land in the output folder exactly as the CLI
+// writes them.
+//
+// Link with -lzipper -lzip -lz -lssl -lcrypto -pthread (plus any codec backends
+// the library was built with).
+#ifndef ZIPPER_H
+#define ZIPPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define ZIPPER_API __attribute__((visibility("default")))
+#else
+#define ZIPPER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct zipper_engine zipper_engine;
+typedef struct zipper_request zipper_request;
+typedef struct zipper_job zipper_job;
+
+// Progress of the running job. Totals are known once planning is done.
+typedef struct zipper_progress {
+    uint64_t files_done;
+    uint64_t files_failed;
+    uint64_t files_total;
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+} zipper_progress;
+
+typedef struct zipper_result {
+    int ok;         // nonzero when no input failed
+    int cancelled;  // nonzero when the job was cancelled before every input started
+    uint64_t processed;
+    uint64_t skipped;  // unchanged since they were last zipped
+    uint64_t failed;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+} zipper_result;
+
+// Called on a worker thread after every finished or failed file; keep it short
+typedef void (*zipper_progress_fn)(const zipper_progress* progress, void* user);
+
+// Set a ZIPPER_* setting by its environment name, e.g. ("ZIPPER_THREADS", "8").
+// Settings are global, not per engine: this overrides the environment for
+// every engine in the process. Most are read on first use, so set them
+// before creating the first engine; a later value may not take effect.
+// ZIPPER_QUIET=1 keeps the engine off stdout.
+ZIPPER_API void zipper_set_option(const char* name, const char* value);
+
+// NULL on failure, with the reason on stderr. input_folder may be NULL; it
+// is only scanned by requests without inputs.
+ZIPPER_API zipper_engine* zipper_engine_new(const char* output_folder, const char* password,
+                                            const char* input_folder);
+// Finishes the running job and cancels queued ones
+ZIPPER_API void zipper_engine_free(zipper_engine* engine);
+
+ZIPPER_API zipper_request* zipper_request_new(void);
+ZIPPER_API void zipper_request_free(zipper_request* request);
+// name is the output name ("docs/a.pdf" -> docs/a.pdf.zip); NULL uses the file name.
+// Returns 0, or -1 for an unusable name.
+ZIPPER_API int zipper_request_add_file(zipper_request* request, const char* path, const char* name);
+// The bytes are copied; the caller may free them once this returns
+ZIPPER_API int zipper_request_add_buffer(zipper_request* request, const char* name, const void* data, size_t size);
+
+// Queue a job; a request without inputs scans the engine's input folder.
+// The request can be freed or reused afterwards. NULL on failure.
+ZIPPER_API zipper_job* zipper_submit(zipper_engine* engine, const zipper_request* request,
+                                     zipper_progress_fn on_progress, void* user);
+// Inputs that have not started are skipped; ones in flight finish
+ZIPPER_API void zipper_job_cancel(zipper_job* job);
+// Nonzero once the result is available
+ZIPPER_API int zipper_job_ready(const zipper_job* job);
+// Blocks until the job is done. A job that failed outright reports ok = 0
+// and nothing done, with the reason on stderr.
+ZIPPER_API void zipper_job_wait(zipper_job* job, zipper_result* result);
+// Releases the handle; the job itself still runs to completion
+ZIPPER_API void zipper_job_free(zipper_job* job);
+
+#ifdef __cplusplus
+}
+
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace zipper {
+
+using Progress = zipper_progress;
+using Result = zipper_result;
+using ProgressCallback = std::function<void(const Progress&)>;
+
+struct Options {
+    std::filesystem::path outputFolder;
+    std::string password;
+    std::filesystem::path inputFolder;  // scanned by requests without inputs
+    // ZIPPER_* settings by environment name. They are global, not this
+    // engine's: applied to the whole process when the engine is created and
+    // seen by every other engine, as with zipper_set_option.
+    std::vector<std::pair<std::string, std::string>> settings;
+};
+
+// A file read from where it is, or bytes held in memory
+struct Input {
+    std::string name;  // output name; empty uses the file's name
+    std::filesystem::path path;
+    std::vector<unsigned char> data;  // used when path is empty
+
+    static Input file(std::filesystem::path path, std::string name = {}) {
+        return Input{std::move(name), std::move(path), {}};
+    }
+    static Input buffer(std::string name, std::vector<unsigned char> data) {
+        return Input{std::move(name), {}, std::move(data)};
+    }
+};
+
+struct Request {
+    std::vector<Input> inputs;  // empty: scan the engine's input folder
+};
+
+class ZIPPER_API Job {
+public:
+    Job() = default;
+
+    void cancel();
+    bool ready() const;
+    // Rethrows what the job threw, if it failed outright
+    Result wait() const;
+    std::shared_future<Result> future() const;
+
+    struct State;
+
+private:
+    explicit Job(std::shared_ptr<State> s) : state(std::move(s)) {}
+    std::shared_ptr<State> state;
+    friend class Engine;
+};
+
+class ZIPPER_API Engine {
+public:
+    // Throws std::invalid_argument without a password, std::runtime_error
+    // if the output folder cannot be created
+    explicit Engine(const Options& options);
+    ~Engine();
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // Throws std::invalid_argument for an absolute or ".." output name
+    Job submit(Request request, ProgressCallback onProgress = {});
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// The command-line front end: environment settings, optional file-list
+// arguments, watch mode. Returns the process exit code.
+ZIPPER_API int runCommandLine(int argc, char* argv[]);
+
+}  // namespace zipper
+#endif
+
+#endif  // ZIPPER_H
@@ -0,0 +1,6 @@
+// Command-line front end of libzipper; see zipper::runCommandLine
+#include "zipper.h"
+
+int main(int argc, char* argv[]) {
+    return zipper::runCommandLine(argc, argv);
+}
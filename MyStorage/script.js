@@ -10,6 +10,12 @@ const CONFIG = {
     // Files list - Files in the "files" directory
     FILES: [],
     
+    // Paged listing written by the zipper: pages of files-list.json plus an
+    // index.json describing them. Pages not yet shown are loaded on scroll.
+    INDEX_URL: 'files/files-index/',
+    INDEX: null, // { pages, next } while the paged listing is in use
+    STAGGERED_CARDS: 20, // Cards animated one after another; the rest appear together
+    
     // File type mappings
     FILE_TYPES: {
         'application/pdf': 'pdf',
@@ -108,6 +114,21 @@ function getMimeTypeFromFilename(filename) {
 
 // Function to auto-discover files in the directory
 function autoDiscoverFiles() {
+    // The paged listing needs only its index and first page up front
+    return loadFileIndex()
+        .then(index => {
+            CONFIG.INDEX = { pages: index.pages, next: 1 };
+            return index.pages.length > 0 ? loadIndexPage(index.pages[0]) : [];
+        })
+        .catch(error => {
+            console.log('No paged listing, scanning the files directory:', error.message);
+            CONFIG.INDEX = null;
+            return discoverFilesFromDirectory();
+        });
+}
+
+// Function to discover files from the directory listing, or files-list.json
+function discoverFilesFromDirectory() {
     return new Promise((resolve, reject) => {
         console.log('Starting file discovery process...');
         
@@ -186,25 +207,7 @@ function scanFilesDirectory() {
             }
             
             // Process each file to add required properties
-            const filesInDirectory = filesData.map(file => {
-                // Create a display name by replacing underscores with spaces
-                const displayName = file.name.replace(/_/g, ' ').replace(/\.\w+$/, '');
-                
-                // Use provided type or guess from filename
-                const fileType = file.type || getMimeTypeFromFilename(file.name);
-                
-                // Create file object with proper properties
-                const fileObj = {
-                    name: displayName,
-                    filename: file.name,
-                    type: identifyFileType({ type: fileType }),
-                    fromServer: true, // Mark as loaded from server
-                    fileId: `server-${file.name}-${Date.now()}` // Add unique ID to prevent duplicates
-                };
-                
-                console.log('Processed file:', fileObj);
-                return fileObj;
-            });
+            const filesInDirectory = filesData.map(toServerFile);
             
             console.log('All processed files:', filesInDirectory);
             
@@ -241,6 +244,99 @@ function scanFilesDirectory() {
         });
 }
 
+// Turn a listing entry into the file object the grid shows
+function toServerFile(file) {
+    // Create a display name by replacing underscores with spaces
+    const displayName = file.name.replace(/_/g, ' ').replace(/\.\w+$/, '');
+    
+    // Use provided type or guess from filename
+    const fileType = file.type || getMimeTypeFromFilename(file.name);
+    
+    return {
+        name: displayName,
+        filename: file.name,
+        type: identifyFileType({ type: fileType }),
+        bundle: file.bundle, // Archive holding this file when the zipper bundled it
+        fromServer: true, // Mark as loaded from server
+        fileId: `server-${file.name}-${Date.now()}` // Add unique ID to prevent duplicates
+    };
+}
+
+// Function to load the paged listing's index.json
+function loadFileIndex() {
+    // Always revalidated, so an unchanged index costs a 304
+    return fetch(`${CONFIG.INDEX_URL}index.json`, { cache: 'no-cache' })
+        .then(response => {
+            if (!response.ok) {
+                throw new Error('Failed to load index.json');
+            }
+            return response.json();
+        })
+        .then(index => {
+            if (!index || !Array.isArray(index.pages)) {
+                throw new Error('index.json does not list any pages');
+            }
+            console.log(`Paged listing: ${index.total} files in ${index.pages.length} pages`);
+            return index;
+        });
+}
+
+// Function to load one page of the paged listing
+function loadIndexPage(page) {
+    // The hash changes whenever the page does, so cached copies never go stale
+    return fetch(`${CONFIG.INDEX_URL}${encodeURIComponent(page.file)}?v=${encodeURIComponent(page.hash)}`)
+        .then(response => {
+            if (!response.ok) {
+                throw new Error(`Failed to load ${page.file}`);
+            }
+            return response.json();
+        })
+        .then(filesData => {
+            if (!Array.isArray(filesData)) {
+                throw new Error(`${page.file} does not contain a valid array of files`);
+            }
+            return filesData.filter(file => {
+                return file && typeof file.name === 'string' && typeof file.type === 'string';
+            });
+        });
+}
+
+// Load the next page of the paged listing and add its cards to the grid
+function loadNextIndexPage() {
+    const index = CONFIG.INDEX;
+    if (!index || index.loading || index.next >= index.pages.length) {
+        return;
+    }
+    
+    index.loading = true;
+    loadIndexPage(index.pages[index.next])
+        .then(filesData => {
+            // A refresh or logout replaced the listing meanwhile
+            if (CONFIG.INDEX !== index) {
+                return;
+            }
+            index.next++;
+            index.loading = false;
+            
+            const filenameSeen = new Set(CONFIG.FILES.map(file => file.filename));
+            const newFiles = filesData.map(toServerFile).filter(file => !filenameSeen.has(file.filename));
+            CONFIG.FILES.push(...newFiles);
+            appendFileCards(newFiles);
+            
+            // Check again once the cards are in, as the end may still be in view
+            setTimeout(() => {
+                if (index.observer) {
+                    index.observer.unobserve(index.sentinel);
+                    index.observer.observe(index.sentinel);
+                }
+            }, CONFIG.STAGGERED_CARDS * 100 + 100);
+        })
+        .catch(error => {
+            console.error('Error loading the next page of files:', error);
+            index.loading = false;
+        });
+}
+
 // Function to load known files from JSON file
 function loadKnownFilesFromJSON() {
     return new Promise((resolve, reject) => {
@@ -424,6 +520,7 @@ function handleLogout() {
     
     // Clear all file data from memory for security
     CONFIG.FILES = [];
+    CONFIG.INDEX = null;
     
     // Show login container
     showLoginContainer();
@@ -441,6 +538,7 @@ function handleRefresh() {
     
     // Reset the files array to force a rescan
     CONFIG.FILES = CONFIG.FILES.filter(file => file.uploadTime); // Keep only user uploaded files
+    CONFIG.INDEX = null;
     
     // Rescan the files directory
     scanFilesDirectory();
@@ -515,13 +613,15 @@ function hideErrorMessage() {
 // Create file card HTML
 function createFileCard(file) {
     const iconClass = FILE_ICONS[file.type] || FILE_ICONS.default;
-    const filePath = `files/${encodeURIComponent(file.filename)}`;
+    // Bundled files are downloaded as the archive that holds them
+    const archive = file.bundle || file.filename;
+    const filePath = `files/${encodeURIComponent(archive)}`;
     
     return `
         <div class="file-card">
             <i class="${iconClass} file-icon ${file.type}"></i>
             <div class="file-name">${file.name}</div>
-            <a href="${filePath}" class="download-btn" download="${file.filename}" target="_blank">
+            <a href="${filePath}" class="download-btn" download="${archive}" target="_blank"${file.bundle ? ` title="Inside ${archive}"` : ''}>
                 <i class="fas fa-download"></i>
                 Download
             </a>
@@ -574,35 +674,87 @@ function populateFiles() {
         // Update the FILES array with unique files only
         CONFIG.FILES = uniqueFiles;
         
-        // Add files with a slight delay for animation
-        CONFIG.FILES.forEach((file, index) => {
-            setTimeout(() => {
-                const fileCardHTML = createFileCard(file);
-                const tempDiv = document.createElement('div');
-                tempDiv.innerHTML = fileCardHTML;
-                const fileCardElement = tempDiv.firstElementChild;
-                
-                filesGrid.appendChild(fileCardElement);
-                
-                // Add fade-in animation
-                setTimeout(() => {
-                    fileCardElement.classList.add('file-card-visible');
-                }, 50);
-            }, index * 100); // Stagger the appearance of cards
-        });
-        
-        // Add click analytics (optional)
-        setTimeout(() => {
-            addDownloadTracking();
-        }, CONFIG.FILES.length * 100 + 100);
+        appendFileCards(CONFIG.FILES);
+        watchForMorePages();
     }, 800); // Short delay to show loading indicator
 }
 
+// Add cards for files to the grid, keeping the load-more marker last
+function appendFileCards(files) {
+    const sentinel = filesGrid.querySelector('.files-sentinel');
+    const staggered = Math.min(files.length, CONFIG.STAGGERED_CARDS);
+    
+    // Add files with a slight delay for animation
+    files.forEach((file, index) => {
+        setTimeout(() => {
+            const fileCardHTML = createFileCard(file);
+            const tempDiv = document.createElement('div');
+            tempDiv.innerHTML = fileCardHTML;
+            const fileCardElement = tempDiv.firstElementChild;
+            
+            filesGrid.insertBefore(fileCardElement, sentinel && sentinel.parentNode === filesGrid ? sentinel : null);
+            
+            // Add fade-in animation
+            setTimeout(() => {
+                fileCardElement.classList.add('file-card-visible');
+            }, 50);
+        }, Math.min(index, staggered) * 100); // Stagger the appearance of cards
+    });
+    
+    // Add click analytics (optional)
+    setTimeout(() => {
+        addDownloadTracking();
+    }, staggered * 100 + 100);
+}
+
+// Load further pages of the paged listing as the end of the grid comes into view
+function watchForMorePages() {
+    const index = CONFIG.INDEX;
+    if (!index || index.next >= index.pages.length) {
+        return;
+    }
+    
+    if (!('IntersectionObserver' in window)) {
+        // No way to tell when the end is in view: load the pages one after another
+        const loadAll = () => {
+            if (CONFIG.INDEX !== index || index.next >= index.pages.length) return;
+            loadNextIndexPage();
+            setTimeout(loadAll, 500);
+        };
+        loadAll();
+        return;
+    }
+    
+    if (index.observer) {
+        index.observer.disconnect();
+    }
+    
+    const sentinel = document.createElement('div');
+    sentinel.className = 'files-sentinel';
+    filesGrid.appendChild(sentinel);
+    
+    const observer = new IntersectionObserver(entries => {
+        if (CONFIG.INDEX !== index || index.next >= index.pages.length) {
+            observer.disconnect();
+            sentinel.remove();
+            index.observer = null;
+            return;
+        }
+        if (entries.some(entry => entry.isIntersecting)) {
+            loadNextIndexPage();
+        }
+    }, { rootMargin: '600px' });
+    index.observer = observer;
+    index.sentinel = sentinel;
+    observer.observe(sentinel);
+}
+
 // Add download tracking (optional - for analytics)
 function addDownloadTracking() {
-    const downloadButtons = document.querySelectorAll('.download-btn');
+    const downloadButtons = document.querySelectorAll('.download-btn:not([data-tracked])');
     
     downloadButtons.forEach(button => {
+        button.dataset.tracked = 'true';
         button.addEventListener('click', function(event) {
             const fileName = this.getAttribute('download');
             console.log(`File download initiated: ${fileName}`);